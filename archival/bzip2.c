@@ -36,6 +36,16 @@
 //config:	5                  67.05             9427
 //config:	4-0 (fastest)      64.14            12083
 //config:
+//config:config FEATURE_BZIP2_PARALLEL
+//config:	bool "Enable -p N: compress in N processes"
+//config:	default y
+//config:	depends on BZIP2 && !NOMMU
+//config:	help
+//config:	Split input into chunks of one block each and compress them
+//config:	in N worker processes. The blocks are stitched together into
+//config:	one ordinary bzip2 stream. Each worker needs about as much
+//config:	memory as bzip2 itself (7.6 MB at -9).
+//config:
 //config:config FEATURE_BZIP2_DECOMPRESS
 //config:	bool "Enable decompression"
 //config:	default y
@@ -50,7 +60,9 @@
 //kbuild:lib-$(CONFIG_BZIP2) += bzip2.o
 
 //usage:#define bzip2_trivial_usage
-//usage:       "[-cfk" IF_FEATURE_BZIP2_DECOMPRESS("dt") "123456789] [FILE]..."
+//usage:       "[-cfk" IF_FEATURE_BZIP2_DECOMPRESS("dt") "123456789] "
+//usage:	IF_FEATURE_BZIP2_PARALLEL("[-p N] ")
+//usage:       "[FILE]..."
 //usage:#define bzip2_full_usage "\n\n"
 //usage:       "Compress FILEs (or stdin) with bzip2 algorithm\n"
 //usage:     "\n	-1..9	Compression level"
@@ -60,6 +72,9 @@
 //usage:     "\n	-c	Write to stdout"
 //usage:     "\n	-f	Force"
 //usage:     "\n	-k	Keep input files"
+//usage:	IF_FEATURE_BZIP2_PARALLEL(
+//usage:     "\n	-p N	Compress in N processes"
+//usage:	)
 //usage:	IF_FEATURE_BZIP2_DECOMPRESS(
 //usage:     "\n	-t	Test integrity"
 //usage:	)
@@ -118,6 +133,19 @@ enum {
  * (delete incomplete .bz2 file)
  */
 
+/* Returns -1 on errors, 0 otherwise */
+static int bz_full_write(const void *buf, int n)
+{
+	int n2 = full_write(STDOUT_FILENO, buf, n);
+	if (n2 != n) {
+		if (n2 >= 0)
+			errno = 0; /* prevent bogus error message */
+		bb_simple_perror_msg(n2 >= 0 ? "short write" : bb_msg_write_error);
+		return -1;
+	}
+	return 0;
+}
+
 /* Returns:
  * -1 on errors
  * total written bytes so far otherwise
@@ -125,7 +153,7 @@ enum {
 static
 IF_DESKTOP(long long) int bz_write(bz_stream *strm, void* rbuf, ssize_t rlen, void *wbuf)
 {
-	int n, n2, ret;
+	int n, ret;
 
 	strm->avail_in = rlen;
 	strm->next_in = rbuf;
@@ -142,15 +170,8 @@ IF_DESKTOP(long long) int bz_write(bz_stream *strm, void* rbuf, ssize_t rlen, vo
 		}
 
 		n = IOBUF_SIZE - strm->avail_out;
-		if (n) {
-			n2 = full_write(STDOUT_FILENO, wbuf, n);
-			if (n2 != n) {
-				if (n2 >= 0)
-					errno = 0; /* prevent bogus error message */
-				bb_simple_perror_msg(n2 >= 0 ? "short write" : bb_msg_write_error);
-				return -1;
-			}
-		}
+		if (n && bz_full_write(wbuf, n) < 0)
+			return -1;
 
 		if (ret == BZ_STREAM_END)
 			break;
@@ -160,6 +181,283 @@ IF_DESKTOP(long long) int bz_write(bz_stream *strm, void* rbuf, ssize_t rlen, vo
 	return 0 IF_DESKTOP( + strm->total_out );
 }
 
+#if ENABLE_FEATURE_BZIP2_PARALLEL
+/* bzip2 -p N: input is cut into chunks of one block's worth, which are
+ * compressed by N worker processes, handed out round-robin as in gzip -p.
+ * A worker returns the bits of the chunk's block(s) without the stream
+ * header and trailer, plus their combined CRC. Blocks are not byte-aligned,
+ * so the parent shifts each chunk's bits to follow the previous ones,
+ * and puts one header and trailer around them: the result is one ordinary
+ * bzip2 stream. The parent computes the stream CRC from per-chunk CRCs.
+ */
+struct bz_worker {
+	pid_t pid;
+	int cmd_fd;
+	int data_fd;
+	smallint busy;
+};
+struct bz_parallel {
+	unsigned nworkers;
+	/* Output: bits not yet written, at the top of acc */
+	unsigned acc, live;
+	uint32_t combinedCRC;
+	smallint error;         /* a write failed, drop the rest */
+	IF_DESKTOP(unsigned long long total_out;)
+	uint8_t *zbuf;
+	unsigned zbuf_size;
+	struct bz_worker worker[];
+};
+/* Sent on the command pipe, followed by len bytes */
+struct bz_job {
+	unsigned len;
+	unsigned level;
+};
+/* Sent back, followed by (nbits + 7) / 8 bytes */
+struct bz_result {
+	unsigned nbits;
+	unsigned nblocks;
+	uint32_t combinedCRC;
+};
+
+static struct bz_parallel *bz_par;
+
+static void NORETURN bz_worker(void)
+{
+	bz_stream bzs;
+	EState *s = NULL;
+	uint8_t *in = NULL;
+	uint8_t *zbuf = NULL;
+	unsigned zbuf_size = 0;
+	struct bz_job job;
+
+	while (full_read(STDIN_FILENO, &job, sizeof(job)) == sizeof(job)) {
+		struct bz_result res;
+		unsigned zlen, n;
+
+		if (!s) {
+			BZ2_bzCompressInit(&bzs, job.level);
+			s = bzs.state;
+			in = xmalloc(100000 * job.level);
+		}
+		xread(STDIN_FILENO, in, job.len);
+		bzs.next_in = (char*)in;
+		bzs.avail_in = job.len;
+
+		/* Not the first block: BZ2_compressBlock() won't write
+		 * the stream header */
+		s->blockNo = 2;
+		s->combinedCRC = 0;
+		BZ2_bsInitWrite(s);
+		res.nblocks = 0;
+		zlen = 0;
+		for (;;) {
+			copy_input_until_stop(s);
+			if (bzs.avail_in == 0)
+				flush_RL(s);
+			BZ2_compressBlock(s, 0);
+			res.nblocks++;
+			/* The last block: pad its last bits to a whole byte */
+			if (bzs.avail_in == 0) {
+				res.nbits = (zlen + (s->posZ - s->zbits)) * 8 + s->bsLive;
+				bsFinishWrite(s);
+			}
+			n = s->posZ - s->zbits;
+			if (zbuf_size - zlen < n) {
+				zbuf_size = zlen + n + 64 * 1024;
+				zbuf = xrealloc(zbuf, zbuf_size);
+			}
+			memcpy(zbuf + zlen, s->zbits, n);
+			zlen += n;
+			prepare_new_block(s);
+			if (bzs.avail_in == 0)
+				break;
+		}
+		res.combinedCRC = s->combinedCRC;
+		xwrite(STDOUT_FILENO, &res, sizeof(res));
+		xwrite(STDOUT_FILENO, zbuf, zlen);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+static void bz_start_workers(unsigned n)
+{
+	struct bz_parallel *p;
+	unsigned i;
+
+	p = xzalloc(sizeof(*p) + n * sizeof(p->worker[0]));
+	p->nworkers = n;
+	for (i = 0; i < n; i++) {
+		struct bz_worker *w = &p->worker[i];
+		struct fd_pair cmd, data;
+
+		xpiped_pair(cmd);
+		xpiped_pair(data);
+		w->pid = xfork();
+		if (w->pid == 0) {
+			unsigned j;
+			/* Other workers must see EOF on their command pipes
+			 * when we close them, don't hold them open */
+			for (j = 0; j < i; j++) {
+				close(p->worker[j].cmd_fd);
+				close(p->worker[j].data_fd);
+			}
+			close(cmd.wr);
+			close(data.rd);
+			xmove_fd(cmd.rd, STDIN_FILENO);
+			xmove_fd(data.wr, STDOUT_FILENO);
+			bz_worker();
+		}
+		close(cmd.rd);
+		close(data.wr);
+		w->cmd_fd = cmd.wr;
+		w->data_fd = data.rd;
+	}
+	bz_par = p;
+}
+
+static void bz_stop_workers(void)
+{
+	struct bz_parallel *p = bz_par;
+	unsigned i;
+
+	for (i = 0; i < p->nworkers; i++)
+		close(p->worker[i].cmd_fd);
+	for (i = 0; i < p->nworkers; i++)
+		wait4pid(p->worker[i].pid);
+}
+
+/* Append nbits from src to the output bitstream.
+ * Whole bytes are written out, the rest is kept in p->acc.
+ * Sets p->error on errors.
+ */
+static void bz_put_bits(struct bz_parallel *p, const uint8_t *src, unsigned nbits)
+{
+	uint8_t *dst = p->zbuf; /* in place: dst never gets ahead of src */
+	unsigned acc = p->acc;
+	unsigned live = p->live;
+	unsigned b;
+
+	while (nbits >= 8) {
+		b = *src++;
+		*dst++ = acc | (b >> live);
+		acc = (b << (8 - live)) & 0xff;
+		nbits -= 8;
+	}
+	if (nbits) {
+		b = *src & (0xff00 >> nbits);
+		acc |= b >> live;
+		if (live + nbits >= 8) {
+			*dst++ = acc;
+			acc = (b << (8 - live)) & 0xff;
+		}
+		live = (live + nbits) & 7;
+	}
+	p->acc = acc;
+	p->live = live;
+	b = dst - p->zbuf;
+	if (b && bz_full_write(p->zbuf, b) < 0)
+		p->error = 1;
+	IF_DESKTOP(p->total_out += b;)
+}
+
+/* Write out the compressed chunk the worker is busy with.
+ * After an error, only read and drop it */
+static void bz_collect_chunk(struct bz_parallel *p, struct bz_worker *w)
+{
+	struct bz_result res;
+	unsigned len, n;
+
+	xread(w->data_fd, &res, sizeof(res));
+	len = (res.nbits + 7) / 8;
+	if (p->zbuf_size < len) {
+		p->zbuf_size = len;
+		p->zbuf = xrealloc(p->zbuf, len);
+	}
+	xread(w->data_fd, p->zbuf, len);
+	w->busy = 0;
+	if (p->error)
+		return;
+
+	/* combinedCRC = rol(combinedCRC, 1) ^ blockCRC, for each block */
+	n = res.nblocks & 31;
+	if (n)
+		p->combinedCRC = (p->combinedCRC << n) | (p->combinedCRC >> (32 - n));
+	p->combinedCRC ^= res.combinedCRC;
+
+	bz_put_bits(p, p->zbuf, res.nbits);
+}
+
+static
+IF_DESKTOP(long long) int bz_compress_parallel(unsigned level)
+{
+	struct bz_parallel *p = bz_par;
+	/* Usually one block after the initial run-length encoding */
+	unsigned chunk_size = 100000 * level - 19;
+	uint8_t *in = xmalloc(chunk_size);
+	struct bz_job job;
+	unsigned next = 0;
+	unsigned i;
+	uint8_t tail[11];
+	static const uint8_t eos[6] ALIGN1 = { 0x17, 0x72, 0x45, 0x38, 0x50, 0x90 };
+
+	if (p->zbuf_size < sizeof(tail)) {
+		p->zbuf_size = sizeof(tail);
+		p->zbuf = xrealloc(p->zbuf, p->zbuf_size);
+	}
+	p->acc = 0;
+	p->live = 0;
+	p->combinedCRC = 0;
+	p->error = 0;
+	IF_DESKTOP(p->total_out = 0;)
+	job.level = level;
+
+	put_unaligned_be32(BZ_HDR_BZh0 + level, tail);
+	bz_put_bits(p, tail, 32);
+
+	while (!p->error) {
+		struct bz_worker *w;
+		ssize_t count;
+
+		count = full_read(STDIN_FILENO, in, chunk_size);
+		if (count < 0) {
+			bb_simple_perror_msg(bb_msg_read_error);
+			p->error = 1;
+			break;
+		}
+		if (count == 0)
+			break;
+		w = &p->worker[next++ % p->nworkers];
+		if (w->busy)
+			bz_collect_chunk(p, w);
+		job.len = count;
+		xwrite(w->cmd_fd, &job, sizeof(job));
+		xwrite(w->cmd_fd, in, count);
+		w->busy = 1;
+		if (count != chunk_size)
+			break;
+	}
+
+	for (i = 0; i < p->nworkers; i++) {
+		struct bz_worker *w = &p->worker[next++ % p->nworkers];
+		if (w->busy)
+			bz_collect_chunk(p, w);
+	}
+	free(in);
+
+	if (p->error)
+		return -1;
+
+	/* End of stream magic, stream CRC, zero bits up to a byte */
+	memcpy(tail, eos, 6);
+	put_unaligned_be32(p->combinedCRC, tail + 6);
+	tail[10] = 0;
+	bz_put_bits(p, tail, 80 + ((8 - p->live) & 7));
+	if (p->error)
+		return -1;
+	return 0 IF_DESKTOP( + p->total_out );
+}
+#endif
+
 static
 IF_DESKTOP(long long) int FAST_FUNC compressStream(transformer_state_t *xstate UNUSED_PARAM)
 {
@@ -172,8 +470,6 @@ IF_DESKTOP(long long) int FAST_FUNC compressStream(transformer_state_t *xstate U
 #define rbuf iobuf
 #define wbuf (iobuf + IOBUF_SIZE)
 
-	iobuf = xmalloc(2 * IOBUF_SIZE);
-
 	opt = option_mask32 >> (BBUNPK_OPTSTRLEN IF_FEATURE_BZIP2_DECOMPRESS(+ 2) + 2);
 	/* skipped BBUNPK_OPTSTR, "dt" and "zs" bits */
 	opt |= 0x100; /* if nothing else, assume -9 */
@@ -184,6 +480,11 @@ IF_DESKTOP(long long) int FAST_FUNC compressStream(transformer_state_t *xstate U
 		opt >>= 1;
 	}
 
+#if ENABLE_FEATURE_BZIP2_PARALLEL
+	if (bz_par)
+		return bz_compress_parallel(level);
+#endif
+	iobuf = xmalloc(2 * IOBUF_SIZE);
 	BZ2_bzCompressInit(strm, level);
 
 	while (1) {
@@ -212,6 +513,8 @@ int bzip2_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int bzip2_main(int argc UNUSED_PARAM, char **argv)
 {
 	unsigned opt;
+	int status;
+	IF_FEATURE_BZIP2_PARALLEL(unsigned nproc = 1;)
 
 	/* standard bzip2 flags
 	 * -d --decompress force decompression
@@ -231,7 +534,9 @@ int bzip2_main(int argc UNUSED_PARAM, char **argv)
 	opt = getopt32(argv, "^"
 		/* Must match BBUNPK_foo constants! */
 		BBUNPK_OPTSTR IF_FEATURE_BZIP2_DECOMPRESS("dt") "zs123456789"
+		IF_FEATURE_BZIP2_PARALLEL("p:+")
 		"\0" "s2" /* -s means -2 (compatibility) */
+		IF_FEATURE_BZIP2_PARALLEL(, &nproc)
 	);
 #if ENABLE_FEATURE_BZIP2_DECOMPRESS /* bunzip2_main may not be visible... */
 	if (opt & (BBUNPK_OPT_DECOMPRESS|BBUNPK_OPT_TEST)) /* -d and/or -t */
@@ -242,6 +547,15 @@ int bzip2_main(int argc UNUSED_PARAM, char **argv)
 	option_mask32 = opt & ~(BBUNPK_OPT_DECOMPRESS|BBUNPK_OPT_TEST);
 #endif
 
+#if ENABLE_FEATURE_BZIP2_PARALLEL
+	if (nproc > 1)
+		bz_start_workers(nproc);
+#endif
 	argv += optind;
-	return bbunpack(argv, compressStream, append_ext, "bz2");
+	status = bbunpack(argv, compressStream, append_ext, "bz2");
+#if ENABLE_FEATURE_BZIP2_PARALLEL
+	if (bz_par)
+		bz_stop_workers();
+#endif
+	return status;
 }
@@ -50,11 +50,22 @@ aa:      85.1% -- replaced with aa.gz
 //config:	default n
 //config:	depends on GZIP
 //config:	help
-//config:	Enable support for compression levels 4-9. The default level
-//config:	is 6. If levels 1-3 are specified, 4 is used.
+//config:	Enable support for compression levels 1-9. The default level
+//config:	is 6. Levels 1 and 2 take the first match found (faster),
+//config:	level 3 is the same as 4.
 //config:	If this option is not selected, -N options are ignored and -6
 //config:	is used.
 //config:
+//config:config FEATURE_GZIP_PARALLEL
+//config:	bool "Enable -p N: compress in N processes"
+//config:	default y
+//config:	depends on GZIP && !NOMMU
+//config:	help
+//config:	Split input into 128 KB chunks and compress them in N worker
+//config:	processes. Each chunk is primed with the last 32 KB of input
+//config:	before it, so compression ratio stays close to that of a single
+//config:	process. The result is one ordinary gzip stream.
+//config:
 //config:config FEATURE_GZIP_DECOMPRESS
 //config:	bool "Enable decompression"
 //config:	default y
@@ -69,7 +80,9 @@ aa:      85.1% -- replaced with aa.gz
 //kbuild:lib-$(CONFIG_GZIP) += gzip.o
 
 //usage:#define gzip_trivial_usage
-//usage:       "[-cfk" IF_FEATURE_GZIP_DECOMPRESS("dt") IF_FEATURE_GZIP_LEVELS("123456789") "] [FILE]..."
+//usage:       "[-cfk" IF_FEATURE_GZIP_DECOMPRESS("dt") IF_FEATURE_GZIP_LEVELS("123456789") "] "
+//usage:	IF_FEATURE_GZIP_PARALLEL("[-p N] ")
+//usage:       "[FILE]..."
 //usage:#define gzip_full_usage "\n\n"
 //usage:       "Compress FILEs (or stdin)\n"
 //usage:	IF_FEATURE_GZIP_LEVELS(
@@ -81,6 +94,9 @@ aa:      85.1% -- replaced with aa.gz
 //usage:     "\n	-c	Write to stdout"
 //usage:     "\n	-f	Force"
 //usage:     "\n	-k	Keep input files"
+//usage:	IF_FEATURE_GZIP_PARALLEL(
+//usage:     "\n	-p N	Compress in N processes"
+//usage:	)
 //usage:	IF_FEATURE_GZIP_DECOMPRESS(
 //usage:     "\n	-t	Test integrity"
 //usage:	)
@@ -261,7 +277,7 @@ enum {
 
 #if !ENABLE_FEATURE_GZIP_LEVELS
 
-	comp_level_minus4 = 6 - 4,
+	comp_level = 6,
 	max_chain_length = 128,
 /* To speed up deflation, hash chains are never searched beyond this length.
  * A higher limit improves compression ratio but degrades the speed.
@@ -337,16 +353,25 @@ struct globals {
 #define head (G1.prev + WSIZE) /* hash head (see deflate.c) */
 
 #if ENABLE_FEATURE_GZIP_LEVELS
-	unsigned comp_level_minus4;	/* can be a byte */
+	unsigned comp_level;	/* can be a byte */
 	unsigned max_chain_length;
 	unsigned max_lazy_match;
 	unsigned good_match;
 	unsigned nice_match;
-#define comp_level_minus4 (G1.comp_level_minus4)
+#define comp_level        (G1.comp_level)
 #define max_chain_length  (G1.max_chain_length)
 #define max_lazy_match    (G1.max_lazy_match)
 #define good_match        (G1.good_match)
 #define nice_match        (G1.nice_match)
+/* For deflate_fast() (levels 1,2), max_lazy_match is max_insert_length */
+#define max_insert_length max_lazy_match
+#endif
+
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	struct gzip_parallel *par;	/* -p N: the workers, NULL in workers */
+	char *zbuf;	/* in a worker: compressed chunk is collected here */
+	unsigned zbuf_len;
+	unsigned zbuf_size;
 #endif
 
 /* =========================================================================== */
@@ -391,6 +416,13 @@ struct globals {
 	unsigned outcnt;	/* bytes in output buffer */
 	smallint eofile;	/* flag set at end of input file */
 
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	/* In a worker: input is the chunk sent by the parent */
+	const uch *chunk;
+	unsigned chunk_left;
+	smallint sync_flush;	/* end chunk with an empty stored block, not eof */
+#endif
+
 /* ===========================================================================
  * Local data used by the "bit string" routines.
  */
@@ -427,6 +459,16 @@ static void flush_outbuf(void)
 	if (G1.outcnt == 0)
 		return;
 
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	if (G1.zbuf) {
+		if (G1.zbuf_size - G1.zbuf_len < G1.outcnt) {
+			G1.zbuf_size = G1.zbuf_size * 2 + OUTBUFSIZ;
+			G1.zbuf = xrealloc(G1.zbuf, G1.zbuf_size);
+		}
+		memcpy(G1.zbuf + G1.zbuf_len, G1.outbuf, G1.outcnt);
+		G1.zbuf_len += G1.outcnt;
+	} else
+#endif
 	xwrite(ofd, (char *) G1.outbuf, G1.outcnt);
 	G1.outcnt = 0;
 }
@@ -525,6 +567,16 @@ static unsigned file_read(void *buf, unsigned size)
 
 	Assert(G1.insize == 0, "l_buf not empty");
 
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	if (G1.chunk) {
+		/* The parent takes care of crc and isize */
+		len = MIN(size, G1.chunk_left);
+		memcpy(buf, G1.chunk, len);
+		G1.chunk += len;
+		G1.chunk_left -= len;
+		return len;
+	}
+#endif
 	len = safe_read(ifd, buf, size);
 	if (len == (unsigned)(-1) || len == 0)
 		return len;
@@ -757,6 +809,25 @@ static int longest_match(IPos cur_match)
 		 */
 		scan += 2, match++;
 
+#if BB_UNALIGNED_MEMACCESS_OK
+		/* Compare a word at a time, the first differing byte
+		 * is found from the lowest (LE) or highest (BE) set bit
+		 * of the XOR. MAX_MATCH-2 is a multiple of the word size,
+		 * so we never read past strstart+258.
+		 */
+		do {
+			unsigned long s, m;
+			move_from_unaligned_long(s, scan);
+			move_from_unaligned_long(m, match);
+			s ^= m;
+			if (s) {
+				scan += (BB_LITTLE_ENDIAN ? __builtin_ctzl(s) : __builtin_clzl(s)) >> 3;
+				break;
+			}
+			scan += sizeof(long);
+			match += sizeof(long);
+		} while (scan < strend);
+#else
 		/* We check for insufficient lookahead only every 8th comparison;
 		 * the 256th check will be made at strstart+258.
 		 */
@@ -765,6 +836,7 @@ static int longest_match(IPos cur_match)
 				 *++scan == *++match && *++scan == *++match &&
 				 *++scan == *++match && *++scan == *++match &&
 				 *++scan == *++match && *++scan == *++match && scan < strend);
+#endif
 
 		len = MAX_MATCH - (int) (strend - scan);
 		scan = strend - MAX_MATCH;
@@ -1807,6 +1879,91 @@ do { \
 	head[G1.ins_h] = (s); \
 } while (0)
 
+static void flush_last_block(void)
+{
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	if (G1.sync_flush) {
+		FLUSH_BLOCK(0);
+		/* Empty stored block: byte-aligns the output, so that
+		 * the next chunk can simply be appended to it */
+		send_bits(STORED_BLOCK << 1, 3);
+		copy_block(NULL, 0, 1);
+		return;
+	}
+#endif
+	FLUSH_BLOCK(1);	/* eof */
+}
+
+#if ENABLE_FEATURE_GZIP_LEVELS
+/* ===========================================================================
+ * Processes a new input file for levels 1 and 2. This is a greedy
+ * version of deflate(): a match is taken as soon as it is found, there
+ * is no lazy evaluation of the next position. Strings are inserted
+ * in the hash table only for matches of max_insert_length or shorter.
+ */
+static NOINLINE void deflate_fast(void)
+{
+	IPos hash_head;		/* head of hash chain */
+	int flush;			/* set if current block must be flushed */
+	unsigned match_length = 0;	/* length of best match */
+
+	/* longest_match() only takes matches longer than this */
+	G1.prev_length = MIN_MATCH - 1;
+
+	while (G1.lookahead != 0) {
+		/* Insert the string window[strstart .. strstart+2] in the
+		 * dictionary, and set hash_head to the head of the hash chain:
+		 */
+		INSERT_STRING(G1.strstart, hash_head);
+
+		if (hash_head != 0 && G1.strstart - hash_head <= MAX_DIST) {
+			match_length = longest_match(hash_head);
+			/* longest_match() sets match_start */
+			if (match_length > G1.lookahead)
+				match_length = G1.lookahead;
+		}
+		if (match_length >= MIN_MATCH) {
+			check_match(G1.strstart, G1.match_start, match_length);
+			flush = ct_tally(G1.strstart - G1.match_start, match_length - MIN_MATCH);
+			G1.lookahead -= match_length;
+
+			if (match_length <= max_insert_length) {
+				/* Insert new strings in the hash table.
+				 * The string at strstart is already in it.
+				 */
+				match_length--;
+				do {
+					G1.strstart++;
+					INSERT_STRING(G1.strstart, hash_head);
+				} while (--match_length != 0);
+				G1.strstart++;
+			} else {
+				/* Skip the rest of the match, restart
+				 * the running hash after it */
+				G1.strstart += match_length;
+				match_length = 0;
+				G1.ins_h = G1.window[G1.strstart];
+				UPDATE_HASH(G1.ins_h, G1.window[G1.strstart + 1]);
+			}
+		} else {
+			/* No match, output a literal byte */
+			Tracevv((stderr, "%c", G1.window[G1.strstart]));
+			flush = ct_tally(0, G1.window[G1.strstart]);
+			G1.lookahead--;
+			G1.strstart++;
+		}
+		if (flush) {
+			FLUSH_BLOCK(0);
+			G1.block_start = G1.strstart;
+		}
+
+		fill_window_if_needed();
+	}
+
+	flush_last_block();
+}
+#endif
+
 static NOINLINE void deflate(void)
 {
 	IPos hash_head;		/* head of hash chain */
@@ -1815,6 +1972,13 @@ static NOINLINE void deflate(void)
 	int match_available = 0;	/* set if previous match exists */
 	unsigned match_length = MIN_MATCH - 1;	/* length of best match */
 
+#if ENABLE_FEATURE_GZIP_LEVELS
+	if (comp_level <= 2) {
+		deflate_fast();
+		return;
+	}
+#endif
+
 	/* Process the input block. */
 	while (G1.lookahead != 0) {
 		/* Insert the string window[strstart .. strstart+2] in the
@@ -1908,7 +2072,7 @@ static NOINLINE void deflate(void)
 	if (match_available)
 		ct_tally(0, G1.window[G1.strstart - 1]);
 
-	FLUSH_BLOCK(1);	/* eof */
+	flush_last_block();
 }
 
 /* ===========================================================================
@@ -1922,9 +2086,11 @@ static void bi_init(void)
 }
 
 /* ===========================================================================
- * Initialize the "longest match" routines for a new file
+ * Initialize the "longest match" routines for a new file.
+ * The first dict_len bytes of window are already filled with
+ * the preceding data (-p N), matches may refer to them.
  */
-static void lm_init(void)
+static void lm_init(unsigned dict_len)
 {
 	unsigned j;
 
@@ -1934,11 +2100,11 @@ static void lm_init(void)
 
 	/* ??? reduce max_chain_length for binary files */
 
-	//G1.strstart = 0; // globals are zeroed in pack_gzip()
-	//G1.block_start = 0L; // globals are zeroed in pack_gzip()
+	G1.strstart = dict_len;
+	G1.block_start = dict_len;
 
-	G1.lookahead = file_read(G1.window,
-			sizeof(int) <= 2 ? (unsigned) WSIZE : 2 * WSIZE);
+	G1.lookahead = file_read(G1.window + dict_len,
+			(sizeof(int) <= 2 ? (unsigned) WSIZE : 2 * WSIZE) - dict_len);
 
 	if (G1.lookahead == 0 || G1.lookahead == (unsigned) -1) {
 		G1.eofile = 1;
@@ -1958,6 +2124,11 @@ static void lm_init(void)
 	/* If lookahead < MIN_MATCH, ins_h is garbage, but this is
 	 * not important since only literal bytes will be emitted.
 	 */
+	for (j = 0; j < dict_len; j++) {
+		UPDATE_HASH(G1.ins_h, G1.window[j + MIN_MATCH-1]);
+		G1.prev[j & WMASK] = head[G1.ins_h];
+		head[G1.ins_h] = j;
+	}
 }
 
 /* ===========================================================================
@@ -2057,6 +2228,209 @@ static void ct_init(void)
 	init_block();
 }
 
+/* ===========================================================================
+ * Reinit G1.xxx except pointers to allocated buffers, and entire G2
+ */
+static void init_globals(void)
+{
+	memset(&G1.crc, 0, (sizeof(G1) - offsetof(struct globals, crc)) + sizeof(G2));
+
+	/* Clear input and output buffers */
+	//G1.outcnt = 0;
+#ifdef DEBUG
+	//G1.insize = 0;
+#endif
+	//G1.isize = 0;
+
+	/* Reinit G2.xxx */
+	G2.l_desc.dyn_tree     = G2.dyn_ltree;
+	G2.l_desc.static_tree  = G2.static_ltree;
+	G2.l_desc.extra_bits   = extra_lbits;
+	G2.l_desc.extra_base   = LITERALS + 1;
+	G2.l_desc.elems        = L_CODES;
+	G2.l_desc.max_length   = MAX_BITS;
+	//G2.l_desc.max_code     = 0;
+	G2.d_desc.dyn_tree     = G2.dyn_dtree;
+	G2.d_desc.static_tree  = G2.static_dtree;
+	G2.d_desc.extra_bits   = extra_dbits;
+	//G2.d_desc.extra_base   = 0;
+	G2.d_desc.elems        = D_CODES;
+	G2.d_desc.max_length   = MAX_BITS;
+	//G2.d_desc.max_code     = 0;
+	G2.bl_desc.dyn_tree    = G2.bl_tree;
+	//G2.bl_desc.static_tree = NULL;
+	G2.bl_desc.extra_bits  = extra_blbits,
+	//G2.bl_desc.extra_base  = 0;
+	G2.bl_desc.elems       = BL_CODES;
+	G2.bl_desc.max_length  = MAX_BL_BITS;
+	//G2.bl_desc.max_code    = 0;
+}
+
+#if ENABLE_FEATURE_GZIP_PARALLEL
+/* gzip -p N: input is cut into chunks, which are compressed
+ * by N worker processes. Each worker gets a chunk together with
+ * up to WSIZE bytes of input before it, to prime its window with,
+ * and returns the chunk compressed to a byte-aligned sequence
+ * of deflate blocks. Concatenated in order, they make one deflate
+ * stream. Chunks are handed out round-robin, so the oldest chunk
+ * in flight is always at the worker we need to reuse next.
+ * crc and isize are computed by the parent as it reads input.
+ */
+#define GZIP_CHUNK (128 * 1024)
+
+struct gzip_worker {
+	pid_t pid;
+	int cmd_fd;
+	int data_fd;
+	smallint busy;
+};
+struct gzip_parallel {
+	unsigned nworkers;
+	uch *in;	/* WSIZE bytes of dictionary, then the chunk */
+	struct gzip_worker worker[];
+};
+/* Sent on the command pipe, followed by dict_len + len bytes */
+struct gzip_job {
+	unsigned dict_len;
+	unsigned len;
+	unsigned last;
+};
+
+static void NORETURN gzip_worker(void)
+{
+	uch *in = xmalloc(GZIP_CHUNK);
+	struct gzip_job job;
+
+	G1.zbuf_size = GZIP_CHUNK / 2;
+	G1.zbuf = xmalloc(G1.zbuf_size);
+	while (full_read(STDIN_FILENO, &job, sizeof(job)) == sizeof(job)) {
+		init_globals();
+		xread(STDIN_FILENO, G1.window, job.dict_len);
+		xread(STDIN_FILENO, in, job.len);
+		G1.chunk = in;
+		G1.chunk_left = job.len;
+		G1.sync_flush = !job.last;
+
+		ct_init();
+		lm_init(job.dict_len);
+		deflate();
+		flush_outbuf();
+
+		xwrite(STDOUT_FILENO, &G1.zbuf_len, sizeof(G1.zbuf_len));
+		xwrite(STDOUT_FILENO, G1.zbuf, G1.zbuf_len);
+		G1.zbuf_len = 0;
+	}
+	exit(EXIT_SUCCESS);
+}
+
+static void start_workers(unsigned n)
+{
+	struct gzip_parallel *p;
+	unsigned i;
+
+	p = xzalloc(sizeof(*p) + n * sizeof(p->worker[0]));
+	p->nworkers = n;
+	p->in = xmalloc(WSIZE + GZIP_CHUNK);
+	for (i = 0; i < n; i++) {
+		struct gzip_worker *w = &p->worker[i];
+		struct fd_pair cmd, data;
+
+		xpiped_pair(cmd);
+		xpiped_pair(data);
+		w->pid = xfork();
+		if (w->pid == 0) {
+			unsigned j;
+			/* Other workers must see EOF on their command pipes
+			 * when we close them, don't hold them open */
+			for (j = 0; j < i; j++) {
+				close(p->worker[j].cmd_fd);
+				close(p->worker[j].data_fd);
+			}
+			close(cmd.wr);
+			close(data.rd);
+			xmove_fd(cmd.rd, STDIN_FILENO);
+			xmove_fd(data.wr, STDOUT_FILENO);
+			gzip_worker();
+		}
+		close(cmd.rd);
+		close(data.wr);
+		w->cmd_fd = cmd.wr;
+		w->data_fd = data.rd;
+	}
+	G1.par = p;
+}
+
+/* Write out the compressed chunk the worker is busy with */
+static void collect_chunk(struct gzip_worker *w)
+{
+	unsigned len;
+
+	xread(w->data_fd, &len, sizeof(len));
+	bb_copyfd_exact_size(w->data_fd, ofd, len);
+	w->busy = 0;
+}
+
+static void deflate_parallel(void)
+{
+	struct gzip_parallel *p = G1.par;
+	uch *chunk = p->in + WSIZE;
+	struct gzip_job job;
+	unsigned next = 0;
+	unsigned i;
+
+	/* The header must go before the chunks */
+	flush_outbuf();
+
+	job.dict_len = 0;
+	do {
+		struct gzip_worker *w;
+		unsigned n;
+
+		job.len = 0;
+		job.last = 0;
+		do {
+			n = file_read(chunk + job.len, GZIP_CHUNK - job.len);
+			if (n == 0 || n == (unsigned) -1) {
+				job.last = 1;
+				break;
+			}
+			job.len += n;
+		} while (job.len < GZIP_CHUNK);
+
+		w = &p->worker[next++ % p->nworkers];
+		if (w->busy)
+			collect_chunk(w);
+		xwrite(w->cmd_fd, &job, sizeof(job));
+		xwrite(w->cmd_fd, chunk - job.dict_len, job.dict_len + job.len);
+		w->busy = 1;
+
+		/* The tail of this chunk is the dictionary for the next one */
+		n = job.dict_len + job.len;
+		if (n > WSIZE)
+			n = WSIZE;
+		memmove(chunk - n, chunk + job.len - n, n);
+		job.dict_len = n;
+	} while (!job.last);
+
+	for (i = 0; i < p->nworkers; i++) {
+		struct gzip_worker *w = &p->worker[next++ % p->nworkers];
+		if (w->busy)
+			collect_chunk(w);
+	}
+}
+
+static void stop_workers(void)
+{
+	struct gzip_parallel *p = G1.par;
+	unsigned i;
+
+	for (i = 0; i < p->nworkers; i++)
+		close(p->worker[i].cmd_fd);
+	for (i = 0; i < p->nworkers; i++)
+		wait4pid(p->worker[i].pid);
+}
+#endif
+
 /* ===========================================================================
  * Deflate in to out.
  * IN assertions: the input and output buffers are cleared.
@@ -2077,23 +2451,32 @@ static void zip(void)
 	/* Write deflated file to zip file */
 	G1.crc = ~0;
 
-	bi_init();
-	ct_init();
-	lm_init();
-
 	deflate_flags = 0x300; /* extra flags. OS id = 3 (Unix) */
 #if ENABLE_FEATURE_GZIP_LEVELS
-	/* Note that comp_level < 4 do not exist in this version of gzip */
-	if (comp_level_minus4 == 9 - 4) {
+	/* Note that level 3 is the same as 4 in this version of gzip */
+	if (comp_level == 9) {
 		deflate_flags |= 0x02; /* SLOW flag */
 	}
+	if (comp_level == 1) {
+		deflate_flags |= 0x04; /* FAST flag */
+	}
 #endif
 	put_16bit(deflate_flags);
 
 	/* The above 32-bit misaligns outbuf (10 bytes are stored), flush it */
 	flush_outbuf_if_32bit_optimized();
 
-	deflate();
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	if (G1.par) {
+		deflate_parallel();
+	} else
+#endif
+	{
+		bi_init();
+		ct_init();
+		lm_init(0);
+		deflate();
+	}
 
 	/* Write the crc and uncompressed size */
 	put_32bit(~G1.crc);
@@ -2106,38 +2489,7 @@ static void zip(void)
 static
 IF_DESKTOP(long long) int FAST_FUNC pack_gzip(transformer_state_t *xstate UNUSED_PARAM)
 {
-	/* Reinit G1.xxx except pointers to allocated buffers, and entire G2 */
-	memset(&G1.crc, 0, (sizeof(G1) - offsetof(struct globals, crc)) + sizeof(G2));
-
-	/* Clear input and output buffers */
-	//G1.outcnt = 0;
-#ifdef DEBUG
-	//G1.insize = 0;
-#endif
-	//G1.isize = 0;
-
-	/* Reinit G2.xxx */
-	G2.l_desc.dyn_tree     = G2.dyn_ltree;
-	G2.l_desc.static_tree  = G2.static_ltree;
-	G2.l_desc.extra_bits   = extra_lbits;
-	G2.l_desc.extra_base   = LITERALS + 1;
-	G2.l_desc.elems        = L_CODES;
-	G2.l_desc.max_length   = MAX_BITS;
-	//G2.l_desc.max_code     = 0;
-	G2.d_desc.dyn_tree     = G2.dyn_dtree;
-	G2.d_desc.static_tree  = G2.static_dtree;
-	G2.d_desc.extra_bits   = extra_dbits;
-	//G2.d_desc.extra_base   = 0;
-	G2.d_desc.elems        = D_CODES;
-	G2.d_desc.max_length   = MAX_BITS;
-	//G2.d_desc.max_code     = 0;
-	G2.bl_desc.dyn_tree    = G2.bl_tree;
-	//G2.bl_desc.static_tree = NULL;
-	G2.bl_desc.extra_bits  = extra_blbits,
-	//G2.bl_desc.extra_base  = 0;
-	G2.bl_desc.elems       = BL_CODES;
-	G2.bl_desc.max_length  = MAX_BL_BITS;
-	//G2.bl_desc.max_code    = 0;
+	init_globals();
 
 #if 0
 	/* Saving of timestamp is disabled. Why?
@@ -2174,6 +2526,9 @@ static const char gzip_longopts[] ALIGN1 =
 	"fast\0"                No_argument       "1"
 	"best\0"                No_argument       "9"
 	"no-name\0"             No_argument       "n"
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	"processes\0"           Required_argument "p"
+#endif
 	;
 #endif
 
@@ -2199,13 +2554,19 @@ int gzip_main(int argc UNUSED_PARAM, char **argv)
 #endif
 {
 	unsigned opt;
+	int status;
+	IF_FEATURE_GZIP_PARALLEL(unsigned nproc = 1;)
 #if ENABLE_FEATURE_GZIP_LEVELS
 	static const struct {
 		uint8_t good;
 		uint8_t chain_shift;
 		uint8_t lazy2;
 		uint8_t nice2;
-	} gzip_level_config[6] = {
+	} gzip_level_config[9] = {
+		/* Levels 1,2 use deflate_fast(), lazy is max_insert_length there */
+		{4,   2,   4/2,   8/2}, /* Level 1 */
+		{4,   3,   6/2,  16/2}, /* Level 2 */
+		{4,   4,   4/2,  16/2}, /* Level 3 (same as 4) */
 		{4,   4,   4/2,  16/2}, /* Level 4 */
 		{8,   5,  16/2,  32/2}, /* Level 5 */
 		{8,   7,  16/2, 128/2}, /* Level 6 */
@@ -2220,9 +2581,15 @@ int gzip_main(int argc UNUSED_PARAM, char **argv)
 
 	/* Must match bbunzip's constants OPT_STDOUT, OPT_FORCE! */
 #if ENABLE_FEATURE_GZIP_LONG_OPTIONS
-	opt = getopt32long(argv, BBUNPK_OPTSTR IF_FEATURE_GZIP_DECOMPRESS("dt") "n123456789", gzip_longopts);
+	opt = getopt32long(argv, BBUNPK_OPTSTR IF_FEATURE_GZIP_DECOMPRESS("dt") "n123456789"
+			IF_FEATURE_GZIP_PARALLEL("p:+"), gzip_longopts
+			IF_FEATURE_GZIP_PARALLEL(, &nproc)
+	);
 #else
-	opt = getopt32(argv, BBUNPK_OPTSTR IF_FEATURE_GZIP_DECOMPRESS("dt") "n123456789");
+	opt = getopt32(argv, BBUNPK_OPTSTR IF_FEATURE_GZIP_DECOMPRESS("dt") "n123456789"
+			IF_FEATURE_GZIP_PARALLEL("p:+")
+			IF_FEATURE_GZIP_PARALLEL(, &nproc)
+	);
 #endif
 #if ENABLE_FEATURE_GZIP_DECOMPRESS /* gunzip_main may not be visible... */
 	if (opt & (BBUNPK_OPT_DECOMPRESS|BBUNPK_OPT_TEST)) /* -d and/or -t */
@@ -2230,11 +2597,12 @@ int gzip_main(int argc UNUSED_PARAM, char **argv)
 #endif
 #if ENABLE_FEATURE_GZIP_LEVELS
 	opt >>= (BBUNPK_OPTSTRLEN IF_FEATURE_GZIP_DECOMPRESS(+ 2) + 1); /* drop cfkvq[dt]n bits */
+	opt &= 0x1ff; /* drop -p bit */
 	if (opt == 0)
 		opt = 1 << 5; /* default: 6 */
-	opt = ffs(opt >> 4); /* Maps -1..-4 to [0], -5 to [1] ... -9 to [5] */
+	opt = ffs(opt) - 1; /* Maps -1 to [0] ... -9 to [8] */
 
-	comp_level_minus4 = opt;
+	comp_level = opt + 1;
 
 	max_chain_length = 1 << gzip_level_config[opt].chain_shift;
 	good_match	 = gzip_level_config[opt].good;
@@ -2253,6 +2621,15 @@ int gzip_main(int argc UNUSED_PARAM, char **argv)
 	/* Initialize the CRC32 table */
 	global_crc32_new_table_le();
 
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	if (nproc > 1)
+		start_workers(nproc);
+#endif
 	argv += optind;
-	return bbunpack(argv, pack_gzip, append_ext, "gz");
+	status = bbunpack(argv, pack_gzip, append_ext, "gz");
+#if ENABLE_FEATURE_GZIP_PARALLEL
+	if (G1.par)
+		stop_workers();
+#endif
+	return status;
 }
@@ -766,6 +766,598 @@ static void FAST_FUNC dealloc_bunzip(bunzip_data *bd)
 }
 
 
+#if ENABLE_FEATURE_BUNZIP2_PARALLEL
+/* Parallel decoding. Every block starts with a 48-bit magic, at any bit
+ * position, and can be decoded on its own. The parent scans the input for
+ * block and end of stream magics, cuts it into blocks and hands them
+ * round-robin to forked workers, the same way gzip -p does. Their output
+ * is written in order.
+ * A magic can also turn up inside compressed data. The block which
+ * contains it then runs out of input: it is decoded again, with the
+ * next piece appended, by the parent.
+ */
+#define BLOCK_MAGIC     0x314159265359ULL
+#define EOS_MAGIC       0x177245385090ULL
+#define MAGIC_MASK      0xffffffffffffULL
+#define BZ2_MAX_WORKERS 16
+/* A block has at most dbufSize symbols of at most 20 bits, plus tables:
+ * no magic for longer than this means the input is not bzip2 data */
+#define BZ2_MAX_BLOCK_BITS(dbufSize) ((uint64_t)(dbufSize) * 24 + 64 * 1024 * 8)
+
+struct bz2_worker {
+	pid_t pid;
+	int cmd_fd;
+	int data_fd;
+};
+/* Bits [start,end) of the input, in flight on the worker with the same index */
+struct bz2_block {
+	uint64_t start, end;
+	unsigned dbufSize;
+	smallint discard;       /* it was appended to the block before it */
+	smallint last;          /* end of stream follows */
+	uint32_t streamCRC;
+};
+/* Sent on the command pipe, followed by len bytes from bz2_make_job() */
+struct bz2_job {
+	unsigned len;
+	unsigned bits;
+	unsigned dbufSize;
+};
+/* Sent back, followed by len bytes of output */
+struct bz2_result {
+	int status;             /* RETVAL_xxx, or 1: ran out of input */
+	uint32_t blockCRC;
+	unsigned len;
+};
+struct bz2_parallel {
+	/* Input, from byte raw_base of the stream on */
+	uint8_t *raw;
+	unsigned raw_len, raw_size;
+	uint64_t raw_base;
+	int src_fd;
+
+	/* Where the next block starts, if more */
+	uint64_t pos;
+	unsigned dbufSize;
+	smallint more;
+	int status;             /* error found by the scanner, for after the blocks before it */
+	unsigned end_byte;      /* end of the last stream, in raw[] */
+
+	unsigned nworkers, head, count;
+	struct bz2_worker *worker;
+	struct bz2_block *block;
+	uint32_t totalCRC;
+
+	bunzip_data *bd;        /* for blocks decoded by the parent */
+	uint8_t *job;
+	unsigned job_size;
+	char *out;
+	unsigned out_size;
+
+	/* Shifts (bits) at which the byte before the last one matches a magic */
+	uint8_t filter[256];
+};
+
+/* Read more input. Leaves slack after it, bz2_make_job() may read a byte
+ * past the end */
+static int bz2_fill(struct bz2_parallel *p)
+{
+	int n;
+
+	if (p->raw_size - p->raw_len < 2 * IOBUF_SIZE) {
+		p->raw_size = p->raw_size * 2 + 2 * IOBUF_SIZE;
+		p->raw = xrealloc(p->raw, p->raw_size);
+	}
+	n = safe_read(p->src_fd, p->raw + p->raw_len, IOBUF_SIZE);
+	if (n <= 0)
+		return 0;
+	p->raw_len += n;
+	return n;
+}
+
+/* Make sure input is there up to bit position end */
+static int bz2_need(struct bz2_parallel *p, uint64_t end)
+{
+	while ((p->raw_base + p->raw_len) * 8 < end) {
+		if (!bz2_fill(p))
+			return 0;
+	}
+	return 1;
+}
+
+/* Up to 32 bits at bit position pos, which must be in raw[] */
+static uint32_t bz2_peek(struct bz2_parallel *p, uint64_t pos, unsigned n)
+{
+	const uint8_t *s = p->raw + (pos >> 3) - p->raw_base;
+	uint64_t v = 0;
+	unsigned i;
+
+	for (i = 0; i < 5; i++)
+		v = (v << 8) | s[i];
+	return (v >> (40 - n - (pos & 7))) & (((uint64_t)1 << n) - 1);
+}
+
+/* Find the first magic which starts at or after bit position from,
+ * and before limit. Returns -1 if input ends first, -2 if limit is reached,
+ * 0 for block magic, 1 for end of stream.
+ */
+static int bz2_find_magic(struct bz2_parallel *p, uint64_t from, uint64_t limit, uint64_t *pos)
+{
+	uint64_t reg = 0;
+	unsigned i = (from >> 3) - p->raw_base;
+
+	for (;; i++) {
+		unsigned m, s;
+
+		if ((p->raw_base + i) * 8 >= limit + 48)
+			return -2;
+		if (i == p->raw_len && !bz2_fill(p))
+			return -1;
+		reg = (reg << 8) | p->raw[i];
+		m = p->filter[(uint8_t)(reg >> 8)];
+		for (s = 0; m; s++, m >>= 1) {
+			uint64_t v;
+
+			if (!(m & 1))
+				continue;
+			v = (reg >> s) & MAGIC_MASK;
+			if (v == BLOCK_MAGIC || v == EOS_MAGIC) {
+				*pos = (p->raw_base + i + 1) * 8 - s - 48;
+				if (*pos >= from)
+					return (v == EOS_MAGIC);
+			}
+		}
+	}
+}
+
+/* p->pos is at a stream's first block, or its end of stream magic if it is
+ * empty. Find the first block, skipping empty streams, or the end of input.
+ */
+static void bz2_stream_start(struct bz2_parallel *p)
+{
+	while (1) {
+		uint64_t magic;
+		uint8_t *s;
+
+		p->more = 0;
+		if (!bz2_need(p, p->pos + 80)) {
+			p->status = RETVAL_UNEXPECTED_INPUT_EOF;
+			return;
+		}
+		magic = ((uint64_t)bz2_peek(p, p->pos, 24) << 24) | bz2_peek(p, p->pos + 24, 24);
+		if (magic == BLOCK_MAGIC) {
+			p->more = 1;
+			return;
+		}
+		if (magic != EOS_MAGIC) {
+			p->status = RETVAL_NOT_BZIP_DATA;
+			return;
+		}
+		/* Empty stream: its CRC must be 0 */
+		if (bz2_peek(p, p->pos + 48, 32) != 0) {
+			p->status = RETVAL_LAST_BLOCK;
+			return;
+		}
+		/* Is there another "BZh[1-9]" after it? */
+		p->end_byte = ((p->pos + 80 + 7) >> 3) - p->raw_base;
+		if (!bz2_need(p, (p->raw_base + p->end_byte + 4) * 8))
+			return;
+		s = p->raw + p->end_byte;
+		if (s[0] != 'B' || s[1] != 'Z' || s[2] != 'h' || (unsigned)(s[3] - '1') >= 9)
+			return;
+		p->dbufSize = 100000 * (s[3] - '0');
+		p->pos = (p->raw_base + p->end_byte + 4) * 8;
+	}
+}
+
+/* Cut the block which starts at p->pos, and advance p->pos past it */
+static void bz2_scan_block(struct bz2_parallel *p, struct bz2_block *b)
+{
+	uint64_t end;
+	int r;
+
+	b->start = p->pos;
+	b->dbufSize = p->dbufSize;
+	b->discard = 0;
+	b->last = 0;
+	p->more = 1;
+	/* +1: skip the magic of this block */
+	r = bz2_find_magic(p, p->pos + 1, p->pos + BZ2_MAX_BLOCK_BITS(p->dbufSize), &end);
+	if (r == -2) {
+		/* Don't read (and keep) megabytes of garbage */
+		b->end = p->pos + BZ2_MAX_BLOCK_BITS(p->dbufSize);
+		p->pos = b->end;
+		p->more = 0;
+		p->status = RETVAL_DATA_ERROR;
+		return;
+	}
+	if (r < 0) {
+		/* Truncated input */
+		b->end = (p->raw_base + p->raw_len) * 8;
+		p->pos = b->end;
+		p->more = 0;
+		p->status = RETVAL_UNEXPECTED_INPUT_EOF;
+		return;
+	}
+	b->end = p->pos = end;
+	if (r == 0)
+		return;
+
+	/* End of stream */
+	b->last = 1;
+	b->streamCRC = 0;
+	p->more = 0;
+	if (!bz2_need(p, end + 80)) {
+		p->status = RETVAL_UNEXPECTED_INPUT_EOF;
+		return;
+	}
+	b->streamCRC = bz2_peek(p, end + 48, 32);
+	p->end_byte = ((end + 80 + 7) >> 3) - p->raw_base;
+	if (bz2_need(p, (p->raw_base + p->end_byte + 4) * 8)) {
+		uint8_t *s = p->raw + p->end_byte;
+		/* pbzip2 writes a stream per block */
+		if (s[0] == 'B' && s[1] == 'Z' && s[2] == 'h' && (unsigned)(s[3] - '1') < 9) {
+			p->dbufSize = 100000 * (s[3] - '0');
+			p->pos = (p->raw_base + p->end_byte + 4) * 8;
+			bz2_stream_start(p);
+		}
+	}
+}
+
+/* Copy block b to p->job, shifted to start at bit 0, and put an end of
+ * stream magic after it: read_bunzip() stops there. Returns its length.
+ */
+static unsigned bz2_make_job(struct bz2_parallel *p, struct bz2_block *b)
+{
+	const uint8_t *src = p->raw + (b->start >> 3) - p->raw_base;
+	unsigned shift = b->start & 7;
+	unsigned bits = b->end - b->start;
+	unsigned len = (bits + 80 + 7) / 8;
+	unsigned n = (bits + 7) / 8;
+	uint8_t *dst;
+	unsigned i;
+
+	if (p->job_size < len) {
+		p->job_size = len;
+		p->job = xrealloc(p->job, len);
+	}
+	dst = p->job;
+	if (shift == 0) {
+		memcpy(dst, src, n);
+	} else {
+		for (i = 0; i < n; i++)
+			dst[i] = (src[i] << shift) | (src[i + 1] >> (8 - shift));
+	}
+	if (bits & 7)
+		dst[n - 1] &= 0xff << (8 - (bits & 7));
+	/* 48 bits of magic, 32 bits of (unused) stream CRC */
+	for (i = 0; i < 80; i++) {
+		unsigned pos = bits + i;
+		if (!(pos & 7))
+			dst[pos >> 3] = 0;
+		if (i < 48 && ((EOS_MAGIC >> (47 - i)) & 1))
+			dst[pos >> 3] |= 0x80 >> (pos & 7);
+	}
+	return len;
+}
+
+/* Decode a block made by bz2_make_job() into *outp. Returns RETVAL_OK,
+ * 1 if the block runs on past its end, RETVAL_LAST_BLOCK on CRC error,
+ * or another error.
+ */
+static int bz2_decode_block(bunzip_data **bdp,
+		uint8_t *in, unsigned len, unsigned bits, unsigned dbufSize,
+		char **outp, unsigned *out_size, struct bz2_result *res)
+{
+	bunzip_data *bd = *bdp;
+	jmp_buf jmpbuf;
+	unsigned pos;
+	int i;
+
+	if (!bd) {
+		bd = *bdp = xzalloc(sizeof(*bd));
+		crc32_filltable(bd->crc32Table, 1);
+	}
+	if (bd->dbufSize != dbufSize) {
+		free(bd->dbuf);
+		bd->dbufSize = dbufSize;
+		bd->dbuf = xmalloc(dbufSize * sizeof(bd->dbuf[0]));
+	}
+	bd->jmpbuf = &jmpbuf;
+	bd->in_fd = -1;
+	bd->inbuf = in;
+	bd->inbufCount = len;
+	bd->inbufPos = 0;
+	bd->inbufBitCount = 0;
+	bd->writeCopies = 0;
+	bd->writeCount = 0;
+	bd->totalCRC = 0;
+	res->len = 0;
+
+	i = setjmp(jmpbuf);
+	if (i == 0) {
+		while (1) {
+			unsigned avail;
+
+			if (*out_size - res->len < IOBUF_SIZE) {
+				*out_size = *out_size * 2 + IOBUF_SIZE;
+				*outp = xrealloc(*outp, *out_size);
+			}
+			avail = *out_size - res->len;
+			i = read_bunzip(bd, *outp + res->len, avail);
+			if (i < 0)
+				break;
+			i = avail - i;
+			if (i == 0)
+				break;
+			res->len += i;
+		}
+	}
+	res->blockCRC = bd->writeCRC;
+
+	pos = bd->inbufPos * 8 - bd->inbufBitCount;
+	if ((i == RETVAL_OK || i == RETVAL_LAST_BLOCK) && pos == bits + 80)
+		return RETVAL_OK; /* it read our end of stream magic */
+	if (i == RETVAL_UNEXPECTED_INPUT_EOF)
+		return 1;
+	/* Not a magic after the block? Then pos is 80 bits past it */
+	if (i == RETVAL_NOT_BZIP_DATA)
+		pos -= 80;
+	if (pos > bits)
+		return 1;
+	return i;
+}
+
+static void NORETURN bz2_worker(void)
+{
+	bunzip_data *bd = NULL;
+	uint8_t *in = NULL;
+	unsigned in_size = 0;
+	char *out = NULL;
+	unsigned out_size = 0;
+	struct bz2_job job;
+	struct bz2_result res;
+
+	/* Die quietly if the parent stops reading */
+	signal(SIGPIPE, SIG_DFL);
+	while (full_read(STDIN_FILENO, &job, sizeof(job)) == sizeof(job)) {
+		if (in_size < job.len) {
+			in_size = job.len;
+			in = xrealloc(in, in_size);
+		}
+		xread(STDIN_FILENO, in, job.len);
+		res.status = bz2_decode_block(&bd, in, job.len, job.bits, job.dbufSize,
+				&out, &out_size, &res);
+		xwrite(STDOUT_FILENO, &res, sizeof(res));
+		xwrite(STDOUT_FILENO, out, res.len);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static void bz2_start_workers(struct bz2_parallel *p, transformer_state_t *xstate)
+{
+	unsigned i;
+
+	p->worker = xzalloc(p->nworkers * sizeof(p->worker[0]));
+	for (i = 0; i < p->nworkers; i++) {
+		struct bz2_worker *w = &p->worker[i];
+		struct fd_pair cmd, data;
+
+		xpiped_pair(cmd);
+		xpiped_pair(data);
+		w->pid = xfork();
+		if (w->pid == 0) {
+			unsigned j;
+			/* Other workers must see EOF on their command pipes
+			 * when we close them, don't hold them open */
+			for (j = 0; j < i; j++) {
+				close(p->worker[j].cmd_fd);
+				close(p->worker[j].data_fd);
+			}
+			/* Nor the output, if we are a transformer child */
+			if (xstate->dst_fd > STDERR_FILENO)
+				close(xstate->dst_fd);
+			close(cmd.wr);
+			close(data.rd);
+			xmove_fd(cmd.rd, STDIN_FILENO);
+			xmove_fd(data.wr, STDOUT_FILENO);
+			bz2_worker();
+		}
+		close(cmd.rd);
+		close(data.wr);
+		w->cmd_fd = cmd.wr;
+		w->data_fd = data.rd;
+	}
+}
+
+static void bz2_send_job(struct bz2_parallel *p, unsigned i)
+{
+	struct bz2_block *b = &p->block[i];
+	int fd = p->worker[i].cmd_fd;
+	struct bz2_job job;
+
+	job.len = bz2_make_job(p, b);
+	job.bits = b->end - b->start;
+	job.dbufSize = b->dbufSize;
+	xwrite(fd, &job, sizeof(job));
+	xwrite(fd, p->job, job.len);
+}
+
+static int bz2_decode_here(struct bz2_parallel *p, struct bz2_block *b, struct bz2_result *res)
+{
+	unsigned len = bz2_make_job(p, b);
+
+	return bz2_decode_block(&p->bd, p->job, len, b->end - b->start, b->dbufSize,
+			&p->out, &p->out_size, res);
+}
+
+/* Write out the oldest block in flight */
+static int bz2_write_block(struct bz2_parallel *p, transformer_state_t *xstate
+		IF_DESKTOP(, long long *total_written))
+{
+	struct bz2_block *b = &p->block[p->head];
+	struct bz2_result res;
+	unsigned keep;
+
+	if (p->worker) {
+		int fd = p->worker[p->head].data_fd;
+
+		xread(fd, &res, sizeof(res));
+		if (p->out_size < res.len) {
+			p->out_size = res.len;
+			p->out = xrealloc(p->out, res.len);
+		}
+		xread(fd, p->out, res.len);
+	} else {
+		res.status = bz2_decode_here(p, b, &res);
+	}
+	if (b->discard)
+		goto next;
+
+	while (res.status == 1) {
+		/* We cut it at a magic inside compressed data.
+		 * Append the next piece and try again */
+		struct bz2_block next, *n = NULL;
+		unsigned i;
+
+		for (i = 1; i < p->count; i++) {
+			n = &p->block[(p->head + i) % p->nworkers];
+			if (!n->discard)
+				break;
+		}
+		if (i < p->count) {
+			n->discard = 1;
+		} else {
+			if (!p->more && !b->last)
+				return p->status != RETVAL_OK ? p->status : RETVAL_UNEXPECTED_INPUT_EOF;
+			/* Scan on from b->end. If it looked like the end
+			 * of stream, forget what we found after it */
+			p->pos = b->end;
+			p->dbufSize = b->dbufSize;
+			p->status = RETVAL_OK;
+			bz2_scan_block(p, &next);
+			n = &next;
+		}
+		if (n->end - b->start > BZ2_MAX_BLOCK_BITS(b->dbufSize))
+			return RETVAL_DATA_ERROR;
+		b->end = n->end;
+		b->last = n->last;
+		b->streamCRC = n->streamCRC;
+		res.status = bz2_decode_here(p, b, &res);
+	}
+	if (res.status != RETVAL_OK)
+		return res.status;
+
+	if (transformer_write(xstate, p->out, res.len) != (ssize_t)res.len)
+		return RETVAL_SHORT_WRITE;
+	IF_DESKTOP(*total_written += res.len;)
+	p->totalCRC = ((p->totalCRC << 1) | (p->totalCRC >> 31)) ^ res.blockCRC;
+	if (b->last) {
+		if (p->totalCRC != b->streamCRC)
+			return RETVAL_LAST_BLOCK;
+		p->totalCRC = 0;
+	}
+ next:
+	p->head = (p->head + 1) % p->nworkers;
+	p->count--;
+
+	/* Drop input which no block needs any more */
+	keep = ((p->count ? p->block[p->head].start : p->pos) >> 3) - p->raw_base;
+	if (keep > p->raw_len / 2) {
+		p->raw_len -= keep;
+		memmove(p->raw, p->raw + keep, p->raw_len);
+		p->raw_base += keep;
+		p->end_byte -= keep;
+	}
+	return RETVAL_OK;
+}
+
+/* Decode the rest of the stream bd has read the header of, and any
+ * streams which follow it. Returns like read_bunzip() at the end:
+ * RETVAL_OK, RETVAL_LAST_BLOCK with bd->totalCRC != bd->headerCRC
+ * on CRC error, or another error.
+ */
+static int unpack_bz2_parallel(bunzip_data *bd, transformer_state_t *xstate,
+		unsigned nworkers IF_DESKTOP(, long long *total_written))
+{
+	struct bz2_parallel *p;
+	unsigned i, s;
+	int r = RETVAL_OK;
+
+	p = xzalloc(sizeof(*p));
+	p->nworkers = nworkers;
+	p->block = xzalloc(nworkers * sizeof(p->block[0]));
+	for (s = 0; s < 8; s++) {
+		p->filter[(uint8_t)(BLOCK_MAGIC >> (8 - s))] |= 1 << s;
+		p->filter[(uint8_t)(EOS_MAGIC >> (8 - s))] |= 1 << s;
+	}
+	p->src_fd = bd->in_fd;
+	p->raw_size = 2 * IOBUF_SIZE;
+	p->raw = xmalloc(p->raw_size);
+	p->raw_len = bd->inbufCount - bd->inbufPos;
+	memcpy(p->raw, &bd->inbuf[bd->inbufPos], p->raw_len);
+	p->dbufSize = bd->dbufSize;
+	bz2_stream_start(p);
+
+	while (1) {
+		if (p->more && p->count < p->nworkers) {
+			i = (p->head + p->count) % p->nworkers;
+			bz2_scan_block(p, &p->block[i]);
+			p->count++;
+			if (!p->worker) {
+				/* Don't fork for just one block */
+				if (p->count == 1)
+					continue;
+				bz2_start_workers(p, xstate);
+				bz2_send_job(p, p->head);
+			}
+			bz2_send_job(p, i);
+			continue;
+		}
+		if (p->count == 0)
+			break;
+		r = bz2_write_block(p, xstate IF_DESKTOP(, total_written));
+		if (r != RETVAL_OK)
+			break;
+	}
+	if (r == RETVAL_OK)
+		r = p->status;
+
+	if (p->worker) {
+		/* Workers which are still busy (on error) die on write */
+		for (i = 0; i < p->nworkers; i++) {
+			close(p->worker[i].cmd_fd);
+			close(p->worker[i].data_fd);
+		}
+		for (i = 0; i < p->nworkers; i++)
+			wait4pid(p->worker[i].pid);
+		free(p->worker);
+	}
+
+	if (r == RETVAL_OK) {
+		/* Give back what follows the last stream */
+		unsigned len = p->raw_len - p->end_byte;
+		if (len > IOBUF_SIZE)
+			len = IOBUF_SIZE;
+		memcpy(bd->inbuf, p->raw + p->end_byte, len);
+		bd->inbufPos = 0;
+		bd->inbufCount = len;
+		bd->headerCRC = bd->totalCRC = 0;
+	} else if (r == RETVAL_LAST_BLOCK) {
+		bd->totalCRC = bd->headerCRC + 1;
+	}
+
+	if (p->bd)
+		dealloc_bunzip(p->bd);
+	free(p->out);
+	free(p->job);
+	free(p->raw);
+	free(p->block);
+	free(p);
+	return r;
+}
+#endif
+
 /* Decompress src_fd to dst_fd.  Stops at end of bzip data, not end of file. */
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_bz2_stream(transformer_state_t *xstate)
@@ -775,10 +1367,25 @@ unpack_bz2_stream(transformer_state_t *xstate)
 	char *outbuf;
 	int i;
 	unsigned len;
+#if ENABLE_FEATURE_BUNZIP2_PARALLEL
+	long nworkers;
+#endif
 
 	if (check_signature16(xstate, BZIP2_MAGIC))
 		return -1;
 
+#if ENABLE_FEATURE_BUNZIP2_PARALLEL
+	{
+		/* BUNZIP2_WORKERS=N overrides the number of CPUs (testsuite uses it) */
+		const char *s = getenv("BUNZIP2_WORKERS");
+		nworkers = s ? (long)bb_strtou(s, NULL, 10) : -1;
+		if (nworkers < 0 || errno)
+			nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nworkers > BZ2_MAX_WORKERS)
+		nworkers = BZ2_MAX_WORKERS;
+#endif
+
 	outbuf = xmalloc(IOBUF_SIZE);
 	len = 0;
 	while (1) { /* "Process one BZ... stream" loop */
@@ -790,6 +1397,13 @@ unpack_bz2_stream(transformer_state_t *xstate)
 			i = start_bunzip(&jmpbuf, &bd, xstate->src_fd, outbuf + 2, len);
 
 		if (i == 0) {
+#if ENABLE_FEATURE_BUNZIP2_PARALLEL
+			if (nworkers > 1) {
+				i = unpack_bz2_parallel(bd, xstate, nworkers IF_DESKTOP(, &total_written));
+				if (i == RETVAL_SHORT_WRITE)
+					goto release_mem;
+			} else
+#endif
 			while (1) { /* "Produce some output bytes" loop */
 				i = read_bunzip(bd, outbuf, IOBUF_SIZE);
 				if (i < 0) /* error? */
@@ -52,6 +52,38 @@ enum {
 	/* If BMAX needs to be larger than 16, then h and x[] should be ulg. */
 	BMAX = 16,	/* maximum bit length of any code (16 for explode) */
 	N_MAX = 288,	/* maximum number of codes in any set */
+	MAX_MATCH = 258,
+};
+
+/* Bit buffer. Refilled 8 bytes at a time when enough input is buffered,
+ * it then holds all bits one length/distance pair can need (48) */
+typedef uint64_t bitbuf_t;
+
+/* Literal/length and distance decoding tables. The low LIT_BITS
+ * (DIST_BITS) bits of input index the table directly. Codes longer
+ * than that continue in a subtable, an entry with OP_SUB points to it.
+ * Where two literals fit in LIT_BITS, one entry decodes both.
+ */
+typedef struct code_t {
+	uint16_t val;	/* literal(s), length or distance base, subtable index */
+	uint8_t bits;	/* bits to consume (in subtable: bits after LIT_BITS) */
+	uint8_t op;	/* OP_xxx | extra bits, bits of subtable, bits of 1st literal */
+} code_t;
+enum {
+	OP_LIT  = 0x00,
+	OP_LIT2 = 0x10,
+	OP_BASE = 0x20,
+	OP_EOB  = 0x30,
+	OP_SUB  = 0x40,
+	OP_BAD  = 0x50,
+	OP_MASK = 0xf0,
+
+	LIT_BITS = 10,
+	DIST_BITS = 8,
+	/* Each code longer than xx_BITS can start a new subtable of
+	 * no more than 1 << (15 - xx_BITS) entries */
+	LIT_ENOUGH = (1 << LIT_BITS) + (286 << (15 - LIT_BITS)),
+	DIST_ENOUGH = (1 << DIST_BITS) + (30 << (15 - DIST_BITS)),
 };
 
 
@@ -79,7 +111,7 @@ typedef struct state_t {
 	uint32_t *gunzip_crc_table;
 
 	/* bitbuffer */
-	unsigned gunzip_bb; /* bit buffer */
+	bitbuf_t gunzip_bb; /* bit buffer */
 	unsigned char gunzip_bk; /* bits in bit buffer */
 
 	/* input (compressed) data */
@@ -90,19 +122,15 @@ typedef struct state_t {
 	unsigned bytebuffer_size;       /* how much data is there (size <= max) */
 
 	/* private data of inflate_codes() */
-	unsigned inflate_codes_ml; /* masks for bl and bd bits */
-	unsigned inflate_codes_md; /* masks for bl and bd bits */
-	unsigned inflate_codes_bb; /* bit buffer */
+	bitbuf_t inflate_codes_bb; /* bit buffer */
 	unsigned inflate_codes_k; /* number of bits in bit buffer */
 	unsigned inflate_codes_w; /* current gunzip_window position */
-	huft_t *inflate_codes_tl;
-	huft_t *inflate_codes_td;
-	unsigned inflate_codes_bl;
-	unsigned inflate_codes_bd;
+	huft_t *inflate_codes_tl; /* bit length code table of a dynamic block */
 	unsigned inflate_codes_nn; /* length and index for copy */
 	unsigned inflate_codes_dd;
 
 	smallint resume_copy;
+	smallint fixed_tables; /* lit_table and dist_table hold the fixed codes */
 
 	/* private data of inflate_get_next_window() */
 	smallint method; /* method == -1 for stored, -2 for codes */
@@ -111,12 +139,15 @@ typedef struct state_t {
 
 	/* private data of inflate_stored() */
 	unsigned inflate_stored_n;
-	unsigned inflate_stored_b;
+	bitbuf_t inflate_stored_b;
 	unsigned inflate_stored_k;
 	unsigned inflate_stored_w;
 
 	const char *error_msg;
 	jmp_buf error_jmp;
+
+	code_t lit_table[LIT_ENOUGH];
+	code_t dist_table[DIST_ENOUGH];
 } state_t;
 #define gunzip_bytes_out    (S()gunzip_bytes_out   )
 #define gunzip_crc          (S()gunzip_crc         )
@@ -133,18 +164,14 @@ typedef struct state_t {
 #define bytebuffer          (S()bytebuffer         )
 #define bytebuffer_offset   (S()bytebuffer_offset  )
 #define bytebuffer_size     (S()bytebuffer_size    )
-#define inflate_codes_ml    (S()inflate_codes_ml   )
-#define inflate_codes_md    (S()inflate_codes_md   )
 #define inflate_codes_bb    (S()inflate_codes_bb   )
 #define inflate_codes_k     (S()inflate_codes_k    )
 #define inflate_codes_w     (S()inflate_codes_w    )
 #define inflate_codes_tl    (S()inflate_codes_tl   )
-#define inflate_codes_td    (S()inflate_codes_td   )
-#define inflate_codes_bl    (S()inflate_codes_bl   )
-#define inflate_codes_bd    (S()inflate_codes_bd   )
 #define inflate_codes_nn    (S()inflate_codes_nn   )
 #define inflate_codes_dd    (S()inflate_codes_dd   )
 #define resume_copy         (S()resume_copy        )
+#define fixed_tables        (S()fixed_tables       )
 #define method              (S()method             )
 #define need_another_block  (S()need_another_block )
 #define end_reached         (S()end_reached        )
@@ -154,6 +181,8 @@ typedef struct state_t {
 #define inflate_stored_w    (S()inflate_stored_w   )
 #define error_msg           (S()error_msg          )
 #define error_jmp           (S()error_jmp          )
+#define lit_table           (S()lit_table          )
+#define dist_table          (S()dist_table         )
 
 /* This is a generic part */
 #if STATE_IN_BSS /* Use global data segment */
@@ -244,9 +273,7 @@ static void huft_free(huft_t *p)
 static void huft_free_all(STATE_PARAM_ONLY)
 {
 	huft_free(inflate_codes_tl);
-	huft_free(inflate_codes_td);
 	inflate_codes_tl = NULL;
-	inflate_codes_td = NULL;
 }
 
 static void abort_unzip(STATE_PARAM_ONLY) NORETURN;
@@ -256,32 +283,48 @@ static void abort_unzip(STATE_PARAM_ONLY)
 	longjmp(error_jmp, 1);
 }
 
-static unsigned fill_bitbuffer(STATE_PARAM unsigned bitbuffer, unsigned *current, const unsigned required)
+static bitbuf_t fill_bitbuffer(STATE_PARAM bitbuf_t bitbuffer, unsigned *current, const unsigned required)
 {
 	while (*current < required) {
 		if (bytebuffer_offset >= bytebuffer_size) {
-			unsigned sz = bytebuffer_max - 4;
+			unsigned sz = bytebuffer_max - 8;
 			if (to_read >= 0 && to_read < sz) /* unzip only */
 				sz = to_read;
-			/* Leave the first 4 bytes empty so we can always unwind the bitbuffer
+			/* Leave the first 8 bytes empty so we can always unwind the bitbuffer
 			 * to the front of the bytebuffer */
-			bytebuffer_size = safe_read(gunzip_src_fd, &bytebuffer[4], sz);
+			bytebuffer_size = safe_read(gunzip_src_fd, &bytebuffer[8], sz);
 			if ((int)bytebuffer_size < 1) {
 				error_msg = "unexpected end of file";
 				abort_unzip(PASS_STATE_ONLY);
 			}
 			if (to_read >= 0) /* unzip only */
 				to_read -= bytebuffer_size;
-			bytebuffer_size += 4;
-			bytebuffer_offset = 4;
+			bytebuffer_size += 8;
+			bytebuffer_offset = 8;
 		}
-		bitbuffer |= ((unsigned) bytebuffer[bytebuffer_offset]) << *current;
+		bitbuffer |= ((bitbuf_t) bytebuffer[bytebuffer_offset]) << *current;
 		bytebuffer_offset++;
 		*current += 8;
 	}
 	return bitbuffer;
 }
 
+/* If at least 8 bytes are buffered, top up the bit buffer to 56..63 bits
+ * with one load. Bits above *current may already hold the next input bits
+ * (never garbage): they are simply loaded again.
+ */
+static ALWAYS_INLINE bitbuf_t refill_bitbuffer(STATE_PARAM bitbuf_t bitbuffer, unsigned *current)
+{
+	if (bytebuffer_offset + 8 <= bytebuffer_size) {
+		bitbuf_t v;
+		move_from_unaligned64(v, &bytebuffer[bytebuffer_offset]);
+		bitbuffer |= SWAP_LE64(v) << *current;
+		bytebuffer_offset += (63 - *current) >> 3;
+		*current |= 56;
+	}
+	return bitbuffer;
+}
+
 
 /* Given a list of code lengths and a maximum table size, make a set of
  * tables to decode that set of codes.
@@ -492,173 +535,359 @@ static huft_t* huft_build(const unsigned *b, const unsigned n,
 }
 
 
+/*
+ * Build a decoding table (lit_table or dist_table) for code lengths
+ * b[0..n-1] of literal/length (cp_ext == &lit) or distance codes.
+ * tbits: bits of input the table is indexed by.
+ * Returns 1 if the code set is over-subscribed, or incomplete other than
+ * a lone one-bit code (the caller ignores this for the fixed distances).
+ * Unused entries decode as OP_BAD.
+ */
+static int build_table(code_t *table, unsigned tbits,
+			const unsigned *b, unsigned n, const struct cp_ext *cp_ext)
+{
+	unsigned count[BMAX + 1];
+	unsigned next_code[BMAX + 1];
+	uint16_t rev[N_MAX];
+	uint8_t sub_bits[1 << LIT_BITS];
+	unsigned tsize = 1 << tbits;
+	unsigned next_sub;
+	unsigned sym, i, len, code;
+	unsigned ncodes, max_len;
+	int left;
+	code_t bad;
+
+	memset(count, 0, sizeof(count));
+	for (sym = 0; sym < n; sym++)
+		count[b[sym]]++;
+	count[0] = 0;
+	left = 1;
+	code = 0;
+	ncodes = max_len = 0;
+	for (len = 1; len <= 15; len++) {
+		left = (left << 1) - count[len];
+		if (left < 0)
+			return 1; /* over-subscribed */
+		code = (code + count[len - 1]) << 1;
+		next_code[len] = code;
+		ncodes += count[len];
+		if (count[len])
+			max_len = len;
+	}
+
+	/* Canonical codes, bit-reversed: deflate sends them msb first */
+	memset(sub_bits, 0, tsize);
+	for (sym = 0; sym < n; sym++) {
+		unsigned r;
+
+		len = b[sym];
+		if (len == 0)
+			continue;
+		code = next_code[len]++;
+		r = 0;
+		for (i = 0; i < len; i++) {
+			r = (r << 1) | (code & 1);
+			code >>= 1;
+		}
+		rev[sym] = r;
+		if (len > tbits && sub_bits[r & (tsize - 1)] < len - tbits)
+			sub_bits[r & (tsize - 1)] = len - tbits;
+	}
+
+	bad.val = 0;
+	bad.bits = tbits;
+	bad.op = OP_BAD;
+	for (i = 0; i < tsize; i++)
+		table[i] = bad;
+	next_sub = tsize;
+	for (i = 0; i < tsize; i++) {
+		if (sub_bits[i]) {
+			unsigned j;
+			table[i].op = OP_SUB | sub_bits[i];
+			table[i].val = next_sub;
+			bad.bits = sub_bits[i];
+			for (j = 0; j < (1U << sub_bits[i]); j++)
+				table[next_sub + j] = bad;
+			next_sub += 1 << sub_bits[i];
+		}
+	}
+
+	for (sym = 0; sym < n; sym++) {
+		code_t c;
+		code_t *t;
+		unsigned r, step, end;
+
+		len = b[sym];
+		if (len == 0)
+			continue;
+		if (cp_ext == &lit && sym < 256) {
+			c.op = OP_LIT;
+			c.val = sym;
+		} else if (cp_ext == &lit && sym == 256) {
+			c.op = OP_EOB;
+			c.val = 0;
+		} else {
+			unsigned s = sym - (cp_ext == &lit ? 257 : 0);
+			c.op = OP_BASE | cp_ext->ext[s];
+			c.val = cp_ext->cp[s];
+			if (cp_ext->ext[s] == 99)
+				c.op = OP_BAD;
+		}
+		r = rev[sym];
+		t = table;
+		end = tsize;
+		if (len > tbits) {
+			t = table + table[r & (tsize - 1)].val;
+			end = 1 << sub_bits[r & (tsize - 1)];
+			r >>= tbits;
+			len -= tbits;
+		}
+		c.bits = len;
+		step = 1 << len;
+		for (; r < end; r += step)
+			t[r] = c;
+	}
+
+	/* Where a short literal is followed by another one which fits
+	 * into the same lookup, decode both at once. Going downwards,
+	 * table[i >> bits] is not converted yet when we look at it.
+	 */
+	if (cp_ext == &lit) {
+		i = tsize;
+		while (i-- != 0) {
+			code_t c = table[i];
+			code_t c2;
+
+			if (c.op != OP_LIT)
+				continue;
+			c2 = table[i >> c.bits];
+			if (c2.op != OP_LIT || c.bits + c2.bits > tbits)
+				continue;
+			table[i].op = OP_LIT2 | c.bits;
+			table[i].val = c.val | (c2.val << 8);
+			table[i].bits = c.bits + c2.bits;
+		}
+	}
+
+	/* Incomplete code set is an error, unless it is a single one-bit code */
+	return left > 0 && ncodes != 0 && max_len != 1;
+}
+
+
 /*
  * inflate (decompress) the codes in a deflated (compressed) block.
- * Return an error code or zero if it all goes ok.
- *
- * tl, td: literal/length and distance decoder tables
- * bl, bd: number of bits decoded by tl[] and td[]
+ * Returns 1 when gunzip_window is full, 0 at the end of block.
  */
 /* called once from inflate_block */
 
 /* map formerly local static variables to globals */
-#define ml inflate_codes_ml
-#define md inflate_codes_md
 #define bb inflate_codes_bb
 #define k  inflate_codes_k
 #define w  inflate_codes_w
-#define tl inflate_codes_tl
-#define td inflate_codes_td
-#define bl inflate_codes_bl
-#define bd inflate_codes_bd
 #define nn inflate_codes_nn
 #define dd inflate_codes_dd
-static void inflate_codes_setup(STATE_PARAM unsigned my_bl, unsigned my_bd)
+static void inflate_codes_setup(STATE_PARAM_ONLY)
 {
-	bl = my_bl;
-	bd = my_bd;
 	/* make local copies of globals */
 	bb = gunzip_bb;			/* initialize bit buffer */
 	k = gunzip_bk;
 	w = gunzip_outbuf_count;	/* initialize gunzip_window position */
-	/* inflate the coded data */
-	ml = mask_bits[bl];		/* precompute masks for speed */
-	md = mask_bits[bd];
 }
+
+/* Copy a match which does not wrap around the end of the window,
+ * a word at a time if source and destination are a word apart.
+ * Must not write past the end of the match: bytes there are still
+ * history for distances up to GUNZIP_WSIZE. So the last word is copied
+ * overlapping the previous one, its source bytes are final by then.
+ */
+static ALWAYS_INLINE void copy_match(unsigned char *out, unsigned distance, unsigned len)
+{
+	const unsigned char *from = out - distance;
+	uint64_t v;
+
+	if (distance >= 8 && len >= 8) {
+		unsigned char *last = out + len - 8;
+		while (out < last) {
+			move_from_unaligned64(v, from);
+			move_to_unaligned64(out, v);
+			from += 8;
+			out += 8;
+		}
+		move_from_unaligned64(v, last - distance);
+		move_to_unaligned64(last, v);
+	} else if (distance == 1) {
+		memset(out, *from, len);
+	} else {
+		do {
+			*out++ = *from++;
+		} while (--len);
+	}
+}
+
+/* Look up the next code in table. When the bit buffer could not
+ * be refilled (end of input is near), fetch only as many bytes
+ * as the code turns out to need.
+ */
+#define LOOKUP(t, table, tbits) \
+do { \
+	t = &table[(unsigned) b & ((1 << tbits) - 1)]; \
+	while (t->bits > bk) { \
+		if ((t->op & OP_MASK) == OP_LIT2 && (t->op & 0xf) <= bk) \
+			break; /* we only need the first literal */ \
+		b = fill_bitbuffer(PASS_STATE b, &bk, bk + 1); \
+		t = &table[(unsigned) b & ((1 << tbits) - 1)]; \
+	} \
+	if ((t->op & OP_MASK) == OP_SUB) { \
+		const code_t *sub = &table[t->val]; \
+		unsigned sub_mask = (1 << (t->op & 0xf)) - 1; \
+		b >>= tbits; \
+		bk -= tbits; \
+		t = &sub[(unsigned) b & sub_mask]; \
+		while (t->bits > bk) { \
+			b = fill_bitbuffer(PASS_STATE b, &bk, bk + 1); \
+			t = &sub[(unsigned) b & sub_mask]; \
+		} \
+	} \
+} while (0)
+
 /* called once from inflate_get_next_window */
 static NOINLINE int inflate_codes(STATE_PARAM_ONLY)
 {
-	unsigned e;	/* table entry flag/number of extra bits */
-	huft_t *t;	/* pointer to table entry */
+	/* Work on local copies, they can live in registers */
+	unsigned char *window = gunzip_window;
+	bitbuf_t b = bb;
+	unsigned bk = k;
+	unsigned wp = w;
+	const code_t *t;
+	unsigned e;	/* number of extra bits */
 
 	if (resume_copy)
 		goto do_copy;
 
 	while (1) {			/* do until end of block */
-		bb = fill_bitbuffer(PASS_STATE bb, &k, bl);
-		t = tl + ((unsigned) bb & ml);
-		e = t->e;
-		if (e > 16)
-			do {
-				if (e == 99) {
-					abort_unzip(PASS_STATE_ONLY);
-				}
-				bb >>= t->b;
-				k -= t->b;
-				e -= 16;
-				bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-				t = t->v.t + ((unsigned) bb & mask_bits[e]);
-				e = t->e;
-			} while (e > 16);
-		bb >>= t->b;
-		k -= t->b;
-		if (e == 16) {	/* then it's a literal */
-			gunzip_window[w++] = (unsigned char) t->v.n;
-			if (w == GUNZIP_WSIZE) {
-				gunzip_outbuf_count = w;
-				//flush_gunzip_window();
-				w = 0;
-				return 1; // We have a block to read
-			}
-		} else {		/* it's an EOB or a length */
-			/* exit if end of block */
-			if (e == 15) {
-				break;
+		unsigned distance;
+
+		b = refill_bitbuffer(PASS_STATE b, &bk);
+		LOOKUP(t, lit_table, LIT_BITS);
+		e = t->op & OP_MASK;
+		if (e == OP_LIT2) {
+			if (t->bits <= bk && wp < GUNZIP_WSIZE - 1) {
+				b >>= t->bits;
+				bk -= t->bits;
+				window[wp++] = (unsigned char) t->val;
+				window[wp++] = (unsigned char) (t->val >> 8);
+				goto check_full;
 			}
+			/* Only the first literal */
+			e = t->op & 0xf;
+			b >>= e;
+			bk -= e;
+			window[wp++] = (unsigned char) t->val;
+			goto check_full;
+		}
+		if (e == OP_BAD)
+			abort_unzip(PASS_STATE_ONLY);
+		b >>= t->bits;
+		bk -= t->bits;
+		if (e == OP_LIT) {
+			window[wp++] = (unsigned char) t->val;
+ check_full:
+			if (wp == GUNZIP_WSIZE)
+				goto full;
+			continue;
+		}
+		/* exit if end of block */
+		if (e == OP_EOB)
+			break;
 
-			/* get length of block to copy */
-			bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-			nn = t->v.n + ((unsigned) bb & mask_bits[e]);
-			bb >>= e;
-			k -= e;
-
-			/* decode distance of block to copy */
-			bb = fill_bitbuffer(PASS_STATE bb, &k, bd);
-			t = td + ((unsigned) bb & md);
-			e = t->e;
-			if (e > 16)
-				do {
-					if (e == 99) {
-						abort_unzip(PASS_STATE_ONLY);
-					}
-					bb >>= t->b;
-					k -= t->b;
-					e -= 16;
-					bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-					t = t->v.t + ((unsigned) bb & mask_bits[e]);
-					e = t->e;
-				} while (e > 16);
-			bb >>= t->b;
-			k -= t->b;
-			bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-			dd = w - t->v.n - ((unsigned) bb & mask_bits[e]);
-			bb >>= e;
-			k -= e;
-
-			/* do the copy */
- do_copy:
-			do {
-				/* Was: nn -= (e = (e = GUNZIP_WSIZE - ((dd &= GUNZIP_WSIZE - 1) > w ? dd : w)) > nn ? nn : e); */
-				/* Who wrote THAT?? rewritten as: */
-				unsigned delta;
-
-				dd &= GUNZIP_WSIZE - 1;
-				e = GUNZIP_WSIZE - (dd > w ? dd : w);
-				delta = w > dd ? w - dd : dd - w;
-				if (e > nn) e = nn;
-				nn -= e;
-
-				/* copy to new buffer to prevent possible overwrite */
-				if (delta >= e) {
-					memcpy(gunzip_window + w, gunzip_window + dd, e);
-					w += e;
-					dd += e;
-				} else {
-					/* do it slow to avoid memcpy() overlap */
-					/* !NOMEMCPY */
-					do {
-						gunzip_window[w++] = gunzip_window[dd++];
-					} while (--e);
-				}
-				if (w == GUNZIP_WSIZE) {
-					gunzip_outbuf_count = w;
-					resume_copy = (nn != 0);
-					//flush_gunzip_window();
-					w = 0;
-					return 1;
-				}
-			} while (nn);
-			resume_copy = 0;
+		/* get length of block to copy */
+		e = t->op & 0xf;
+		if (bk < e)
+			b = fill_bitbuffer(PASS_STATE b, &bk, e);
+		nn = t->val + ((unsigned) b & mask_bits[e]);
+		b >>= e;
+		bk -= e;
+
+		/* decode distance of block to copy */
+		LOOKUP(t, dist_table, DIST_BITS);
+		if ((t->op & OP_MASK) != OP_BASE)
+			abort_unzip(PASS_STATE_ONLY);
+		b >>= t->bits;
+		bk -= t->bits;
+		e = t->op & 0xf;
+		if (bk < e)
+			b = fill_bitbuffer(PASS_STATE b, &bk, e);
+		distance = t->val + ((unsigned) b & mask_bits[e]);
+		b >>= e;
+		bk -= e;
+
+		/* Common case: no wrap around, and the window does not fill up */
+		if (distance <= wp && wp < GUNZIP_WSIZE - MAX_MATCH) {
+			copy_match(window + wp, distance, nn);
+			wp += nn;
+			continue;
 		}
+		dd = wp - distance;
+
+		/* do the copy */
+ do_copy:
+		do {
+			/* Was: nn -= (e = (e = GUNZIP_WSIZE - ((dd &= GUNZIP_WSIZE - 1) > w ? dd : w)) > nn ? nn : e); */
+			/* Who wrote THAT?? rewritten as: */
+			unsigned delta;
+
+			dd &= GUNZIP_WSIZE - 1;
+			e = GUNZIP_WSIZE - (dd > wp ? dd : wp);
+			delta = wp > dd ? wp - dd : dd - wp;
+			if (e > nn) e = nn;
+			nn -= e;
+
+			/* copy to new buffer to prevent possible overwrite */
+			if (delta >= e) {
+				memcpy(window + wp, window + dd, e);
+				wp += e;
+				dd += e;
+			} else {
+				/* do it slow to avoid memcpy() overlap */
+				/* !NOMEMCPY */
+				do {
+					window[wp++] = window[dd++];
+				} while (--e);
+			}
+			if (wp == GUNZIP_WSIZE) {
+				resume_copy = (nn != 0);
+				goto full;
+			}
+		} while (nn);
+		resume_copy = 0;
 	}
 
 	/* restore the globals from the locals */
-	gunzip_outbuf_count = w;	/* restore global gunzip_window pointer */
-	gunzip_bb = bb;			/* restore global bit buffer */
-	gunzip_bk = k;
-
-	/* normally just after call to inflate_codes, but save code by putting it here */
-	/* free the decoding tables (tl and td), return */
-	huft_free_all(PASS_STATE_ONLY);
+	gunzip_outbuf_count = wp;	/* restore global gunzip_window pointer */
+	gunzip_bb = b;			/* restore global bit buffer */
+	gunzip_bk = bk;
 
 	/* done */
 	return 0;
+
+ full:
+	gunzip_outbuf_count = wp;
+	//flush_gunzip_window();
+	bb = b;
+	k = bk;
+	w = 0;
+	return 1; // We have a block to read
 }
-#undef ml
-#undef md
+#undef LOOKUP
 #undef bb
 #undef k
 #undef w
-#undef tl
-#undef td
-#undef bl
-#undef bd
 #undef nn
 #undef dd
 
 
 /* called once from inflate_block */
-static void inflate_stored_setup(STATE_PARAM int my_n, int my_b, int my_k)
+static void inflate_stored_setup(STATE_PARAM int my_n, bitbuf_t my_b, int my_k)
 {
 	inflate_stored_n = my_n;
 	inflate_stored_b = my_b;
@@ -670,19 +899,30 @@ static void inflate_stored_setup(STATE_PARAM int my_n, int my_b, int my_k)
 static int inflate_stored(STATE_PARAM_ONLY)
 {
 	/* read and output the compressed data */
-	while (inflate_stored_n--) {
-		inflate_stored_b = fill_bitbuffer(PASS_STATE inflate_stored_b, &inflate_stored_k, 8);
-		gunzip_window[inflate_stored_w++] = (unsigned char) inflate_stored_b;
+	while (inflate_stored_n) {
+		if (inflate_stored_k == 0 && bytebuffer_offset < bytebuffer_size) {
+			/* Bit buffer is empty: copy straight from bytebuffer */
+			unsigned n = MIN(inflate_stored_n, bytebuffer_size - bytebuffer_offset);
+			n = MIN(n, GUNZIP_WSIZE - inflate_stored_w);
+			memcpy(&gunzip_window[inflate_stored_w], &bytebuffer[bytebuffer_offset], n);
+			bytebuffer_offset += n;
+			inflate_stored_w += n;
+			inflate_stored_n -= n;
+			/* it may hold lookahead bits of the bytes we just skipped */
+			inflate_stored_b = 0;
+		} else {
+			inflate_stored_b = fill_bitbuffer(PASS_STATE inflate_stored_b, &inflate_stored_k, 8);
+			gunzip_window[inflate_stored_w++] = (unsigned char) inflate_stored_b;
+			inflate_stored_b >>= 8;
+			inflate_stored_k -= 8;
+			inflate_stored_n--;
+		}
 		if (inflate_stored_w == GUNZIP_WSIZE) {
 			gunzip_outbuf_count = inflate_stored_w;
 			//flush_gunzip_window();
 			inflate_stored_w = 0;
-			inflate_stored_b >>= 8;
-			inflate_stored_k -= 8;
 			return 1; /* We have a block */
 		}
-		inflate_stored_b >>= 8;
-		inflate_stored_k -= 8;
 	}
 
 	/* restore the globals from the locals */
@@ -705,7 +945,7 @@ static int inflate_block(STATE_PARAM smallint *e)
 {
 	unsigned ll[286 + 30];  /* literal/length and distance code lengths */
 	unsigned t;     /* block type */
-	unsigned b;     /* bit buffer */
+	bitbuf_t b;     /* bit buffer */
 	unsigned k;     /* number of bits in bit buffer */
 
 	/* make local bit buffer */
@@ -738,7 +978,7 @@ static int inflate_block(STATE_PARAM smallint *e)
 	case 0: /* Inflate stored */
 	{
 		unsigned n;	/* number of bytes in block */
-		unsigned b_stored;	/* bit buffer */
+		bitbuf_t b_stored;	/* bit buffer */
 		unsigned k_stored;	/* number of bits in bit buffer */
 
 		/* make local copies of globals */
@@ -769,15 +1009,13 @@ static int inflate_block(STATE_PARAM smallint *e)
 	}
 	case 1:
 	/* Inflate fixed
-	 * decompress an inflated type 1 (fixed Huffman codes) block. We should
-	 * either replace this with a custom decoder, or at least precompute the
-	 * Huffman tables. TODO */
-	{
+	 * decompress an inflated type 1 (fixed Huffman codes) block.
+	 * The tables are kept until a dynamic block replaces them.
+	 */
+	if (!fixed_tables) {
 		int i;                  /* temporary variable */
-		unsigned bl;            /* lookup bits for tl */
-		unsigned bd;            /* lookup bits for td */
 		/* gcc 4.2.1 is too dumb to reuse stackspace. Moved up... */
-		//unsigned ll[288];     /* length list for huft_build */
+		//unsigned ll[288];     /* length list for build_table */
 
 		/* set up literal table */
 		for (i = 0; i < 144; i++)
@@ -788,31 +1026,21 @@ static int inflate_block(STATE_PARAM smallint *e)
 			ll[i] = 7;
 		for (; i < 288; i++) /* make a complete, but wrong code set */
 			ll[i] = 8;
-		bl = 7;
-		inflate_codes_tl = huft_build(ll, 288, 257, &lit, &bl);
+		build_table(lit_table, LIT_BITS, ll, 288, &lit);
 		/* ^^^ never returns error here - we use known data */
 
 		/* set up distance table */
 		for (i = 0; i < 30; i++) /* make an incomplete code set */
 			ll[i] = 5;
-		bd = 5;
-		inflate_codes_td = huft_build(ll, 30, 0, &dist, &bd);
-		/* ^^^ does return error here! (lsb bit is set) - we gave it incomplete code set */
-		/* clearing error bit: */
-		inflate_codes_td = (void*)((uintptr_t)inflate_codes_td & ~(uintptr_t)1);
-
-		/* set up data for inflate_codes() */
-		inflate_codes_setup(PASS_STATE bl, bd);
-
-		/* huft_free code moved into inflate_codes */
-
-		return -2;
+		build_table(dist_table, DIST_BITS, ll, 30, &dist);
+		/* ^^^ does return error here - we gave it incomplete code set */
+		fixed_tables = 1;
 	}
+	/* set up data for inflate_codes() */
+	inflate_codes_setup(PASS_STATE_ONLY);
+	return -2;
 	case 2: /* Inflate dynamic */
 	{
-		enum { dbits = 6 };     /* bits in base distance lookup table */
-		enum { lbits = 9 };     /* bits in base literal/length lookup table */
-
 		huft_t *td;             /* distance code table */
 		unsigned i;             /* temporary variables */
 		unsigned j;
@@ -820,13 +1048,12 @@ static int inflate_block(STATE_PARAM smallint *e)
 		unsigned m;             /* mask for bit lengths table */
 		unsigned n;             /* number of lengths to get */
 		unsigned bl;            /* lookup bits for tl */
-		unsigned bd;            /* lookup bits for td */
 		unsigned nb;            /* number of bit length codes */
 		unsigned nl;            /* number of literal/length codes */
 		unsigned nd;            /* number of distance codes */
 
 		//unsigned ll[286 + 30];/* literal/length and distance code lengths */
-		unsigned b_dynamic;     /* bit buffer */
+		bitbuf_t b_dynamic;     /* bit buffer */
 		unsigned k_dynamic;     /* number of bits in bit buffer */
 
 		/* make local bit buffer */
@@ -922,29 +1149,22 @@ static int inflate_block(STATE_PARAM smallint *e)
 		}
 
 		/* free decoding table for trees */
-		huft_free(inflate_codes_tl);
+		huft_free_all(PASS_STATE_ONLY);
 
 		/* restore the global bit buffer */
 		gunzip_bb = b_dynamic;
 		gunzip_bk = k_dynamic;
 
 		/* build the decoding tables for literal/length and distance codes */
-		bl = lbits;
-		inflate_codes_tl = huft_build(ll, nl, 257, &lit, &bl);
-		if (BAD_HUFT(inflate_codes_tl)) {
-			abort_unzip(PASS_STATE_ONLY);
-		}
-		bd = dbits;
-		inflate_codes_td = huft_build(ll + nl, nd, 0, &dist, &bd);
-		if (BAD_HUFT(inflate_codes_td)) {
+		fixed_tables = 0;
+		if (build_table(lit_table, LIT_BITS, ll, nl, &lit)
+		 || build_table(dist_table, DIST_BITS, ll + nl, nd, &dist)
+		) {
 			abort_unzip(PASS_STATE_ONLY);
 		}
 
 		/* set up data for inflate_codes() */
-		inflate_codes_setup(PASS_STATE bl, bd);
-
-		/* huft_free code moved into inflate_codes */
-
+		inflate_codes_setup(PASS_STATE_ONLY);
 		return -2;
 	}
 	default:
@@ -1045,11 +1265,18 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 	/* Store unused bytes in a global buffer so calling applets can access it */
 	if (gunzip_bk >= 8) {
 		/* Undo too much lookahead. The next read will be byte aligned
-		 * so we can discard unused bits in the last meaningful byte. */
-		bytebuffer_offset--;
-		bytebuffer[bytebuffer_offset] = gunzip_bb & 0xff;
-		gunzip_bb >>= 8;
-		gunzip_bk -= 8;
+		 * so we can discard unused bits in the last meaningful byte.
+		 * Whole bytes go back, there is room for all of them
+		 * in front of bytebuffer[bytebuffer_offset]. */
+		unsigned i;
+
+		gunzip_bb >>= (gunzip_bk & 7);
+		bytebuffer_offset -= gunzip_bk >> 3;
+		for (i = 0; i < (gunzip_bk >> 3); i++) {
+			bytebuffer[bytebuffer_offset + i] = gunzip_bb & 0xff;
+			gunzip_bb >>= 8;
+		}
+		gunzip_bk &= 7;
 	}
  ret:
 	/* Cleanup */
@@ -1073,7 +1300,7 @@ inflate_unzip(transformer_state_t *xstate)
 
 	to_read = xstate->bytes_in;
 //	bytebuffer_max = 0x8000;
-	bytebuffer_offset = 4;
+	bytebuffer_offset = 8;
 	bytebuffer = xmalloc(bytebuffer_max);
 	n = inflate_unzip_internal(PASS_STATE xstate);
 	free(bytebuffer);
@@ -107,6 +107,7 @@ int chmod_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int chmod_main(int argc UNUSED_PARAM, char **argv)
 {
 	int retval = EXIT_SUCCESS;
+	unsigned flags;
 	char *arg, **argp;
 	char *smode;
 
@@ -134,11 +135,16 @@ int chmod_main(int argc UNUSED_PARAM, char **argv)
 	/* Restore option-like mode if needed */
 	if (arg) arg[0] = '-';
 
+	flags = OPT_RECURSE;
+	/* Order does not matter, unless we print what we do */
+	if (!OPT_VERBOSE && !OPT_CHANGED)
+		flags |= ACTION_PARALLEL;
+
 	/* Ok, ready to do the deed now */
 	smode = *argv++;
 	do {
 		if (!recursive_action(*argv,
-			OPT_RECURSE,    // recurse
+			flags,          // recurse
 			fileAction,     // file action
 			fileAction,     // dir action
 			smode)          // user data
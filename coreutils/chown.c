@@ -154,6 +154,9 @@ int chown_main(int argc UNUSED_PARAM, char **argv)
 		flags |= ACTION_FOLLOWLINKS_L0; /* -H/-L: follow links on depth 0 */
 	if (OPT_TRAVERSE)
 		flags |= ACTION_FOLLOWLINKS; /* follow links if -L */
+	/* Order does not matter, unless we print what we do */
+	if (!OPT_VERBOSE && !OPT_CHANGED)
+		flags |= ACTION_PARALLEL;
 
 	parse_chown_usergroup_or_die(&param.ugid, argv[0]);
 
@@ -46,6 +46,15 @@
 //config:	Enabling the -c options allows files to be checked
 //config:	against pre-calculated hash values.
 //config:	-s and -w are useful options when verifying checksums.
+//config:
+//config:config FEATURE_MD5_SHA1_SUM_PARALLEL
+//config:	bool "Enable -j N: hash files in N processes"
+//config:	default y
+//config:	depends on (MD5SUM || SHA1SUM || SHA256SUM || SHA512SUM || SHA3SUM) && !NOMMU
+//config:	help
+//config:	Hash many files (or check many lines of a -c list) in N
+//config:	worker processes. Results are printed in the order
+//config:	in which files are given.
 
 //applet:IF_MD5SUM(APPLET_NOEXEC(md5sum, md5_sha1_sum, BB_DIR_USR_BIN, BB_SUID_DROP, md5sum))
 //applet:IF_SHA1SUM(APPLET_NOEXEC(sha1sum, md5_sha1_sum, BB_DIR_USR_BIN, BB_SUID_DROP, sha1sum))
@@ -60,7 +69,7 @@
 //kbuild:lib-$(CONFIG_SHA3SUM)   += md5_sha1_sum.o
 
 //usage:#define md5sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[FILE]..."
 //usage:#define md5sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " MD5 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -68,6 +77,9 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL(
+//usage:     "\n	-j N	Hash files in N processes"
+//usage:	)
 //usage:
 //usage:#define md5sum_example_usage
 //usage:       "$ md5sum < busybox\n"
@@ -80,7 +92,7 @@
 //usage:       "^D\n"
 //usage:
 //usage:#define sha1sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[FILE]..."
 //usage:#define sha1sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " SHA1 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -88,9 +100,12 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL(
+//usage:     "\n	-j N	Hash files in N processes"
+//usage:	)
 //usage:
 //usage:#define sha256sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[FILE]..."
 //usage:#define sha256sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " SHA256 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -98,9 +113,12 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL(
+//usage:     "\n	-j N	Hash files in N processes"
+//usage:	)
 //usage:
 //usage:#define sha512sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[FILE]..."
 //usage:#define sha512sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " SHA512 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -108,9 +126,12 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL(
+//usage:     "\n	-j N	Hash files in N processes"
+//usage:	)
 //usage:
 //usage:#define sha3sum_trivial_usage
-//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")"[-a BITS] [FILE]..."
+//usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK("[-c[sw]] ")IF_FEATURE_MD5_SHA1_SUM_PARALLEL("[-j N] ")"[-a BITS] [FILE]..."
 //usage:#define sha3sum_full_usage "\n\n"
 //usage:       "Print" IF_FEATURE_MD5_SHA1_SUM_CHECK(" or check") " SHA3 checksums"
 //usage:	IF_FEATURE_MD5_SHA1_SUM_CHECK( "\n"
@@ -118,6 +139,9 @@
 //usage:     "\n	-s	Don't output anything, status code shows success"
 //usage:     "\n	-w	Warn about improperly formatted checksum lines"
 //usage:	)
+//usage:	IF_FEATURE_MD5_SHA1_SUM_PARALLEL(
+//usage:     "\n	-j N	Hash files in N processes"
+//usage:	)
 //usage:     "\n	-a BITS	224 (default), 256, 384, 512"
 
 //FIXME: GNU coreutils 8.25 has no -s option, it has only these two long opts:
@@ -125,6 +149,7 @@
 // --status  don't output anything, status code shows success
 
 #include "libbb.h"
+#include "common_bufsiz.h"
 
 /* This is a NOEXEC applet. Be very careful! */
 
@@ -151,82 +176,92 @@ static unsigned char *hash_bin_to_hex(unsigned char *hash_value,
 	return (unsigned char *)hex_value;
 }
 
-#define BUFSZ (CONFIG_FEATURE_COPYBUF_KB < 4 ? 4096 : CONFIG_FEATURE_COPYBUF_KB * 1024)
+/* Hashing is fast enough for read() overhead to show with small buffers */
+#define BUFSZ (CONFIG_FEATURE_COPYBUF_KB < 64 ? 64 * 1024 : CONFIG_FEATURE_COPYBUF_KB * 1024)
+
+typedef union hash_ctx {
+	sha3_ctx_t sha3;
+	sha512_ctx_t sha512;
+	sha256_ctx_t sha256;
+	sha1_ctx_t sha1;
+	md5_ctx_t md5;
+} hash_ctx_t;
+
+typedef void FAST_FUNC update_fn_t(void*, const void*, size_t);
+typedef unsigned FAST_FUNC final_fn_t(void*, void*);
 
 #if !ENABLE_SHA3SUM
-# define hash_file(b,f,w) hash_file(b,f)
+# define hash_begin(c,w,u,f) hash_begin(c,u,f)
 #endif
-static uint8_t *hash_file(unsigned char *in_buf, const char *filename, unsigned sha3_width)
+/* Start hashing with applet's algorithm, return hash length */
+static unsigned hash_begin(hash_ctx_t *context, unsigned sha3_width,
+		update_fn_t **update, final_fn_t **final)
 {
-	int src_fd, hash_len, count;
-	union _ctx_ {
-		sha3_ctx_t sha3;
-		sha512_ctx_t sha512;
-		sha256_ctx_t sha256;
-		sha1_ctx_t sha1;
-		md5_ctx_t md5;
-	} context;
-	uint8_t *hash_value;
-	void FAST_FUNC (*update)(void*, const void*, size_t);
-	unsigned FAST_FUNC (*final)(void*, void*);
+	unsigned hash_len;
 	char hash_algo;
 
-	src_fd = open_or_warn_stdin(filename);
-	if (src_fd < 0) {
-		return NULL;
-	}
-
 	hash_algo = applet_name[3];
 
 	/* figure specific hash algorithms */
 	if (ENABLE_MD5SUM && hash_algo == HASH_MD5) {
-		md5_begin(&context.md5);
-		update = (void*)md5_hash;
-		final = (void*)md5_end;
+		md5_begin(&context->md5);
+		*update = (void*)md5_hash;
+		*final = (void*)md5_end;
 		hash_len = 16;
 	}
 	else if (ENABLE_SHA1SUM && hash_algo == HASH_SHA1) {
-		sha1_begin(&context.sha1);
-		update = (void*)sha1_hash;
-		final = (void*)sha1_end;
+		sha1_begin(&context->sha1);
+		*update = (void*)sha1_hash;
+		*final = (void*)sha1_end;
 		hash_len = 20;
 	}
 	else if (ENABLE_SHA256SUM && hash_algo == HASH_SHA256) {
-		sha256_begin(&context.sha256);
-		update = (void*)sha256_hash;
-		final = (void*)sha256_end;
+		sha256_begin(&context->sha256);
+		*update = (void*)sha256_hash;
+		*final = (void*)sha256_end;
 		hash_len = 32;
 	}
 	else if (ENABLE_SHA512SUM && hash_algo == HASH_SHA512) {
-		sha512_begin(&context.sha512);
-		update = (void*)sha512_hash;
-		final = (void*)sha512_end;
+		sha512_begin(&context->sha512);
+		*update = (void*)sha512_hash;
+		*final = (void*)sha512_end;
 		hash_len = 64;
 	}
 #if ENABLE_SHA3SUM
 	else if (ENABLE_SHA3SUM && hash_algo == HASH_SHA3) {
-		sha3_begin(&context.sha3);
-		update = (void*)sha3_hash;
-		final = (void*)sha3_end;
-		/*
-		 * Should support 224, 256, 384, 512.
-		 * We allow any value which does not blow the algorithm up.
-		 */
-		if (sha3_width >= 1600/2 /* input block can't be <= 0 */
-		 || sha3_width == 0      /* hash len can't be 0 */
-		 || (sha3_width & 0x1f)  /* should be multiple of 32 */
-		/* (because input uses up to 8 byte wide word XORs. 32/4=8) */
-		) {
-			bb_error_msg_and_die("bad -a%u", sha3_width);
-		}
+		sha3_begin(&context->sha3);
+		*update = (void*)sha3_hash;
+		*final = (void*)sha3_end;
+		/* sha3_width is checked by main */
 		sha3_width /= 4;
-		context.sha3.input_block_bytes = 1600/8 - sha3_width;
+		context->sha3.input_block_bytes = 1600/8 - sha3_width;
 		hash_len = sha3_width/2;
 	}
 #endif
 	else {
 		xfunc_die(); /* can't reach this */
 	}
+	return hash_len;
+}
+
+#if !ENABLE_SHA3SUM
+# define hash_file(b,f,w) hash_file(b,f)
+#endif
+static uint8_t *hash_file(unsigned char *in_buf, const char *filename, unsigned sha3_width)
+{
+	int src_fd, count;
+	unsigned hash_len;
+	hash_ctx_t context;
+	uint8_t *hash_value;
+	update_fn_t *update;
+	final_fn_t *final;
+
+	src_fd = open_or_warn_stdin(filename);
+	if (src_fd < 0) {
+		return NULL;
+	}
+
+	hash_len = hash_begin(&context, sha3_width, &update, &final);
 
 	{
 		while ((count = safe_read(src_fd, in_buf, BUFSZ)) > 0) {
@@ -248,14 +283,378 @@ static uint8_t *hash_file(unsigned char *in_buf, const char *filename, unsigned
 	return hash_value;
 }
 
+/* One file to hash, and (with -c) the hash it should have */
+struct sum_job {
+	char *filename;
+	char *expected;  /* -c: malloced line, filename points into it */
+	uint8_t *hash_value;
+	smallint done;
+};
+
+#if ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL
+/* -j N: files are hashed by N worker processes.
+ * Each worker reads NUL-terminated file names from its own command pipe,
+ * and sends a result for each of them on the result pipe shared
+ * by all workers. Results are small, so writes of them are atomic.
+ * Results are printed in the order in which files were dispatched;
+ * at most 4*N files can be in flight or waiting to be printed.
+ */
+struct sum_worker {
+	pid_t pid;
+	int cmd_fd;
+	unsigned job;    /* number of the file being hashed */
+	smallint busy;
+};
+struct sum_parallel {
+	unsigned nworkers;
+	unsigned njobs;        /* size of jobs[] */
+	unsigned next_job;     /* number of files dispatched so far */
+	unsigned next_print;   /* next file to print */
+	int res_fd;
+	struct sum_job *jobs;
+	struct sum_worker worker[];
+};
+struct sum_result {
+	unsigned worker;
+	char hash_value[128 + 1]; /* "" if file can't be read */
+};
+#endif
+
+struct globals {
+	uint8_t *in_buf;
+	unsigned flags;
+#if ENABLE_SHA3SUM
+	unsigned sha3_width;
+#endif
+	int return_value;
+	int count_failed;
+	IF_FEATURE_MD5_SHA1_SUM_PARALLEL(struct sum_parallel *par;)
+#if ENABLE_HASH_LANES
+	/* Files hashed at once in SIMD lanes. 1: no lanes */
+	unsigned lanes;
+	unsigned nbatch;
+	void FAST_FUNC (*hash_lanes)(void *ctx[], const void *const buf[], const size_t len[], unsigned n);
+	struct sum_lanes *lanes_buf;
+	struct sum_job batch[8];
+#endif
+} FIX_ALIASING;
+#define G (*(struct globals*)bb_common_bufsiz1)
+#define INIT_G() do { \
+	setup_common_bufsiz(); \
+	/* we have to zero it out because of NOEXEC */ \
+	memset(&G, 0, sizeof(G)); \
+} while (0)
+
+static void print_result(struct sum_job *job)
+{
+	uint8_t *hash_value = job->hash_value;
+
+	if (ENABLE_FEATURE_MD5_SHA1_SUM_CHECK && job->expected) {
+		if (hash_value && (strcmp((char*)hash_value, job->expected) == 0)) {
+			if (!(G.flags & FLAG_SILENT))
+				printf("%s: OK\n", job->filename);
+		} else {
+			if (!(G.flags & FLAG_SILENT))
+				printf("%s: FAILED\n", job->filename);
+			G.count_failed++;
+			G.return_value = EXIT_FAILURE;
+		}
+		free(job->expected);
+	} else {
+		if (hash_value == NULL) {
+			G.return_value = EXIT_FAILURE;
+		} else {
+			printf("%s  %s\n", hash_value, job->filename);
+		}
+	}
+	/* possible free(NULL) */
+	free(hash_value);
+}
+
+#if ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL
+static void NORETURN sum_worker(unsigned idx, int cmd_fd, int res_fd)
+{
+	FILE *cmd = xfdopen_for_read(cmd_fd);
+	struct sum_result res;
+	char *filename;
+
+	res.worker = idx;
+	while ((filename = bb_get_chunk_from_file(cmd, NULL)) != NULL) {
+		uint8_t *hash_value = hash_file(G.in_buf, filename, G.sha3_width);
+
+		res.hash_value[0] = '\0';
+		if (hash_value)
+			strcpy(res.hash_value, (char*)hash_value);
+		xwrite(res_fd, &res, sizeof(res));
+		free(hash_value);
+		free(filename);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+static void start_workers(unsigned n)
+{
+	struct sum_parallel *p;
+	struct fd_pair res;
+	unsigned i;
+
+	p = xzalloc(sizeof(*p) + n * sizeof(p->worker[0]));
+	p->nworkers = n;
+	p->njobs = 4 * n;
+	p->jobs = xzalloc(p->njobs * sizeof(p->jobs[0]));
+	xpiped_pair(res);
+	p->res_fd = res.rd;
+	fflush_all();
+	for (i = 0; i < n; i++) {
+		struct sum_worker *w = &p->worker[i];
+		struct fd_pair cmd;
+
+		xpiped_pair(cmd);
+		w->pid = xfork();
+		if (w->pid == 0) {
+			unsigned j;
+			/* Other workers must see EOF on their command pipes
+			 * when we close them, don't hold them open */
+			for (j = 0; j < i; j++)
+				close(p->worker[j].cmd_fd);
+			close(res.rd);
+			close(cmd.wr);
+			sum_worker(i, cmd.rd, res.wr);
+		}
+		close(cmd.rd);
+		w->cmd_fd = cmd.wr;
+	}
+	close(res.wr);
+	G.par = p;
+}
+
+/* Print results of files which are done, up to the first one not done */
+static void print_done_jobs(void)
+{
+	struct sum_parallel *p = G.par;
+
+	while (p->next_print != p->next_job) {
+		struct sum_job *job = &p->jobs[p->next_print % p->njobs];
+		if (!job->done)
+			break;
+		print_result(job);
+		job->done = 0;
+		p->next_print++;
+	}
+}
+
+/* Wait for one worker to finish a file */
+static void collect_result(void)
+{
+	struct sum_parallel *p = G.par;
+	struct sum_result res;
+	struct sum_worker *w;
+	struct sum_job *job;
+
+	/* A worker died. It already said why */
+	if (full_read(p->res_fd, &res, sizeof(res)) != sizeof(res))
+		xfunc_die();
+	w = &p->worker[res.worker];
+	w->busy = 0;
+	job = &p->jobs[w->job % p->njobs];
+	job->hash_value = res.hash_value[0] ? (uint8_t*)xstrdup(res.hash_value) : NULL;
+	job->done = 1;
+	print_done_jobs();
+}
+
+static void dispatch_job(char *filename, char *expected)
+{
+	struct sum_parallel *p = G.par;
+	struct sum_worker *w;
+	struct sum_job *job;
+
+	while (p->next_job - p->next_print >= p->njobs)
+		collect_result();
+	job = &p->jobs[p->next_job % p->njobs];
+	job->filename = filename;
+	job->expected = expected;
+	if (LONE_DASH(filename)) {
+		/* Workers don't read stdin, we do. The result is held
+		 * until files before it are printed */
+		job->hash_value = hash_file(G.in_buf, filename, G.sha3_width);
+		job->done = 1;
+		p->next_job++;
+		print_done_jobs();
+		return;
+	}
+	for (;;) {
+		for (w = p->worker; w < p->worker + p->nworkers; w++)
+			if (!w->busy)
+				goto found;
+		collect_result();
+	}
+ found:
+	w->busy = 1;
+	w->job = p->next_job++;
+	xwrite(w->cmd_fd, filename, strlen(filename) + 1);
+}
+
+/* Wait until all dispatched files are hashed and printed */
+static void wait_for_jobs(void)
+{
+	struct sum_parallel *p = G.par;
+
+	if (p) {
+		while (p->next_print != p->next_job)
+			collect_result();
+	}
+}
+
+static void stop_workers(void)
+{
+	struct sum_parallel *p = G.par;
+	unsigned i;
+
+	wait_for_jobs();
+	for (i = 0; i < p->nworkers; i++)
+		close(p->worker[i].cmd_fd);
+	for (i = 0; i < p->nworkers; i++)
+		wait4pid(p->worker[i].pid);
+}
+#else
+# define wait_for_jobs() ((void)0)
+#endif
+
+#if ENABLE_HASH_LANES
+struct sum_lanes {
+	hash_ctx_t ctx[8];
+	uint8_t buf[8][BUFSZ];
+};
+
+static void init_lanes(void)
+{
+	char hash_algo = applet_name[3];
+
+	G.lanes = 1;
+	if (ENABLE_MD5SUM && hash_algo == HASH_MD5) {
+		G.lanes = md5_lanes();
+		G.hash_lanes = (void*)md5_hash_lanes;
+	}
+	else if (ENABLE_SHA256SUM && hash_algo == HASH_SHA256) {
+		G.lanes = sha256_lanes();
+		G.hash_lanes = (void*)sha256_hash_lanes;
+	}
+	else if (ENABLE_SHA512SUM && hash_algo == HASH_SHA512) {
+		G.lanes = sha512_lanes();
+		G.hash_lanes = (void*)sha512_hash_lanes;
+	}
+	if (G.lanes > ARRAY_SIZE(G.batch))
+		G.lanes = ARRAY_SIZE(G.batch);
+}
+
+/* Hash files of G.batch[] together, each in its own lane */
+static void hash_batch(void)
+{
+	struct sum_lanes *l = G.lanes_buf;
+	unsigned n = G.nbatch;
+	int fd[ARRAY_SIZE(G.batch)];
+	update_fn_t *update;
+	final_fn_t *final;
+	unsigned hash_len = 0;
+	unsigned i;
+
+	if (n == 0)
+		return;
+	if (!l)
+		l = G.lanes_buf = xmalloc(sizeof(*l));
+	for (i = 0; i < n; i++) {
+		G.batch[i].hash_value = NULL;
+		fd[i] = open_or_warn_stdin(G.batch[i].filename);
+		if (fd[i] >= 0)
+			hash_len = hash_begin(&l->ctx[i], G.sha3_width, &update, &final);
+	}
+	for (;;) {
+		void *ctx[ARRAY_SIZE(G.batch)];
+		const void *buf[ARRAY_SIZE(G.batch)];
+		size_t len[ARRAY_SIZE(G.batch)];
+		unsigned m = 0;
+
+		for (i = 0; i < n; i++) {
+			ssize_t count;
+
+			if (fd[i] < 0)
+				continue;
+			count = safe_read(fd[i], l->buf[i], BUFSZ);
+			if (count > 0) {
+				ctx[m] = &l->ctx[i];
+				buf[m] = l->buf[i];
+				len[m] = count;
+				m++;
+				continue;
+			}
+			if (count < 0)
+				bb_perror_msg("can't read '%s'", G.batch[i].filename);
+			else {
+				final(&l->ctx[i], G.in_buf);
+				G.batch[i].hash_value = hash_bin_to_hex(G.in_buf, hash_len);
+			}
+			close(fd[i]);
+			fd[i] = -1;
+		}
+		if (m == 0)
+			break;
+		G.hash_lanes(ctx, buf, len, m);
+	}
+	for (i = 0; i < n; i++)
+		print_result(&G.batch[i]);
+	G.nbatch = 0;
+}
+#else
+# define hash_batch() ((void)0)
+#endif
+
+/* Print results of all files given so far */
+static void finish_files(void)
+{
+	hash_batch();
+	wait_for_jobs();
+}
+
+/* Hash FILENAME and print the result, or hand it to a worker,
+ * or wait until there are enough files to hash them in lanes */
+static void sum_file(char *filename, char *expected)
+{
+	struct sum_job job;
+
+#if ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL
+	if (G.par) {
+		dispatch_job(filename, expected);
+		return;
+	}
+#endif
+#if ENABLE_HASH_LANES
+	if (G.lanes > 1) {
+		if (!LONE_DASH(filename)) {
+			G.batch[G.nbatch].filename = filename;
+			G.batch[G.nbatch].expected = expected;
+			if (++G.nbatch == G.lanes)
+				hash_batch();
+			return;
+		}
+		/* Print files before stdin first */
+		hash_batch();
+	}
+#endif
+	job.filename = filename;
+	job.expected = expected;
+	job.hash_value = hash_file(G.in_buf, filename, G.sha3_width);
+	print_result(&job);
+}
+
 int md5_sha1_sum_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int md5_sha1_sum_main(int argc UNUSED_PARAM, char **argv)
 {
-	unsigned char *in_buf;
-	int return_value = EXIT_SUCCESS;
 	unsigned flags;
+	IF_FEATURE_MD5_SHA1_SUM_PARALLEL(unsigned nproc = 1;)
+
+	INIT_G();
 #if ENABLE_SHA3SUM
-	unsigned sha3_width = 224;
+	G.sha3_width = 224;
 #endif
 
 	if (ENABLE_FEATURE_MD5_SHA1_SUM_CHECK) {
@@ -263,18 +662,42 @@ int md5_sha1_sum_main(int argc UNUSED_PARAM, char **argv)
 		/* -s and -w require -c */
 #if ENABLE_SHA3SUM
 		if (applet_name[3] == HASH_SHA3)
-			flags = getopt32(argv, "^" "scwbta:+" "\0" "s?c:w?c", &sha3_width);
+			flags = getopt32(argv, "^" "scwbt" IF_FEATURE_MD5_SHA1_SUM_PARALLEL("j:+") "a:+"
+				"\0" "s?c:w?c"
+				IF_FEATURE_MD5_SHA1_SUM_PARALLEL(, &nproc), &G.sha3_width);
 		else
 #endif
-			flags = getopt32(argv, "^" "scwbt" "\0" "s?c:w?c");
+			flags = getopt32(argv, "^" "scwbt" IF_FEATURE_MD5_SHA1_SUM_PARALLEL("j:+")
+				"\0" "s?c:w?c"
+				IF_FEATURE_MD5_SHA1_SUM_PARALLEL(, &nproc));
 	} else {
 #if ENABLE_SHA3SUM
 		if (applet_name[3] == HASH_SHA3)
-			getopt32(argv, "a:+", &sha3_width);
+			getopt32(argv, IF_FEATURE_MD5_SHA1_SUM_PARALLEL("j:+") "a:+"
+				IF_FEATURE_MD5_SHA1_SUM_PARALLEL(, &nproc), &G.sha3_width);
 		else
 #endif
-			getopt32(argv, "");
+			getopt32(argv, IF_FEATURE_MD5_SHA1_SUM_PARALLEL("j:+") ""
+				IF_FEATURE_MD5_SHA1_SUM_PARALLEL(, &nproc));
+		flags = 0;
+	}
+	G.flags = flags;
+#if ENABLE_SHA3SUM
+	/*
+	 * Should support 224, 256, 384, 512.
+	 * We allow any value which does not blow the algorithm up.
+	 * Checked here, not in hash_file(), to die once, not in every worker.
+	 */
+	if (applet_name[3] == HASH_SHA3
+	 && (G.sha3_width >= 1600/2 /* input block can't be <= 0 */
+	  || G.sha3_width == 0      /* hash len can't be 0 */
+	  || (G.sha3_width & 0x1f)  /* should be multiple of 32 */
+	/* (because input uses up to 8 byte wide word XORs. 32/4=8) */
+	    )
+	) {
+		bb_error_msg_and_die("bad -a%u", G.sha3_width);
 	}
+#endif
 	argv += optind;
 	//argc -= optind;
 	if (!*argv)
@@ -284,19 +707,27 @@ int md5_sha1_sum_main(int argc UNUSED_PARAM, char **argv)
 	 * for big values of COPYBUF_KB, this helps to keep its pages
 	 * pre-faulted and possibly even fully cached on local CPU.
 	 */
-	in_buf = xmalloc(BUFSZ);
+	G.in_buf = xmalloc(BUFSZ);
+#if ENABLE_HASH_LANES
+	init_lanes();
+#endif
+
+#if ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL
+	/* Workers inherit in_buf. With one file, they are of no use */
+	if (nproc > 1 && ((flags & FLAG_CHECK) || argv[1]))
+		start_workers(nproc);
+#endif
 
 	do {
 		if (ENABLE_FEATURE_MD5_SHA1_SUM_CHECK && (flags & FLAG_CHECK)) {
 			FILE *pre_computed_stream;
 			char *line;
 			int count_total = 0;
-			int count_failed = 0;
 
+			G.count_failed = 0;
 			pre_computed_stream = xfopen_stdin(*argv);
 
 			while ((line = xmalloc_fgetline(pre_computed_stream)) != NULL) {
-				uint8_t *hash_value;
 				char *filename_ptr;
 
 				count_total++;
@@ -305,8 +736,8 @@ int md5_sha1_sum_main(int argc UNUSED_PARAM, char **argv)
 					if (flags & FLAG_WARN) {
 						bb_simple_error_msg("invalid format");
 					}
-					count_failed++;
-					return_value = EXIT_FAILURE;
+					G.count_failed++;
+					G.return_value = EXIT_FAILURE;
 					free(line);
 					continue;
 				}
@@ -318,27 +749,17 @@ int md5_sha1_sum_main(int argc UNUSED_PARAM, char **argv)
 				if (*filename_ptr == ' ' || *filename_ptr == '*')
 					filename_ptr++;
 
-				hash_value = hash_file(in_buf, filename_ptr, sha3_width);
-
-				if (hash_value && (strcmp((char*)hash_value, line) == 0)) {
-					if (!(flags & FLAG_SILENT))
-						printf("%s: OK\n", filename_ptr);
-				} else {
-					if (!(flags & FLAG_SILENT))
-						printf("%s: FAILED\n", filename_ptr);
-					count_failed++;
-					return_value = EXIT_FAILURE;
-				}
-				/* possible free(NULL) */
-				free(hash_value);
-				free(line);
+				/* frees line */
+				sum_file(filename_ptr, line);
 			}
-			if (count_failed && !(flags & FLAG_SILENT)) {
+			/* The summary counts all lines of this FILE */
+			finish_files();
+			if (G.count_failed && !(flags & FLAG_SILENT)) {
 				bb_error_msg("WARNING: %d of %d computed checksums did NOT match",
-						count_failed, count_total);
+						G.count_failed, count_total);
 			}
 			if (count_total == 0) {
-				return_value = EXIT_FAILURE;
+				G.return_value = EXIT_FAILURE;
 				/*
 				 * md5sum from GNU coreutils 8.25 says:
 				 * md5sum: <FILE>: no properly formatted MD5 checksum lines found
@@ -347,15 +768,14 @@ int md5_sha1_sum_main(int argc UNUSED_PARAM, char **argv)
 			}
 			fclose_if_not_stdin(pre_computed_stream);
 		} else {
-			uint8_t *hash_value = hash_file(in_buf, *argv, sha3_width);
-			if (hash_value == NULL) {
-				return_value = EXIT_FAILURE;
-			} else {
-				printf("%s  %s\n", hash_value, *argv);
-				free(hash_value);
-			}
+			sum_file(*argv, NULL);
 		}
 	} while (*++argv);
 
-	return return_value;
+	hash_batch();
+#if ENABLE_FEATURE_MD5_SHA1_SUM_PARALLEL
+	if (G.par)
+		stop_workers();
+#endif
+	return G.return_value;
 }
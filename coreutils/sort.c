@@ -36,6 +36,25 @@
 //config:	help
 //config:	Attempt to use less memory (by storing only one copy
 //config:	of duplicated lines, and such). Useful if you work on huge files.
+//config:
+//config:config FEATURE_SORT_EXTERNAL
+//config:	bool "Support -m, -S BUFSZ and -T TMPDIR (sort files larger than RAM)"
+//config:	default y
+//config:	depends on FEATURE_SORT_BIG
+//config:	help
+//config:	Input which does not fit into the buffer (by default, 1/4
+//config:	of physical memory) is sorted in runs which are written
+//config:	to temporary files and merged. -m merges already sorted
+//config:	files without loading them into memory.
+//config:
+//config:config FEATURE_SORT_PARALLEL
+//config:	bool "Support --parallel=N"
+//config:	default y
+//config:	depends on FEATURE_SORT_EXTERNAL && LONG_OPTS && !NOMMU
+//config:	help
+//config:	Sort large inputs in N forked helper processes,
+//config:	each sorting a part of the lines. Sorted parts
+//config:	are merged by the main process.
 
 //applet:IF_SORT(APPLET_NOEXEC(sort, sort, BB_DIR_USR_BIN, BB_SUID_DROP, sort))
 
@@ -44,6 +63,7 @@
 //usage:#define sort_trivial_usage
 //usage:       "[-nru"
 //usage:	IF_FEATURE_SORT_BIG("ghMcszbdfiokt] [-o FILE] [-k START[.OFS][OPTS][,END[.OFS][OPTS]] [-t CHAR")
+//usage:	IF_FEATURE_SORT_EXTERNAL("] [-m] [-S SIZE] [-T DIR")
 //usage:       "] [FILE]..."
 //usage:#define sort_full_usage "\n\n"
 //usage:       "Sort lines of text\n"
@@ -69,9 +89,14 @@
 //usage:     "\n	-s	Stable (don't sort ties alphabetically)"
 //usage:     "\n	-u	Suppress duplicate lines"
 //usage:     "\n	-z	NUL terminated input and output"
-///////:     "\n	-m	Ignored for GNU compatibility"
-///////:     "\n	-S BUFSZ Ignored for GNU compatibility"
-///////:     "\n	-T TMPDIR Ignored for GNU compatibility"
+//usage:	IF_FEATURE_SORT_EXTERNAL(
+//usage:     "\n	-m	Merge already sorted files"
+//usage:     "\n	-S SIZE	Memory buffer size (K by default; b,K,M,G,%)"
+//usage:     "\n	-T DIR	Temporary directory (default $TMPDIR or /tmp)"
+//usage:	)
+//usage:	IF_FEATURE_SORT_PARALLEL(
+//usage:     "\n	--parallel=N	Sort in N processes"
+//usage:	)
 //usage:
 //usage:#define sort_example_usage
 //usage:       "$ echo -e \"e\\nf\\nb\\nd\\nc\\na\" | sort\n"
@@ -90,6 +115,9 @@
 //usage:       ""
 
 #include "libbb.h"
+#if ENABLE_FEATURE_SORT_EXTERNAL
+# include <sys/sysinfo.h>
+#endif
 
 /* These are sort types */
 enum {
@@ -109,19 +137,27 @@ enum {
 	FLAG_d  = 1 << 11,      /* Ignore !(isalnum()|isspace()) */
 	FLAG_f  = 1 << 12,      /* Force uppercase */
 	FLAG_i  = 1 << 13,      /* Ignore !isprint() */
-	FLAG_m  = 1 << 14,      /* ignored: merge already sorted files; do not sort */
-	FLAG_S  = 1 << 15,      /* ignored: -S, --buffer-size=SIZE */
-	FLAG_T  = 1 << 16,      /* ignored: -T, --temporary-directory=DIR */
+	FLAG_m  = 1 << 14,      /* Merge already sorted files; do not sort */
+	FLAG_S  = 1 << 15,      /* -S, --buffer-size=SIZE */
+	FLAG_T  = 1 << 16,      /* -T, --temporary-directory=DIR */
 	FLAG_o  = 1 << 17,
 	FLAG_k  = 1 << 18,
 	FLAG_t  = 1 << 19,
+	FLAG_parallel = (1 << 20) * ENABLE_FEATURE_SORT_PARALLEL,
 	FLAG_bb = 0x80000000,   /* Ignore trailing blanks  */
 	FLAG_no_tie_break = 0x40000000,
 };
 
 static const char sort_opt_str[] ALIGN1 = "^"
-			"nghMVucszbrdfimS:T:o:k:*t:"
+			"nghMVucszbrdfimS:T:o:k:*t:" IF_FEATURE_SORT_PARALLEL("\xff:")
 			"\0" "o--o:t--t"/*-t, -o: at most one of each*/;
+#if ENABLE_FEATURE_SORT_PARALLEL
+static const char sort_longopts[] ALIGN1 =
+	"parallel\0" Required_argument "\xff"
+	;
+#else
+# define sort_longopts NULL
+#endif
 /*
  * OPT_STR must not be string literal, needs to have stable address:
  * code uses "strchr(OPT_STR,c) - OPT_STR" idiom.
@@ -272,29 +308,142 @@ static int scale_suffix(const char *tail)
 		return -1; /* mg... not accepted, only MG... */
 	return n;
 }
+
+/* A key chopped out of the line, with its number or month already parsed */
+struct parsed_key {
+	char *str;
+	double num;     /* -n, -g, -h */
+	int tag;        /* -g, -h: NOT_A_NUMBER or KMG suffix scale; -M: month or -1 */
+};
+enum { NOT_A_NUMBER = INT_MIN };
+
+static void parse_key(struct parsed_key *pk, char *line, struct sort_key *key, int flags)
+{
+	/* Chop out and modify key chunks, handling -dfib */
+	char *str = pk->str = get_key(line, key, flags);
+
+	switch (flags & (FLAG_n | FLAG_g | FLAG_h | FLAG_M)) {
+	case FLAG_g:
+	case FLAG_h: {
+		char *end;
+//TODO: needs setlocale(LC_NUMERIC, "C")?
+		pk->num = strtod(str, &end);
+		pk->tag = NOT_A_NUMBER;
+		if (end != str)
+			pk->tag = (flags & FLAG_h) ? scale_suffix(end) : 0;
+		break;
+	}
+	case FLAG_M: {
+		struct tm thyme;
+		pk->tag = strptime(skip_whitespace(str), "%b", &thyme) ? thyme.tm_mon : -1;
+		break;
+	}
+	/* Full floating point version of -n */
+	case FLAG_n:
+		pk->num = atof(str);
+		break;
+	}
+}
+
+static int compare_parsed(const struct parsed_key *x, const struct parsed_key *y, int flags)
+{
+	int retval = 0;
+
+	switch (flags & (FLAG_n | FLAG_g | FLAG_h | FLAG_M | FLAG_V)) {
+	default:
+		bb_simple_error_msg_and_die("unknown sort type");
+		break;
+#if defined(HAVE_STRVERSCMP) && HAVE_STRVERSCMP == 1
+	case FLAG_V:
+		retval = strverscmp(x->str, y->str);
+		break;
+#endif
+	/* Ascii sort */
+	case 0:
+#if ENABLE_LOCALE_SUPPORT
+		retval = strcoll(x->str, y->str);
+#else
+		retval = strcmp(x->str, y->str);
+#endif
+		break;
+	case FLAG_g:
+	case FLAG_h: {
+		double dx = x->num;
+		double dy = y->num;
+		/* not numbers < NaN < -infinity < numbers < +infinity) */
+		if (x->tag == NOT_A_NUMBER)
+			retval = (y->tag == NOT_A_NUMBER ? 0 : -1);
+		else if (y->tag == NOT_A_NUMBER)
+			retval = 1;
+		/* Check for isnan */
+		else if (dx != dx)
+			retval = (dy != dy) ? 0 : -1;
+		else if (dy != dy)
+			retval = 1;
+		else {
+			/* -h: compare KMG suffixes first (always equal for -g) */
+			if (x->tag != y->tag) {
+				retval = x->tag - y->tag;
+				break;
+			}
+			/* Check for infinity.  Could underflow, but it avoids libm. */
+			if (1.0 / dx == 0.0) {
+				if (dx < 0)
+					retval = (1.0 / dy == 0.0 && dy < 0) ? 0 : -1;
+				else
+					retval = (1.0 / dy == 0.0 && dy > 0) ? 0 : 1;
+			} else if (1.0 / dy == 0.0)
+				retval = (dy < 0) ? 1 : -1;
+			else
+				retval = (dx > dy) ? 1 : ((dx < dy) ? -1 : 0);
+		}
+		break;
+	}
+	case FLAG_M:
+		if (x->tag < 0)
+			retval = (y->tag < 0) ? 0 : -1;
+		else if (y->tag < 0)
+			retval = 1;
+		else
+			retval = x->tag - y->tag;
+		break;
+	case FLAG_n:
+		retval = (x->num > y->num) ? 1 : ((x->num < y->num) ? -1 : 0);
+		break;
+	} /* switch */
+
+	return retval;
+}
 #endif
 
 /* Iterate through keys list and perform comparisons */
 static int compare_keys(const void *xarg, const void *yarg)
 {
 	int flags = option_mask32, retval = 0;
-	char *x, *y;
 
 #if ENABLE_FEATURE_SORT_BIG
 	struct sort_key *key;
 
 	for (key = key_list; !retval && key; key = key->next_key) {
+		struct parsed_key x, y;
+
 		flags = key->flags ? key->flags : option_mask32;
-		/* Chop out and modify key chunks, handling -dfib */
-		x = get_key(*(char **)xarg, key, flags);
-		y = get_key(*(char **)yarg, key, flags);
+		parse_key(&x, *(char **)xarg, key, flags);
+		parse_key(&y, *(char **)yarg, key, flags);
+		/* Perform actual comparison */
+		retval = compare_parsed(&x, &y, flags);
+		/* Free key copies. */
+		if (x.str != *(char **)xarg) free(x.str);
+		if (y.str != *(char **)yarg) free(y.str);
+		/* if (retval) break; - done by for () anyway */
+	}
 #else
 	/* This curly bracket serves no purpose but to match the nesting
 	 * level of the for () loop we're not using */
 	{
-		x = *(char **)xarg;
-		y = *(char **)yarg;
-#endif
+		char *x = *(char **)xarg;
+		char *y = *(char **)yarg;
+
 		/* Perform actual comparison */
 		switch (flags & (FLAG_n | FLAG_g | FLAG_h | FLAG_M | FLAG_V)) {
 		default:
@@ -313,81 +462,13 @@ static int compare_keys(const void *xarg, const void *yarg)
 			retval = strcmp(x, y);
 #endif
 			break;
-#if ENABLE_FEATURE_SORT_BIG
-		case FLAG_g:
-		case FLAG_h: {
-			char *xx, *yy;
-//TODO: needs setlocale(LC_NUMERIC, "C")?
-			double dx = strtod(x, &xx);
-			double dy = strtod(y, &yy);
-			/* not numbers < NaN < -infinity < numbers < +infinity) */
-			if (x == xx)
-				retval = (y == yy ? 0 : -1);
-			else if (y == yy)
-				retval = 1;
-			/* Check for isnan */
-			else if (dx != dx)
-				retval = (dy != dy) ? 0 : -1;
-			else if (dy != dy)
-				retval = 1;
-			else {
-				if (flags & FLAG_h) {
-					int xs = scale_suffix(xx);
-					int ys = scale_suffix(yy);
-					if (xs != ys) {
-						retval = xs - ys;
-						break;
-					}
-				}
-				/* Check for infinity.  Could underflow, but it avoids libm. */
-				if (1.0 / dx == 0.0) {
-					if (dx < 0)
-						retval = (1.0 / dy == 0.0 && dy < 0) ? 0 : -1;
-					else
-						retval = (1.0 / dy == 0.0 && dy > 0) ? 0 : 1;
-				} else if (1.0 / dy == 0.0)
-					retval = (dy < 0) ? 1 : -1;
-				else
-					retval = (dx > dy) ? 1 : ((dx < dy) ? -1 : 0);
-			}
-			break;
-		}
-		case FLAG_M: {
-			struct tm thyme;
-			int dx;
-			char *xx, *yy;
-
-			xx = strptime(skip_whitespace(x), "%b", &thyme);
-			dx = thyme.tm_mon;
-			yy = strptime(skip_whitespace(y), "%b", &thyme);
-			if (!xx)
-				retval = (!yy) ? 0 : -1;
-			else if (!yy)
-				retval = 1;
-			else
-				retval = dx - thyme.tm_mon;
-			break;
-		}
-		/* Full floating point version of -n */
-		case FLAG_n: {
-			double dx = atof(x);
-			double dy = atof(y);
-			retval = (dx > dy) ? 1 : ((dx < dy) ? -1 : 0);
-			break;
-		}
-		} /* switch */
-		/* Free key copies. */
-		if (x != *(char **)xarg) free(x);
-		if (y != *(char **)yarg) free(y);
-		/* if (retval) break; - done by for () anyway */
-#else
 		/* Integer version of -n for tiny systems */
 		case FLAG_n:
 			retval = atoi(x) - atoi(y);
 			break;
 		} /* switch */
+	}
 #endif
-	} /* for */
 
 	if (retval == 0) {
 		/* So far lines are "the same" */
@@ -428,6 +509,98 @@ static int compare_keys(const void *xarg, const void *yarg)
 	return retval;
 }
 
+#if ENABLE_FEATURE_SORT_BIG
+/* Decorate-sort-undecorate: keys of every line are parsed once,
+ * not on every comparison.
+ */
+struct sort_item {
+	char *line;
+	unsigned idx;   /* for -s */
+	struct parsed_key key[];
+};
+static unsigned key_count;
+static size_t sort_item_size;
+
+static int compare_items(const void *xarg, const void *yarg)
+{
+	const struct sort_item *x = xarg;
+	const struct sort_item *y = yarg;
+	int flags = option_mask32, retval = 0;
+	struct sort_key *key;
+	unsigned i = 0;
+
+	for (key = key_list; !retval && key; key = key->next_key, i++) {
+		flags = key->flags ? key->flags : option_mask32;
+		retval = compare_parsed(&x->key[i], &y->key[i], flags);
+	}
+
+	/* Same tie rules as in compare_keys() */
+	if (retval == 0) {
+		if (option_mask32 & FLAG_s)
+			return (x->idx > y->idx) * 2 - 1;
+		if (!(option_mask32 & FLAG_no_tie_break)) {
+			flags = option_mask32;
+			retval = strcmp(x->line, y->line);
+		}
+	}
+
+	if (flags & FLAG_r)
+		return -retval;
+
+	return retval;
+}
+
+/* Is there anything to gain from parsing keys in advance? */
+static int need_parsed_keys(void)
+{
+	int flags;
+
+	if (option_mask32 & FLAG_s) /* avoids reallocating lines */
+		return 1;
+	if (key_list->next_key)
+		return 1;
+	flags = key_list->flags ? key_list->flags : option_mask32;
+	/* Whole line, plain strcmp/strcoll/strverscmp: key is the line */
+	return !(key_list->range[0] == 1 && !key_list->range[1]
+		&& !key_list->range[2] && !key_list->range[3]
+		&& !(flags & (FLAG_b | FLAG_d | FLAG_f | FLAG_i | FLAG_bb
+			| FLAG_n | FLAG_g | FLAG_h | FLAG_M))
+	);
+}
+
+static void sort_parsed(char **lines, int linecount)
+{
+	char *items = xmalloc(linecount * sort_item_size);
+	char *p;
+	int i;
+
+	for (i = 0, p = items; i < linecount; i++, p += sort_item_size) {
+		struct sort_item *item = (void*)p;
+		struct sort_key *key;
+		unsigned k = 0;
+
+		item->line = lines[i];
+		item->idx = i;
+		for (key = key_list; key; key = key->next_key, k++)
+			parse_key(&item->key[k], lines[i], key,
+				key->flags ? key->flags : option_mask32);
+	}
+
+	qsort(items, linecount, sort_item_size, compare_items);
+
+	for (i = 0, p = items; i < linecount; i++, p += sort_item_size) {
+		struct sort_item *item = (void*)p;
+		unsigned k;
+
+		lines[i] = item->line;
+		for (k = 0; k < key_count; k++)
+			if (item->key[k].str != item->line)
+				free(item->key[k].str);
+	}
+	free(items);
+}
+#endif
+
 #if ENABLE_FEATURE_SORT_BIG
 static unsigned str2u(char **str)
 {
@@ -441,19 +614,394 @@ static unsigned str2u(char **str)
 }
 #endif
 
+static void sort_lines(char **lines, int linecount)
+{
+#if ENABLE_FEATURE_SORT_BIG
+	if (sort_item_size) {
+		sort_parsed(lines, linecount);
+		return;
+	}
+#endif
+	/* For stable sort, store original line position beyond terminating NUL */
+	if (option_mask32 & FLAG_s) {
+		int i;
+		for (i = 0; i < linecount; i++) {
+			uint32_t *p32;
+			char *line;
+			unsigned len;
+
+			line = lines[i];
+			len = (strlen(line) + 4) & (~3u);
+			lines[i] = line = xrealloc(line, len + 4);
+			p32 = (void*)(line + len);
+			*p32 = i;
+		}
+		/*option_mask32 |= FLAG_no_tie_break;*/
+		/* ^^^redundant: if FLAG_s, compare_keys() does no tie break */
+	}
+
+	qsort(lines, linecount, sizeof(lines[0]), compare_keys);
+}
+
+#if ENABLE_FEATURE_SORT_EXTERNAL
+# if ENABLE_FEATURE_SORT_OPTIMIZE_MEMORY
+/* Initial "previous line" of the duplicate tail search */
+static const char empty_line[] ALIGN1 = "";
+# endif
+
+/* Sorted runs which did not fit into memory, in input order.
+ * Runs are merged MERGE_WIDTH at a time, like carries of a counter:
+ * "level" is the number of times the run's lines were merged.
+ */
+enum { MERGE_WIDTH = 16 };
+static struct sort_run {
+	FILE *fp;
+	unsigned level;
+} *run_list;
+static unsigned run_count;
+static const char *tmp_dir;
+# if ENABLE_FEATURE_SORT_PARALLEL
+static unsigned sort_procs = 1;
+# else
+enum { sort_procs = 1 };
+# endif
+
+static const struct suffix_mult bufsize_suffixes[] ALIGN_SUFFIX = {
+	{ "b", 1 },
+	{ "k", 1024 },
+	{ "K", 1024 },
+	{ "M", 1024*1024 },
+	{ "G", 1024*1024*1024 },
+	{ "", 0 }
+};
+
+static unsigned long long physical_memory(void)
+{
+	struct sysinfo info;
+	sysinfo(&info);
+	return (unsigned long long)info.totalram * info.mem_unit;
+}
+
+static size_t parse_bufsize(char *str)
+{
+	unsigned long long sz;
+	char *last = last_char_is(str, '%');
+
+	if (last) {
+		*last = '\0';
+		sz = physical_memory() / 100 * xatou_range(str, 1, 100);
+	} else {
+		sz = xatoull_sfx(str, bufsize_suffixes);
+		/* GNU compat: default unit is kilobytes */
+		if (isdigit(str[strlen(str) - 1]))
+			sz *= 1024;
+	}
+	if (sz > (size_t)-1 / 2)
+		sz = (size_t)-1 / 2;
+	return sz;
+}
+
+static FILE *xtmpfile(void)
+{
+	char *name = concat_path_file(tmp_dir, "sortXXXXXX");
+	int fd = xmkstemp(name);
+	FILE *fp;
+
+	/* Nothing to clean up on exit: the file lives as long as fd */
+	unlink(name);
+	free(name);
+	fp = fdopen(fd, "w+");
+	if (!fp)
+		bb_die_memory_exhausted();
+	return fp;
+}
+
+static void rewind_run(FILE *fp)
+{
+	if (fflush(fp) != 0 || ferror(fp))
+		bb_simple_perror_msg_and_die(bb_msg_write_error);
+	rewind(fp);
+}
+
+# if ENABLE_FEATURE_SORT_OPTIMIZE_MEMORY
+static int compare_ptrs(const void *xarg, const void *yarg)
+{
+	char *x = *(char **)xarg;
+	char *y = *(char **)yarg;
+	return (x > y) - (x < y);
+}
+# endif
+
+static void free_lines(char **lines, int linecount)
+{
+	int i;
+# if ENABLE_FEATURE_SORT_OPTIMIZE_MEMORY
+	/* Some lines may be tails of other lines. Sorted by address,
+	 * tails follow the line they point into: free only the latter.
+	 */
+	char *end = NULL;
+
+	qsort(lines, linecount, sizeof(lines[0]), compare_ptrs);
+	for (i = 0; i < linecount; i++) {
+		char *line = lines[i];
+		if ((end && line <= end) || line == empty_line)
+			continue;
+		end = line + strlen(line);
+		free(line);
+	}
+# else
+	for (i = 0; i < linecount; i++)
+		free(lines[i]);
+# endif
+}
+
+static int run_less(char **line, unsigned x, unsigned y)
+{
+	int r = compare_keys(&line[x], &line[y]);
+	/* On ties, earlier run goes first: this keeps -s stable */
+	return r < 0 || (r == 0 && x < y);
+}
+
+/* k-way merge of runs using a heap of run indexes */
+static void merge_runs(struct sort_run *runs, unsigned n, FILE *out)
+{
+	char **line = xmalloc(n * sizeof(line[0]));
+	unsigned *heap = xmalloc(n * sizeof(heap[0]));
+	char *prev = NULL;
+	unsigned opts = option_mask32;
+	unsigned uniq_mask = (opts | FLAG_no_tie_break) & ~FLAG_s;
+	unsigned cnt, i;
+	int ch = (opts & FLAG_z) ? '\0' : '\n';
+
+	/* Lines read back from runs carry no input position:
+	 * -s is implemented by run_less() instead */
+	if (opts & FLAG_s)
+		option_mask32 = uniq_mask;
+
+	cnt = 0;
+	for (i = 0; i < n; i++) {
+		unsigned j;
+
+		line[i] = GET_LINE(runs[i].fp);
+		if (!line[i])
+			continue;
+		/* Sift up */
+		j = cnt++;
+		while (j != 0) {
+			unsigned parent = (j - 1) / 2;
+			if (!run_less(line, i, heap[parent]))
+				break;
+			heap[j] = heap[parent];
+			j = parent;
+		}
+		heap[j] = i;
+	}
+
+	while (cnt != 0) {
+		unsigned top = heap[0];
+		unsigned j, child;
+		char *cur = line[top];
+
+		if (opts & FLAG_u) {
+			/* Same rules as for in-memory -u: compare keys only */
+			unsigned merge_mask = option_mask32;
+			int dup;
+
+			option_mask32 = uniq_mask;
+			dup = (prev && compare_keys(&prev, &cur) == 0);
+			option_mask32 = merge_mask;
+			if (dup) {
+				free(cur);
+			} else {
+				fprintf(out, "%s%c", cur, ch);
+				free(prev);
+				prev = cur;
+			}
+		} else {
+			fprintf(out, "%s%c", cur, ch);
+			free(cur);
+		}
+
+		line[top] = GET_LINE(runs[top].fp);
+		if (!line[top]) {
+			/* This run is exhausted, move the last heap item to the root */
+			top = heap[--cnt];
+			if (cnt == 0)
+				break;
+		}
+		/* Sift down */
+		j = 0;
+		while ((child = 2 * j + 1) < cnt) {
+			if (child + 1 < cnt && run_less(line, heap[child + 1], heap[child]))
+				child++;
+			if (!run_less(line, heap[child], top))
+				break;
+			heap[j] = heap[child];
+			j = child;
+		}
+		heap[j] = top;
+	}
+
+	free(prev);
+	option_mask32 = opts;
+	for (i = 0; i < n; i++)
+		fclose_if_not_stdin(runs[i].fp);
+	free(heap);
+	free(line);
+}
+
+static void add_run(FILE *fp)
+{
+	unsigned level = 0;
+
+	for (;;) {
+		unsigned first;
+
+		run_list = xrealloc_vector(run_list, 4, run_count);
+		run_list[run_count].fp = fp;
+		run_list[run_count].level = level;
+		run_count++;
+		/* Levels never increase along the list: if the MERGE_WIDTH'th
+		 * run from the end has our level, so do all runs after it.
+		 * This way, we never keep more than MERGE_WIDTH-1 runs
+		 * per level open, and every line is merged ~log(runs) times.
+		 */
+		if (run_count < MERGE_WIDTH)
+			return;
+		first = run_count - MERGE_WIDTH;
+		if (run_list[first].level != level)
+			return;
+		fp = xtmpfile();
+		merge_runs(run_list + first, MERGE_WIDTH, fp);
+		rewind_run(fp);
+		run_count = first;
+		level++;
+	}
+}
+
+static void write_sorted(char **lines, int linecount, FILE *out)
+{
+	unsigned opts = option_mask32;
+	int ch = (opts & FLAG_z) ? '\0' : '\n';
+	char *prev = NULL;
+	int i;
+
+# if ENABLE_FEATURE_SORT_PARALLEL
+	/* Not worth forking for less than a few thousand lines per process */
+	unsigned procs = MIN(sort_procs, (unsigned)linecount / 4096);
+
+	if (procs > 1) {
+		struct sort_run *parts = xmalloc(procs * sizeof(parts[0]));
+		pid_t *pids = xmalloc(procs * sizeof(pids[0]));
+		unsigned n;
+
+		/* Each helper sorts a contiguous part of lines[], so stability
+		 * across parts is kept by merge_runs() preferring earlier runs.
+		 * Helpers get the lines for free thanks to copy-on-write.
+		 */
+		for (n = 0; n < procs; n++) {
+			int start = (unsigned long long)linecount * n / procs;
+			int end = (unsigned long long)linecount * (n + 1) / procs;
+			struct fd_pair pipefd;
+
+			xpiped_pair(pipefd);
+			pids[n] = xfork();
+			if (pids[n] == 0) {
+				/* Child */
+				FILE *fp;
+
+				close(pipefd.rd);
+				fp = xfdopen_for_write(pipefd.wr);
+				sort_procs = 1;
+				write_sorted(lines + start, end - start, fp);
+				if (fflush(fp) != 0)
+					bb_simple_perror_msg_and_die(bb_msg_write_error);
+				_exit(EXIT_SUCCESS);
+			}
+			close(pipefd.wr);
+			parts[n].fp = xfdopen_for_read(pipefd.rd);
+		}
+		merge_runs(parts, procs, out);
+		for (n = 0; n < procs; n++) {
+			/* Helper's error message is already shown */
+			if (wait4pid(pids[n]) != 0)
+				xfunc_die();
+		}
+		free(pids);
+		free(parts);
+		return;
+	}
+# endif
+
+	sort_lines(lines, linecount);
+	if (opts & FLAG_u)
+		option_mask32 = (opts | FLAG_no_tie_break) & ~FLAG_s;
+	for (i = 0; i < linecount; i++) {
+		if ((opts & FLAG_u) && prev && compare_keys(&prev, &lines[i]) == 0)
+			continue;
+		prev = lines[i];
+		fprintf(out, "%s%c", prev, ch);
+	}
+	option_mask32 = opts;
+}
+
+static void spill_run(char **lines, int linecount)
+{
+	FILE *fp = xtmpfile();
+
+	write_sorted(lines, linecount, fp);
+	rewind_run(fp);
+	free_lines(lines, linecount);
+	add_run(fp);
+}
+
+/* "sort -m -o FILE FILE": do not truncate FILE before it is read */
+static void copy_runs_of_file(const char *filename)
+{
+	struct stat st;
+	unsigned i;
+
+	if (stat(filename, &st) != 0)
+		return;
+	for (i = 0; i < run_count; i++) {
+		struct stat run_st;
+		FILE *fp;
+
+		fstat(fileno(run_list[i].fp), &run_st);
+		if (run_st.st_dev != st.st_dev || run_st.st_ino != st.st_ino)
+			continue;
+		/* Nothing was read from this input yet, stdio buffer is empty */
+		fp = xtmpfile();
+		bb_copyfd_eof(fileno(run_list[i].fp), fileno(fp));
+		fclose_if_not_stdin(run_list[i].fp);
+		rewind_run(fp);
+		run_list[i].fp = fp;
+	}
+}
+#endif
+
 int sort_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int sort_main(int argc UNUSED_PARAM, char **argv)
 {
 	char **lines;
-	char *str_ignored, *str_o, *str_t;
+	char *str_S, *str_T, *str_o, *str_t;
+	IF_FEATURE_SORT_PARALLEL(char *str_parallel;)
 	llist_t *lst_k = NULL;
 	int i;
 	int linecount;
 	unsigned opts;
+#if ENABLE_FEATURE_SORT_EXTERNAL
+	size_t mem_used = 0;
+	size_t mem_limit;
+#endif
 #if ENABLE_FEATURE_SORT_OPTIMIZE_MEMORY
 	bool can_drop_dups;
 	size_t prev_len = 0;
+# if ENABLE_FEATURE_SORT_EXTERNAL
+	char *prev_line = (char*) empty_line;
+# else
 	char *prev_line = (char*) "";
+# endif
 	/* Postpone optimizing if the input is small, < 16k lines:
 	 * even just free()ing duplicate lines takes time.
 	 */
@@ -463,9 +1011,10 @@ int sort_main(int argc UNUSED_PARAM, char **argv)
 	xfunc_error_retval = 2;
 
 	/* Parse command line options */
-	opts = getopt32(argv,
-			sort_opt_str,
-			&str_ignored, &str_ignored, &str_o, &lst_k, &str_t
+	opts = getopt32long(argv,
+			sort_opt_str, sort_longopts,
+			&str_S, &str_T, &str_o, &lst_k, &str_t
+			IF_FEATURE_SORT_PARALLEL(, &str_parallel)
 	);
 #if ENABLE_FEATURE_SORT_OPTIMIZE_MEMORY
 	/* Can drop dups only if -u but no "complicating" options,
@@ -552,6 +1101,31 @@ int sort_main(int argc UNUSED_PARAM, char **argv)
 			}
 		}
 	}
+	/* If no key, perform alphabetic sort */
+	if (!key_list)
+		add_key()->range[0] = 1;
+	if (need_parsed_keys()) {
+		struct sort_key *key;
+		for (key = key_list; key; key = key->next_key)
+			key_count++;
+		sort_item_size = sizeof(struct sort_item) + key_count * sizeof(struct parsed_key);
+	}
+#endif
+#if ENABLE_FEATURE_SORT_EXTERNAL
+	tmp_dir = (option_mask32 & FLAG_T) ? str_T : getenv("TMPDIR");
+	if (!tmp_dir || !tmp_dir[0])
+		tmp_dir = "/tmp";
+	if (option_mask32 & FLAG_S)
+		mem_limit = parse_bufsize(str_S);
+	else
+		mem_limit = MIN(physical_memory() / 4, (size_t)-1 / 2);
+	/* -c needs all lines at once */
+	if (option_mask32 & FLAG_c)
+		mem_limit = (size_t)-1;
+#endif
+#if ENABLE_FEATURE_SORT_PARALLEL
+	if (option_mask32 & FLAG_parallel)
+		sort_procs = xatou_range(str_parallel, 1, 256);
 #endif
 
 	/* Open input files and read data */
@@ -560,6 +1134,14 @@ int sort_main(int argc UNUSED_PARAM, char **argv)
 		*--argv = (char*)"-";
 	linecount = 0;
 	lines = NULL;
+#if ENABLE_FEATURE_SORT_EXTERNAL
+	if ((option_mask32 & (FLAG_m | FLAG_c)) == FLAG_m) {
+		/* Inputs are sorted runs already */
+		do
+			add_run(xfopen_stdin(*argv));
+		while (*++argv);
+	} else
+#endif
 	do {
 		/* coreutils 6.9 compat: abort on first open error,
 		 * do not continue to next file: */
@@ -608,14 +1190,28 @@ int sort_main(int argc UNUSED_PARAM, char **argv)
 #endif
 			lines = xrealloc_vector(lines, 6, linecount);
 			lines[linecount++] = line;
+#if ENABLE_FEATURE_SORT_EXTERNAL
+			/* Account for line pointer, malloc overhead
+			 * and parsed keys (sort_parsed() copies keys) too */
+			i = strlen(line) + 1;
+			mem_used += i + 3 * sizeof(char*);
+			if (sort_item_size)
+				mem_used += sort_item_size + i;
+			if (mem_used >= mem_limit) {
+				spill_run(lines, linecount);
+				linecount = 0;
+				mem_used = 0;
+# if ENABLE_FEATURE_SORT_OPTIMIZE_MEMORY
+				prev_len = 0;
+				prev_line = (char*) empty_line;
+# endif
+			}
+#endif
 		}
 		fclose_if_not_stdin(fp);
 	} while (*++argv);
 
 #if ENABLE_FEATURE_SORT_BIG
-	/* If no key, perform alphabetic sort */
-	if (!key_list)
-		add_key()->range[0] = 1;
 	/* Handle -c */
 	if (option_mask32 & FLAG_c) {
 		int j = (option_mask32 & FLAG_u) ? -1 : 0;
@@ -629,25 +1225,28 @@ int sort_main(int argc UNUSED_PARAM, char **argv)
 	}
 #endif
 
-	/* For stable sort, store original line position beyond terminating NUL */
-	if (option_mask32 & FLAG_s) {
-		for (i = 0; i < linecount; i++) {
-			uint32_t *p32;
-			char *line;
-			unsigned len;
-
-			line = lines[i];
-			len = (strlen(line) + 4) & (~3u);
-			lines[i] = line = xrealloc(line, len + 4);
-			p32 = (void*)(line + len);
-			*p32 = i;
+#if ENABLE_FEATURE_SORT_EXTERNAL
+	if (run_count) {
+		/* Input did not fit into memory (or -m): merge sorted runs */
+		if (linecount)
+			spill_run(lines, linecount);
+		if (option_mask32 & FLAG_o) {
+			copy_runs_of_file(str_o);
+			xmove_fd(xopen(str_o, O_WRONLY|O_CREAT|O_TRUNC), STDOUT_FILENO);
 		}
-		/*option_mask32 |= FLAG_no_tie_break;*/
-		/* ^^^redundant: if FLAG_s, compare_keys() does no tie break */
+		merge_runs(run_list, run_count, stdout);
+		fflush_stdout_and_exit_SUCCESS();
 	}
+	if (sort_procs > 1) {
+		if (option_mask32 & FLAG_o)
+			xmove_fd(xopen(str_o, O_WRONLY|O_CREAT|O_TRUNC), STDOUT_FILENO);
+		write_sorted(lines, linecount, stdout);
+		fflush_stdout_and_exit_SUCCESS();
+	}
+#endif
 
 	/* Perform the actual sort */
-	qsort(lines, linecount, sizeof(lines[0]), compare_keys);
+	sort_lines(lines, linecount);
 
 	/* Handle -u */
 	if (option_mask32 & FLAG_u) {
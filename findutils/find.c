@@ -180,6 +180,14 @@
 //config:	Without this option, -exec + is a synonym for -exec ;
 //config:	(IOW: it works correctly, but without expected speedup)
 //config:
+//config:config FEATURE_FIND_JOBS
+//config:	bool "Enable -jobs N: run N -exec + commands at once"
+//config:	default y
+//config:	depends on FEATURE_FIND_EXEC_PLUS
+//config:	help
+//config:	With -jobs N, find keeps walking while up to N
+//config:	'-exec ... {} +' commands run, like xargs -P N.
+//config:
 //config:config FEATURE_FIND_USER
 //config:	bool "Enable -user: username/uid matching"
 //config:	default y
@@ -277,6 +285,14 @@
 //config:	depends on FIND
 //config:	help
 //config:	Support the 'find -links' option for matching number of links.
+//config:
+//config:config FEATURE_FIND_PARALLEL
+//config:	bool "Enable -parallel: walk big trees in several processes"
+//config:	default y
+//config:	depends on FIND && FEATURE_RECURSIVE_ACTION_PARALLEL
+//config:	help
+//config:	With -parallel, big directory trees are walked by one process
+//config:	per CPU. Names are printed in no particular order.
 
 //applet:IF_FIND(APPLET_NOEXEC(find, find, BB_DIR_USR_BIN, BB_SUID_DROP, find))
 
@@ -301,6 +317,13 @@
 //usage:	IF_FEATURE_FIND_DEPTH(
 //usage:     "\n	-depth		Act on directory *after* traversing it"
 //usage:	)
+//usage:	IF_FEATURE_FIND_PARALLEL(
+//usage:     "\n	-parallel	Walk in several processes, print in any order."
+//usage:     "\n			Ignored with -depth, -exec, -delete, -quit"
+//usage:	)
+//usage:	IF_FEATURE_FIND_JOBS(
+//usage:     "\n	-jobs N		Run up to N -exec + commands in parallel"
+//usage:	)
 //usage:     "\n"
 //usage:     "\nActions:"
 //usage:	IF_FEATURE_FIND_PAREN(
@@ -407,6 +430,9 @@
 //usage:       "/etc/passwd\n"
 
 #include <fnmatch.h>
+#if ENABLE_FEATURE_FIND_PARALLEL
+# include <stdio_ext.h>
+#endif
 #include "libbb.h"
 #include "common_bufsiz.h"
 #if ENABLE_FEATURE_FIND_REGEX
@@ -475,6 +501,9 @@ IF_FEATURE_FIND_EXEC(   ACTS(exec,
 					char **filelist;
 					int filelist_idx;
 					int file_len;
+					/* fixed args, and per file besides its name */
+					int base_len;
+					int subst_len;
 				)
 				))
 IF_FEATURE_FIND_GROUP(  ACTS(group, gid_t gid;))
@@ -489,9 +518,12 @@ struct globals {
 	action ***actions;
 	smallint need_print;
 	smallint xdev_on;
+	IF_FEATURE_FIND_PARALLEL(smallint parallel;)
 	smalluint exitstatus;
 	recurse_flags_t recurse_flags;
 	IF_FEATURE_FIND_EXEC_PLUS(unsigned max_argv_len;)
+	IF_FEATURE_FIND_JOBS(unsigned max_jobs;)
+	IF_FEATURE_FIND_JOBS(unsigned running_jobs;)
 } FIX_ALIASING;
 #define G (*(struct globals*)bb_common_bufsiz1)
 #define INIT_G() do { \
@@ -501,10 +533,30 @@ struct globals {
 	memset(&G, 0, sizeof(G)); \
 	IF_FEATURE_FIND_MAXDEPTH(G.minmaxdepth[1] = INT_MAX;) \
 	IF_FEATURE_FIND_EXEC_PLUS(G.max_argv_len = bb_arg_max() - 2048;) \
+	IF_FEATURE_FIND_JOBS(G.max_jobs = 1;) \
 	G.need_print = 1; \
 	G.recurse_flags = ACTION_RECURSE; \
 } while (0)
 
+#if ENABLE_FEATURE_FIND_PARALLEL
+/* Writes of up to PIPE_BUF bytes to a pipe are atomic */
+enum { PARALLEL_OUTBUF_SIZE = PIPE_BUF };
+#endif
+static void print_name(const char *fileName, char end)
+{
+#if ENABLE_FEATURE_FIND_PARALLEL
+	/* Other processes print to the same stdout:
+	 * never let stdio write out a part of a name */
+	if ((G.recurse_flags & ACTION_PARALLEL)
+	 && __fpending(stdout) + strlen(fileName) + 1 > PARALLEL_OUTBUF_SIZE
+	) {
+		fflush(stdout);
+	}
+#endif
+	fputs(fileName, stdout);
+	putchar(end);
+}
+
 /* Return values of ACTFs ('action functions') are a bit mask:
  * bit 1=1: prune (use SKIP constant for setting it)
  * bit 0=1: matched successfully (TRUE)
@@ -750,6 +802,36 @@ ACTF(samefile)
 }
 #endif
 #if ENABLE_FEATURE_FIND_EXEC
+# if ENABLE_FEATURE_FIND_JOBS
+/* -jobs N: wait for one of running -exec + commands */
+static void wait_job(void)
+{
+	int wstat;
+
+	if (safe_waitpid(-1, &wstat, 0) < 0) {
+		G.running_jobs = 0; /* ECHILD */
+		return;
+	}
+	G.running_jobs--;
+	if (!WIFEXITED(wstat) || WEXITSTATUS(wstat) != 0)
+		G.exitstatus |= EXIT_FAILURE;
+}
+
+/* Returns 0 if the command is started, -1 if it can't be */
+static int start_job(char **argv)
+{
+	pid_t pid;
+
+	while (G.running_jobs >= G.max_jobs)
+		wait_job();
+	pid = spawn(argv);
+	if (pid < 0)
+		return -1;
+	G.running_jobs++;
+	return 0;
+}
+# endif
+
 static int do_exec(action_exec *ap, const char *fileName)
 {
 	int i, rc;
@@ -802,6 +884,11 @@ static int do_exec(action_exec *ap, const char *fileName)
 	}
 # endif
 
+# if ENABLE_FEATURE_FIND_JOBS
+	if (ap->filelist && G.max_jobs > 1)
+		rc = start_job(argv);
+	else
+# endif
 	rc = spawn_and_wait(argv);
 	if (rc < 0)
 		bb_simple_perror_msg(argv[0]);
@@ -816,14 +903,18 @@ ACTF(exec)
 # if ENABLE_FEATURE_FIND_EXEC_PLUS
 	if (ap->filelist) {
 		int rc;
+		int len = strlen(fileName) + ap->subst_len;
 
-		ap->filelist = xrealloc_vector(ap->filelist, 8, ap->filelist_idx);
-		ap->filelist[ap->filelist_idx++] = xstrdup(fileName);
-		ap->file_len += strlen(fileName) + sizeof(char*) + 1;
-		/* If we have lots of files already, exec the command */
+		/* If this name does not fit, exec the command without it */
 		rc = 1;
-		if (ap->file_len >= G.max_argv_len)
+		if (ap->filelist_idx != 0
+		 && ap->base_len + ap->file_len + len > G.max_argv_len
+		) {
 			rc = do_exec(ap, NULL);
+		}
+		ap->filelist = xrealloc_vector(ap->filelist, 8, ap->filelist_idx);
+		ap->filelist[ap->filelist_idx++] = xstrdup(fileName);
+		ap->file_len += len;
 		return rc;
 	}
 # endif
@@ -850,6 +941,10 @@ static int flush_exec_plus(void)
 			}
 		}
 	}
+#  if ENABLE_FEATURE_FIND_JOBS
+	while (G.running_jobs != 0)
+		wait_job();
+#  endif
 	return 0;
 }
 # endif
@@ -869,13 +964,13 @@ ACTF(group)
 #if ENABLE_FEATURE_FIND_PRINT0
 ACTF(print0)
 {
-	printf("%s%c", fileName, '\0');
+	print_name(fileName, '\0');
 	return TRUE;
 }
 #endif
 ACTF(print)
 {
-	puts(fileName);
+	print_name(fileName, '\n');
 	return TRUE;
 }
 #if ENABLE_FEATURE_FIND_PAREN
@@ -1016,7 +1111,7 @@ static int FAST_FUNC fileAction(
 	r = exec_actions(G.actions, fileName, statbuf);
 	/* Had no explicit -print[0] or -exec? then print */
 	if ((r & TRUE) && G.need_print)
-		puts(fileName);
+		print_name(fileName, '\n');
 
 #if ENABLE_FEATURE_FIND_MAXDEPTH
 	if (S_ISDIR(statbuf->st_mode)) {
@@ -1036,6 +1131,48 @@ static int FAST_FUNC fileAction(
 }
 
 
+/* What do actions need besides file names? */
+enum {
+	ACTS_NEED_STAT = 1 << 0, /* more than file type from statbuf */
+	ACTS_SERIAL    = 1 << 1, /* can't run in several processes */
+};
+static unsigned actions_need(action ***appp)
+{
+	action **app, *ap;
+	unsigned need = 0;
+
+	while ((app = *appp++) != NULL) {
+		while ((ap = *app++) != NULL) {
+			action_fp f = ap->f;
+#if ENABLE_FEATURE_FIND_PAREN
+			if (f == (action_fp) func_paren) {
+				need |= actions_need(((action_paren*)ap)->subexpr);
+				continue;
+			}
+#endif
+			if (0 IF_FEATURE_FIND_EXEC(|| f == (action_fp) func_exec)
+			      IF_FEATURE_FIND_DELETE(|| f == (action_fp) func_delete)
+			      IF_FEATURE_FIND_QUIT(|| f == (action_fp) func_quit)
+			) {
+				need |= ACTS_SERIAL;
+				continue;
+			}
+			if (f != (action_fp) func_print
+			 && f != (action_fp) func_name
+			 IF_FEATURE_FIND_PATH(&& f != (action_fp) func_path)
+			 IF_FEATURE_FIND_REGEX(&& f != (action_fp) func_regex)
+			 IF_FEATURE_FIND_PRINT0(&& f != (action_fp) func_print0)
+			 IF_FEATURE_FIND_TYPE(&& f != (action_fp) func_type)
+			 IF_FEATURE_FIND_EXECUTABLE(&& f != (action_fp) func_executable)
+			 IF_FEATURE_FIND_PRUNE(&& f != (action_fp) func_prune)
+			) {
+				need |= ACTS_NEED_STAT;
+			}
+		}
+	}
+	return need;
+}
+
 #if ENABLE_FEATURE_FIND_TYPE
 static int find_type(const char *type)
 {
@@ -1105,6 +1242,7 @@ static action*** parse_params(char **argv)
 	                        OPT_FOLLOW     ,
 	IF_FEATURE_FIND_XDEV(   OPT_XDEV       ,)
 	IF_FEATURE_FIND_DEPTH(  OPT_DEPTH      ,)
+	IF_FEATURE_FIND_PARALLEL(OPT_PARALLEL  ,)
 	                        PARM_a         ,
 	                        PARM_o         ,
 	IF_FEATURE_FIND_NOT(	PARM_char_not  ,)
@@ -1150,12 +1288,14 @@ static action*** parse_params(char **argv)
 	IF_FEATURE_FIND_CONTEXT(PARM_context   ,)
 	IF_FEATURE_FIND_LINKS(  PARM_links     ,)
 	IF_FEATURE_FIND_MAXDEPTH(OPT_MINDEPTH,OPT_MAXDEPTH,)
+	IF_FEATURE_FIND_JOBS(   OPT_JOBS       ,)
 	};
 
 	static const char params[] ALIGN1 =
 	                        "-follow\0"
 	IF_FEATURE_FIND_XDEV(   "-xdev\0"                 )
 	IF_FEATURE_FIND_DEPTH(  "-depth\0"                )
+	IF_FEATURE_FIND_PARALLEL("-parallel\0"           )
 	                        "-a\0"
 	                        "-o\0"
 	IF_FEATURE_FIND_NOT(    "!\0"       )
@@ -1199,6 +1339,7 @@ static action*** parse_params(char **argv)
 	IF_FEATURE_FIND_CONTEXT("-context\0")
 	IF_FEATURE_FIND_LINKS(  "-links\0"  )
 	IF_FEATURE_FIND_MAXDEPTH("-mindepth\0""-maxdepth\0")
+	IF_FEATURE_FIND_JOBS(   "-jobs\0"   )
 	;
 
 #if !USE_NESTED_FUNCTION
@@ -1275,12 +1416,24 @@ static action*** parse_params(char **argv)
 			G.minmaxdepth[parm - OPT_MINDEPTH] = xatoi_positive(arg1);
 		}
 #endif
+#if ENABLE_FEATURE_FIND_JOBS
+		else if (parm == OPT_JOBS) {
+			dbg("%d", __LINE__);
+			G.max_jobs = xatou_range(arg1, 1, 1024);
+		}
+#endif
 #if ENABLE_FEATURE_FIND_DEPTH
 		else if (parm == OPT_DEPTH) {
 			dbg("%d", __LINE__);
 			G.recurse_flags |= ACTION_DEPTHFIRST;
 		}
 #endif
+#if ENABLE_FEATURE_FIND_PARALLEL
+		else if (parm == OPT_PARALLEL) {
+			dbg("%d", __LINE__);
+			G.parallel = 1;
+		}
+#endif
 /* Actions are grouped by operators
  * ( expr )              Force precedence
  * ! expr                True if expr is false
@@ -1386,6 +1539,14 @@ static action*** parse_params(char **argv)
 			while (i--) {
 				ap->subst_count[i] = count_strstr(ap->exec_argv[i], "{}");
 				IF_FEATURE_FIND_EXEC_PLUS(all_subst += ap->subst_count[i];)
+# if ENABLE_FEATURE_FIND_EXEC_PLUS
+				/* Every arg takes its length, NUL and a pointer.
+				 * The one with {} is repeated for every file name */
+				if (ap->subst_count[i] == 0)
+					ap->base_len += strlen(ap->exec_argv[i]) + 1 + sizeof(char*);
+				else
+					ap->subst_len = strlen(ap->exec_argv[i]) - 2 + 1 + sizeof(char*);
+# endif
 			}
 # if ENABLE_FEATURE_FIND_EXEC_PLUS
 			/*
@@ -1635,6 +1796,19 @@ int find_main(int argc UNUSED_PARAM, char **argv)
 	char **past_HLP, *saved;
 
 	INIT_G();
+#if ENABLE_FEATURE_FIND_EXEC_PLUS
+	{
+		/* -exec + commands get our environment,
+		 * it counts against ARG_MAX too */
+		unsigned env_len = 0;
+		char **e;
+		for (e = environ; *e; e++)
+			env_len += strlen(*e) + 1 + sizeof(char*);
+		if (env_len > G.max_argv_len / 2)
+			env_len = G.max_argv_len / 2;
+		G.max_argv_len -= env_len;
+	}
+#endif
 
 	/* "find -type f" + getopt("+HLP") => disaster.
 	 * Need to avoid getopt running into a non-HLP option.
@@ -1703,6 +1877,20 @@ int find_main(int argc UNUSED_PARAM, char **argv)
 	}
 #endif
 
+	i = actions_need(G.actions);
+	/* -xdev needs st_dev of directories */
+	if (!(i & ACTS_NEED_STAT) && !G.xdev_on)
+		G.recurse_flags |= ACTION_TYPE_ONLY;
+#if ENABLE_FEATURE_FIND_PARALLEL
+	if (G.parallel
+	 && !(i & ACTS_SERIAL)
+	 && !(G.recurse_flags & ACTION_DEPTHFIRST)
+	) {
+		G.recurse_flags |= ACTION_PARALLEL;
+		setvbuf(stdout, xmalloc(PARALLEL_OUTBUF_SIZE), _IOFBF, PARALLEL_OUTBUF_SIZE);
+	}
+#endif
+
 	for (i = 0; argv[i]; i++) {
 		if (!recursive_action(argv[i],
 				G.recurse_flags,/* flags */
@@ -43,6 +43,16 @@
 //config:	Print the specified number of leading (-B) and/or trailing (-A)
 //config:	context surrounding our matching lines.
 //config:	Print the specified number of context lines (-C).
+//config:
+//config:config FEATURE_GREP_PARALLEL
+//config:	bool "Enable -j N: grep files in N processes"
+//config:	default y
+//config:	depends on (GREP || EGREP || FGREP) && !NOMMU
+//config:	help
+//config:	Grep many files (typically found by -r) in N worker processes.
+//config:	Output of each file is printed as a whole, not interleaved
+//config:	with output of other files. --ordered prints it in the order
+//config:	in which files are given/found.
 
 //applet:IF_GREP(APPLET(grep, BB_DIR_BIN, BB_SUID_DROP))
 //                APPLET_ODDNAME:name   main  location    suid_type     help
@@ -62,6 +72,7 @@
 //usage:	IF_EXTRA_COMPAT("z")
 //usage:       "] [-m N] "
 //usage:	IF_FEATURE_GREP_CONTEXT("[-A|B|C N] ")
+//usage:	IF_FEATURE_GREP_PARALLEL("[-j N] ")
 //usage:       "{ PATTERN | -e PATTERN... | -f FILE... } [FILE]..."
 //usage:#define grep_full_usage "\n\n"
 //usage:       "Search for PATTERN in FILEs (or stdin)\n"
@@ -91,6 +102,12 @@
 //usage:     "\n	-B N	Print N lines of leading context"
 //usage:     "\n	-C N	Same as '-A N -B N'"
 //usage:	)
+//usage:	IF_FEATURE_GREP_PARALLEL(
+//usage:     "\n	-j N	Grep files in N processes"
+//usage:	IF_LONG_OPTS(
+//usage:     "\n	--ordered	Print output of files in the order they are found"
+//usage:	)
+//usage:	)
 //usage:     "\n	-e PTRN	Pattern to match"
 //usage:     "\n	-f FILE	Read pattern from file"
 //usage:
@@ -111,9 +128,11 @@
 	IF_FEATURE_GREP_CONTEXT("A:+B:+C:+") \
 	"E" \
 	IF_EXTRA_COMPAT("z") \
+	IF_FEATURE_GREP_PARALLEL("j:+") \
 	"aI"
 /* ignored: -a "assume all files to be text" */
 /* ignored: -I "assume binary files have no matches" */
+/* long options only: --color (ignored), --ordered */
 enum {
 	OPTBIT_l, /* list matched file names only */
 	OPTBIT_n, /* print line# */
@@ -139,6 +158,11 @@ enum {
 	IF_FEATURE_GREP_CONTEXT(    OPTBIT_C ,) /* -C NUM: -A and -B combined */
 	OPTBIT_E, /* extended regexp */
 	IF_EXTRA_COMPAT(            OPTBIT_z ,) /* input is NUL terminated */
+	IF_FEATURE_GREP_PARALLEL(   OPTBIT_j ,) /* -j N: grep files in N processes */
+	OPTBIT_a,
+	OPTBIT_I,
+	IF_FEATURE_GREP_CONTEXT(    OPTBIT_color ,)
+	IF_FEATURE_GREP_PARALLEL(   OPTBIT_ordered ,) /* --ordered: -j output in order */
 	OPT_l = 1 << OPTBIT_l,
 	OPT_n = 1 << OPTBIT_n,
 	OPT_q = 1 << OPTBIT_q,
@@ -163,6 +187,8 @@ enum {
 	OPT_C = IF_FEATURE_GREP_CONTEXT(    (1 << OPTBIT_C)) + 0,
 	OPT_E = 1 << OPTBIT_E,
 	OPT_z = IF_EXTRA_COMPAT(            (1 << OPTBIT_z)) + 0,
+	OPT_j = IF_FEATURE_GREP_PARALLEL(   (1 << OPTBIT_j)) + 0,
+	OPT_ordered = IF_FEATURE_GREP_PARALLEL((1 << OPTBIT_ordered)) + 0,
 };
 
 #define PRINT_LINE_NUM              (option_mask32 & OPT_n)
@@ -189,10 +215,25 @@ struct globals {
 	char **before_buf;
 	IF_EXTRA_COMPAT(size_t *before_buf_size;)
 	int last_line_printed;
+	IF_FEATURE_GREP_PARALLEL(int first_line_printed;)
 #endif
 	/* globals used internally */
 	llist_t *pattern_head;   /* growable list of patterns to match */
 	const char *cur_file;    /* the current file we are reading */
+	/* the only pattern is a literal string: search whole blocks for it */
+	struct literal *literal;
+	/* -F with many patterns: match them all in one pass */
+	struct ac *ac;
+	/* block reader: input is read in big blocks, lines are used in place */
+	smallint skip_lines;     /* can skip lines without (any of) the literal(s) */
+	char *buf;
+	size_t buf_size;
+	size_t buf_pos;          /* start of the next line */
+	size_t buf_len;          /* end of data */
+	int buf_fd;
+	smallint buf_eof;
+	/* -j N: worker processes */
+	IF_FEATURE_GREP_PARALLEL(struct grep_parallel *par;)
 } FIX_ALIASING;
 #define G (*(struct globals*)bb_common_bufsiz1)
 #define INIT_G() do { \
@@ -218,8 +259,13 @@ struct globals {
 #define print_filename    (G.print_filename      )
 #define open_errors       (G.open_errors         )
 #define did_print_line    (G.did_print_line      )
+#if ENABLE_FEATURE_GREP_CONTEXT
 #define lines_before      (G.lines_before        )
 #define lines_after       (G.lines_after         )
+#else
+#define lines_before      0
+#define lines_after       0
+#endif
 #define before_buf        (G.before_buf          )
 #define before_buf_size   (G.before_buf_size     )
 #define last_line_printed (G.last_line_printed   )
@@ -259,6 +305,7 @@ static void print_line(const char *line, size_t line_len, int linenum, char deco
 	) {
 		puts("--");
 	}
+	IF_FEATURE_GREP_PARALLEL(if (!did_print_line) G.first_line_printed = linenum;)
 	/* guard against printing "--" before first line of first file */
 	did_print_line = 1;
 	last_line_printed = linenum;
@@ -278,38 +325,363 @@ static void print_line(const char *line, size_t line_len, int linenum, char deco
 	}
 }
 
-#if ENABLE_EXTRA_COMPAT
-/* Unlike getline, this one removes trailing '\n' */
-static ssize_t FAST_FUNC bb_getline(char **line_ptr, size_t *line_alloc_len, FILE *file)
+/* Boyer-Moore-Horspool search for a literal pattern,
+ * -i is handled by folding both pattern and text to uppercase.
+ */
+struct literal {
+	unsigned len;
+	unsigned shift[256];
+	unsigned char fold[256];
+	unsigned char str[1];
+};
+
+static struct literal *compile_literal(const char *pattern)
 {
-	ssize_t res_sz;
-	char *line;
-	int delim = (NUL_DELIMITED ? '\0' : '\n');
+	struct literal *lit;
+	unsigned len = strlen(pattern);
+	unsigned i;
 
-	res_sz = getdelim(line_ptr, line_alloc_len, delim, file);
-	line = *line_ptr;
+	if (len == 0)
+		return NULL;
+	if (!FGREP_FLAG && strpbrk(pattern, "\\.[]*^$+?(){}|"))
+		return NULL;
+	lit = xmalloc(sizeof(*lit) + len);
+	lit->len = len;
+	for (i = 0; i < 256; i++)
+		lit->fold[i] = i;
+	if (option_mask32 & OPT_i) {
+		for (i = 0; i < len; i++) {
+			/* Bytewise folding is only correct for ASCII */
+			if ((unsigned char)pattern[i] >= 0x80) {
+				free(lit);
+				return NULL;
+			}
+		}
+		for (i = 'a'; i <= 'z'; i++)
+			lit->fold[i] = i - ('a' - 'A');
+	}
+	for (i = 0; i < len; i++)
+		lit->str[i] = lit->fold[(unsigned char)pattern[i]];
+	for (i = 0; i < 256; i++)
+		lit->shift[i] = len;
+	for (i = 0; i < len - 1; i++)
+		lit->shift[lit->str[i]] = len - 1 - i;
+	/* Folded text byte must shift as its folded value does */
+	for (i = 0; i < 256; i++)
+		lit->shift[i] = lit->shift[lit->fold[i]];
+	return lit;
+}
+
+static char *find_literal(const struct literal *lit, char *p, char *end)
+{
+	unsigned last = lit->len - 1;
 
-	if (res_sz > 0) {
-		if (line[res_sz - 1] == delim)
-			line[--res_sz] = '\0';
-	} else {
-		free(line); /* uclibc allocates a buffer even on EOF. WTF? */
+	while ((size_t)(end - p) > last) {
+		unsigned char c = p[last];
+		if (lit->fold[c] == lit->str[last]) {
+			unsigned i = 0;
+			while (i < last && lit->fold[(unsigned char)p[i]] == lit->str[i])
+				i++;
+			if (i == last)
+				return p;
+		}
+		p += lit->shift[c];
 	}
-	return res_sz;
+	return NULL;
+}
+
+/* Aho-Corasick automaton for many -F patterns */
+struct ac_node {
+	unsigned child;     /* first child */
+	unsigned sibling;   /* next child of the same parent */
+	unsigned fail;      /* longest proper suffix which is in the trie */
+	unsigned out;       /* 1 + index of the first pattern ending here, or 0 */
+	unsigned out_link;  /* nearest node on fail chain with out != 0 */
+	unsigned depth;
+	unsigned char ch;
+};
+
+struct ac {
+	struct ac_node *node;
+	grep_list_data_t **pats;
+	unsigned root_next[256];
+	unsigned char fold[256];
+};
+
+static unsigned ac_child(const struct ac *ac, unsigned s, unsigned char c)
+{
+	if (s == 0)
+		return ac->root_next[c];
+	for (s = ac->node[s].child; s; s = ac->node[s].sibling)
+		if (ac->node[s].ch == c)
+			break;
+	return s;
+}
+
+static unsigned ac_step(const struct ac *ac, unsigned s, unsigned char c)
+{
+	for (;;) {
+		unsigned next = ac_child(ac, s, c);
+		if (next || s == 0)
+			return next;
+		s = ac->node[s].fail;
+	}
+}
+
+static struct ac *compile_ac(void)
+{
+	struct ac *ac;
+	llist_t *lp;
+	unsigned *queue;
+	unsigned count, max_nodes, head, tail, i;
+
+	/* Node count is at most total pattern length + 1 */
+	max_nodes = 1;
+	i = 0;
+	for (lp = pattern_head; lp; lp = lp->link, i++) {
+		const char *p = ((grep_list_data_t *)lp->data)->pattern;
+		/* Empty pattern matches everywhere, let old code handle it */
+		if (!p[0])
+			return NULL;
+		for (; *p; p++, max_nodes++) {
+			/* Bytewise folding is only correct for ASCII */
+			if ((option_mask32 & OPT_i) && (unsigned char)*p >= 0x80)
+				return NULL;
+		}
+	}
+
+	ac = xzalloc(sizeof(*ac));
+	ac->pats = xmalloc(i * sizeof(ac->pats[0]));
+	for (i = 0; i < 256; i++)
+		ac->fold[i] = i;
+	if (option_mask32 & OPT_i) {
+		for (i = 'a'; i <= 'z'; i++)
+			ac->fold[i] = i - ('a' - 'A');
+	}
+	ac->node = xzalloc(max_nodes * sizeof(ac->node[0]));
+
+	/* Build the trie */
+	count = 1;
+	for (i = 0, lp = pattern_head; lp; lp = lp->link, i++) {
+		grep_list_data_t *gl = (grep_list_data_t *)lp->data;
+		const char *p;
+		unsigned s = 0;
+
+		ac->pats[i] = gl;
+		for (p = gl->pattern; *p; p++) {
+			unsigned char c = ac->fold[(unsigned char)*p];
+			unsigned next = ac_child(ac, s, c);
+			if (!next) {
+				next = count++;
+				ac->node[next].ch = c;
+				ac->node[next].depth = ac->node[s].depth + 1;
+				ac->node[next].sibling = ac->node[s].child;
+				ac->node[s].child = next;
+				if (s == 0)
+					ac->root_next[c] = next;
+			}
+			s = next;
+		}
+		if (!ac->node[s].out)
+			ac->node[s].out = i + 1;
+	}
+
+	/* Breadth-first: fail links of a node's parent are known before it */
+	queue = xmalloc(count * sizeof(queue[0]));
+	head = tail = 0;
+	for (i = ac->node[0].child; i; i = ac->node[i].sibling)
+		queue[tail++] = i; /* fail = 0 */
+	while (head < tail) {
+		unsigned u = queue[head++];
+		unsigned v;
+		for (v = ac->node[u].child; v; v = ac->node[v].sibling) {
+			unsigned f = ac_step(ac, ac->node[u].fail, ac->node[v].ch);
+			ac->node[v].fail = f;
+			ac->node[v].out_link = ac->node[f].out ? f : ac->node[f].out_link;
+			queue[tail++] = v;
+		}
+	}
+	free(queue);
+	return ac;
+}
+
+static int is_word_char(unsigned char c)
+{
+	return isalnum(c) || c == '_';
+}
+
+/* Returns first pattern (in list order) which matches the line, honoring -w and -x */
+static grep_list_data_t *ac_match(const char *line)
+{
+	const struct ac *ac = G.ac;
+	size_t len = strlen(line);
+	unsigned best = UINT_MAX;
+	unsigned s = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned o;
+
+		s = ac_step(ac, s, ac->fold[(unsigned char)line[i]]);
+		o = ac->node[s].out ? s : ac->node[s].out_link;
+		for (; o; o = ac->node[o].out_link) {
+			size_t start = i + 1 - ac->node[o].depth;
+			unsigned idx = ac->node[o].out - 1;
+
+			if (option_mask32 & OPT_x) {
+				if (start != 0 || i + 1 != len)
+					continue;
+			} else if (option_mask32 & OPT_w) {
+				if (start != 0 && is_word_char(line[start - 1]))
+					continue;
+				if (is_word_char(line[i + 1]))
+					continue;
+			}
+			/* -o prints the pattern, need the first one, not any */
+			if (!(option_mask32 & OPT_o))
+				return ac->pats[idx];
+			if (best > idx)
+				best = idx;
+		}
+	}
+	return best != UINT_MAX ? ac->pats[best] : NULL;
+}
+
+/* Returns a byte of the first occurrence of any pattern */
+static char *find_ac(const struct ac *ac, char *p, char *end)
+{
+	unsigned s = 0;
+
+	while (p < end) {
+		s = ac_step(ac, s, ac->fold[(unsigned char)*p]);
+		if (ac->node[s].out || ac->node[s].out_link)
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+static char *find_candidate(char *p, char *end)
+{
+	if (G.literal)
+		return find_literal(G.literal, p, end);
+	return find_ac(G.ac, p, end);
+}
+
+/* Without EXTRA_COMPAT lines were read by xmalloc_fgetline(),
+ * which ends a line at NUL too. Keep doing that: matching
+ * stops at NUL, text after it would never be searched */
+#define NUL_ENDS_LINE(delim) (!ENABLE_EXTRA_COMPAT && (delim) != '\0')
+
+static unsigned count_lines(const char *p, const char *end, char delim)
+{
+	const char *s = p;
+	unsigned n = 0;
+	while ((s = memchr(s, delim, end - s)) != NULL) {
+		s++;
+		n++;
+	}
+	if (NUL_ENDS_LINE(delim)) {
+		while ((p = memchr(p, '\0', end - p)) != NULL) {
+			p++;
+			n++;
+		}
+	}
+	return n;
+}
+
+static char *find_eol(char *p, char *end, char delim)
+{
+	char *eol = memchr(p, delim, end - p);
+	if (NUL_ENDS_LINE(delim)) {
+		char *nul = memchr(p, '\0', (eol ? eol : end) - p);
+		if (nul)
+			eol = nul;
+	}
+	return eol;
 }
-#endif
 
-static int grep_file(FILE *file)
+/* Reads input in big blocks and returns lines in place, NUL-terminated.
+ * If skip_to_candidate is set, lines which can't match are skipped,
+ * and counted in *linenum if it is not NULL.
+ */
+static char *next_block_line(size_t *line_len, int skip_to_candidate, int *linenum)
+{
+	char delim = NUL_DELIMITED ? '\0' : '\n';
+
+	for (;;) {
+		char *start = G.buf + G.buf_pos;
+		char *end = G.buf + G.buf_len;
+		char *eol;
+		ssize_t sz;
+
+		if (skip_to_candidate) {
+			/* Search only complete lines: up to the last delimiter */
+			char *stop = G.buf_eof ? end : memrchr(start, delim, end - start);
+			char *hit = stop ? find_candidate(start, stop) : NULL;
+
+			if (hit) {
+				char *line = hit;
+				while (line > start && line[-1] != delim
+				 && !(NUL_ENDS_LINE(delim) && line[-1] == '\0')
+				) {
+					line--;
+				}
+				if (linenum)
+					*linenum += count_lines(start, line, delim);
+				start = line;
+				G.buf_pos = start - G.buf;
+			} else if (stop) {
+				if (G.buf_eof) {
+					G.buf_pos = G.buf_len;
+					return NULL;
+				}
+				start = stop + 1;
+				if (linenum)
+					*linenum += count_lines(G.buf + G.buf_pos, start, delim);
+				G.buf_pos = start - G.buf;
+			}
+		}
+
+		eol = find_eol(start, end, delim);
+		if (eol || (G.buf_eof && start != end)) {
+			if (!eol)
+				eol = end; /* last line without delimiter */
+			*eol = '\0';
+			*line_len = eol - start;
+			G.buf_pos = eol + (eol != end) - G.buf;
+			return start;
+		}
+		if (G.buf_eof)
+			return NULL;
+
+		/* Need more data. Move the incomplete line to the start,
+		 * grow the buffer if the line fills all of it */
+		G.buf_len = end - start;
+		memmove(G.buf, start, G.buf_len);
+		G.buf_pos = 0;
+		if (G.buf_len == G.buf_size - 1) {
+			G.buf_size *= 2;
+			G.buf = xrealloc(G.buf, G.buf_size);
+		}
+		/* Read errors (e.g. EISDIR) are treated as EOF, as with stdio */
+		sz = safe_read(G.buf_fd, G.buf + G.buf_len, G.buf_size - 1 - G.buf_len);
+		if (sz <= 0)
+			G.buf_eof = 1;
+		else
+			G.buf_len += sz;
+	}
+}
+
+static int grep_file(int fd)
 {
 	smalluint found;
 	int linenum = 0;
 	int nmatches = 0;
-#if !ENABLE_EXTRA_COMPAT
 	char *line;
-#else
-	char *line = NULL;
+	size_t line_size;
+#if ENABLE_EXTRA_COMPAT
 	ssize_t line_len;
-	size_t line_alloc_len;
 # define rm_so start[0]
 # define rm_eo end[0]
 #endif
@@ -321,18 +693,30 @@ static int grep_file(FILE *file)
 	enum { print_n_lines_after = 0 };
 #endif
 
-	while (
-#if !ENABLE_EXTRA_COMPAT
-		(line = xmalloc_fgetline(file)) != NULL
-#else
-		(line_len = bb_getline(&line, &line_alloc_len, file)) >= 0
-#endif
-	) {
+	G.buf_fd = fd;
+	G.buf_pos = G.buf_len = 0;
+	G.buf_eof = 0;
+
+	for (;;) {
 		llist_t *pattern_ptr = pattern_head;
 		grep_list_data_t *gl = gl; /* for gcc */
 
+		/* Lines without the literal(s) can't match: skip them,
+		 * unless we print them as trailing context.
+		 * Count skipped lines only if line numbers are used. */
+		line = next_block_line(&line_size, G.skip_lines && !print_n_lines_after,
+			(PRINT_LINE_NUM || print_n_lines_after || lines_after) ? &linenum : NULL);
+		if (!line)
+			break;
+		IF_EXTRA_COMPAT(line_len = line_size;)
+
 		linenum++;
 		found = 0;
+		if (G.ac) {
+			gl = ac_match(line);
+			found = (gl != NULL);
+			pattern_ptr = NULL; /* all patterns are checked */
+		}
 		while (pattern_ptr) {
 			gl = (grep_list_data_t *)pattern_ptr->data;
 			if (FGREP_FLAG) {
@@ -464,7 +848,6 @@ static int grep_file(FILE *file)
 
 			/* quiet/print (non)matching file names only? */
 			if (option_mask32 & (OPT_q|OPT_l|OPT_L)) {
-				free(line); /* we don't need line anymore */
 				if (BE_QUIET) {
 					/* manpage says about -q:
 					 * "exit immediately with zero status
@@ -567,18 +950,13 @@ static int grep_file(FILE *file)
 			} else if (lines_before) {
 				/* Add the line to the circular 'before' buffer */
 				free(before_buf[curpos]);
-				before_buf[curpos] = line;
+				before_buf[curpos] = xmemdup(line, line_size + 1);
 				IF_EXTRA_COMPAT(before_buf_size[curpos] = line_len;)
 				curpos = (curpos + 1) % lines_before;
-				/* avoid free(line) - we took the line */
-				line = NULL;
 			}
 		}
 
 #endif /* ENABLE_FEATURE_GREP_CONTEXT */
-#if !ENABLE_EXTRA_COMPAT
-		free(line);
-#endif
 		/* Did we print all context after last requested match? */
 		if ((option_mask32 & OPT_m)
 		 && !print_n_lines_after
@@ -654,12 +1032,311 @@ static void load_pattern_list(llist_t **lst, char *pattern)
 		llist_add_to(lst, new_grep_list_data(p, 0));
 }
 
+/* Open FILENAME and grep it, return 1 if it matched */
+static int grep_one_file(const char *filename)
+{
+	int fd, matched;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		if (!SUPPRESS_ERR_MSGS)
+			bb_simple_perror_msg(filename);
+		open_errors = 1;
+		return 0;
+	}
+	cur_file = filename;
+	matched = grep_file(fd);
+	close(fd);
+	return matched;
+}
+
+#if ENABLE_FEATURE_GREP_PARALLEL
+/* grep -j N: files are grepped by N worker processes.
+ * Each worker reads file names from its own command pipe and writes
+ * its output to its own data pipe. When it is done with a file,
+ * it says so on the control pipe shared by all workers.
+ * We collect output of each file and print it as a whole.
+ * With --ordered, output of files is printed in the order
+ * in which they were dispatched, i.e. as grep without -j prints it.
+ */
+struct grep_output {
+	char *buf;
+	size_t len;
+	size_t size;
+	int first_line;  /* for "--" separators, 0 if no lines were printed */
+	int last_line;
+};
+struct grep_worker {
+	pid_t pid;
+	int cmd_fd;
+	int data_fd;
+	unsigned job;    /* number of the file being grepped */
+	smallint busy;
+	struct grep_output out;
+};
+struct grep_job {
+	struct grep_output out;
+	smallint done;
+};
+struct grep_parallel {
+	unsigned nworkers;
+	unsigned njobs;         /* --ordered: size of jobs[] */
+	unsigned next_job;      /* number of files dispatched so far */
+	unsigned next_print;    /* --ordered: next file to print */
+	int ctl_fd;
+	smalluint matched;
+	struct grep_job *jobs;  /* --ordered: outputs waiting for their turn */
+	struct pollfd *pfd;
+	struct grep_worker worker[];
+};
+/* Sent on the control pipe. It is small, so writes of it are atomic */
+struct grep_result {
+	unsigned worker;
+	int first_line;
+	int last_line;
+	smalluint matched;
+	smalluint open_failed;
+};
+
+static void NORETURN grep_worker(unsigned idx, int cmd_fd, int ctl_fd)
+{
+	FILE *cmd = xfdopen_for_read(cmd_fd);
+	struct grep_result res;
+	int flags;
+
+	memset(&res, 0, sizeof(res));
+	res.worker = idx;
+	/* Commands are: print_filename byte, file name, NUL */
+	while ((flags = getc(cmd)) != EOF) {
+		char *filename = bb_get_chunk_from_file(cmd, NULL);
+		if (!filename)
+			break;
+		print_filename = flags;
+		open_errors = 0;
+#if ENABLE_FEATURE_GREP_CONTEXT
+		did_print_line = 0;
+#endif
+		res.matched = grep_one_file(filename);
+		res.open_failed = open_errors;
+#if ENABLE_FEATURE_GREP_CONTEXT
+		if (did_print_line) {
+			res.first_line = G.first_line_printed;
+			res.last_line = last_line_printed;
+		}
+#endif
+		fflush_all();
+		xwrite(ctl_fd, &res, sizeof(res));
+		free(filename);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+static void start_workers(unsigned n)
+{
+	struct grep_parallel *p;
+	struct fd_pair ctl;
+	unsigned i;
+
+	p = xzalloc(sizeof(*p) + n * sizeof(p->worker[0]));
+	p->nworkers = n;
+	p->pfd = xzalloc((n + 1) * sizeof(p->pfd[0]));
+	if (option_mask32 & OPT_ordered) {
+		/* Limits how much output we may have to hold */
+		p->njobs = 4 * n;
+		p->jobs = xzalloc(p->njobs * sizeof(p->jobs[0]));
+	}
+	xpiped_pair(ctl);
+	p->ctl_fd = ctl.rd;
+	fflush_all();
+	for (i = 0; i < n; i++) {
+		struct grep_worker *w = &p->worker[i];
+		struct fd_pair cmd, data;
+
+		xpiped_pair(cmd);
+		xpiped_pair(data);
+		w->pid = xfork();
+		if (w->pid == 0) {
+			unsigned j;
+			/* Other workers must see EOF on their command pipes
+			 * when we close them, don't hold them open */
+			for (j = 0; j < i; j++) {
+				close(p->worker[j].cmd_fd);
+				close(p->worker[j].data_fd);
+			}
+			close(ctl.rd);
+			close(cmd.wr);
+			close(data.rd);
+			xmove_fd(data.wr, STDOUT_FILENO);
+			grep_worker(i, cmd.rd, ctl.wr);
+		}
+		close(cmd.rd);
+		close(data.wr);
+		w->cmd_fd = cmd.wr;
+		w->data_fd = data.rd;
+		ndelay_on(w->data_fd);
+	}
+	close(ctl.wr);
+	G.par = p;
+}
+
+static void read_output(struct grep_worker *w)
+{
+	for (;;) {
+		struct grep_output *o = &w->out;
+		ssize_t r;
+
+		if (o->size - o->len < 4096) {
+			o->size = o->size * 2 + 64 * 1024;
+			o->buf = xrealloc(o->buf, o->size);
+		}
+		r = safe_read(w->data_fd, o->buf + o->len, o->size - o->len);
+		if (r < 0) {
+			if (errno == EAGAIN)
+				return;
+			bb_simple_perror_msg_and_die("read");
+		}
+		/* The worker died. It already said why (e.g. bad regex) */
+		if (r == 0)
+			xfunc_die();
+		o->len += r;
+	}
+}
+
+static void print_output(struct grep_output *o)
+{
+	if (o->len == 0)
+		return;
+#if ENABLE_FEATURE_GREP_CONTEXT
+	/* The same "--" separators as print_line() would print */
+	if (o->first_line) {
+		if ((lines_before || lines_after) && did_print_line
+		 && last_line_printed != o->first_line - 1
+		) {
+			xwrite_str(STDOUT_FILENO, "--\n");
+		}
+		did_print_line = 1;
+		last_line_printed = o->last_line;
+	}
+#endif
+	xwrite(STDOUT_FILENO, o->buf, o->len);
+}
+
+/* Wait for workers' output, and for at least one of them to finish a file */
+static void collect_output(void)
+{
+	struct grep_parallel *p = G.par;
+	struct grep_result res;
+	struct grep_worker *w;
+	unsigned i;
+
+	for (i = 0; i < p->nworkers; i++) {
+		p->pfd[i].fd = p->worker[i].data_fd;
+		p->pfd[i].events = POLLIN;
+	}
+	p->pfd[i].fd = p->ctl_fd;
+	p->pfd[i].events = POLLIN;
+	if (safe_poll(p->pfd, i + 1, -1) < 0)
+		bb_simple_perror_msg_and_die("poll");
+	for (i = 0; i < p->nworkers; i++) {
+		if (p->pfd[i].revents)
+			read_output(&p->worker[i]);
+	}
+	if (!p->pfd[i].revents)
+		return;
+
+	xread(p->ctl_fd, &res, sizeof(res));
+	w = &p->worker[res.worker];
+	/* The worker wrote all its output before it sent res */
+	read_output(w);
+	w->busy = 0;
+	p->matched |= res.matched;
+	open_errors |= res.open_failed;
+	w->out.first_line = res.first_line;
+	w->out.last_line = res.last_line;
+	if (!p->jobs) {
+		print_output(&w->out);
+		w->out.len = 0;
+		return;
+	}
+	/* --ordered: park the output until all files before it are printed */
+	p->jobs[w->job % p->njobs].out = w->out;
+	p->jobs[w->job % p->njobs].done = 1;
+	memset(&w->out, 0, sizeof(w->out));
+	while (p->next_print != p->next_job) {
+		struct grep_job *job = &p->jobs[p->next_print % p->njobs];
+		if (!job->done)
+			break;
+		print_output(&job->out);
+		free(job->out.buf);
+		job->done = 0;
+		p->next_print++;
+	}
+}
+
+static void dispatch_file(const char *filename)
+{
+	struct grep_parallel *p = G.par;
+	struct grep_worker *w;
+	char flags;
+
+	for (;;) {
+		if (!p->jobs || p->next_job - p->next_print < p->njobs) {
+			for (w = p->worker; w < p->worker + p->nworkers; w++)
+				if (!w->busy)
+					goto found;
+		}
+		collect_output();
+	}
+ found:
+	w->busy = 1;
+	w->job = p->next_job++;
+	flags = print_filename;
+	xwrite(w->cmd_fd, &flags, 1);
+	xwrite(w->cmd_fd, filename, strlen(filename) + 1);
+}
+
+/* Wait until all dispatched files are grepped and printed */
+static void wait_for_workers(void)
+{
+	struct grep_parallel *p = G.par;
+	unsigned i;
+
+	for (i = 0; i < p->nworkers; i++) {
+		while (p->worker[i].busy)
+			collect_output();
+	}
+}
+
+static int stop_workers(void)
+{
+	struct grep_parallel *p = G.par;
+	unsigned i;
+
+	wait_for_workers();
+	for (i = 0; i < p->nworkers; i++)
+		close(p->worker[i].cmd_fd);
+	for (i = 0; i < p->nworkers; i++)
+		wait4pid(p->worker[i].pid);
+	return p->matched;
+}
+#endif
+
+/* Grep FILENAME, or hand it to a worker */
+static int grep_named_file(const char *filename)
+{
+#if ENABLE_FEATURE_GREP_PARALLEL
+	if (G.par) {
+		dispatch_file(filename);
+		return 0; /* stop_workers() returns whether anything matched */
+	}
+#endif
+	return grep_one_file(filename);
+}
+
 static int FAST_FUNC file_action_grep(struct recursive_state *state UNUSED_PARAM,
 		const char *filename,
 		struct stat *statbuf)
 {
-	FILE *file;
-
 	/* If we are given a link to a directory, we should bail out now, rather
 	 * than trying to open the "file" and hoping getline gives us nothing,
 	 * since that is not portable across operating systems (FreeBSD for
@@ -675,16 +1352,7 @@ static int FAST_FUNC file_action_grep(struct recursive_state *state UNUSED_PARAM
 			return 1;
 	}
 
-	file = fopen_for_read(filename);
-	if (file == NULL) {
-		if (!SUPPRESS_ERR_MSGS)
-			bb_simple_perror_msg(filename);
-		open_errors = 1;
-		return 0;
-	}
-	cur_file = filename;
-	*(int*)state->userData |= grep_file(file);
-	fclose(file);
+	*(int*)state->userData |= grep_named_file(filename);
 	return 1;
 }
 
@@ -707,12 +1375,12 @@ static int grep_dir(const char *dir)
 int grep_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int grep_main(int argc UNUSED_PARAM, char **argv)
 {
-	FILE *file;
 	int matched;
 	llist_t *fopt = NULL;
 #if ENABLE_FEATURE_GREP_CONTEXT
 	int Copt, opts;
 #endif
+	IF_FEATURE_GREP_PARALLEL(unsigned nproc = 1;)
 	INIT_G();
 
 	/* For grep, exitcode of 1 is "not found". Other errors are 2: */
@@ -725,9 +1393,12 @@ int grep_main(int argc UNUSED_PARAM, char **argv)
 		OPTSTR_GREP
 			"\0"
 			"H-h:C-AB",
-		"color\0" Optional_argument "\xff",
+		"color\0" Optional_argument "\xff"
+		IF_FEATURE_GREP_PARALLEL("ordered\0" No_argument "\xfe")
+		,
 		&pattern_head, &fopt, &max_matches,
 		&lines_after, &lines_before, &Copt
+		IF_FEATURE_GREP_PARALLEL(, &nproc)
 		, NULL
 	);
 
@@ -753,8 +1424,11 @@ int grep_main(int argc UNUSED_PARAM, char **argv)
 	}
 #else
 	/* with auto sanity checks */
-	getopt32(argv, "^" OPTSTR_GREP "\0" "H-h:c-n:q-n:l-n:", // why trailing ":"?
-		&pattern_head, &fopt, &max_matches);
+	getopt32long(argv, "^" OPTSTR_GREP "\0" "H-h:c-n:q-n:l-n:", // why trailing ":"?
+		IF_FEATURE_GREP_PARALLEL("ordered\0" No_argument "\xfe") "",
+		&pattern_head, &fopt, &max_matches
+		IF_FEATURE_GREP_PARALLEL(, &nproc)
+	);
 #endif
 	invert_search = ((option_mask32 & OPT_v) != 0); /* 0 | 1 */
 
@@ -817,6 +1491,17 @@ int grep_main(int argc UNUSED_PARAM, char **argv)
 		load_pattern_list(&pattern_head, *argv++);
 	}
 
+	if (!pattern_head->link)
+		G.literal = compile_literal(((grep_list_data_t *)pattern_head->data)->pattern);
+	else if (FGREP_FLAG)
+		G.ac = compile_ac();
+	/* Literal patterns are searched for in whole blocks of input.
+	 * Not with -v or -B: then we can't skip lines without them.
+	 */
+	G.skip_lines = ((G.literal || G.ac) && !invert_search && !lines_before);
+	G.buf_size = 256 * 1024;
+	G.buf = xmalloc(G.buf_size);
+
 	/* argv[0..(argc-1)] should be names of file to grep through. If
 	 * there is more than one file to grep, we will print the filenames. */
 	if (argv[0] && argv[1])
@@ -827,12 +1512,17 @@ int grep_main(int argc UNUSED_PARAM, char **argv)
 	if (option_mask32 & OPT_h)
 		print_filename = 0;
 
+#if ENABLE_FEATURE_GREP_PARALLEL
+	/* -q exits on the first match, workers would only be in the way */
+	if ((option_mask32 & OPT_j) && nproc > 1 && !BE_QUIET)
+		start_workers(nproc);
+#endif
+
 	/* If no files were specified, or '-' was specified, take input from
 	 * stdin. Otherwise, we grep through all the files specified. */
 	matched = 0;
 	do {
 		cur_file = *argv;
-		file = stdin;
 		if (!cur_file || LONE_DASH(cur_file)) {
 			cur_file = "(standard input)";
 		} else {
@@ -845,19 +1535,25 @@ int grep_main(int argc UNUSED_PARAM, char **argv)
 					goto grep_done;
 				}
 			}
-			/* else: fopen(dir) will succeed, but reading won't */
-			file = fopen_for_read(cur_file);
-			if (file == NULL) {
-				if (!SUPPRESS_ERR_MSGS)
-					bb_simple_perror_msg(cur_file);
-				open_errors = 1;
-				continue;
-			}
+			/* else: open(dir) will succeed, but reading won't */
+			matched |= grep_named_file(cur_file);
+			goto grep_done;
 		}
-		matched |= grep_file(file);
-		fclose_if_not_stdin(file);
+#if ENABLE_FEATURE_GREP_PARALLEL
+		/* stdin is grepped by us, after everything before it */
+		if (G.par)
+			wait_for_workers();
+#endif
+		matched |= grep_file(STDIN_FILENO);
+#if ENABLE_FEATURE_GREP_PARALLEL
+		fflush_all();
+#endif
  grep_done: ;
 	} while (*argv && *++argv);
+#if ENABLE_FEATURE_GREP_PARALLEL
+	if (G.par)
+		matched |= stop_workers();
+#endif
 
 	/* destroy all the elements in the pattern list */
 	if (ENABLE_FEATURE_CLEAN_UP) {
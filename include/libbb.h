@@ -514,6 +514,15 @@ enum {
 	ACTION_DEPTHFIRST     = (1 << 3),
 	ACTION_QUIET          = (1 << 4),
 	ACTION_DANGLING_OK    = (1 << 5),
+	/* fileAction/dirAction may run in several processes at once,
+	 * in any order, and do not modify userData. With ACTION_DEPTHFIRST,
+	 * dirAction runs after files of the directory, but possibly
+	 * before files of its subdirectories. Big trees are walked in parallel
+	 * if FEATURE_RECURSIVE_ACTION_PARALLEL is enabled. */
+	ACTION_PARALLEL       = (1 << 6),
+	/* fileAction/dirAction look only at S_IFMT bits of statbuf->st_mode,
+	 * stat() is skipped when readdir() tells the type */
+	ACTION_TYPE_ONLY      = (1 << 7),
 };
 typedef uint8_t recurse_flags_t;
 typedef struct recursive_state {
@@ -522,6 +531,7 @@ typedef struct recursive_state {
 	void *userData;
 	int FAST_FUNC (*fileAction)(struct recursive_state *state, const char *fileName, struct stat* statbuf);
 	int FAST_FUNC  (*dirAction)(struct recursive_state *state, const char *fileName, struct stat* statbuf);
+	struct recursive_walk *walk; /* ACTION_PARALLEL: directories yet to read */
 } recursive_state_t;
 int recursive_action(const char *fileName, unsigned flags,
 	int FAST_FUNC (*fileAction)(struct recursive_state *state, const char *fileName, struct stat* statbuf),
@@ -2174,6 +2184,15 @@ void sha256_begin(sha256_ctx_t *ctx) FAST_FUNC;
 void sha512_begin(sha512_ctx_t *ctx) FAST_FUNC;
 void sha512_hash(sha512_ctx_t *ctx, const void *buffer, size_t len) FAST_FUNC;
 unsigned sha512_end(sha512_ctx_t *ctx, void *resbuf) FAST_FUNC;
+/* Multi-buffer hashing: up to *_lanes() independent messages
+ * are hashed at once in SIMD lanes. *_lanes() returns 1 if the CPU
+ * has no (or no better) SIMD code for the algorithm */
+unsigned md5_lanes(void) FAST_FUNC;
+void md5_hash_lanes(md5_ctx_t *ctx[], const void *const buf[], const size_t len[], unsigned n) FAST_FUNC;
+unsigned sha256_lanes(void) FAST_FUNC;
+void sha256_hash_lanes(sha256_ctx_t *ctx[], const void *const buf[], const size_t len[], unsigned n) FAST_FUNC;
+unsigned sha512_lanes(void) FAST_FUNC;
+void sha512_hash_lanes(sha512_ctx_t *ctx[], const void *const buf[], const size_t len[], unsigned n) FAST_FUNC;
 void sha3_begin(sha3_ctx_t *ctx) FAST_FUNC;
 void sha3_hash(sha3_ctx_t *ctx, const void *buffer, size_t len) FAST_FUNC;
 unsigned sha3_end(sha3_ctx_t *ctx, void *resbuf) FAST_FUNC;
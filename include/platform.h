@@ -271,6 +271,8 @@ typedef uint64_t bb__aliased_uint64_t FIX_ALIASING;
 #define get_unaligned_be32(buf) ({ uint32_t v; move_from_unaligned32(v, buf); SWAP_BE32(v); })
 #define put_unaligned_le32(val, buf) move_to_unaligned32(buf, SWAP_LE32(val))
 #define put_unaligned_be32(val, buf) move_to_unaligned32(buf, SWAP_BE32(val))
+#define get_unaligned_be64(buf) ({ uint64_t v; move_from_unaligned64(v, buf); SWAP_BE64(v); })
+#define put_unaligned_be64(val, buf) move_to_unaligned64(buf, SWAP_BE64(val))
 
 /* unxz needs an aligned fixed-endian accessor.
  * (however, the compiler does not realize it's aligned, the cast is still necessary)
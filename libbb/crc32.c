@@ -17,6 +17,19 @@
  */
 #include "libbb.h"
 
+/* PCLMULQDQ code is written with intrinsics in functions which have
+ * target("...") attributes. Used only if cpuid says it is there.
+ */
+#if ENABLE_CRC32_HWACCEL && defined(__GNUC__) \
+ && (defined(__i386__) || defined(__x86_64__)) \
+ && (__GNUC__ >= 5 || defined(__clang__))
+# define CRC32_X86_HWACCEL 1
+# include <wmmintrin.h>
+# include <tmmintrin.h>
+#else
+# define CRC32_X86_HWACCEL 0
+#endif
+
 uint32_t *global_crc32_table;
 
 uint32_t* FAST_FUNC crc32_filltable(uint32_t *crc_table, int endian)
@@ -52,24 +65,284 @@ uint32_t* FAST_FUNC global_crc32_new_table_le(void)
 	return global_crc32_table;
 }
 
-uint32_t FAST_FUNC crc32_block_endian1(uint32_t val, const void *buf, unsigned len, uint32_t *crc_table)
+/* Slice-by-8: table k (0..7) gives CRC of a byte followed by k zero bytes.
+ * Then 8 bytes are processed with 8 independent lookups.
+ * Built on first use: 8k for each of the two polynomials.
+ */
+static uint32_t *crc32_table8[2];
+
+static const uint32_t *get_crc32_table8(int endian)
+{
+	uint32_t *t = crc32_table8[endian];
+
+	if (!t) {
+		unsigned i;
+
+		t = crc32_filltable(xmalloc(8 * 256 * sizeof(t[0])), endian);
+		for (i = 256; i < 8 * 256; i++) {
+			uint32_t c = t[i - 256];
+			t[i] = endian ? (c << 8) ^ t[c >> 24] : (c >> 8) ^ t[c & 0xff];
+		}
+		crc32_table8[endian] = t;
+	}
+	return t;
+}
+
+/* Process LEN bytes, LEN is a multiple of 8 */
+static uint32_t crc32_slice8(uint32_t val, const uint8_t *p, unsigned len, int endian)
 {
-	const void *end = (uint8_t*)buf + len;
+	const uint32_t *t = get_crc32_table8(endian);
+	const uint8_t *end = p + len;
 
-	while (buf != end) {
-		val = (val << 8) ^ crc_table[(val >> 24) ^ *(uint8_t*)buf];
-		buf = (uint8_t*)buf + 1;
+	if (endian) {
+		while (p != end) {
+			uint32_t hi = get_unaligned_be32(p) ^ val;
+			uint32_t lo = get_unaligned_be32(p + 4);
+			val = t[7*256 + (hi >> 24)] ^ t[6*256 + ((hi >> 16) & 0xff)]
+			    ^ t[5*256 + ((hi >> 8) & 0xff)] ^ t[4*256 + (hi & 0xff)]
+			    ^ t[3*256 + (lo >> 24)] ^ t[2*256 + ((lo >> 16) & 0xff)]
+			    ^ t[1*256 + ((lo >> 8) & 0xff)] ^ t[lo & 0xff];
+			p += 8;
+		}
+	} else {
+		while (p != end) {
+			uint32_t lo = get_unaligned_le32(p) ^ val;
+			uint32_t hi = get_unaligned_le32(p + 4);
+			val = t[7*256 + (lo & 0xff)] ^ t[6*256 + ((lo >> 8) & 0xff)]
+			    ^ t[5*256 + ((lo >> 16) & 0xff)] ^ t[4*256 + (lo >> 24)]
+			    ^ t[3*256 + (hi & 0xff)] ^ t[2*256 + ((hi >> 8) & 0xff)]
+			    ^ t[1*256 + ((hi >> 16) & 0xff)] ^ t[hi >> 24];
+			p += 8;
+		}
 	}
 	return val;
 }
 
+#if CRC32_X86_HWACCEL
+static void cpuid(unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx)
+{
+	asm ("cpuid"
+		: "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+		: "0"(*eax),  "1"(*ebx),  "2"(*ecx),  "3"(*edx)
+	);
+}
+static smallint pclmul;
+
+# define PCLMUL_FUNC __attribute__((target("pclmul,ssse3")))
+
+// Folding: a 128-bit block B which is followed by D more bits of data
+// can be replaced by (B * x^D mod P) added to the block D bits later,
+// the CRC does not change. With B = H:L (two 64-bit halves),
+// B * x^D = H * x^(D+64) + L * x^D, and with the constants
+// x^(D+64) mod P and x^D mod P (32 bits) each product is two PCLMULQDQs,
+// 96 bits wide. Four blocks at a time are folded by 512 bits,
+// then the four are folded into one, and the CRC of the final
+// 16 bytes (with initial value 0) is the CRC of all the data.
+//
+// Non-reflected (endian = 1) data is byte-swapped to make
+// bit i of a 128-bit block the coefficient of x^i.
+// Reflected (endian = 0) data is used as is, bit i is the coefficient
+// of x^(127-i). Then PCLMULQDQ product of 64-bit halves is shifted
+// by one bit: the constants are x^(D+63) and x^(D-1) mod P,
+// reflected into the upper 32 bits of a 64-bit word.
+static PCLMUL_FUNC ALWAYS_INLINE uint32_t crc32_fold(uint32_t val, const uint8_t *p, unsigned len, int endian)
+{
+	const __m128i bswap = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+	__m128i k4, k1, x0, x1, x2, x3;
+	uint8_t buf[16];
+
+	if (endian) {
+		/* {x^512, x^576} mod P and {x^128, x^192} mod P */
+		k4 = _mm_set_epi64x(0x8833794c, 0xe6228b11);
+		k1 = _mm_set_epi64x(0xc5b9cd4c, 0xe8a45605);
+	} else {
+		/* reflected {x^575, x^511} mod P and {x^191, x^127} mod P */
+		k4 = _mm_set_epi64x(0xcad38e8f00000000ULL, 0x653d982200000000ULL);
+		k1 = _mm_set_epi64x(0x9ba54c6f00000000ULL, 0x65673b4600000000ULL);
+	}
+# define LOAD(p) (endian \
+	? _mm_shuffle_epi8(_mm_loadu_si128((const void*)(p)), bswap) \
+	: _mm_loadu_si128((const void*)(p)))
+# define FOLD(x, k, next) _mm_xor_si128(next, _mm_xor_si128( \
+	_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)))
+
+	x0 = LOAD(p);
+	x1 = LOAD(p + 16);
+	x2 = LOAD(p + 32);
+	x3 = LOAD(p + 48);
+	/* CRC so far goes into the first 4 bytes */
+	x0 = _mm_xor_si128(x0, endian ? _mm_set_epi32(val, 0, 0, 0) : _mm_cvtsi32_si128(val));
+	p += 64;
+	len -= 64;
+	while (len >= 64) {
+		x0 = FOLD(x0, k4, LOAD(p));
+		x1 = FOLD(x1, k4, LOAD(p + 16));
+		x2 = FOLD(x2, k4, LOAD(p + 32));
+		x3 = FOLD(x3, k4, LOAD(p + 48));
+		p += 64;
+		len -= 64;
+	}
+	x0 = FOLD(x0, k1, x1);
+	x0 = FOLD(x0, k1, x2);
+	x0 = FOLD(x0, k1, x3);
+	while (len >= 16) {
+		x0 = FOLD(x0, k1, LOAD(p));
+		p += 16;
+		len -= 16;
+	}
+# undef LOAD
+# undef FOLD
+	if (endian)
+		x0 = _mm_shuffle_epi8(x0, bswap);
+	_mm_storeu_si128((void*)buf, x0);
+	return crc32_slice8(0, buf, 16, endian);
+}
+static PCLMUL_FUNC uint32_t crc32_fold_endian0(uint32_t val, const uint8_t *p, unsigned len)
+{
+	return crc32_fold(val, p, len, 0);
+}
+static PCLMUL_FUNC uint32_t crc32_fold_endian1(uint32_t val, const uint8_t *p, unsigned len)
+{
+	return crc32_fold(val, p, len, 1);
+}
+#endif
+
+static uint32_t crc32_block(uint32_t val, const uint8_t *p, unsigned len, uint32_t *crc_table, int endian)
+{
+	const uint8_t *end;
+
+#if CRC32_X86_HWACCEL
+	if (len >= 64) {
+		if (!pclmul) {
+			unsigned eax = 1, ebx = ebx, ecx = 0, edx = edx;
+			cpuid(&eax, &ebx, &ecx, &edx);
+			/* CPUID.1:ECX bit 1 is PCLMULQDQ, bit 9 is SSSE3 (for PSHUFB) */
+			pclmul = ((ecx & 0x202) == 0x202) ? 1 : -1;
+		}
+		if (pclmul > 0) {
+			unsigned n = len & ~15;
+			val = (endian ? crc32_fold_endian1 : crc32_fold_endian0)(val, p, n);
+			p += n;
+			len -= n;
+		}
+	}
+#endif
+	if (len >= 16) {
+		unsigned n = len & ~7;
+		val = crc32_slice8(val, p, n, endian);
+		p += n;
+		len -= n;
+	}
+
+	end = p + len;
+	if (endian) {
+		while (p != end)
+			val = (val << 8) ^ crc_table[(val >> 24) ^ *p++];
+	} else {
+		while (p != end)
+			val = crc_table[(uint8_t)val ^ *p++] ^ (val >> 8);
+	}
+	return val;
+}
+
+uint32_t FAST_FUNC crc32_block_endian1(uint32_t val, const void *buf, unsigned len, uint32_t *crc_table)
+{
+	return crc32_block(val, buf, len, crc_table, 1);
+}
+
 uint32_t FAST_FUNC crc32_block_endian0(uint32_t val, const void *buf, unsigned len, uint32_t *crc_table)
 {
-	const void *end = (uint8_t*)buf + len;
+	return crc32_block(val, buf, len, crc_table, 0);
+}
 
-	while (buf != end) {
-		val = crc_table[(uint8_t)val ^ *(uint8_t*)buf] ^ (val >> 8);
-		buf = (uint8_t*)buf + 1;
+#if ENABLE_UNIT_TEST
+
+/* One byte at a time, as it was done before slice-by-8 and PCLMULQDQ */
+static uint32_t crc32_ref(uint32_t val, const uint8_t *p, unsigned len, const uint32_t *crc_table, int endian)
+{
+	while (len--) {
+		if (endian)
+			val = (val << 8) ^ crc_table[(val >> 24) ^ *p++];
+		else
+			val = crc_table[(uint8_t)val ^ *p++] ^ (val >> 8);
 	}
 	return val;
 }
+
+static uint8_t *crc32_test_data(unsigned size)
+{
+	uint8_t *buf = xmalloc(size);
+	uint32_t x = 1;
+	unsigned i;
+
+	for (i = 0; i < size; i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = x >> 23;
+	}
+	return buf;
+}
+
+BBUNIT_DEFINE_TEST(crc32)
+{
+	enum { SIZE = 4096 + 64 };
+	uint8_t *buf = crc32_test_data(SIZE);
+	int endian;
+
+	for (endian = 0; endian < 2; endian++) {
+		uint32_t *table = crc32_filltable(NULL, endian);
+		unsigned offset, len;
+
+		/* Well-known check values of "123456789" */
+		BBUNIT_ASSERT_EQ(endian ? 0xfc891918 : 0xcbf43926,
+			(endian ? crc32_block_endian1 : crc32_block_endian0)(0xffffffff, "123456789", 9, table) ^ 0xffffffff
+		);
+		for (offset = 0; offset < 16; offset++) {
+			for (len = 0; len <= SIZE - 64; len += (len < 300 ? 1 : 61)) {
+				uint32_t init = len * 0x9e3779b9;
+				BBUNIT_ASSERT_EQ(
+					crc32_ref(init, buf + offset, len, table, endian),
+					(endian ? crc32_block_endian1 : crc32_block_endian0)(init, buf + offset, len, table)
+				);
+			}
+		}
+		free(table);
+	}
+	free(buf);
+
+	BBUNIT_ENDTEST;
+}
+
+/* Not a test: prints throughput, to compare with one byte at a time */
+BBUNIT_DEFINE_TEST(crc32_throughput)
+{
+	enum { SIZE = 1024 * 1024, ROUNDS = 64 };
+	uint8_t *buf = crc32_test_data(SIZE);
+	int endian;
+
+	for (endian = 0; endian < 2; endian++) {
+		uint32_t *table = crc32_filltable(NULL, endian);
+		uint32_t crc1 = 0, crc2 = 0;
+		unsigned long long t0, t1, t2;
+		unsigned i;
+
+		t0 = monotonic_us();
+		for (i = 0; i < ROUNDS; i++)
+			crc1 = crc32_ref(crc1, buf, SIZE, table, endian);
+		t1 = monotonic_us();
+		for (i = 0; i < ROUNDS; i++)
+			crc2 = (endian ? crc32_block_endian1 : crc32_block_endian0)(crc2, buf, SIZE, table);
+		t2 = monotonic_us();
+		BBUNIT_ASSERT_EQ(crc1, crc2);
+		bb_error_msg("crc32_block_endian%d: %u MB/s, one byte at a time: %u MB/s",
+			endian,
+			(unsigned)((unsigned long long)SIZE * ROUNDS / (t2 - t1 + 1)),
+			(unsigned)((unsigned long long)SIZE * ROUNDS / (t1 - t0 + 1))
+		);
+		free(table);
+	}
+	free(buf);
+
+	BBUNIT_ENDTEST;
+}
+
+#endif /* ENABLE_UNIT_TEST */
@@ -13,7 +13,16 @@
 
 #define NEED_SHA512 (ENABLE_SHA512SUM || ENABLE_USE_BB_CRYPT_SHA)
 
-#if ENABLE_SHA1_HWACCEL || ENABLE_SHA256_HWACCEL
+/* Multi-buffer code is written with gcc vector extensions,
+ * it is used only where they map to SSE2/AVX2 */
+#if ENABLE_HASH_LANES && defined(__GNUC__) && defined(__x86_64__) \
+ && (__GNUC__ >= 5 || defined(__clang__))
+# define HASH_LANES_X86 1
+#else
+# define HASH_LANES_X86 0
+#endif
+
+#if ENABLE_SHA1_HWACCEL || ENABLE_SHA256_HWACCEL || HASH_LANES_X86
 # if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
 static void cpuid(unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx)
 {
@@ -22,7 +31,21 @@ static void cpuid(unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx)
 		: "0"(*eax),  "1"(*ebx),  "2"(*ecx),  "3"(*edx)
 	);
 }
+# endif
+#endif
+
+#if ENABLE_SHA1_HWACCEL || ENABLE_SHA256_HWACCEL
+# if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
 static smallint shaNI;
+static int get_shaNI(void)
+{
+	if (!shaNI) {
+		unsigned eax = 7, ebx = ebx, ecx = 0, edx = edx;
+		cpuid(&eax, &ebx, &ecx, &edx);
+		shaNI = ((ebx >> 29) << 1) - 1;
+	}
+	return shaNI;
+}
 void FAST_FUNC sha1_process_block64_shaNI(sha1_ctx_t *ctx);
 void FAST_FUNC sha256_process_block64_shaNI(sha256_ctx_t *ctx);
 #  if defined(__i386__)
@@ -1174,15 +1197,8 @@ void FAST_FUNC sha1_begin(sha1_ctx_t *ctx)
 	ctx->process_block = sha1_process_block64;
 #if ENABLE_SHA1_HWACCEL
 # if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
-	{
-		if (!shaNI) {
-			unsigned eax = 7, ebx = ebx, ecx = 0, edx = edx;
-			cpuid(&eax, &ebx, &ecx, &edx);
-			shaNI = ((ebx >> 29) << 1) - 1;
-		}
-		if (shaNI > 0)
-			ctx->process_block = sha1_process_block64_shaNI;
-	}
+	if (get_shaNI() > 0)
+		ctx->process_block = sha1_process_block64_shaNI;
 # endif
 #endif
 }
@@ -1228,15 +1244,8 @@ void FAST_FUNC sha256_begin(sha256_ctx_t *ctx)
 	ctx->process_block = sha256_process_block64;
 #if ENABLE_SHA256_HWACCEL
 # if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
-	{
-		if (!shaNI) {
-			unsigned eax = 7, ebx = ebx, ecx = 0, edx = edx;
-			cpuid(&eax, &ebx, &ecx, &edx);
-			shaNI = ((ebx >> 29) << 1) - 1;
-		}
-		if (shaNI > 0)
-			ctx->process_block = sha256_process_block64_shaNI;
-	}
+	if (get_shaNI() > 0)
+		ctx->process_block = sha256_process_block64_shaNI;
 # endif
 #endif
 }
@@ -1906,3 +1915,455 @@ unsigned FAST_FUNC sha3_end(sha3_ctx_t *ctx, void *resbuf)
 	memcpy(resbuf, ctx->state, 64);
 	return 64;
 }
+
+#if ENABLE_HASH_LANES
+/*
+ * Multi-buffer hashing: up to 8 independent messages are hashed
+ * at once, message j in element j of every vector.
+ * Useful when there are many files to hash: unlike one message,
+ * blocks of different messages don't depend on each other.
+ *
+ * Kernels are written with gcc vector extensions, once per algorithm,
+ * and are inlined into one wrapper per instruction set: a 32-byte vector
+ * is a single register with AVX2, a pair of registers with SSE2.
+ * With AVX512VL, gcc also uses its vector rotates.
+ * The scalar code above is the reference.
+ */
+# define LANES_ARGS uint32_t *const hash[8], const uint8_t *const data[8], size_t blocks
+typedef void lanes_fn_t(LANES_ARGS);
+
+# if HASH_LANES_X86
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+#  define VROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#  define VROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#  define VROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+/* Gather word k of 8 hash states, or of 8 blocks */
+#  define GATHER8(p, k) (v8u32){ \
+	(p)[0][k], (p)[1][k], (p)[2][k], (p)[3][k], \
+	(p)[4][k], (p)[5][k], (p)[6][k], (p)[7][k] }
+#  define LOAD8(get, d, off) (v8u32){ \
+	get((d)[0] + (off)), get((d)[1] + (off)), get((d)[2] + (off)), get((d)[3] + (off)), \
+	get((d)[4] + (off)), get((d)[5] + (off)), get((d)[6] + (off)), get((d)[7] + (off)) }
+
+static smallint lanes_isa; /* 1: SSE2, 2: AVX2, 3: AVX512VL */
+static int get_lanes_isa(void)
+{
+	if (!lanes_isa) {
+		unsigned eax = 1, ebx = 0, ecx = 0, edx = 0;
+
+		lanes_isa = 1; /* x86-64 always has SSE2 */
+		cpuid(&eax, &ebx, &ecx, &edx);
+		if (ecx & (1 << 27)) { /* OS saves extended state (OSXSAVE) */
+			unsigned xcr0, xcr0_hi;
+			asm ("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+			eax = 7; ecx = 0;
+			cpuid(&eax, &ebx, &ecx, &edx);
+			/* Are YMM registers saved? AVX2? */
+			if ((xcr0 & 0x06) == 0x06 && (ebx & (1 << 5))) {
+				lanes_isa = 2;
+				/* Opmask and ZMM too? AVX512F and AVX512VL? */
+				if ((xcr0 & 0xe6) == 0xe6
+				 && (ebx & (1 << 16)) && (ebx & (1U << 31))
+				) {
+					lanes_isa = 3;
+				}
+			}
+		}
+	}
+	return lanes_isa;
+}
+
+#  define LANES_AVX_WRAPPERS(name) \
+static __attribute__((target("avx2"))) void name##_avx2(LANES_ARGS) \
+{ name(hash, data, blocks); } \
+static __attribute__((target("avx2,avx512f,avx512vl"))) void name##_avx512(LANES_ARGS) \
+{ name(hash, data, blocks); }
+
+static const uint32_t md5_K[64] ALIGN4 = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static ALWAYS_INLINE void md5_process_lanes(LANES_ARGS)
+{
+	const uint8_t *d[8];
+	v8u32 A = GATHER8(hash, 0);
+	v8u32 B = GATHER8(hash, 1);
+	v8u32 C = GATHER8(hash, 2);
+	v8u32 D = GATHER8(hash, 3);
+
+	memcpy(d, data, sizeof(d));
+	do {
+		v8u32 W[16];
+		v8u32 a = A, b = B, c = C, d_ = D;
+		const uint32_t *k = md5_K;
+		unsigned i;
+
+		for (i = 0; i < 16; i++)
+			W[i] = LOAD8(get_unaligned_le32, d, i * 4);
+#  define FF(b, c, d) (d ^ (b & (c ^ d)))
+#  define FG(b, c, d) FF(d, b, c)
+#  define FH(b, c, d) (b ^ c ^ d)
+#  define FI(b, c, d) (c ^ (b | ~d))
+#  define OP(f, a, b, c, d, w, s, T) \
+	do { a += f(b, c, d) + w + T; a = VROTL32(a, s) + b; } while (0)
+		for (i = 0; i < 16; i += 4, k += 4) {
+			OP(FF, a, b, c, d_, W[i + 0],  7, k[0]);
+			OP(FF, d_, a, b, c, W[i + 1], 12, k[1]);
+			OP(FF, c, d_, a, b, W[i + 2], 17, k[2]);
+			OP(FF, b, c, d_, a, W[i + 3], 22, k[3]);
+		}
+		for (i = 0; i < 16; i += 4, k += 4) {
+			OP(FG, a, b, c, d_, W[(5*i +  1) & 15],  5, k[0]);
+			OP(FG, d_, a, b, c, W[(5*i +  6) & 15],  9, k[1]);
+			OP(FG, c, d_, a, b, W[(5*i + 11) & 15], 14, k[2]);
+			OP(FG, b, c, d_, a, W[(5*i + 16) & 15], 20, k[3]);
+		}
+		for (i = 0; i < 16; i += 4, k += 4) {
+			OP(FH, a, b, c, d_, W[(3*i +  5) & 15],  4, k[0]);
+			OP(FH, d_, a, b, c, W[(3*i +  8) & 15], 11, k[1]);
+			OP(FH, c, d_, a, b, W[(3*i + 11) & 15], 16, k[2]);
+			OP(FH, b, c, d_, a, W[(3*i + 14) & 15], 23, k[3]);
+		}
+		for (i = 0; i < 16; i += 4, k += 4) {
+			OP(FI, a, b, c, d_, W[(7*i +  0) & 15],  6, k[0]);
+			OP(FI, d_, a, b, c, W[(7*i +  7) & 15], 10, k[1]);
+			OP(FI, c, d_, a, b, W[(7*i + 14) & 15], 15, k[2]);
+			OP(FI, b, c, d_, a, W[(7*i + 21) & 15], 21, k[3]);
+		}
+#  undef FF
+#  undef FG
+#  undef FH
+#  undef FI
+#  undef OP
+		A += a;
+		B += b;
+		C += c;
+		D += d_;
+		for (i = 0; i < 8; i++)
+			d[i] += 64;
+	} while (--blocks);
+
+	for (blocks = 0; blocks < 8; blocks++) {
+		hash[blocks][0] = A[blocks];
+		hash[blocks][1] = B[blocks];
+		hash[blocks][2] = C[blocks];
+		hash[blocks][3] = D[blocks];
+	}
+}
+static void md5_process_lanes_sse2(LANES_ARGS)
+{
+	md5_process_lanes(hash, data, blocks);
+}
+LANES_AVX_WRAPPERS(md5_process_lanes)
+static lanes_fn_t *const md5_process_lanes_fn[] = {
+	md5_process_lanes_sse2, md5_process_lanes_avx2, md5_process_lanes_avx512
+};
+
+#  define Ch(x, y, z) ((x & y) ^ (~x & z))
+#  define Maj(x, y, z) ((x & y) ^ (x & z) ^ (y & z))
+
+static ALWAYS_INLINE void sha256_process_lanes(LANES_ARGS)
+{
+	const uint8_t *d[8];
+	v8u32 H[8];
+	unsigned t;
+
+	for (t = 0; t < 8; t++)
+		H[t] = GATHER8(hash, t);
+	memcpy(d, data, sizeof(d));
+	do {
+		v8u32 W[64], a, b, c, d_, e, f, g, h;
+
+#  define S0(x) (VROTR32(x, 2) ^ VROTR32(x, 13) ^ VROTR32(x, 22))
+#  define S1(x) (VROTR32(x, 6) ^ VROTR32(x, 11) ^ VROTR32(x, 25))
+#  define R0(x) (VROTR32(x, 7) ^ VROTR32(x, 18) ^ (x >> 3))
+#  define R1(x) (VROTR32(x, 17) ^ VROTR32(x, 19) ^ (x >> 10))
+		for (t = 0; t < 16; ++t)
+			W[t] = LOAD8(get_unaligned_be32, d, t * 4);
+		for (/*t = 16*/; t < 64; ++t)
+			W[t] = R1(W[t - 2]) + W[t - 7] + R0(W[t - 15]) + W[t - 16];
+
+		a = H[0]; b = H[1]; c = H[2]; d_ = H[3];
+		e = H[4]; f = H[5]; g = H[6]; h = H[7];
+		for (t = 0; t < 64; ++t) {
+			uint32_t K_t = NEED_SHA512 ? (sha_K[t] >> 32) : sha_K[t];
+			v8u32 T1 = h + S1(e) + Ch(e, f, g) + K_t + W[t];
+			v8u32 T2 = S0(a) + Maj(a, b, c);
+			h = g;
+			g = f;
+			f = e;
+			e = d_ + T1;
+			d_ = c;
+			c = b;
+			b = a;
+			a = T1 + T2;
+		}
+#  undef S0
+#  undef S1
+#  undef R0
+#  undef R1
+		H[0] += a; H[1] += b; H[2] += c; H[3] += d_;
+		H[4] += e; H[5] += f; H[6] += g; H[7] += h;
+		for (t = 0; t < 8; t++)
+			d[t] += 64;
+	} while (--blocks);
+
+	for (t = 0; t < 8 * 8; t++)
+		hash[t / 8][t % 8] = H[t % 8][t / 8];
+}
+/* SHA256 and SHA512 have more rotates and more state than MD5:
+ * with SSE2 (no rotates, 16 registers), lanes are no faster than
+ * scalar code. See sha256_lanes() */
+LANES_AVX_WRAPPERS(sha256_process_lanes)
+static lanes_fn_t *const sha256_process_lanes_fn[] = {
+	NULL, sha256_process_lanes_avx2, sha256_process_lanes_avx512
+};
+
+#  if NEED_SHA512
+/* 4 lanes of 64 bits. hash[] and data[] have 4 used elements */
+static ALWAYS_INLINE void sha512_process_lanes(LANES_ARGS)
+{
+	uint64_t *const *hash64 = (uint64_t *const *)hash;
+	const uint8_t *d[4];
+	v4u64 H[8];
+	unsigned t;
+
+	for (t = 0; t < 8; t++)
+		H[t] = (v4u64){ hash64[0][t], hash64[1][t], hash64[2][t], hash64[3][t] };
+	memcpy(d, data, sizeof(d));
+	do {
+		v4u64 W[80], a, b, c, d_, e, f, g, h;
+
+#   define S0(x) (VROTR64(x, 28) ^ VROTR64(x, 34) ^ VROTR64(x, 39))
+#   define S1(x) (VROTR64(x, 14) ^ VROTR64(x, 18) ^ VROTR64(x, 41))
+#   define R0(x) (VROTR64(x, 1) ^ VROTR64(x, 8) ^ (x >> 7))
+#   define R1(x) (VROTR64(x, 19) ^ VROTR64(x, 61) ^ (x >> 6))
+		for (t = 0; t < 16; ++t) {
+			W[t] = (v4u64){
+				get_unaligned_be64(d[0] + t * 8), get_unaligned_be64(d[1] + t * 8),
+				get_unaligned_be64(d[2] + t * 8), get_unaligned_be64(d[3] + t * 8)
+			};
+		}
+		for (/*t = 16*/; t < 80; ++t)
+			W[t] = R1(W[t - 2]) + W[t - 7] + R0(W[t - 15]) + W[t - 16];
+
+		a = H[0]; b = H[1]; c = H[2]; d_ = H[3];
+		e = H[4]; f = H[5]; g = H[6]; h = H[7];
+		for (t = 0; t < 80; ++t) {
+			v4u64 T1 = h + S1(e) + Ch(e, f, g) + sha_K[t] + W[t];
+			v4u64 T2 = S0(a) + Maj(a, b, c);
+			h = g;
+			g = f;
+			f = e;
+			e = d_ + T1;
+			d_ = c;
+			c = b;
+			b = a;
+			a = T1 + T2;
+		}
+#   undef S0
+#   undef S1
+#   undef R0
+#   undef R1
+		H[0] += a; H[1] += b; H[2] += c; H[3] += d_;
+		H[4] += e; H[5] += f; H[6] += g; H[7] += h;
+		for (t = 0; t < 4; t++)
+			d[t] += 128;
+	} while (--blocks);
+
+	for (t = 0; t < 4 * 8; t++)
+		hash64[t / 8][t % 8] = H[t % 8][t / 8];
+}
+LANES_AVX_WRAPPERS(sha512_process_lanes)
+static lanes_fn_t *const sha512_process_lanes_fn[] = {
+	NULL, sha512_process_lanes_avx2, sha512_process_lanes_avx512
+};
+#  endif
+#  undef Ch
+#  undef Maj
+
+/* Fewer messages than this are hashed by scalar code */
+#  define LANES_MIN 2
+
+/* Hash the whole blocks of up to 8 messages in lanes. Advances buf[],
+ * len[] and the byte counts. Partial blocks are left to the caller.
+ */
+static void hash_lanes(void *ctx[], const uint8_t *buf[], size_t len[], unsigned n,
+		lanes_fn_t *fn, unsigned lanes, unsigned block_size)
+{
+	for (;;) {
+		uint32_t *hash[8];
+		const uint8_t *data[8];
+		unsigned idx[8];
+		uint64_t scratch[8];
+		size_t blocks = (size_t)-1;
+		unsigned i, m;
+
+		m = 0;
+		for (i = 0; i < n; i++) {
+			if (len[i] < block_size)
+				continue;
+			if (len[i] / block_size < blocks)
+				blocks = len[i] / block_size;
+			idx[m++] = i;
+			if (m == lanes)
+				break;
+		}
+		if (m < LANES_MIN)
+			return;
+		for (i = 0; i < lanes; i++) {
+			if (i < m) {
+				void *c = ctx[idx[i]];
+				/* hash[] is directly after the byte count(s) */
+				hash[i] = (block_size == 64)
+					? ((md5_ctx_t*)c)->hash
+					: (uint32_t*)((sha512_ctx_t*)c)->hash;
+				data[i] = buf[idx[i]];
+			} else {
+				/* Unused lanes hash the same data into scratch */
+				hash[i] = (uint32_t*)scratch;
+				data[i] = data[0];
+			}
+		}
+		fn(hash, data, blocks);
+		for (i = 0; i < m; i++) {
+			unsigned j = idx[i];
+			size_t done = blocks * block_size;
+			buf[j] += done;
+			len[j] -= done;
+			if (block_size == 64) {
+				((md5_ctx_t*)ctx[j])->total64 += done;
+			} else {
+				sha512_ctx_t *c = ctx[j];
+				c->total64[0] += done;
+				if (c->total64[0] < done)
+					c->total64[1]++;
+			}
+		}
+	}
+}
+/* Finish partially filled blocks, so that lanes start at block boundary */
+static void hash_head(void *ctx[], const uint8_t *buf[], size_t len[], unsigned n,
+		void FAST_FUNC (*update)(void*, const void*, size_t), unsigned block_size)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		unsigned bufpos = (block_size == 64)
+			? ((md5_ctx_t*)ctx[i])->total64 & 63
+			: ((sha512_ctx_t*)ctx[i])->total64[0] & 127;
+		if (bufpos) {
+			size_t k = block_size - bufpos;
+			if (k > len[i])
+				k = len[i];
+			update(ctx[i], buf[i], k);
+			buf[i] += k;
+			len[i] -= k;
+		}
+	}
+}
+
+#  define LANES_FN(name) name##_fn
+# else
+#  define LANES_FN(name) NULL
+# endif /* HASH_LANES_X86 */
+
+/* Messages can be of different lengths. Whole blocks of two or more
+ * of them are hashed in lanes, the rest by md5_hash() etc.
+ */
+static void hash_messages(void *ctx[], const void *const buf[], const size_t len[], unsigned n,
+		void FAST_FUNC (*update)(void*, const void*, size_t),
+		lanes_fn_t *const *fn UNUSED_PARAM,
+		unsigned lanes UNUSED_PARAM,
+		unsigned block_size UNUSED_PARAM)
+{
+	const uint8_t *p[8];
+	size_t l[8];
+
+	while (n != 0) {
+		unsigned m = n < 8 ? n : 8;
+		unsigned i;
+
+		memcpy(p, buf, m * sizeof(p[0]));
+		memcpy(l, len, m * sizeof(l[0]));
+# if HASH_LANES_X86
+		if (lanes > 1) {
+			hash_head(ctx, p, l, m, update, block_size);
+			hash_lanes(ctx, p, l, m, fn[get_lanes_isa() - 1], lanes, block_size);
+		}
+# endif
+		for (i = 0; i < m; i++)
+			update(ctx[i], p[i], l[i]);
+		ctx += m;
+		buf += m;
+		len += m;
+		n -= m;
+	}
+}
+
+unsigned FAST_FUNC md5_lanes(void)
+{
+	return HASH_LANES_X86 ? 8 : 1;
+}
+
+void FAST_FUNC md5_hash_lanes(md5_ctx_t *ctx[], const void *const buf[], const size_t len[], unsigned n)
+{
+	hash_messages((void**)ctx, buf, len, n, (void*)md5_hash,
+		LANES_FN(md5_process_lanes), md5_lanes(), 64);
+}
+
+unsigned FAST_FUNC sha256_lanes(void)
+{
+# if ENABLE_SHA256_HWACCEL && defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	/* One SHA-NI stream is faster than 8 lanes of SSE2/AVX2 */
+	if (get_shaNI() > 0)
+		return 1;
+# endif
+# if HASH_LANES_X86
+	if (get_lanes_isa() >= 2)
+		return 8;
+# endif
+	return 1;
+}
+
+void FAST_FUNC sha256_hash_lanes(sha256_ctx_t *ctx[], const void *const buf[], const size_t len[], unsigned n)
+{
+	hash_messages((void**)ctx, buf, len, n, (void*)sha256_hash,
+		LANES_FN(sha256_process_lanes), sha256_lanes(), 64);
+}
+
+# if NEED_SHA512
+unsigned FAST_FUNC sha512_lanes(void)
+{
+#  if HASH_LANES_X86
+	if (get_lanes_isa() >= 2)
+		return 4;
+#  endif
+	return 1;
+}
+
+void FAST_FUNC sha512_hash_lanes(sha512_ctx_t *ctx[], const void *const buf[], const size_t len[], unsigned n)
+{
+	hash_messages((void**)ctx, buf, len, n, (void*)sha512_hash,
+		LANES_FN(sha512_process_lanes), sha512_lanes(), 128);
+}
+# endif
+#endif /* ENABLE_HASH_LANES */
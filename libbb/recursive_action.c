@@ -6,7 +6,19 @@
  *
  * Licensed under GPLv2 or later, see file LICENSE in this source tree.
  */
+//config:config FEATURE_RECURSIVE_ACTION_PARALLEL
+//config:	bool "Walk big directory trees in several processes"
+//config:	default y
+//config:	depends on !NOMMU
+//config:	help
+//config:	Applets which can process files in any order (chmod -R, chown -R)
+//config:	start one walker process per CPU once a directory tree turns out
+//config:	to be big. Walkers take unread directories from each other
+//config:	when they run out of their own.
+
 #include "libbb.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
 
 #undef DEBUG_RECURS_ACTION
 
@@ -28,6 +40,401 @@ static int FAST_FUNC true_action(struct recursive_state *state UNUSED_PARAM,
 	return TRUE;
 }
 
+static int recursive_action1(recursive_state_t *state, const char *fileName, unsigned d_type);
+
+static int stat_follow(recursive_state_t *state, const char *fileName, struct stat *statbuf)
+{
+	unsigned follow;
+
+	follow = ACTION_FOLLOWLINKS;
+	if (state->depth == 0)
+		follow = ACTION_FOLLOWLINKS | ACTION_FOLLOWLINKS_L0;
+	follow &= state->flags;
+	return (follow ? stat : lstat)(fileName, statbuf);
+}
+
+/* Act on everything in directory fileName (and on it, if ACTION_DEPTHFIRST) */
+static int recurse_dir(recursive_state_t *state, const char *fileName, struct stat *statbuf)
+{
+	int status;
+	DIR *dir;
+	struct dirent *next;
+
+	dir = opendir(fileName);
+	if (!dir) {
+		/* findutils-4.1.20 reports this */
+		/* (i.e. it doesn't silently return with exit code 1) */
+		/* To trigger: "find -exec rm -rf {} \;" */
+		goto done_nak_warn;
+	}
+	status = TRUE;
+	while ((next = readdir(dir)) != NULL) {
+		char *nextFile;
+		int s;
+
+		nextFile = concat_subpath_file(fileName, next->d_name);
+		if (nextFile == NULL)
+			continue;
+
+		/* process every file (NB: ACTION_RECURSE is set in flags) */
+		state->depth++;
+		s = recursive_action1(state, nextFile, next->d_type);
+		if (s == FALSE)
+			status = FALSE;
+		free(nextFile);
+		state->depth--;
+
+//#define RECURSE_RESULT_ABORT -1
+//		if (s == RECURSE_RESULT_ABORT) {
+//			closedir(dir);
+//			return s;
+//		}
+	}
+	closedir(dir);
+
+	if (state->flags & ACTION_DEPTHFIRST) {
+		if (!state->dirAction(state, fileName, statbuf))
+			goto done_nak_warn;
+	}
+
+	return status;
+
+ done_nak_warn:
+	if (!(state->flags & ACTION_QUIET))
+		bb_simple_perror_msg(fileName);
+	return FALSE;
+}
+
+#if ENABLE_FEATURE_RECURSIVE_ACTION_PARALLEL
+/* ACTION_PARALLEL: directories are not read as soon as they are found,
+ * but pushed on a stack, and the most recently found one is read next.
+ * When the stack grows big, we start more walker processes.
+ * A walker which runs out of directories asks for more by counting itself
+ * as idle, others give it the oldest directories from the bottom
+ * of their stacks (likely the biggest subtrees) through a datagram socket
+ * shared by all walkers. A count of unread directories in shared memory
+ * tells walkers when the whole tree is done.
+ * A walker killed by a signal never reads its directories, so the count
+ * would never reach zero: every child holds the write end of a pipe,
+ * and the parent watches the read ends while it waits.
+ */
+enum {
+	WALK_SPAWN_DIRS = 64, /* start walkers when this many dirs are waiting */
+	WALK_MAX_PROCS = 16,
+};
+struct walk_dir {
+	char *name;
+	unsigned depth;
+};
+struct walk_shared {
+	int pending;    /* directories not read yet, by all walkers */
+	int idle;       /* walkers waiting for directories */
+	int queued;     /* directories in the socket */
+	smallint failed;
+	smallint died;
+};
+struct walk_msg {
+	unsigned depth;
+	char name[PATH_MAX];
+};
+struct recursive_walk {
+	struct walk_dir *dir;
+	unsigned bottom, top, size;
+	unsigned nprocs;        /* 0 until other walkers are started */
+	smallint spawn_tried;
+	int sock[2];
+	struct walk_shared *sh;
+	struct walk_msg *msg;
+	pid_t *pids;
+	int *lifeline;          /* in the parent: read ends, -1 once reaped */
+};
+static struct recursive_walk *dying_walk;
+
+static void walk_push(struct recursive_walk *w, char *name, unsigned depth)
+{
+	if (w->top == w->size) {
+		if (w->bottom > w->size / 2) {
+			w->top -= w->bottom;
+			memmove(w->dir, w->dir + w->bottom, w->top * sizeof(w->dir[0]));
+			w->bottom = 0;
+		} else {
+			w->size = w->size * 2 + 64;
+			w->dir = xrealloc(w->dir, w->size * sizeof(w->dir[0]));
+		}
+	}
+	w->dir[w->top].name = name;
+	w->dir[w->top].depth = depth;
+	w->top++;
+}
+
+static void walk_stop(struct recursive_walk *w)
+{
+	unsigned i;
+	/* An empty message wakes up and stops one walker */
+	for (i = 0; i < w->nprocs; i++)
+		send(w->sock[0], "", 0, 0);
+}
+
+static void walk_died(void)
+{
+	dying_walk->sh->died = 1;
+	walk_stop(dying_walk);
+}
+
+/* Give directories to idle walkers, keep at least one */
+static void walk_share(struct recursive_walk *w)
+{
+	struct walk_shared *sh = w->sh;
+
+	while (sh->idle > sh->queued && w->top - w->bottom > 1) {
+		struct walk_dir *d = &w->dir[w->bottom];
+		size_t len = strlen(d->name);
+
+		if (len >= PATH_MAX)
+			break;
+		w->msg->depth = d->depth;
+		memcpy(w->msg->name, d->name, len + 1);
+		__sync_fetch_and_add(&sh->queued, 1);
+		if (send(w->sock[0], w->msg, offsetof(struct walk_msg, name) + len + 1, MSG_DONTWAIT) < 0) {
+			__sync_fetch_and_sub(&sh->queued, 1);
+			break;
+		}
+		free(d->name);
+		w->bottom++;
+	}
+}
+
+/* Parent: wait until the socket is readable.
+ * Returns 0 if a walker died without telling the others */
+static int walk_watch(struct recursive_walk *w)
+{
+	struct pollfd pfd[WALK_MAX_PROCS];
+	unsigned idx[WALK_MAX_PROCS];
+
+	for (;;) {
+		unsigned i, n;
+
+		pfd[0].fd = w->sock[1];
+		pfd[0].events = POLLIN;
+		n = 1;
+		for (i = 1; i < w->nprocs; i++) {
+			if (w->lifeline[i] < 0)
+				continue;
+			pfd[n].fd = w->lifeline[i];
+			pfd[n].events = POLLIN;
+			idx[n] = i;
+			n++;
+		}
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			bb_simple_perror_msg_and_die("poll");
+		}
+		if (pfd[0].revents)
+			return 1;
+		for (i = 1; i < n; i++) {
+			int status = 0;
+
+			if (!pfd[i].revents)
+				continue;
+			close(w->lifeline[idx[i]]);
+			w->lifeline[idx[i]] = -1;
+			/* Walkers exit with 0 only after the tree is done */
+			if (safe_waitpid(w->pids[idx[i]], &status, 0) > 0
+			 && WIFEXITED(status) && WEXITSTATUS(status) == 0
+			) {
+				w->pids[idx[i]] = 0;
+				continue;
+			}
+			w->pids[idx[i]] = 0;
+			if (WIFSIGNALED(status))
+				bb_error_msg("walker process killed by signal %u", WTERMSIG(status));
+			return 0;
+		}
+	}
+}
+
+/* Wait for a directory from other walkers. Returns 0 if we should stop */
+static int walk_wait(struct recursive_walk *w)
+{
+	ssize_t n;
+
+	__sync_fetch_and_add(&w->sh->idle, 1);
+	for (;;) {
+		if (w->lifeline && !walk_watch(w)) {
+			w->sh->died = 1;
+			walk_stop(w);
+			n = 0;
+			break;
+		}
+		/* Parent: another walker may take the message first */
+		n = recv(w->sock[1], w->msg, sizeof(*w->msg), w->lifeline ? MSG_DONTWAIT : 0);
+		if (n >= 0 || (errno != EINTR && errno != EAGAIN))
+			break;
+	}
+	__sync_fetch_and_sub(&w->sh->idle, 1);
+	if (n <= (ssize_t)offsetof(struct walk_msg, name))
+		return 0;
+	__sync_fetch_and_sub(&w->sh->queued, 1);
+	walk_push(w, xstrdup(w->msg->name), w->msg->depth);
+	return 1;
+}
+
+static int walk_loop(recursive_state_t *state);
+
+static void NORETURN walk_child(recursive_state_t *state)
+{
+	struct recursive_walk *w = state->walk;
+
+	/* Parent's directories are parent's */
+	while (w->top != w->bottom)
+		free(w->dir[--w->top].name);
+	w->top = w->bottom = 0;
+	if (!walk_loop(state))
+		w->sh->failed = 1;
+	fflush_all();
+	_exit(EXIT_SUCCESS);
+}
+
+static void walk_spawn(recursive_state_t *state)
+{
+	struct recursive_walk *w = state->walk;
+	long n;
+	unsigned i;
+
+	w->spawn_tried = 1;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 2)
+		return;
+	if (n > WALK_MAX_PROCS)
+		n = WALK_MAX_PROCS;
+	w->sh = mmap(NULL, sizeof(*w->sh), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (w->sh == MAP_FAILED)
+		return;
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, w->sock) != 0) {
+		munmap(w->sh, sizeof(*w->sh));
+		return;
+	}
+	w->sh->pending = w->top - w->bottom;
+	w->msg = xmalloc(sizeof(*w->msg));
+	w->pids = xmalloc(n * sizeof(w->pids[0]));
+	w->lifeline = xmalloc(n * sizeof(w->lifeline[0]));
+	w->lifeline[0] = -1;
+	w->nprocs = n;
+	dying_walk = w;
+	die_func = walk_died;
+	fflush_all();
+	for (i = 1; i < n; i++) {
+		int fd[2];
+		pid_t pid;
+
+		if (pipe(fd) != 0)
+			break;
+		pid = fork();
+		if (pid < 0) {
+			close(fd[0]);
+			close(fd[1]);
+			break;
+		}
+		if (pid == 0) {
+			unsigned j;
+			/* Keep only the write end of our own lifeline */
+			for (j = 1; j < i; j++)
+				close(w->lifeline[j]);
+			close(fd[0]);
+			w->lifeline = NULL;
+			walk_child(state);
+		}
+		close(fd[1]);
+		w->lifeline[i] = fd[0];
+		w->pids[i] = pid;
+	}
+	/* If fork failed, make do with what we have.
+	 * Children think there are more of us, so they may get
+	 * more than one "stop" message. That's ok */
+	w->nprocs = i;
+}
+
+static int walk_loop(recursive_state_t *state)
+{
+	struct recursive_walk *w = state->walk;
+	int status = TRUE;
+
+	for (;;) {
+		struct walk_dir d;
+		struct stat statbuf;
+
+		if (w->top == w->bottom) {
+			if (!w->nprocs || !walk_wait(w))
+				break;
+		}
+		d = w->dir[--w->top];
+		state->depth = d.depth;
+		/* DEPTHFIRST dirAction needs statbuf */
+		if ((state->flags & ACTION_DEPTHFIRST)
+		 && stat_follow(state, d.name, &statbuf) != 0
+		) {
+			if (!(state->flags & ACTION_QUIET))
+				bb_simple_perror_msg(d.name);
+			status = FALSE;
+		} else if (!recurse_dir(state, d.name, &statbuf)) {
+			status = FALSE;
+		}
+		free(d.name);
+
+		if (!w->nprocs) {
+			if (!w->spawn_tried && w->top - w->bottom >= WALK_SPAWN_DIRS)
+				walk_spawn(state);
+			continue;
+		}
+		if (__sync_sub_and_fetch(&w->sh->pending, 1) == 0)
+			walk_stop(w);
+		if (w->sh->died)
+			break;
+		walk_share(w);
+	}
+	return status;
+}
+
+static int walk_parallel(recursive_state_t *state, const char *fileName)
+{
+	struct recursive_walk w;
+	void (*prev_die_func)(void) = die_func;
+	int status;
+
+	memset(&w, 0, sizeof(w));
+	state->walk = &w;
+	status = recursive_action1(state, fileName, DT_UNKNOWN);
+	if (!walk_loop(state))
+		status = FALSE;
+	if (w.nprocs) {
+		unsigned i;
+		/* If one died, the others are stopping too */
+		for (i = 1; i < w.nprocs; i++) {
+			if (w.pids[i])
+				wait4pid(w.pids[i]);
+			if (w.lifeline[i] >= 0)
+				close(w.lifeline[i]);
+		}
+		die_func = prev_die_func;
+		if (w.sh->died)
+			xfunc_die();
+		if (w.sh->failed)
+			status = FALSE;
+		munmap(w.sh, sizeof(*w.sh));
+		close(w.sock[0]);
+		close(w.sock[1]);
+		free(w.msg);
+		free(w.pids);
+		free(w.lifeline);
+	}
+	free(w.dir);
+	state->walk = NULL;
+	return status;
+}
+#endif
+
 /* fileName is (l)stat'ed (depending on ACTION_FOLLOWLINKS[_L0]).
  *
  * If it is a file: fileAction in run on it, its return value is returned.
@@ -59,24 +466,30 @@ static int FAST_FUNC true_action(struct recursive_state *state UNUSED_PARAM,
  * If ACTION_DEPTHFIRST, dirAction is called after recurse.
  * If it returns 0, the warning is printed and recursive_action() returns 0.
  *
+ * ACTION_TYPE_ONLY: actions only look at the file type in st_mode,
+ * the rest of statbuf may be zeroed (readdir's d_type is used if known).
+ *
  * ACTION_FOLLOWLINKS mainly controls handling of links to dirs.
  * 0: lstat(statbuf). Calls fileAction on link name even if points to dir.
  * 1: stat(statbuf). Calls dirAction and optionally recurse on link to dir.
  */
 
-static int recursive_action1(recursive_state_t *state, const char *fileName)
+static int recursive_action1(recursive_state_t *state, const char *fileName, unsigned d_type)
 {
 	struct stat statbuf;
-	unsigned follow;
 	int status;
-	DIR *dir;
-	struct dirent *next;
 
-	follow = ACTION_FOLLOWLINKS;
-	if (state->depth == 0)
-		follow = ACTION_FOLLOWLINKS | ACTION_FOLLOWLINKS_L0;
-	follow &= state->flags;
-	status = (follow ? stat : lstat)(fileName, &statbuf);
+	/* ACTION_TYPE_ONLY: if readdir told us the type, don't stat.
+	 * Links need stat if we follow them */
+	if ((state->flags & ACTION_TYPE_ONLY)
+	 && d_type != DT_UNKNOWN
+	 && (d_type != DT_LNK || !(state->flags & ACTION_FOLLOWLINKS))
+	) {
+		memset(&statbuf, 0, sizeof(statbuf));
+		statbuf.st_mode = DTTOIF(d_type);
+		status = 0;
+	} else
+		status = stat_follow(state, fileName, &statbuf);
 	if (status < 0) {
 #ifdef DEBUG_RECURS_ACTION
 		bb_error_msg("status=%d flags=%x", status, state->flags);
@@ -114,44 +527,17 @@ static int recursive_action1(recursive_state_t *state, const char *fileName)
 			return TRUE;
 	}
 
-	dir = opendir(fileName);
-	if (!dir) {
-		/* findutils-4.1.20 reports this */
-		/* (i.e. it doesn't silently return with exit code 1) */
-		/* To trigger: "find -exec rm -rf {} \;" */
-		goto done_nak_warn;
+#if ENABLE_FEATURE_RECURSIVE_ACTION_PARALLEL
+	if (state->walk) {
+		/* Read it later, maybe in another process */
+		struct recursive_walk *w = state->walk;
+		walk_push(w, xstrdup(fileName), state->depth);
+		if (w->nprocs)
+			__sync_fetch_and_add(&w->sh->pending, 1);
+		return TRUE;
 	}
-	status = TRUE;
-	while ((next = readdir(dir)) != NULL) {
-		char *nextFile;
-		int s;
-
-		nextFile = concat_subpath_file(fileName, next->d_name);
-		if (nextFile == NULL)
-			continue;
-
-		/* process every file (NB: ACTION_RECURSE is set in flags) */
-		state->depth++;
-		s = recursive_action1(state, nextFile);
-		if (s == FALSE)
-			status = FALSE;
-		free(nextFile);
-		state->depth--;
-
-//#define RECURSE_RESULT_ABORT -1
-//		if (s == RECURSE_RESULT_ABORT) {
-//			closedir(dir);
-//			return s;
-//		}
-	}
-	closedir(dir);
-
-	if (state->flags & ACTION_DEPTHFIRST) {
-		if (!state->dirAction(state, fileName, &statbuf))
-			goto done_nak_warn;
-	}
-
-	return status;
+#endif
+	return recurse_dir(state, fileName, &statbuf);
 
  done_nak_warn:
 	if (!(state->flags & ACTION_QUIET))
@@ -176,6 +562,11 @@ int FAST_FUNC recursive_action(const char *fileName,
 	state.userData = userData;
 	state.fileAction = fileAction ? fileAction : true_action;
 	state.dirAction  =  dirAction ?  dirAction : true_action;
+	state.walk = NULL;
 
-	return recursive_action1(&state, fileName);
+#if ENABLE_FEATURE_RECURSIVE_ACTION_PARALLEL
+	if ((flags & (ACTION_PARALLEL | ACTION_RECURSE)) == (ACTION_PARALLEL | ACTION_RECURSE))
+		return walk_parallel(&state, fileName);
+#endif
+	return recursive_action1(&state, fileName, DT_UNKNOWN);
 }
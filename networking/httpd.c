@@ -83,9 +83,10 @@
  * subdir paths are relative to the containing subdir and thus cannot
  * affect the parent rules.
  *
- * Note that since the sub dir is parsed in the forked thread servicing the
- * subdir http request, any merge is discarded when the process exits.  As a
- * result, the subdir settings only have a lifetime of a single request.
+ * Config files of all subdirectories are read at startup and on SIGHUP
+ * (with -i, in very big trees, and below symlinks to directories: when
+ * a request first reaches the subdirectory).  Their rules only apply
+ * to requests for that subdirectory and below.
  *
  * Custom error pages can contain an absolute path or be relative to
  * 'home_httpd'. Error pages are to be static files (no CGI or script). Error
@@ -252,6 +253,29 @@
 //config:	RFC2616 says that server MUST add Date header to response.
 //config:	But it is almost useless and can be omitted.
 //config:
+//config:config FEATURE_HTTPD_KEEPALIVE
+//config:	bool "Support persistent connections"
+//config:	default y
+//config:	depends on HTTPD
+//config:	help
+//config:	Serve more than one request (including pipelined ones) over
+//config:	a connection if the client asks for it, instead of closing
+//config:	the connection after every response. Saves a TCP handshake
+//config:	and a fork per request for pages with many small files.
+//config:	CGI, proxied and error responses still close the connection.
+//config:
+//config:config FEATURE_HTTPD_EVENT
+//config:	bool "Enable -E N: serve static files without forking"
+//config:	default y
+//config:	depends on FEATURE_HTTPD_KEEPALIVE && FEATURE_USE_SENDFILE && !NOMMU
+//config:	help
+//config:	With -E N, N processes serve files from an epoll loop using
+//config:	nonblocking sendfile(), instead of forking for every connection.
+//config:	Recently served files are kept open, with their headers
+//config:	and .gz variants, and rechecked at most once a second.
+//config:	Requests for CGI, proxied, password protected URLs etc. are
+//config:	still served by a forked process. Linux only.
+//config:
 //config:config FEATURE_HTTPD_ACL_IP
 //config:	bool "ACL IP"
 //config:	default y
@@ -269,6 +293,7 @@
 //usage:       " [-p [IP:]PORT]"
 //usage:	IF_FEATURE_HTTPD_SETUID(" [-u USER[:GRP]]")
 //usage:	IF_FEATURE_HTTPD_BASIC_AUTH(" [-r REALM]")
+//usage:	IF_FEATURE_HTTPD_EVENT(" [-E N]")
 //usage:       " [-h HOME]\n"
 //usage:       "or httpd -d/-e" IF_FEATURE_HTTPD_AUTH_MD5("/-m") " STRING"
 //usage:#define httpd_full_usage "\n\n"
@@ -281,6 +306,9 @@
 //usage:     "\n	-u USER[:GRP]	Set uid/gid after binding to port")
 //usage:	IF_FEATURE_HTTPD_BASIC_AUTH(
 //usage:     "\n	-r REALM	Authentication Realm for Basic Authentication")
+//usage:	IF_FEATURE_HTTPD_EVENT(
+//usage:     "\n	-E N		Serve static files from N non-forking processes"
+//usage:     "\n			(0: one per CPU)")
 //usage:     "\n	-h HOME		Home directory (default .)"
 //usage:     "\n	-c FILE		Configuration file (default {/etc,HOME}/httpd.conf)"
 //usage:	IF_FEATURE_HTTPD_AUTH_MD5(
@@ -303,6 +331,16 @@
 #if ENABLE_FEATURE_USE_SENDFILE
 # include <sys/sendfile.h>
 #endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+# include <netinet/tcp.h>
+#endif
+#if ENABLE_FEATURE_HTTPD_EVENT
+# include <sys/epoll.h>
+# include <sys/prctl.h>
+# ifndef EPOLLEXCLUSIVE
+#  define EPOLLEXCLUSIVE (1u << 28)
+# endif
+#endif
 
 /* see sys/netinet6/in6.h */
 #if defined(__FreeBSD__)
@@ -319,8 +357,17 @@
 
 #define IOBUF_SIZE 8192
 #define MAX_HTTP_HEADERS_SIZE (32*1024)
+/* Longer httpd.conf lines are split. Thus "I:index_page" is shorter, too */
+#define MAX_CONF_LINE 160
 
 #define HEADER_READ_TIMEOUT 60
+/* How long an idle persistent connection is kept open, and
+ * how many requests it may serve before we close it */
+#define KEEPALIVE_TIMEOUT 5
+#define KEEPALIVE_MAX_REQUESTS 100
+/* Trees with more directories are not read at startup,
+ * their httpd.conf files are looked for per request */
+#define CONF_WALK_MAX_DIRS 10000
 
 #define STR1(s) #s
 #define STR(s) STR1(s)
@@ -351,6 +398,41 @@ typedef struct Htaccess_IP {
 } Htaccess_IP;
 #endif
 
+#if ENABLE_FEATURE_HTTPD_ACL_IP
+/* Compiled allow/deny rules: sorted, non-overlapping address ranges,
+ * each covering [first, next range's first) */
+typedef struct ip_range {
+	unsigned first;
+	smallint deny;
+} ip_range;
+#endif
+
+/*
+ * Config of the directory tree, one node per path component.
+ * Nodes exist for directories with httpd.conf (and their parents)
+ * and for "/path:user:pass" prefixes. Rules of a directory apply to
+ * everything below it, deeper ones take precedence.
+ */
+typedef struct conf_node {
+	struct conf_node *parent;
+	struct conf_node *child;
+	struct conf_node *sibling;
+	const char *index_file; /* "I:" of this dir, NULL - inherited */
+	Htaccess *mime_a;       /* ".ext:mime/type" lines of this dir */
+#if ENABLE_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR
+	Htaccess *script_i;     /* "*.php:/path/php" lines of this dir */
+#endif
+#if ENABLE_FEATURE_HTTPD_BASIC_AUTH
+	Htaccess *auth;         /* "user:pass" lines for exactly this path */
+#endif
+#if ENABLE_FEATURE_HTTPD_ACL_IP
+	ip_range *ip_table;     /* NULL: allow all */
+	unsigned ip_count;
+#endif
+	smallint checked;       /* httpd.conf was looked for */
+	char name[1];           /* really bigger, must be last */
+} conf_node;
+
 /* Must have "next" as a first member */
 typedef struct Htaccess_Proxy {
 	struct Htaccess_Proxy *next;
@@ -452,7 +534,9 @@ static const struct {
 
 struct globals {
 	int verbose;            /* must be int (used by getopt32) */
-	smallint flg_deny_all;
+	/* read subdir httpd.conf files when URLs reach them, not at startup */
+	smallint conf_on_demand;
+	unsigned conf_walk_dirs;
 #if ENABLE_FEATURE_HTTPD_GZIP
 	/* client can handle gzip / we are going to send gzip */
 	smallint content_gzip;
@@ -471,9 +555,8 @@ struct globals {
 
 	const char *found_mime_type;
 	const char *found_moved_temporarily;
-#if ENABLE_FEATURE_HTTPD_ACL_IP
-	Htaccess_IP *ip_a_d;    /* config allow/deny lines */
-#endif
+	conf_node *conf_root;   /* main config */
+	conf_node *conf_dir;    /* config of the requested URL's directory */
 
 	IF_FEATURE_HTTPD_BASIC_AUTH(const char *g_realm;)
 	IF_FEATURE_HTTPD_BASIC_AUTH(char *remoteuser;)
@@ -485,13 +568,6 @@ struct globals {
 	off_t range_len;
 #endif
 
-#if ENABLE_FEATURE_HTTPD_BASIC_AUTH
-	Htaccess *g_auth;       /* config user:password lines */
-#endif
-	Htaccess *mime_a;       /* config mime types */
-#if ENABLE_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR
-	Htaccess *script_i;     /* config script interpreters */
-#endif
 	char *iobuf;            /* [IOBUF_SIZE] */
 #define        hdr_buf bb_common_bufsiz1
 #define sizeof_hdr_buf COMMON_BUFSIZE
@@ -506,10 +582,26 @@ struct globals {
 #if ENABLE_FEATURE_HTTPD_PROXY
 	Htaccess_Proxy *proxy;
 #endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* set: after this response, read next request from the connection */
+	smallint keepalive;
+	unsigned requests_left;
+	int file_fd;            /* file being sent, closed before the next request */
+	jmp_buf next_request;
+#endif
+#if ENABLE_FEATURE_HTTPD_EVENT
+	int server_socket;
+	int ev_fd;              /* epoll */
+	unsigned ev_conn_size;
+	struct ev_conn **ev_conn; /* [ev_conn_size], indexed by fd */
+	struct file_entry **fc_hash; /* [FILE_CACHE_HASH] */
+	struct file_entry *fc_lru_head;
+	struct file_entry *fc_lru_tail;
+	unsigned fc_count;
+#endif
 };
 #define G (*ptr_to_globals)
 #define verbose           (G.verbose          )
-#define flg_deny_all      (G.flg_deny_all     )
 #if ENABLE_FEATURE_HTTPD_GZIP
 # define content_gzip     (G.content_gzip     )
 #else
@@ -538,9 +630,6 @@ enum {
 };
 #endif
 #define rmt_ip_str        (G.rmt_ip_str       )
-#define g_auth            (G.g_auth           )
-#define mime_a            (G.mime_a           )
-#define script_i          (G.script_i         )
 #define iobuf             (G.iobuf            )
 #define hdr_ptr           (G.hdr_ptr          )
 #define hdr_cnt           (G.hdr_cnt          )
@@ -554,6 +643,7 @@ enum {
 	bind_addr_or_port = STR(CONFIG_FEATURE_HTTPD_PORT_DEFAULT); \
 	index_page = index_html; \
 	file_size = -1; \
+	IF_FEATURE_HTTPD_KEEPALIVE(G.file_fd = -1;) \
 } while (0)
 
 
@@ -589,6 +679,137 @@ static ALWAYS_INLINE void free_Htaccess_IP_list(Htaccess_IP **pptr)
 }
 #endif
 
+static void free_conf_tree(conf_node *n)
+{
+	while (n) {
+		conf_node *t = n;
+
+		free_conf_tree(n->child);
+		free((char*)n->index_file);
+		free_Htaccess_list(&n->mime_a);
+		IF_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR(free_Htaccess_list(&n->script_i);)
+		IF_FEATURE_HTTPD_BASIC_AUTH(free_Htaccess_list(&n->auth);)
+		IF_FEATURE_HTTPD_ACL_IP(free(n->ip_table);)
+		n = n->sibling;
+		free(t);
+	}
+}
+
+/* Find (or add) subdirectory name[0..len-1] of n */
+static conf_node *conf_child(conf_node *n, const char *name, unsigned len, int create)
+{
+	conf_node *c;
+
+	for (c = n->child; c; c = c->sibling) {
+		if (strncmp(c->name, name, len) == 0 && c->name[len] == '\0')
+			return c;
+	}
+	if (create) {
+		c = xzalloc(sizeof(*c) + len);
+		memcpy(c->name, name, len);
+		c->parent = n;
+		c->sibling = n->child;
+		n->child = c;
+	}
+	return c;
+}
+
+/* Node for "dir/subdir" (or "/dir/file"), created if needed */
+static conf_node *conf_node_get(const char *path)
+{
+	conf_node *n = G.conf_root;
+
+	while (1) {
+		const char *end;
+
+		while (*path == '/')
+			path++;
+		if (!*path)
+			return n;
+		end = strchrnul(path, '/');
+		n = conf_child(n, path, end - path, /*create:*/ 1);
+		path = end;
+	}
+}
+
+#if ENABLE_FEATURE_HTTPD_ACL_IP
+static int compare_unsigned(const void *a, const void *b)
+{
+	unsigned x = *(unsigned*)a;
+	unsigned y = *(unsigned*)b;
+	return (x > y) - (x < y);
+}
+
+/* The answer of a linear scan of rules for ip: deny rules win,
+ * then allow rules, then "D:*" */
+static int ip_rules_deny(Htaccess_IP *rules, int deny_all, unsigned ip)
+{
+	for (; rules; rules = rules->next) {
+		if ((ip & rules->mask) == rules->ip) {
+			if (rules->allow_deny == 'D')
+				return 1;
+			deny_all = 0;
+		}
+	}
+	return deny_all;
+}
+
+/*
+ * Turn A/D rules into n->ip_table: the rule boundaries split the
+ * address space into ranges, all addresses in a range get the same
+ * answer. Adjacent ranges with the same answer are merged.
+ */
+static void compile_ip_rules(conf_node *n, Htaccess_IP *rules, int deny_all)
+{
+	Htaccess_IP *cur;
+	unsigned *bound;
+	unsigned i, cnt, k;
+
+	free(n->ip_table);
+	n->ip_table = NULL;
+	n->ip_count = 0;
+	if (!rules && !deny_all)
+		return;
+
+	cnt = 1;
+	for (cur = rules; cur; cur = cur->next)
+		cnt += 2;
+	bound = xmalloc(cnt * sizeof(bound[0]));
+	bound[0] = 0;
+	k = 1;
+	for (cur = rules; cur; cur = cur->next) {
+		unsigned last = cur->ip | ~cur->mask;
+		bound[k++] = cur->ip;
+		if (last != 0xffffffff)
+			bound[k++] = last + 1;
+	}
+	qsort(bound, k, sizeof(bound[0]), compare_unsigned);
+
+	n->ip_table = xmalloc(k * sizeof(n->ip_table[0]));
+	cnt = 0;
+	for (i = 0; i < k; i++) {
+		int deny;
+
+		if (i != 0 && bound[i] == bound[i - 1])
+			continue;
+		deny = ip_rules_deny(rules, deny_all, bound[i]);
+		if (cnt != 0 && n->ip_table[cnt - 1].deny == deny)
+			continue;
+		n->ip_table[cnt].first = bound[i];
+		n->ip_table[cnt].deny = deny;
+		cnt++;
+	}
+	free(bound);
+	n->ip_count = cnt;
+	if (cnt == 1 && !n->ip_table[0].deny) {
+		/* only "A:" lines */
+		free(n->ip_table);
+		n->ip_table = NULL;
+		n->ip_count = 0;
+	}
+}
+#endif
+
 #if ENABLE_FEATURE_HTTPD_ACL_IP
 /* Returns presumed mask width in bits or < 0 on error.
  * Updates strp, stores IP at provided pointer */
@@ -677,12 +898,11 @@ static int scan_ip_mask(const char *str, unsigned *ipp, unsigned *maskp)
 #endif
 
 /*
- * Parse configuration file into in-memory linked list.
+ * Parse configuration file into the config tree.
  *
- * Any previous IP rules are discarded.
- * If the flag argument is not SUBDIR_PARSE then all /path and mime rules
- * are also discarded.  That is, previous settings are retained if flag is
- * SUBDIR_PARSE.
+ * If the flag argument is not SUBDIR_PARSE then the whole tree is
+ * discarded and the file becomes its root.  Otherwise the file sets
+ * the rules of the node for path.
  * Error pages are only parsed on the main config file.
  *
  * path   Path where to look for httpd.conf (without filename).
@@ -701,22 +921,20 @@ static int parse_conf(const char *path, int flag)
 
 	FILE *f;
 	const char *filename;
-	char buf[160];
-
-	/* discard old rules */
+	conf_node *node;
 #if ENABLE_FEATURE_HTTPD_ACL_IP
-	free_Htaccess_IP_list(&G.ip_a_d);
+	Htaccess_IP *ip_a_d = NULL;
+	smallint flg_deny_all = 0;
 #endif
-	flg_deny_all = 0;
-	/* retain previous auth and mime config only for subdir parse */
+	char buf[MAX_CONF_LINE];
+
 	if (flag != SUBDIR_PARSE) {
-		free_Htaccess_list(&mime_a);
-#if ENABLE_FEATURE_HTTPD_BASIC_AUTH
-		free_Htaccess_list(&g_auth);
-#endif
-#if ENABLE_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR
-		free_Htaccess_list(&script_i);
-#endif
+		/* discard old rules */
+		free_conf_tree(G.conf_root);
+		G.conf_root = G.conf_dir = xzalloc(sizeof(*G.conf_root));
+		node = G.conf_root;
+	} else {
+		node = conf_node_get(path);
 	}
 
 	filename = opt_c_configFile;
@@ -798,6 +1016,11 @@ static int parse_conf(const char *path, int flag)
 		ch = (buf[0] & ~0x20); /* toupper if it's a letter */
 
 		if (ch == 'I') {
+			if (flag == SUBDIR_PARSE) {
+				free((char*)node->index_file);
+				node->index_file = xstrdup(after_colon);
+				continue;
+			}
 			if (index_page != index_html)
 				free((char*)index_page);
 			index_page = xstrdup(after_colon);
@@ -833,13 +1056,13 @@ static int parse_conf(const char *path, int flag)
 			pip->allow_deny = ch;
 			if (ch == 'D') {
 				/* Deny:from_IP - prepend */
-				pip->next = G.ip_a_d;
-				G.ip_a_d = pip;
+				pip->next = ip_a_d;
+				ip_a_d = pip;
 			} else {
 				/* A:from_IP - append (thus all D's precedes A's) */
-				Htaccess_IP *prev_IP = G.ip_a_d;
+				Htaccess_IP *prev_IP = ip_a_d;
 				if (prev_IP == NULL) {
-					G.ip_a_d = pip;
+					ip_a_d = pip;
 				} else {
 					while (prev_IP->next)
 						prev_IP = prev_IP->next;
@@ -923,14 +1146,14 @@ static int parse_conf(const char *path, int flag)
 			cur->after_colon = p;
 			if (ch == '.') {
 				/* .mime line: prepend to mime_a list */
-				cur->next = mime_a;
-				mime_a = cur;
+				cur->next = node->mime_a;
+				node->mime_a = cur;
 			}
 #if ENABLE_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR
 			else {
 				/* script interpreter line: prepend to script_i list */
-				cur->next = script_i;
-				script_i = cur;
+				cur->next = node->script_i;
+				node->script_i = cur;
 			}
 #endif
 			continue;
@@ -940,7 +1163,6 @@ static int parse_conf(const char *path, int flag)
 		if (ch == '/') { /* "/file:user:pass" */
 			char *p;
 			Htaccess *cur;
-			unsigned file_len;
 
 			/* note: path is "" unless we are in SUBDIR parse,
 			 * otherwise it does NOT start with "/" */
@@ -955,26 +1177,15 @@ static int parse_conf(const char *path, int flag)
 				buf);
 			/* canonicalize it */
 			p = bb_simplify_abs_path_inplace(cur->before_colon);
-			file_len = p - cur->before_colon;
 			/* add "user:pass" after NUL */
 			strcpy(++p, after_colon);
 			cur->after_colon = p;
 
-			/* insert cur into g_auth */
-			/* g_auth is sorted by decreased filename length */
+			/* prepend to the list of its path */
 			{
-				Htaccess *auth, **authp;
-
-				authp = &g_auth;
-				while ((auth = *authp) != NULL) {
-					if (file_len >= strlen(auth->before_colon)) {
-						/* insert cur before auth */
-						cur->next = auth;
-						break;
-					}
-					authp = &auth->next;
-				}
-				*authp = cur;
+				conf_node *n = conf_node_get(cur->before_colon);
+				cur->next = n->auth;
+				n->auth = cur;
 			}
 			continue;
 		}
@@ -986,9 +1197,120 @@ static int parse_conf(const char *path, int flag)
 	} /* while (fgets) */
 
 	fclose(f);
+#if ENABLE_FEATURE_HTTPD_ACL_IP
+	compile_ip_rules(node, ip_a_d, flg_deny_all);
+	free_Htaccess_IP_list(&ip_a_d);
+#endif
 	return 0;
 }
 
+static int FAST_FUNC find_subdir_conf(struct recursive_state *state,
+		const char *fileName,
+		struct stat *statbuf UNUSED_PARAM)
+{
+	/* "./dir/httpd.conf": parse it as the config of "dir" */
+	if (state->depth > 1 && strcmp(bb_basename(fileName), HTTPD_CONF) == 0) {
+		char *dir = xstrndup(fileName + 2, strlen(fileName) - 2 - sizeof(HTTPD_CONF));
+		conf_node *n;
+
+		parse_conf(dir, SUBDIR_PARSE);
+		/* The walk has seen these directories, requests need not
+		 * look at them (the walk does not follow symlinks, so all
+		 * of them are real directories) */
+		for (n = conf_node_get(dir); n && !n->checked; n = n->parent)
+			n->checked = 1;
+		free(dir);
+	}
+	return TRUE;
+}
+
+static int FAST_FUNC count_subdir(struct recursive_state *state UNUSED_PARAM,
+		const char *fileName UNUSED_PARAM,
+		struct stat *statbuf UNUSED_PARAM)
+{
+	/* Over the limit: skip the rest quickly, load_conf() gives up */
+	return ++G.conf_walk_dirs > CONF_WALK_MAX_DIRS ? SKIP : TRUE;
+}
+
+/*
+ * (Re)load the main config, then httpd.conf files of all
+ * subdirectories of home_httpd, so that requests only look them up.
+ * New subdir configs are picked up on SIGHUP.
+ * Not from a signal handler: it mallocs.
+ */
+static void load_conf(int flag)
+{
+	parse_conf(DEFAULT_PATH_HTTPD_CONF, flag);
+	if (!G.conf_on_demand) {
+		G.conf_walk_dirs = 0;
+		recursive_action(".", ACTION_RECURSE | ACTION_QUIET | ACTION_TYPE_ONLY,
+			find_subdir_conf, count_subdir, NULL);
+		if (G.conf_walk_dirs > CONF_WALK_MAX_DIRS) {
+			/* Too big to read in full at every SIGHUP,
+			 * look for subdir configs as requests reach them */
+			G.conf_on_demand = 1;
+			parse_conf(DEFAULT_PATH_HTTPD_CONF, flag);
+		}
+	}
+}
+
+/*
+ * Config node of the directory url is in: "/a/b/c" -> "a/b",
+ * or the deepest existing parent of it.
+ * In on-demand mode, httpd.conf files on the way are read now
+ * (url is temporarily modified for that). So are those the startup
+ * walk did not see: below symlinks to directories.
+ */
+static conf_node *find_dir_conf(char *url)
+{
+	conf_node *n = G.conf_root;
+	conf_node *c = n;       /* node of the path so far, if any */
+	char *name = url + 1;
+	char *slash;
+	smallint on_demand = G.conf_on_demand;
+
+	while ((slash = strchr(name, '/')) != NULL) {
+		*slash = '\0';
+		if (c)
+			c = conf_child(c, name, slash - name, on_demand);
+		if (!on_demand && (!c || !c->checked)) {
+			struct stat sb;
+
+			if (lstat(url + 1, &sb) != 0) {
+				/* Nothing below it exists */
+				*slash = '/';
+				break;
+			}
+			if (S_ISLNK(sb.st_mode)) {
+				/* Read configs from here on. Missing
+				 * nodes of real dirs above it are created too */
+				on_demand = 1;
+				c = conf_node_get(url + 1);
+			}
+		}
+		if (c && !c->checked && on_demand) {
+			c->checked = 1;
+			parse_conf(url + 1, SUBDIR_PARSE);
+		}
+		*slash = '/';
+		/* No node: a real directory without rules, but there
+		 * may be symlinks below it */
+		if (c)
+			n = c;
+		name = slash + 1;
+	}
+	return n;
+}
+
+static const char *conf_index_page(const conf_node *n)
+{
+	for (; n; n = n->parent) {
+		if (n->index_file)
+			return n->index_file;
+	}
+	return index_page;
+}
+
 #if ENABLE_FEATURE_HTTPD_ENCODE_URL_STR
 /*
  * Given a string, html-encode special characters.
@@ -1054,6 +1376,10 @@ static int openServer(void)
 static void log_and_exit(void) NORETURN;
 static void log_and_exit(void)
 {
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	if (G.keepalive)
+		longjmp(G.next_request, 1);
+#endif
 	/* Paranoia. IE said to be buggy. It may send some extra data
 	 * or be confused by us just exiting without SHUT_WR. Oh well. */
 	shutdown(1, SHUT_WR);
@@ -1070,13 +1396,13 @@ static void log_and_exit(void)
 }
 
 /*
- * Create and send HTTP response headers.
- * The arguments are combined and sent as one write operation.  Note that
- * IE will puke big-time if the headers are not sent in one packet and the
- * second packet is delayed for any reason.
+ * Create HTTP response headers in iobuf, return their length.
+ * Error responses get a short HTML body after the headers, unless
+ * a custom error page is configured for them: then *error_page_p
+ * is set and the caller is to send that file as a body.
  * responseNum - the result code to send.
  */
-static void send_headers(unsigned responseNum)
+static unsigned build_headers(unsigned responseNum, const char **error_page_p)
 {
 #if ENABLE_FEATURE_HTTPD_DATE || ENABLE_FEATURE_HTTPD_LAST_MODIFIED
 	static const char RFC1123FMT[] ALIGN1 = "%a, %d %b %Y %H:%M:%S GMT";
@@ -1092,6 +1418,7 @@ static void send_headers(unsigned responseNum)
 	unsigned len;
 	unsigned i;
 
+	*error_page_p = NULL;
 	for (i = 0; i < ARRAY_SIZE(http_response_type); i++) {
 		if (http_response_type[i] == responseNum) {
 			responseString = http_response[i].name;
@@ -1106,6 +1433,17 @@ static void send_headers(unsigned responseNum)
 	if (verbose)
 		bb_error_msg("response:%u", responseNum);
 
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* The connection can be reused only if the peer
+	 * can tell where this response ends */
+	if (infoString
+	 IF_FEATURE_HTTPD_ERROR_PAGES(|| error_page)
+	 || (responseNum == HTTP_OK && file_size == -1)
+	) {
+		G.keepalive = 0;
+	}
+#endif
+
 	/* We use sprintf, not snprintf (it's less code).
 	 * iobuf[] is several kbytes long and all headers we generate
 	 * always fit into those kbytes.
@@ -1122,11 +1460,12 @@ static void send_headers(unsigned responseNum)
 #if ENABLE_FEATURE_HTTPD_DATE
 			"Date: %s\r\n"
 #endif
-			"Connection: close\r\n",
-			responseNum, responseString
+			"Connection: %s\r\n",
+			responseNum, responseString,
 #if ENABLE_FEATURE_HTTPD_DATE
-			, date_str
+			date_str,
 #endif
+			IF_FEATURE_HTTPD_KEEPALIVE(G.keepalive ? "keep-alive" :) "close"
 		);
 	}
 
@@ -1154,6 +1493,10 @@ static void send_headers(unsigned responseNum)
 		 * mkdir test
 		 * python -c 'print("get /test?" + ("x" * 8192))' | busybox httpd -i -h .
 		 */
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+		/* There is no body, say so before Location: possibly gets truncated */
+		len += sprintf(iobuf + len, "Content-Length: 0\r\n");
+#endif
 		len += snprintf(iobuf + len, IOBUF_SIZE-3 - len,
 				"Location: %s/%s%s\r\n",
 				found_moved_temporarily,
@@ -1168,13 +1511,8 @@ static void send_headers(unsigned responseNum)
 	if (error_page && access(error_page, R_OK) == 0) {
 		iobuf[len++] = '\r';
 		iobuf[len++] = '\n';
-		if (DEBUG) {
-			iobuf[len] = '\0';
-			fprintf(stderr, "headers: '%s'\n", iobuf);
-		}
-		full_write(STDOUT_FILENO, iobuf, len);
-		dbg("writing error page: '%s'\n", error_page);
-		return send_file_and_exit(error_page, SEND_BODY);
+		*error_page_p = error_page;
+		return len;
 	}
 #endif
 
@@ -1275,10 +1613,32 @@ static void send_headers(unsigned responseNum)
 				infoString
 		);
 	}
+	return len;
+}
+
+/*
+ * Create and send HTTP response headers.
+ * The arguments are combined and sent as one write operation.  Note that
+ * IE will puke big-time if the headers are not sent in one packet and the
+ * second packet is delayed for any reason.
+ * responseNum - the result code to send.
+ */
+static void send_headers(unsigned responseNum)
+{
+	const char *error_page;
+	unsigned len = build_headers(responseNum, &error_page);
+
 	if (DEBUG) {
 		iobuf[len] = '\0';
 		fprintf(stderr, "headers: '%s'\n", iobuf);
 	}
+#if ENABLE_FEATURE_HTTPD_ERROR_PAGES
+	if (error_page) {
+		full_write(STDOUT_FILENO, iobuf, len);
+		dbg("writing error page: '%s'\n", error_page);
+		send_file_and_exit(error_page, SEND_BODY);
+	}
+#endif
 	if (full_write(STDOUT_FILENO, iobuf, len) != len) {
 		if (verbose > 1)
 			bb_simple_perror_msg("error");
@@ -1529,6 +1889,26 @@ static void setenv1(const char *name, const char *value)
 	setenv(name, value ? value : "", 1);
 }
 
+#if ENABLE_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR
+/* "*.ext:/path/interpreter" line for the suffix of path, if any */
+static Htaccess *find_script_interpr(const char *path)
+{
+	const char *suffix = strrchr(path, '.');
+	conf_node *n;
+
+	if (suffix) {
+		for (n = G.conf_dir; n; n = n->parent) {
+			Htaccess *cur;
+			for (cur = n->script_i; cur; cur = cur->next) {
+				if (strcmp(cur->before_colon + 1, suffix) == 0)
+					return cur;
+			}
+		}
+	}
+	return NULL;
+}
+#endif
+
 /*
  * Spawn CGI script, forward CGI's stdin/out <=> network
  *
@@ -1680,19 +2060,12 @@ static void send_cgi_and_exit(
 
 #if ENABLE_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR
 		{
-			char *suffix = strrchr(script, '.');
-
-			if (suffix) {
-				Htaccess *cur;
-				for (cur = script_i; cur; cur = cur->next) {
-					if (strcmp(cur->before_colon + 1, suffix) == 0) {
-						/* found interpreter name */
-						argv[0] = cur->after_colon;
-						argv[1] = script;
-						argv[2] = NULL;
-						break;
-					}
-				}
+			Htaccess *cur = find_script_interpr(script);
+			if (cur) {
+				/* found interpreter name */
+				argv[0] = cur->after_colon;
+				argv[1] = script;
+				argv[2] = NULL;
 			}
 		}
 #endif
@@ -1729,63 +2102,13 @@ static void send_cgi_and_exit(
 #endif          /* FEATURE_HTTPD_CGI */
 
 /*
- * Send a file response to a HTTP request, and exit
- *
- * Parameters:
- * const char *url  The requested URL (with leading /).
- * what             What to send (headers/body/both).
+ * Set found_mime_type from the suffix of url.
  */
-static NOINLINE void send_file_and_exit(const char *url, int what)
+static void find_mime_type(const char *url)
 {
-	char *suffix;
-	int fd;
-	ssize_t count;
-
-	if (content_gzip) {
-		/* does <url>.gz exist? Then use it instead */
-		char *gzurl = xasprintf("%s.gz", url);
-		fd = open(gzurl, O_RDONLY);
-		free(gzurl);
-		if (fd != -1) {
-			struct stat sb;
-			fstat(fd, &sb);
-			file_size = sb.st_size;
-			last_mod = sb.st_mtime;
-		} else {
-			IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
-			fd = open(url, O_RDONLY);
-		}
-	} else {
-		fd = open(url, O_RDONLY);
-		/* file_size and last_mod are already populated */
-	}
-	if (fd < 0) {
-		dbg("can't open '%s'\n", url);
-		/* Error pages are sent by using send_file_and_exit(SEND_BODY).
-		 * IOW: it is unsafe to call send_headers_and_exit
-		 * if what is SEND_BODY! Can recurse! */
-		if (what != SEND_BODY)
-			send_headers_and_exit(HTTP_NOT_FOUND);
-		log_and_exit();
-	}
-#if ENABLE_FEATURE_HTTPD_ETAG
-	/* ETag is "hex(last_mod)-hex(file_size)" e.g. "5e132e20-417" */
-	sprintf(G.etag, "\"%llx-%llx\"", (unsigned long long)last_mod, (unsigned long long)file_size);
-
-	if (G.if_none_match) {
-		dbg("If-None-Match:'%s' file's ETag:'%s'\n", G.if_none_match, G.etag);
-		/* Weak ETag comparision.
-		 * If-None-Match may have many ETags but they are quoted so we can use simple substring search */
-		if (strstr(G.if_none_match, G.etag))
-			send_headers_and_exit(HTTP_NOT_MODIFIED);
-	}
-#endif
-	/* If you want to know about EPIPE below
-	 * (happens if you abort downloads from local httpd): */
-	signal(SIGPIPE, SIG_IGN);
+	const char *suffix;
 
 	/* If not found, default is to not send "Content-type:" */
-	/*found_mime_type = NULL; - already is */
 	suffix = strrchr(url, '.');
 	if (suffix) {
 		static const char suffixTable[] ALIGN1 =
@@ -1815,7 +2138,7 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 #endif
 			/* compiler adds another "\0" here */
 		;
-		Htaccess *cur;
+		conf_node *n;
 
 		/* Examine built-in table */
 		const char *table = suffixTable;
@@ -1840,48 +2163,127 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 			 * and we stop the search: */
 			break;
 		}
-		/* ...then user's table */
-		for (cur = mime_a; cur; cur = cur->next) {
-			if (strcmp(cur->before_colon, suffix) == 0) {
-				found_mime_type = cur->after_colon;
-				break;
+		/* ...then user's tables, deepest directory first */
+		for (n = G.conf_dir; n; n = n->parent) {
+			Htaccess *cur;
+			for (cur = n->mime_a; cur; cur = cur->next) {
+				if (strcmp(cur->before_colon, suffix) == 0) {
+					found_mime_type = cur->after_colon;
+					return;
+				}
 			}
 		}
 	}
+}
 
-	dbg("sending file '%s' content-type:%s\n", url, found_mime_type);
-
-#if ENABLE_FEATURE_HTTPD_RANGES
-	if (what == SEND_BODY /* err pages and ranges don't mix */
-	 || content_gzip /* we are sending compressed page: can't do ranges */  ///why?
-	) {
-		range_start = -1;
-	}
-	range_len = MAXINT(off_t);
-	if (range_start >= 0) {
-		if (!range_end || range_end > file_size - 1) {
-			range_end = file_size - 1;
-		}
-		if (range_end < range_start
-		 || lseek(fd, range_start, SEEK_SET) != range_start
-		) {
-			lseek(fd, 0, SEEK_SET);
-			range_start = -1;
-		} else {
-			range_len = range_end - range_start + 1;
-			send_headers(HTTP_PARTIAL_CONTENT);
-			what = SEND_BODY;
+/*
+ * Open url, or url.gz instead if the client takes gzip
+ * and it exists (file_size and last_mod are updated then).
+ */
+static int open_file(const char *url)
+{
+	if (content_gzip) {
+		/* does <url>.gz exist? Then use it instead */
+		char *gzurl = xasprintf("%s.gz", url);
+		int fd = open(gzurl, O_RDONLY);
+		free(gzurl);
+		if (fd != -1) {
+			struct stat sb;
+			fstat(fd, &sb);
+			file_size = sb.st_size;
+			last_mod = sb.st_mtime;
+			return fd;
 		}
+		IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
 	}
-#endif
-	if (what & SEND_HEADERS)
-		send_headers(HTTP_OK);
-#if ENABLE_FEATURE_USE_SENDFILE
-	{
-		off_t offset;
-# if ENABLE_FEATURE_HTTPD_RANGES
-		if (range_start < 0)
-			range_start = 0;
+	/* else file_size and last_mod are already populated */
+	return open(url, O_RDONLY);
+}
+
+/*
+ * Send a file response to a HTTP request, and exit
+ *
+ * Parameters:
+ * const char *url  The requested URL (with leading /).
+ * what             What to send (headers/body/both).
+ */
+static NOINLINE void send_file_and_exit(const char *url, int what)
+{
+	int fd;
+	ssize_t count;
+	IF_FEATURE_HTTPD_KEEPALIVE(off_t sent = 0;)
+
+	fd = open_file(url);
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* log_and_exit() may jump to the next request:
+	 * reset_request_state() closes fd then. If we are sending
+	 * an error page instead of a file, that file is done with */
+	if (G.file_fd >= 0)
+		close(G.file_fd);
+	G.file_fd = fd;
+#endif
+	if (fd < 0) {
+		dbg("can't open '%s'\n", url);
+		/* Error pages are sent by using send_file_and_exit(SEND_BODY).
+		 * IOW: it is unsafe to call send_headers_and_exit
+		 * if what is SEND_BODY! Can recurse! */
+		if (what != SEND_BODY)
+			send_headers_and_exit(HTTP_NOT_FOUND);
+		log_and_exit();
+	}
+#if ENABLE_FEATURE_HTTPD_ETAG
+	/* ETag is "hex(last_mod)-hex(file_size)" e.g. "5e132e20-417" */
+	sprintf(G.etag, "\"%llx-%llx\"", (unsigned long long)last_mod, (unsigned long long)file_size);
+
+	if (G.if_none_match) {
+		dbg("If-None-Match:'%s' file's ETag:'%s'\n", G.if_none_match, G.etag);
+		/* Weak ETag comparision.
+		 * If-None-Match may have many ETags but they are quoted so we can use simple substring search */
+		if (strstr(G.if_none_match, G.etag))
+			send_headers_and_exit(HTTP_NOT_MODIFIED);
+	}
+#endif
+	/* If you want to know about EPIPE below
+	 * (happens if you abort downloads from local httpd): */
+	signal(SIGPIPE, SIG_IGN);
+
+	find_mime_type(url);
+
+	dbg("sending file '%s' content-type:%s\n", url, found_mime_type);
+
+#if ENABLE_FEATURE_HTTPD_RANGES
+	if (what == SEND_BODY /* err pages and ranges don't mix */
+	 || content_gzip /* we are sending compressed page: can't do ranges */  ///why?
+	) {
+		range_start = -1;
+	}
+	range_len = MAXINT(off_t);
+	if (range_start >= 0) {
+		if (!range_end || range_end > file_size - 1) {
+			range_end = file_size - 1;
+		}
+		if (range_end < range_start
+		 || lseek(fd, range_start, SEEK_SET) != range_start
+		) {
+			lseek(fd, 0, SEEK_SET);
+			range_start = -1;
+		} else {
+			range_len = range_end - range_start + 1;
+			send_headers(HTTP_PARTIAL_CONTENT);
+			what = SEND_BODY;
+		}
+	}
+#endif
+	if (what & SEND_HEADERS)
+		send_headers(HTTP_OK);
+	if (!(what & SEND_BODY)) /* HEAD */
+		log_and_exit();
+#if ENABLE_FEATURE_USE_SENDFILE
+	{
+		off_t offset;
+# if ENABLE_FEATURE_HTTPD_RANGES
+		if (range_start < 0)
+			range_start = 0;
 		offset = range_start;
 # else
 		offset = 0;
@@ -1897,8 +2299,9 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 				goto fin;
 			}
 			IF_FEATURE_HTTPD_RANGES(range_len -= count;)
+			IF_FEATURE_HTTPD_KEEPALIVE(sent += count;)
 			if (count == 0 || range_len == 0)
-				log_and_exit();
+				goto done;
 		}
 	}
 #endif
@@ -1909,6 +2312,7 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 		if (count != n)
 			break;
 		IF_FEATURE_HTTPD_RANGES(range_len -= count;)
+		IF_FEATURE_HTTPD_KEEPALIVE(sent += count;)
 		if (range_len == 0)
 			break;
 	}
@@ -1917,38 +2321,66 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 		if (verbose > 1)
 			bb_simple_perror_msg("error");
 	}
+ IF_FEATURE_USE_SENDFILE(done:)
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* Short body (I/O error, file shrank): the peer
+	 * would wait for the rest, only closing can help */
+	if (sent != file_size)
+		G.keepalive = 0;
+#endif
 	log_and_exit();
 }
 
 #if ENABLE_FEATURE_HTTPD_ACL_IP
-static void if_ip_denied_send_HTTP_FORBIDDEN_and_exit(unsigned remote_ip)
+static unsigned remote_ipv4(const len_and_sockaddr *fromAddr)
 {
-	Htaccess_IP *cur;
+	if (fromAddr->u.sa.sa_family == AF_INET) {
+		return ntohl(fromAddr->u.sin.sin_addr.s_addr);
+	}
+# if ENABLE_FEATURE_IPV6
+	if (fromAddr->u.sa.sa_family == AF_INET6
+	 && fromAddr->u.sin6.sin6_addr.s6_addr32[0] == 0
+	 && fromAddr->u.sin6.sin6_addr.s6_addr32[1] == 0
+	 && ntohl(fromAddr->u.sin6.sin6_addr.s6_addr32[2]) == 0xffff)
+		return ntohl(fromAddr->u.sin6.sin6_addr.s6_addr32[3]);
+# endif
+	return 0;
+}
 
-	for (cur = G.ip_a_d; cur; cur = cur->next) {
-		dbg("checkPermIP: '%s' ? '%u.%u.%u.%u/%u.%u.%u.%u'\n",
-			rmt_ip_str,
-			(unsigned char)(cur->ip >> 24),
-			(unsigned char)(cur->ip >> 16),
-			(unsigned char)(cur->ip >> 8),
-			(unsigned char)(cur->ip),
-			(unsigned char)(cur->mask >> 24),
-			(unsigned char)(cur->mask >> 16),
-			(unsigned char)(cur->mask >> 8),
-			(unsigned char)(cur->mask)
-		);
-		if ((remote_ip & cur->mask) == cur->ip) {
-			if (cur->allow_deny == 'A')
-				return;
-			send_headers_and_exit(HTTP_FORBIDDEN);
+/* Do allow/deny rules of n or of any of its parents deny remote_ip? */
+static int is_ip_denied(const conf_node *n, unsigned remote_ip)
+{
+	for (; n; n = n->parent) {
+		const ip_range *t = n->ip_table;
+		unsigned lo, hi;
+
+		if (!t)
+			continue;
+		/* find the last range with first <= remote_ip, t[0].first is 0 */
+		lo = 0;
+		hi = n->ip_count;
+		while (hi - lo > 1) {
+			unsigned mid = (lo + hi) / 2;
+			if (t[mid].first <= remote_ip)
+				lo = mid;
+			else
+				hi = mid;
 		}
+		dbg("checkPermIP: '%s' in range from %08x: %s\n",
+			rmt_ip_str, t[lo].first, t[lo].deny ? "deny" : "allow");
+		if (t[lo].deny)
+			return 1;
 	}
+	return 0;
+}
 
-	if (flg_deny_all) /* depends on whether we saw "D:*" */
+static void if_ip_denied_send_HTTP_FORBIDDEN_and_exit(const conf_node *n, unsigned remote_ip)
+{
+	if (is_ip_denied(n, remote_ip))
 		send_headers_and_exit(HTTP_FORBIDDEN);
 }
 #else
-# define if_ip_denied_send_HTTP_FORBIDDEN_and_exit(arg) ((void)0)
+# define if_ip_denied_send_HTTP_FORBIDDEN_and_exit(n, arg) ((void)0)
 #endif
 
 #if ENABLE_FEATURE_HTTPD_BASIC_AUTH
@@ -2002,8 +2434,33 @@ static int pam_talker(int num_msg,
 }
 # endif
 
+/* "/path:user:pass" lines of the longest path which is a prefix of path */
+static Htaccess *find_auth(const char *path)
+{
+	conf_node *n = G.conf_root;
+	Htaccess *auth = n->auth;
+
+	while (1) {
+		const char *end;
+
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+		end = strchrnul(path, '/');
+		n = conf_child(n, path, end - path, /*create:*/ 0);
+		if (!n)
+			break;
+		if (n->auth)
+			auth = n->auth;
+		path = end;
+	}
+	return auth;
+}
+
 /*
  * Config file entries are of the form "/<path>:<user>:<passwd>".
+ * Only entries of the longest <path> which is a prefix of path are used.
  * If config file has no prefix match for path, access is allowed.
  *
  * path                 The file path
@@ -2014,34 +2471,12 @@ static int pam_talker(int num_msg,
 static int check_user_passwd(const char *path, char *user_and_passwd)
 {
 	Htaccess *cur;
-	const char *prev = NULL;
+	Htaccess *auth = find_auth(path);
 
-	for (cur = g_auth; cur; cur = cur->next) {
-		const char *dir_prefix;
-		size_t len;
+	for (cur = auth; cur; cur = cur->next) {
 		int r;
 
-		dir_prefix = cur->before_colon;
-
-		/* WHY? */
-		/* If already saw a match, don't accept other different matches */
-		if (prev && strcmp(prev, dir_prefix) != 0)
-			continue;
-
-		dbg("checkPerm: '%s' ? '%s'\n", dir_prefix, user_and_passwd);
-
-		/* If it's not a prefix match, continue searching */
-		len = strlen(dir_prefix);
-		if (len != 1 /* dir_prefix "/" matches all, don't need to check */
-		 && (strncmp(dir_prefix, path, len) != 0
-		    || (path[len] != '/' && path[len] != '\0')
-		    )
-		) {
-			continue;
-		}
-
-		/* Path match found */
-		prev = dir_prefix;
+		dbg("checkPerm: '%s' ? '%s'\n", cur->before_colon, user_and_passwd);
 
 		if (ENABLE_FEATURE_HTTPD_AUTH_MD5) {
 			char *colon_after_user;
@@ -2147,8 +2582,8 @@ static int check_user_passwd(const char *path, char *user_and_passwd)
 		}
 	} /* for */
 
-	/* 0(bad) if prev is set: matches were found but passwd was wrong */
-	return (prev == NULL);
+	/* 0(bad) if matches were found but passwd was wrong */
+	return (auth == NULL);
 }
 #endif  /* FEATURE_HTTPD_BASIC_AUTH */
 
@@ -2167,6 +2602,80 @@ static Htaccess_Proxy *find_proxy_entry(const char *url)
 /*
  * Handle timeouts
  */
+/*
+ * Canonicalize URL path in place.
+ * Algorithm stolen from libbb bb_simplify_path(),
+ * but don't strdup, retain trailing slash, protect root.
+ * Returns pointer to the terminating NUL, or NULL for "/.." paths.
+ */
+static char *canonicalize_url(char *urlcopy)
+{
+	char *urlp;
+	char *tptr;
+
+	urlp = tptr = urlcopy;
+	while (1) {
+		if (*urlp == '/') {
+			/* skip duplicate (or initial) slash */
+			if (*tptr == '/') {
+				goto next_char;
+			}
+			if (*tptr == '.') {
+				if (tptr[1] == '.' && (tptr[2] == '/' || tptr[2] == '\0')) {
+					/* "..": be careful */
+					/* protect root */
+					if (urlp == urlcopy)
+						return NULL;
+					/* omit previous dir */
+					while (*--urlp != '/')
+						continue;
+					/* skip to "./" or ".<NUL>" */
+					tptr++;
+				}
+				if (tptr[1] == '/' || tptr[1] == '\0') {
+					/* skip extra "/./" */
+					goto next_char;
+				}
+			}
+		}
+		*++urlp = *tptr;
+		if (*tptr == '\0')
+			break;
+ next_char:
+		tptr++;
+	}
+	return urlp;
+}
+
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+/*
+ * Forget everything learned from the previous request on this connection.
+ */
+static void reset_request_state(void)
+{
+	G.keepalive = 0;
+	if (G.file_fd >= 0) {
+		close(G.file_fd);
+		G.file_fd = -1;
+	}
+	found_mime_type = NULL;
+	found_moved_temporarily = NULL;
+	file_size = -1;
+	g_query = NULL;
+	IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
+	IF_FEATURE_HTTPD_RANGES(range_start = -1;)
+	IF_FEATURE_HTTPD_RANGES(range_end = 0;)
+# if ENABLE_FEATURE_HTTPD_ETAG
+	free(G.if_none_match);
+	G.if_none_match = NULL;
+# endif
+# if ENABLE_FEATURE_HTTPD_BASIC_AUTH
+	free(remoteuser);
+	remoteuser = NULL;
+# endif
+}
+#endif
+
 static void send_REQUEST_TIMEOUT_and_exit(int sig) NORETURN;
 static void send_REQUEST_TIMEOUT_and_exit(int sig UNUSED_PARAM)
 {
@@ -2226,23 +2735,41 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 			bb_simple_error_msg("connected");
 	}
 #if ENABLE_FEATURE_HTTPD_ACL_IP
-	remote_ip = 0;
-	if (fromAddr->u.sa.sa_family == AF_INET) {
-		remote_ip = ntohl(fromAddr->u.sin.sin_addr.s_addr);
-	}
-# if ENABLE_FEATURE_IPV6
-	if (fromAddr->u.sa.sa_family == AF_INET6
-	 && fromAddr->u.sin6.sin6_addr.s6_addr32[0] == 0
-	 && fromAddr->u.sin6.sin6_addr.s6_addr32[1] == 0
-	 && ntohl(fromAddr->u.sin6.sin6_addr.s6_addr32[2]) == 0xffff)
-		remote_ip = ntohl(fromAddr->u.sin6.sin6_addr.s6_addr32[3]);
-# endif
-	if_ip_denied_send_HTTP_FORBIDDEN_and_exit(remote_ip);
+	remote_ip = remote_ipv4(fromAddr);
+	if_ip_denied_send_HTTP_FORBIDDEN_and_exit(G.conf_root, remote_ip);
 #endif
 
 	/* Install timeout handler. get_line() needs it. */
 	signal(SIGALRM, send_REQUEST_TIMEOUT_and_exit);
 
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* Headers and a small body go out in separate writes,
+	 * don't let Nagle hold back the second one */
+	setsockopt_1(STDOUT_FILENO, IPPROTO_TCP, TCP_NODELAY);
+	/* -E hands off connections with some requests served already */
+	if (G.requests_left == 0)
+		G.requests_left = KEEPALIVE_MAX_REQUESTS;
+	if (setjmp(G.next_request)) {
+		/* Previous response is sent, forget its state.
+		 * Pipelined requests may be waiting in hdr_buf already */
+		reset_request_state();
+		IF_FEATURE_HTTPD_BASIC_AUTH(authorized = -1;)
+# if ENABLE_FEATURE_HTTPD_CGI
+		cgi_type = CGI_NONE;
+# endif
+		if (hdr_cnt <= 0) {
+			struct pollfd pfd[1];
+			pfd[0].fd = STDIN_FILENO;
+			pfd[0].events = POLLIN;
+			if (safe_poll(pfd, 1, KEEPALIVE_TIMEOUT * 1000) <= 0) {
+				if (verbose > 2)
+					bb_simple_error_msg("idle, closing");
+				log_and_exit();
+			}
+		}
+	}
+#endif
+
 	if (!get_line()) { /* EOF or error or empty line */
 		/* Observed Firefox to "speculatively" open
 		 * extra connections to a new site on first access,
@@ -2276,6 +2803,11 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 	if (!HTTP_slash || strncmp(HTTP_slash + 1, HTTP_200, 5) != 0)
 		send_headers_and_exit(HTTP_BAD_REQUEST);
 	*HTTP_slash++ = '\0';
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* HTTP/1.1 connections are persistent unless the client says otherwise */
+	if (--G.requests_left != 0)
+		G.keepalive = (strcmp(HTTP_slash + 5, "1.0") != 0);
+#endif
 
 #if ENABLE_FEATURE_HTTPD_PROXY
 	proxy_entry = find_proxy_entry(urlp);
@@ -2285,6 +2817,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 
 		if (verbose > 1)
 			bb_error_msg("proxy:%s", urlp);
+		IF_FEATURE_HTTPD_KEEPALIVE(G.keepalive = 0;)
 		lsa = host2sockaddr(proxy_entry->host_port, 80);
 		if (!lsa)
 			send_headers_and_exit(HTTP_INTERNAL_SERVER_ERROR);
@@ -2329,7 +2862,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 #endif
  found:
 	/* Copy URL to stack-allocated char[] */
-	urlcopy = alloca((HTTP_slash - urlp) + 2 + strlen(index_page));
+	urlcopy = alloca((HTTP_slash - urlp) + 2 + MAX_CONF_LINE);
 	strcpy(urlcopy, urlp);
 	/* NB: urlcopy ptr is never changed after this */
 
@@ -2348,53 +2881,17 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 	}
 
 	/* Canonicalize path */
-	/* Algorithm stolen from libbb bb_simplify_path(),
-	 * but don't strdup, retain trailing slash, protect root */
-	urlp = tptr = urlcopy;
-	while (1) {
-		if (*urlp == '/') {
-			/* skip duplicate (or initial) slash */
-			if (*tptr == '/') {
-				goto next_char;
-			}
-			if (*tptr == '.') {
-				if (tptr[1] == '.' && (tptr[2] == '/' || tptr[2] == '\0')) {
-					/* "..": be careful */
-					/* protect root */
-					if (urlp == urlcopy)
-						send_headers_and_exit(HTTP_BAD_REQUEST);
-					/* omit previous dir */
-					while (*--urlp != '/')
-						continue;
-					/* skip to "./" or ".<NUL>" */
-					tptr++;
-				}
-				if (tptr[1] == '/' || tptr[1] == '\0') {
-					/* skip extra "/./" */
-					goto next_char;
-				}
-			}
-		}
-		*++urlp = *tptr;
-		if (*tptr == '\0')
-			break;
- next_char:
-		tptr++;
-	}
+	urlp = canonicalize_url(urlcopy);
+	if (!urlp)
+		send_headers_and_exit(HTTP_BAD_REQUEST);
 
 	/* Log it */
 	if (verbose > 1)
 		bb_error_msg("url:%s", urlcopy);
 
-	tptr = urlcopy;
-	while ((tptr = strchr(tptr + 1, '/')) != NULL) {
-		/* have path1/path2 */
-		*tptr = '\0';
-		/* may have subdir config */
-		if (parse_conf(urlcopy + 1, SUBDIR_PARSE) == 0)
-			if_ip_denied_send_HTTP_FORBIDDEN_and_exit(remote_ip);
-		*tptr = '/';
-	}
+	/* Rules of the directory (from subdir httpd.conf files) */
+	G.conf_dir = find_dir_conf(urlcopy);
+	if_ip_denied_send_HTTP_FORBIDDEN_and_exit(G.conf_dir, remote_ip);
 
 	tptr = urlcopy + 1;      /* skip first '/' */
 
@@ -2416,7 +2913,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		 */
 		if (ENABLE_FEATURE_HTTPD_CGI)
 			g_query = xstrdup(g_query); /* ok for NULL too */
-		strcpy(urlp, index_page);
+		strcpy(urlp, conf_index_page(G.conf_dir));
 	}
 	if (stat(tptr, &sb) == 0) {
 		/* If URL is a directory with no slash, set up
@@ -2425,16 +2922,8 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 			found_moved_temporarily = urlcopy;
 		} else {
 #if ENABLE_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR
-			char *suffix = strrchr(tptr, '.');
-			if (suffix) {
-				Htaccess *cur;
-				for (cur = script_i; cur; cur = cur->next) {
-					if (strcmp(cur->before_colon + 1, suffix) == 0) {
-						cgi_type = CGI_INTERPRETER;
-						break;
-					}
-				}
-			}
+			if (find_script_interpr(tptr))
+				cgi_type = CGI_INTERPRETER;
 #endif
 			file_size = sb.st_size;
 			last_mod = sb.st_mtime;
@@ -2538,6 +3027,21 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 			continue;
 		}
 #endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+		if (STRNCASECMP(iobuf, "Connection:") == 0) {
+			if (strcasestr(iobuf, "close"))
+				G.keepalive = 0;
+			else if (strcasestr(iobuf, "keep-alive") && G.requests_left != 0)
+				G.keepalive = 1;
+		}
+		/* We don't read request bodies of files, a body would be
+		 * taken for the next request. CGI does read it, but closes */
+		if (STRNCASECMP(iobuf, "Content-Length:") == 0
+		 || STRNCASECMP(iobuf, "Transfer-Encoding:") == 0
+		) {
+			G.keepalive = 0;
+		}
+#endif
 #if ENABLE_FEATURE_HTTPD_ETAG
 		if (STRNCASECMP(iobuf, "If-None-Match:") == 0) {
 			free(G.if_none_match);
@@ -2597,6 +3101,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 
 #if ENABLE_FEATURE_HTTPD_CGI
 	if (cgi_type != CGI_NONE) {
+		IF_FEATURE_HTTPD_KEEPALIVE(G.keepalive = 0;)
 		send_cgi_and_exit(
 			(cgi_type == CGI_INDEX) ? "/cgi-bin/index.cgi"
 			/*CGI_NORMAL or CGI_INTERPRETER*/ : urlcopy,
@@ -2617,7 +3122,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 #if ENABLE_FEATURE_HTTPD_BASIC_AUTH
 	/* Restore truncated .../index.html */
 	if (urlp[-1] == '/')
-		urlp[0] = index_page[0];
+		urlp[0] = conf_index_page(G.conf_dir)[0];
 #endif
 	send_file_and_exit(urlcopy + 1,
 		(prequest != request_HEAD ? (SEND_HEADERS + SEND_BODY) : SEND_HEADERS)
@@ -2643,6 +3148,11 @@ static void mini_httpd(int server_socket)
 		int n;
 		len_and_sockaddr fromAddr;
 
+		if (bb_got_signal == SIGHUP) {
+			bb_got_signal = 0;
+			load_conf(SIGNALED_PARSE);
+		}
+
 		/* Wait for connections... */
 		fromAddr.len = LSA_SIZEOF_SA;
 		n = accept(server_socket, &fromAddr.u.sa, &fromAddr.len);
@@ -2692,6 +3202,11 @@ static void mini_httpd_nommu(int server_socket, int argc, char **argv)
 	while (1) {
 		int n;
 
+		if (bb_got_signal == SIGHUP) {
+			bb_got_signal = 0;
+			load_conf(SIGNALED_PARSE);
+		}
+
 		/* Wait for connections... */
 		n = accept(server_socket, NULL, NULL);
 		if (n < 0)
@@ -2719,6 +3234,727 @@ static void mini_httpd_nommu(int server_socket, int argc, char **argv)
 }
 #endif
 
+#if ENABLE_FEATURE_HTTPD_EVENT
+/*
+ * Non-forking server for static files (-E N).
+ * Each of N processes runs an epoll loop over the shared listening
+ * socket and its own connections. GET and HEAD of a plain file are
+ * answered right in the loop with nonblocking sendfile(). Anything
+ * else (CGI, proxy, auth, ranges, errors...) is
+ * handed to a forked child which continues with handle_incoming_and_exit()
+ * on the bytes read so far, exactly as in forking mode.
+ */
+enum {
+	/* Requests with longer headers are handed off */
+	EV_BUF_SIZE = 4 * 1024,
+	EV_MAX_EVENTS = 64,
+};
+
+/*
+ * Cache of open files. Hot files are served without any stat(),
+ * open() or access() calls: an entry is rechecked with stat() at most
+ * once a second (FILE_CACHE_VALID) and the whole cache is dropped
+ * on SIGHUP, since it remembers results of config lookups too.
+ */
+enum {
+	FILE_CACHE_SIZE = 256,  /* files (up to twice as many fds, with .gz) */
+	FILE_CACHE_HASH = 256,
+	FILE_CACHE_VALID = 1,   /* seconds */
+};
+
+struct file_variant {
+	int fd;                 /* -1: no such file (.gz) */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	/* "200 OK" headers, valid while Date: and Connection: are the same */
+	char *hdr;
+	unsigned hdr_len;
+	time_t hdr_time;
+	smallint hdr_keepalive;
+};
+
+struct file_entry {
+	struct file_entry *hash_next;
+	struct file_entry *lru_prev;
+	struct file_entry *lru_next;
+	unsigned refcnt;        /* 1 for being in cache + number of senders */
+	unsigned checked;       /* monotonic_sec() of last check */
+	const char *mime_type;
+	struct file_variant var[2]; /* [0]: file, [1]: file.gz */
+	char url[1];            /* "/path/file", really bigger */
+};
+
+struct ev_conn {
+	unsigned deadline;
+	unsigned in_len;        /* bytes in in[] */
+	char *out;              /* unsent response headers */
+	unsigned out_pos;
+	unsigned out_len;
+	struct file_entry *fe;  /* file being sent, or NULL */
+	int file_fd;            /* fd of fe's variant being sent */
+	off_t file_pos;
+	off_t file_end;
+	smallint keepalive;     /* read next request after this response */
+	unsigned requests_left; /* KEEPALIVE_MAX_REQUESTS, minus requests served */
+	smallint want_out;      /* waiting for EPOLLOUT, not EPOLLIN */
+	len_and_sockaddr peer;
+	char in[EV_BUF_SIZE];
+};
+
+enum {
+	EV_NEED_MORE,
+	EV_HAND_OFF,
+	EV_RESPOND,
+};
+
+static unsigned file_cache_hash(const char *url)
+{
+	unsigned h = 0;
+	while (*url)
+		h = h * 31 + (unsigned char)*url++;
+	return h % FILE_CACHE_HASH;
+}
+
+static void file_entry_put(struct file_entry *fe)
+{
+	int i;
+
+	if (--fe->refcnt != 0)
+		return;
+	for (i = 0; i < 2; i++) {
+		if (fe->var[i].fd >= 0)
+			close(fe->var[i].fd);
+		free(fe->var[i].hdr);
+	}
+	free(fe);
+}
+
+static void file_cache_drop(struct file_entry *fe)
+{
+	struct file_entry **pp = &G.fc_hash[file_cache_hash(fe->url)];
+
+	while (*pp != fe)
+		pp = &(*pp)->hash_next;
+	*pp = fe->hash_next;
+	if (fe->lru_prev)
+		fe->lru_prev->lru_next = fe->lru_next;
+	else
+		G.fc_lru_head = fe->lru_next;
+	if (fe->lru_next)
+		fe->lru_next->lru_prev = fe->lru_prev;
+	else
+		G.fc_lru_tail = fe->lru_prev;
+	G.fc_count--;
+	/* Still open if a connection is sending it */
+	file_entry_put(fe);
+}
+
+static void file_cache_flush(void)
+{
+	while (G.fc_lru_head)
+		file_cache_drop(G.fc_lru_head);
+}
+
+/* Open name, and fill v if it is a regular file */
+static int file_variant_open(struct file_variant *v, const char *name)
+{
+	struct stat sb;
+
+	v->fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (v->fd < 0)
+		return 0;
+	if (fstat(v->fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+		close(v->fd);
+		v->fd = -1;
+		return 0;
+	}
+	v->dev = sb.st_dev;
+	v->ino = sb.st_ino;
+	v->size = sb.st_size;
+	v->mtime = sb.st_mtime;
+	return 1;
+}
+
+/* Is name still the file we have open in v? */
+static int file_variant_valid(struct file_variant *v, const char *name)
+{
+	struct stat sb;
+
+	if (stat(name, &sb) != 0 || !S_ISREG(sb.st_mode))
+		return v->fd < 0;
+	return v->fd >= 0
+		&& v->dev == sb.st_dev && v->ino == sb.st_ino
+		&& v->size == sb.st_size && v->mtime == sb.st_mtime;
+}
+
+static struct file_entry *file_cache_find(const char *url)
+{
+	struct file_entry *fe;
+	unsigned now;
+
+	for (fe = G.fc_hash[file_cache_hash(url)]; fe; fe = fe->hash_next)
+		if (strcmp(fe->url, url) == 0)
+			break;
+	if (!fe)
+		return NULL;
+
+	now = monotonic_sec();
+	if (fe->checked != now) {
+		char *gz = xasprintf("%s.gz", fe->url + 1);
+		int ok = file_variant_valid(&fe->var[0], fe->url + 1)
+			&& (!ENABLE_FEATURE_HTTPD_GZIP || file_variant_valid(&fe->var[1], gz));
+		free(gz);
+		if (!ok) {
+			file_cache_drop(fe);
+			return NULL;
+		}
+		fe->checked = now;
+	}
+
+	/* Move to the head of LRU list */
+	if (fe->lru_prev) {
+		fe->lru_prev->lru_next = fe->lru_next;
+		if (fe->lru_next)
+			fe->lru_next->lru_prev = fe->lru_prev;
+		else
+			G.fc_lru_tail = fe->lru_prev;
+		fe->lru_prev = NULL;
+		fe->lru_next = G.fc_lru_head;
+		G.fc_lru_head->lru_prev = fe;
+		G.fc_lru_head = fe;
+	}
+	return fe;
+}
+
+/*
+ * Open the file for url (and url.gz), remember it in the cache.
+ * Returns NULL if url is not a plain file which can be served
+ * without forking.
+ */
+static struct file_entry *file_cache_add(const char *url)
+{
+	struct file_entry *fe;
+	unsigned h;
+
+	fe = xzalloc(sizeof(*fe) + strlen(url));
+	strcpy(fe->url, url);
+	fe->var[1].fd = -1;
+	if (!file_variant_open(&fe->var[0], url + 1)) {
+		free(fe);
+		return NULL;
+	}
+#if ENABLE_FEATURE_HTTPD_GZIP
+	{
+		char *gz = xasprintf("%s.gz", url + 1);
+		file_variant_open(&fe->var[1], gz);
+		free(gz);
+	}
+#endif
+	found_mime_type = NULL;
+	find_mime_type(url + 1);
+	fe->mime_type = found_mime_type;
+	fe->checked = monotonic_sec();
+	fe->refcnt = 1;
+
+	if (G.fc_count >= FILE_CACHE_SIZE)
+		file_cache_drop(G.fc_lru_tail);
+	G.fc_count++;
+	h = file_cache_hash(url);
+	fe->hash_next = G.fc_hash[h];
+	G.fc_hash[h] = fe;
+	fe->lru_next = G.fc_lru_head;
+	if (G.fc_lru_head)
+		G.fc_lru_head->lru_prev = fe;
+	else
+		G.fc_lru_tail = fe;
+	G.fc_lru_head = fe;
+	return fe;
+}
+
+static void ev_close(int fd)
+{
+	struct ev_conn *c = G.ev_conn[fd];
+
+	if (c->fe)
+		file_entry_put(c->fe);
+	free(c->out);
+	free(c);
+	G.ev_conn[fd] = NULL;
+	close(fd); /* removes it from epoll set too */
+}
+
+/* Let a forked child serve this connection the usual way */
+static void ev_hand_off(int fd)
+{
+	struct ev_conn *c = G.ev_conn[fd];
+
+	if (fork() == 0) {
+		/* child */
+		unsigned i;
+
+		struct file_entry *fe;
+
+		close(G.ev_fd);
+		for (i = 0; i < G.ev_conn_size; i++) {
+			if (i != (unsigned)fd && G.ev_conn[i]) {
+				close(i);
+				if (G.ev_conn[i]->fe)
+					close(G.ev_conn[i]->file_fd);
+			}
+		}
+		for (fe = G.fc_lru_head; fe; fe = fe->lru_next) {
+			close(fe->var[0].fd);
+			close(fe->var[1].fd);
+		}
+		close(G.server_socket);
+		signal(SIGHUP, SIG_IGN);
+		signal(SIGPIPE, SIG_DFL);
+		xmove_fd(fd, 0);
+		xdup2(0, 1);
+		ndelay_off(0);
+		/* What we have read already is the start of the request */
+		reset_request_state();
+		G.requests_left = c->requests_left;
+		hdr_ptr = c->in;
+		hdr_cnt = c->in_len;
+		handle_incoming_and_exit(&c->peer);
+	}
+	/* parent, or fork failed */
+	ev_close(fd);
+}
+
+/*
+ * Look at the request at the start of c->in. If it is a complete
+ * GET or HEAD of a plain file we may serve ourself, set up response
+ * in c and remove the request from c->in.
+ */
+static int ev_parse_request(struct ev_conn *c)
+{
+	struct file_entry *fe;
+	struct file_variant *v;
+	const char *error_page;
+	char *end;
+	char *line;
+	char *urlp;
+	char *url;
+	char *tptr;
+	char *HTTP_slash;
+	int head;
+	unsigned code;
+	unsigned len;
+	unsigned req_len;
+
+	/* Have all headers? */
+	end = memmem(c->in, c->in_len, "\n\r\n", 3);
+	if (!end) {
+		end = memmem(c->in, c->in_len, "\n\n", 2);
+		if (!end)
+			return c->in_len < EV_BUF_SIZE ? EV_NEED_MORE : EV_HAND_OFF;
+		end += 2;
+	} else {
+		end += 3;
+	}
+	req_len = end - c->in;
+	memcpy(iobuf, c->in, req_len);
+	iobuf[req_len] = '\0';
+
+	reset_request_state();
+
+	/* "GET /url HTTP/1.1" */
+	line = iobuf;
+	end = strchrnul(line, '\n');
+	*end = '\0';
+	if (end != line && end[-1] == '\r')
+		end[-1] = '\0';
+	urlp = strchr(line, ' ');
+	if (!urlp)
+		return EV_HAND_OFF;
+	*urlp++ = '\0';
+	head = (strcasecmp(line, "HEAD") == 0);
+	if (!head && strcasecmp(line, "GET") != 0)
+		return EV_HAND_OFF;
+	if (urlp[0] != '/')
+		return EV_HAND_OFF;
+	HTTP_slash = strchr(urlp, ' ');
+	if (!HTTP_slash || strncmp(HTTP_slash + 1, HTTP_200, 5) != 0)
+		return EV_HAND_OFF;
+	*HTTP_slash++ = '\0';
+	/* The last request we allow on this connection? */
+	G.keepalive = (c->requests_left > 1 && strcmp(HTTP_slash + 5, "1.0") != 0);
+#if ENABLE_FEATURE_HTTPD_PROXY
+	if (find_proxy_entry(urlp))
+		return EV_HAND_OFF;
+#endif
+
+	/* Headers */
+	while ((line = end + 1)[0] != '\0') {
+		end = strchrnul(line, '\n');
+		*end = '\0';
+		if (end != line && end[-1] == '\r')
+			end[-1] = '\0';
+		if (STRNCASECMP(line, "Connection:") == 0) {
+			if (strcasestr(line, "close"))
+				G.keepalive = 0;
+			else if (strcasestr(line, "keep-alive") && c->requests_left > 1)
+				G.keepalive = 1;
+			continue;
+		}
+		if (STRNCASECMP(line, "Content-Length:") == 0
+		 || STRNCASECMP(line, "Transfer-Encoding:") == 0
+		 IF_FEATURE_HTTPD_BASIC_AUTH(|| STRNCASECMP(line, "Authorization:") == 0)
+		 IF_FEATURE_HTTPD_RANGES(|| STRNCASECMP(line, "Range:") == 0)
+		) {
+			return EV_HAND_OFF;
+		}
+#if ENABLE_FEATURE_HTTPD_GZIP
+		if (STRNCASECMP(line, "Accept-Encoding:") == 0) {
+			if (strstr(line, "gzip"))
+				content_gzip = 1;
+			continue;
+		}
+#endif
+#if ENABLE_FEATURE_HTTPD_ETAG
+		if (STRNCASECMP(line, "If-None-Match:") == 0) {
+			free(G.if_none_match);
+			G.if_none_match = xstrdup(skip_whitespace(line + sizeof("If-None-Match:") - 1));
+			continue;
+		}
+#endif
+	}
+
+	/* Same URL processing as in handle_incoming_and_exit() */
+	url = xmalloc(strlen(urlp) + 2 + MAX_CONF_LINE);
+	strcpy(url, urlp);
+	g_query = strchr(url, '?');
+	if (g_query)
+		*g_query++ = '\0';
+	tptr = percent_decode_in_place(url, /*strict:*/ 1);
+	if (!tptr || tptr == url + 1)
+		goto hand_off;
+	urlp = canonicalize_url(url);
+	if (!urlp)
+		goto hand_off;
+	G.conf_dir = find_dir_conf(url);
+#if ENABLE_FEATURE_HTTPD_ACL_IP
+	if (is_ip_denied(G.conf_dir, remote_ipv4(&c->peer)))
+		goto hand_off;
+#endif
+	if (urlp[-1] == '/')
+		strcpy(urlp, conf_index_page(G.conf_dir));
+	fe = file_cache_find(url);
+	if (!fe) {
+		char c0;
+
+		/* Is it something we should leave to a forked child? */
+		tptr = url + 1;
+		if (ENABLE_FEATURE_HTTPD_CGI && is_prefixed_with(tptr, "cgi-bin/"))
+			goto hand_off;
+#if ENABLE_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR
+		if (find_script_interpr(tptr))
+			goto hand_off;
+#endif
+		/* These look at URL without index.html */
+		c0 = urlp[0];
+		urlp[0] = '\0';
+		if (strcmp(bb_basename(url), HTTPD_CONF) == 0
+		 IF_FEATURE_HTTPD_BASIC_AUTH(|| find_auth(url))
+		) {
+			goto hand_off;
+		}
+		urlp[0] = c0;
+		fe = file_cache_add(url);
+		if (!fe)
+			goto hand_off; /* 404, 302 to "dir/", cgi-bin/index.cgi... */
+	}
+	if (verbose > 1)
+		bb_error_msg("url:%s", url);
+	free(url);
+
+	/* Send .gz if client takes it and we have it */
+	v = &fe->var[0];
+	if (content_gzip && fe->var[1].fd >= 0)
+		v = &fe->var[1];
+	IF_FEATURE_HTTPD_GZIP(content_gzip = (v != &fe->var[0]);)
+	file_size = v->size;
+	last_mod = v->mtime;
+	found_mime_type = fe->mime_type;
+
+	code = HTTP_OK;
+#if ENABLE_FEATURE_HTTPD_ETAG
+	sprintf(G.etag, "\"%llx-%llx\"", (unsigned long long)last_mod, (unsigned long long)file_size);
+	if (G.if_none_match && strstr(G.if_none_match, G.etag)) {
+		IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
+		file_size = -1;
+		code = HTTP_NOT_MODIFIED;
+	}
+#endif
+	if (code == HTTP_OK
+	 && v->hdr
+	 && v->hdr_keepalive == G.keepalive
+	 && (!ENABLE_FEATURE_HTTPD_DATE || v->hdr_time == time(NULL))
+	) {
+		c->out = xmemdup(v->hdr, v->hdr_len);
+		len = v->hdr_len;
+	} else {
+		len = build_headers(code, &error_page);
+		if (error_page)
+			return EV_HAND_OFF;
+		c->out = xmemdup(iobuf, len);
+		if (code == HTTP_OK) {
+			free(v->hdr);
+			v->hdr = xmemdup(iobuf, len);
+			v->hdr_len = len;
+			v->hdr_keepalive = G.keepalive;
+			v->hdr_time = time(NULL);
+		}
+	}
+	c->out_pos = 0;
+	c->out_len = len;
+	c->keepalive = G.keepalive;
+	c->requests_left--;
+	if (!head && code == HTTP_OK) {
+		c->fe = fe;
+		fe->refcnt++;
+		c->file_fd = v->fd;
+		c->file_pos = 0;
+		c->file_end = v->size;
+	}
+
+	/* Next request, if pipelined, is after this one */
+	c->in_len -= req_len;
+	memmove(c->in, c->in + req_len, c->in_len);
+	return EV_RESPOND;
+
+ hand_off:
+	free(url);
+	return EV_HAND_OFF;
+}
+
+/* Returns 1 if the whole response is sent, 0 if socket is full, -1 on error */
+static int ev_send(int fd, struct ev_conn *c)
+{
+	ssize_t n;
+
+	while (c->out_pos < c->out_len) {
+		n = send(fd, c->out + c->out_pos, c->out_len - c->out_pos,
+			MSG_NOSIGNAL | (c->fe && c->file_end != 0 ? MSG_MORE : 0));
+		if (n < 0)
+			goto err;
+		c->out_pos += n;
+	}
+	while (c->fe && c->file_pos < c->file_end) {
+		n = sendfile(fd, c->file_fd, &c->file_pos, c->file_end - c->file_pos);
+		if (n < 0)
+			goto err;
+		if (n == 0) /* file shrank, can't keep Content-Length promise */
+			return -1;
+	}
+	if (c->fe) {
+		file_entry_put(c->fe);
+		c->fe = NULL;
+	}
+	free(c->out);
+	c->out = NULL;
+	return 1;
+ err:
+	if (errno == EAGAIN || errno == EINTR)
+		return 0;
+	return -1;
+}
+
+static void ev_want(int fd, struct ev_conn *c, int want_out)
+{
+	struct epoll_event ev;
+
+	c->deadline = monotonic_sec() + (want_out || c->in_len ? HEADER_READ_TIMEOUT : KEEPALIVE_TIMEOUT);
+	if (c->want_out == want_out)
+		return;
+	c->want_out = want_out;
+	ev.events = want_out ? EPOLLOUT : EPOLLIN;
+	ev.data.fd = fd;
+	epoll_ctl(G.ev_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* Serve whatever can be served on this connection now */
+static void ev_process(int fd)
+{
+	struct ev_conn *c = G.ev_conn[fd];
+
+	while (1) {
+		int r;
+
+		if (c->out) {
+			r = ev_send(fd, c);
+			if (r < 0) {
+				ev_close(fd);
+				return;
+			}
+			if (r == 0) {
+				ev_want(fd, c, 1);
+				return;
+			}
+			if (!c->keepalive) {
+				shutdown(fd, SHUT_WR);
+				ev_close(fd);
+				return;
+			}
+		}
+		r = ev_parse_request(c);
+		if (r == EV_NEED_MORE) {
+			ev_want(fd, c, 0);
+			return;
+		}
+		if (r == EV_HAND_OFF) {
+			ev_hand_off(fd);
+			return;
+		}
+		/* EV_RESPOND: loop back to send it */
+	}
+}
+
+static void ev_accept(void)
+{
+	while (1) {
+		struct epoll_event ev;
+		struct ev_conn *c;
+		len_and_sockaddr fromAddr;
+		int n;
+
+		fromAddr.len = LSA_SIZEOF_SA;
+		n = accept(G.server_socket, &fromAddr.u.sa, &fromAddr.len);
+		if (n < 0)
+			return;
+		ndelay_on(n);
+		setsockopt_keepalive(n);
+		setsockopt_1(n, IPPROTO_TCP, TCP_NODELAY);
+
+		if ((unsigned)n >= G.ev_conn_size) {
+			unsigned sz = G.ev_conn_size;
+			G.ev_conn_size = n + 64;
+			G.ev_conn = xrealloc(G.ev_conn, G.ev_conn_size * sizeof(G.ev_conn[0]));
+			memset(&G.ev_conn[sz], 0, (G.ev_conn_size - sz) * sizeof(G.ev_conn[0]));
+		}
+		c = xzalloc(sizeof(*c));
+		c->deadline = monotonic_sec() + HEADER_READ_TIMEOUT;
+		c->requests_left = KEEPALIVE_MAX_REQUESTS;
+		memcpy(&c->peer, &fromAddr, sizeof(fromAddr));
+		G.ev_conn[n] = c;
+#if ENABLE_FEATURE_HTTPD_ACL_IP
+		if (is_ip_denied(G.conf_root, remote_ipv4(&fromAddr))) {
+			/* child will send "403 Forbidden" */
+			ev_hand_off(n);
+			continue;
+		}
+#endif
+		ev.events = EPOLLIN;
+		ev.data.fd = n;
+		if (epoll_ctl(G.ev_fd, EPOLL_CTL_ADD, n, &ev) != 0)
+			ev_close(n);
+	}
+}
+
+static void mini_httpd_event(int server_socket, unsigned procs) NORETURN;
+static void mini_httpd_event(int server_socket, unsigned procs)
+{
+	struct epoll_event events[EV_MAX_EVENTS];
+	pid_t *pids;
+	int nprocs;
+	unsigned last_sweep;
+
+	if (procs == 0)
+		procs = sysconf(_SC_NPROCESSORS_ONLN);
+	/* All processes wait on the same listening socket.
+	 * Forking server's backlog of 9 would drop SYNs of bursts
+	 * which we can easily accept */
+	G.server_socket = server_socket;
+	listen(server_socket, SOMAXCONN);
+	ndelay_on(server_socket);
+	pids = xzalloc(procs * sizeof(pids[0]));
+	nprocs = 0;
+	while (nprocs < (int)procs - 1) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			/* Go away together with the first one */
+			prctl(PR_SET_PDEATHSIG, SIGTERM, 0, 0, 0);
+			nprocs = 0;
+			break;
+		}
+		if (pid > 0)
+			pids[nprocs++] = pid;
+		else
+			break;
+	}
+
+	/* Don't reparse config in the middle of a request, see below */
+	signal(SIGHUP, record_signo);
+	signal(SIGPIPE, SIG_IGN);
+	iobuf = xmalloc(IOBUF_SIZE);
+	G.fc_hash = xzalloc(FILE_CACHE_HASH * sizeof(G.fc_hash[0]));
+	G.ev_fd = epoll_create(EV_MAX_EVENTS);
+	if (G.ev_fd < 0)
+		bb_simple_perror_msg_and_die("epoll_create");
+	/* EPOLLEXCLUSIVE: wake up only one of us per connection */
+	events[0].events = EPOLLIN | EPOLLEXCLUSIVE;
+	events[0].data.fd = server_socket;
+	if (epoll_ctl(G.ev_fd, EPOLL_CTL_ADD, server_socket, &events[0]) != 0) {
+		/* Linux < 4.5 */
+		events[0].events = EPOLLIN;
+		if (epoll_ctl(G.ev_fd, EPOLL_CTL_ADD, server_socket, &events[0]) != 0)
+			bb_simple_perror_msg_and_die("epoll_ctl");
+	}
+
+	last_sweep = monotonic_sec();
+	while (1) {
+		unsigned now;
+		int i, n;
+
+		n = epoll_wait(G.ev_fd, events, EV_MAX_EVENTS, 1000);
+		if (bb_got_signal == SIGHUP) {
+			bb_got_signal = 0;
+			file_cache_flush();
+			load_conf(SIGNALED_PARSE);
+			for (i = 0; i < nprocs; i++)
+				kill(pids[i], SIGHUP);
+		}
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			struct ev_conn *c;
+
+			if (fd == server_socket) {
+				ev_accept();
+				continue;
+			}
+			c = G.ev_conn[fd];
+			if (!c)
+				continue;
+			if (!c->want_out) {
+				ssize_t r = safe_read(fd, c->in + c->in_len, EV_BUF_SIZE - c->in_len);
+				if (r <= 0) {
+					if (r == 0 || errno != EAGAIN)
+						ev_close(fd);
+					continue;
+				}
+				c->in_len += r;
+			}
+			ev_process(fd);
+		}
+
+		/* Close connections which are idle for too long */
+		now = monotonic_sec();
+		if (now != last_sweep) {
+			unsigned fd;
+			last_sweep = now;
+			for (fd = 0; fd < G.ev_conn_size; fd++) {
+				if (G.ev_conn[fd] && (int)(G.ev_conn[fd]->deadline - now) < 0)
+					ev_close(fd);
+			}
+		}
+	}
+}
+#endif
+
 /*
  * Process a HTTP connection on stdin/out.
  * Never returns.
@@ -2735,13 +3971,6 @@ static void mini_httpd_inetd(void)
 	handle_incoming_and_exit(&fromAddr);
 }
 
-static void sighup_handler(int sig UNUSED_PARAM)
-{
-	int sv = errno;
-	parse_conf(DEFAULT_PATH_HTTPD_CONF, SIGNALED_PARSE);
-	errno = sv;
-}
-
 enum {
 	c_opt_config_file = 0,
 	d_opt_decode_url,
@@ -2750,6 +3979,7 @@ enum {
 	IF_FEATURE_HTTPD_BASIC_AUTH(    r_opt_realm     ,)
 	IF_FEATURE_HTTPD_AUTH_MD5(      m_opt_md5       ,)
 	IF_FEATURE_HTTPD_SETUID(        u_opt_setuid    ,)
+	IF_FEATURE_HTTPD_EVENT(         E_opt_event     ,)
 	p_opt_port      ,
 	p_opt_inetd     ,
 	p_opt_foreground,
@@ -2761,6 +3991,7 @@ enum {
 	OPT_REALM       = IF_FEATURE_HTTPD_BASIC_AUTH(    (1 << r_opt_realm     )) + 0,
 	OPT_MD5         = IF_FEATURE_HTTPD_AUTH_MD5(      (1 << m_opt_md5       )) + 0,
 	OPT_SETUID      = IF_FEATURE_HTTPD_SETUID(        (1 << u_opt_setuid    )) + 0,
+	OPT_EVENT       = IF_FEATURE_HTTPD_EVENT(         (1 << E_opt_event     )) + 0,
 	OPT_PORT        = 1 << p_opt_port,
 	OPT_INETD       = 1 << p_opt_inetd,
 	OPT_FOREGROUND  = 1 << p_opt_foreground,
@@ -2778,6 +4009,7 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 	IF_FEATURE_HTTPD_SETUID(const char *s_ugid = NULL;)
 	IF_FEATURE_HTTPD_SETUID(struct bb_uidgid_t ugid;)
 	IF_FEATURE_HTTPD_AUTH_MD5(const char *pass;)
+	IF_FEATURE_HTTPD_EVENT(unsigned event_procs;)
 
 	INIT_G();
 
@@ -2796,6 +4028,7 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 			IF_FEATURE_HTTPD_BASIC_AUTH("r:")
 			IF_FEATURE_HTTPD_AUTH_MD5("m:")
 			IF_FEATURE_HTTPD_SETUID("u:")
+			IF_FEATURE_HTTPD_EVENT("E:+")
 			"p:ifv"
 			"\0"
 			/* -v counts, -i implies -f */
@@ -2805,6 +4038,7 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 			IF_FEATURE_HTTPD_BASIC_AUTH(, &g_realm)
 			IF_FEATURE_HTTPD_AUTH_MD5(, &pass)
 			IF_FEATURE_HTTPD_SETUID(, &s_ugid)
+			IF_FEATURE_HTTPD_EVENT(, &event_procs)
 			, &bind_addr_or_port
 			, &verbose
 		);
@@ -2881,9 +4115,14 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 	}
 #endif
 
-	parse_conf(DEFAULT_PATH_HTTPD_CONF, FIRST_PARSE);
+	/* inetd and NOMMU (which re-execs us with -i per connection)
+	 * serve few requests per process, don't read all of the tree */
+	G.conf_on_demand = (!BB_MMU || (opt & OPT_INETD));
+	load_conf(FIRST_PARSE);
+	/* Server loops reload config when they see bb_got_signal.
+	 * Without SA_RESTART, so that accept() returns at once */
 	if (!(opt & OPT_INETD))
-		signal(SIGHUP, sighup_handler);
+		signal_no_SA_RESTART_empty_mask(SIGHUP, record_signo);
 
 	xfunc_error_retval = 0;
 	if (opt & OPT_INETD)
@@ -2891,6 +4130,10 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 #if BB_MMU
 	if (!(opt & OPT_FOREGROUND))
 		bb_daemonize(0); /* don't change current directory */
+# if ENABLE_FEATURE_HTTPD_EVENT
+	if (opt & OPT_EVENT)
+		mini_httpd_event(server_socket, event_procs); /* never returns */
+# endif
 	mini_httpd(server_socket); /* never returns */
 #else
 	mini_httpd_nommu(server_socket, argc, argv); /* never returns */
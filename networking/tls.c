@@ -21,6 +21,9 @@
 //kbuild:lib-$(CONFIG_TLS) += tls_sp_c32.o
 
 #include "tls.h"
+#if ENABLE_FEATURE_TLS_SESSION_CACHE
+# include <sys/file.h>
+#endif
 
 // Usually enabled. You can disable some of them to force only
 // specific ciphers to be advertized to server.
@@ -269,6 +272,14 @@ struct tls_handshake_data {
 	/* for P256, it contains x,y point pair, each 32 bytes long */
 	uint8_t ecc_pub_key32[2 * 32];
 
+#if ENABLE_FEATURE_TLS_SESSION_CACHE
+	char *session_key; /* "host:port", NULL if no cache */
+	smallint resumed;
+	uint8_t session_id_len;
+	uint8_t session_id[32]; /* cached one (offered in hello), then new one from server */
+	uint16_t session_cipher_id;
+#endif
+
 /* HANDSHAKE HASH: */
 	//unsigned saved_client_hello_size;
 	//uint8_t saved_client_hello[1];
@@ -832,8 +843,6 @@ static void xwrite_encrypted_aesgcm(tls_state_t *tls, unsigned size, unsigned ty
 	uint8_t authtag[AES_BLOCK_SIZE] ALIGNED_long; //[16]
 	uint8_t *buf;
 	struct record_hdr *xhdr;
-	unsigned remaining;
-	unsigned cnt;
 	uint64_t t64;
 
 	buf = tls->outbuf + OUTBUF_PFX; /* see above for the byte it points to */
@@ -857,19 +866,9 @@ static void xwrite_encrypted_aesgcm(tls_state_t *tls, unsigned size, unsigned ty
 	/* seq64 is not used later in this func, can increment here */
 	tls->write_seq64_be = SWAP_BE64(1 + SWAP_BE64(t64));
 
-	cnt = 1;
-	remaining = size;
-	while (remaining != 0) {
-		unsigned n;
-
-		cnt++;
-		COUNTER(nonce) = htonl(cnt); /* yes, first cnt here is 2 (!) */
-		aes_encrypt_one_block(&tls->aes_encrypt, nonce, scratch);
-		n = remaining > AES_BLOCK_SIZE ? AES_BLOCK_SIZE : remaining;
-		xorbuf(buf, scratch, n);
-		buf += n;
-		remaining -= n;
-	}
+	COUNTER(nonce) = htonl(2); /* yes, first counter here is 2 (!) */
+	aes_ctr32_xor(&tls->aes_encrypt, nonce, buf, size, buf);
+	buf += size;
 
 	aesgcm_GHASH(tls->H, aad, /*sizeof(aad),*/ tls->outbuf + OUTBUF_PFX, size, authtag /*, sizeof(authtag)*/);
 	COUNTER(nonce) = htonl(1);
@@ -999,10 +998,8 @@ static void tls_aesgcm_decrypt(tls_state_t *tls, uint8_t *buf, int size)
 
 	//uint8_t aad[13 + 3] ALIGNED_long; /* +3 creates [16] buffer, simplifying GHASH() */
 	uint8_t nonce[12 + 4] ALIGNED_long; /* +4 creates space for AES block counter */
-	uint8_t scratch[AES_BLOCK_SIZE] ALIGNED_long; //[16]
+	//uint8_t scratch[AES_BLOCK_SIZE] ALIGNED_long; //[16]
 	//uint8_t authtag[AES_BLOCK_SIZE] ALIGNED_long; //[16]
-	unsigned remaining;
-	unsigned cnt;
 
 	//memcpy(aad, buf, 8);
 	//aad[8] = type;
@@ -1015,19 +1012,9 @@ static void tls_aesgcm_decrypt(tls_state_t *tls, uint8_t *buf, int size)
 	memcpy(nonce,     tls->server_write_IV, 4);
 	memcpy(nonce + 4, buf, 8);
 
-	cnt = 1;
-	remaining = size;
-	while (remaining != 0) {
-		unsigned n;
-
-		cnt++;
-		COUNTER(nonce) = htonl(cnt); /* yes, first cnt here is 2 (!) */
-		aes_encrypt_one_block(&tls->aes_decrypt, nonce, scratch);
-		n = remaining > AES_BLOCK_SIZE ? AES_BLOCK_SIZE : remaining;
-		xorbuf3(buf, scratch, buf + 8, n);
-		buf += n;
-		remaining -= n;
-	}
+	/* Decrypt, moving data 8 bytes down over the explicit nonce */
+	COUNTER(nonce) = htonl(2); /* yes, first counter here is 2 (!) */
+	aes_ctr32_xor(&tls->aes_decrypt, nonce, buf + 8, size, buf);
 
 	//aesgcm_GHASH(tls->H, aad, tls->inbuf + RECHDR_LEN, size, authtag);
 	//COUNTER(nonce) = htonl(1);
@@ -1497,6 +1484,138 @@ static ALWAYS_INLINE void fill_handshake_record_hdr(void *buf, unsigned type, un
 	h->len24_lo  = len & 0xff;
 }
 
+#if ENABLE_FEATURE_TLS_SESSION_CACHE
+// RFC 5246 7.3: abbreviated handshake.
+// ClientHello with session_id of a previous connection: if the server
+// still has the session, it answers with the same session_id,
+// and both sides derive new keys from the old master secret.
+// No certificate, no key exchange.
+//
+// The cache is a file of fixed-size slots, locked with flock()
+// while it is read or updated. Not held locked during handshake.
+# define TLS_SESSION_SLOTS   16
+/* Servers forget sessions after 5 minutes (openssl) to a day */
+# define TLS_SESSION_MAX_AGE (60 * 60)
+struct tls_session {
+	char key[64];
+	uint32_t time;
+	uint16_t cipher_id;
+	uint8_t session_id[32];
+	uint8_t master_secret[48];
+};
+
+static int open_session_cache(void)
+{
+	const char *fname = getenv("TLS_SESSION_CACHE");
+	int fd;
+
+	if (!fname || !fname[0])
+		return -1;
+	fd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd >= 0)
+		flock(fd, LOCK_EX);
+	return fd;
+}
+
+/* Returns slot with matching key, or the one to reuse for it */
+static int find_session(int fd, const char *key, struct tls_session *s)
+{
+	unsigned now = time(NULL);
+	unsigned oldest = UINT_MAX;
+	int slot = 0;
+	int i;
+
+	xlseek(fd, 0, SEEK_SET);
+	for (i = 0; i < TLS_SESSION_SLOTS; i++) {
+		if (full_read(fd, s, sizeof(*s)) != sizeof(*s)) {
+			/* EOF: slots from here on are free */
+			if (oldest != 0)
+				slot = i;
+			break;
+		}
+		if (strncmp(s->key, key, sizeof(s->key)) == 0)
+			return i;
+		/* Expired (or clock went back) slots are the best to reuse */
+		if (now - s->time > TLS_SESSION_MAX_AGE)
+			s->time = 0;
+		if (s->time < oldest) {
+			oldest = s->time;
+			slot = i;
+		}
+	}
+	memset(s, 0, sizeof(*s));
+	return slot;
+}
+
+static void lookup_session(tls_state_t *tls, const char *sni)
+{
+	struct tls_handshake_data *hsd = tls->hsd;
+	struct tls_session s;
+	len_and_sockaddr lsa;
+	char *key;
+	int fd;
+
+	fd = open_session_cache();
+	if (fd < 0)
+		return;
+
+	lsa.len = LSA_SIZEOF_SA;
+	if (getpeername(tls->ofd, &lsa.u.sa, &lsa.len) != 0)
+		goto ret; /* not a socket? */
+	if (sni)
+		key = xasprintf("%s:%u", sni, ntohs(get_nport(&lsa.u.sa)));
+	else
+		key = xmalloc_sockaddr2dotted(&lsa.u.sa);
+	if (strlen(key) >= sizeof(s.key)) {
+		free(key);
+		goto ret;
+	}
+	hsd->session_key = key;
+
+	find_session(fd, key, &s);
+	if (s.key[0]
+	 && (unsigned)time(NULL) - s.time <= TLS_SESSION_MAX_AGE
+	) {
+		dbg("offering cached session for %s\n", key);
+		hsd->session_id_len = sizeof(s.session_id);
+		memcpy(hsd->session_id, s.session_id, sizeof(s.session_id));
+		memcpy(hsd->master_secret, s.master_secret, sizeof(s.master_secret));
+		hsd->session_cipher_id = s.cipher_id;
+	}
+ ret:
+	memset(&s, 0, sizeof(s));
+	close(fd);
+}
+
+static void save_session(tls_state_t *tls)
+{
+	struct tls_handshake_data *hsd = tls->hsd;
+	struct tls_session s;
+	int slot;
+	int fd;
+
+	if (!hsd->session_key || hsd->session_id_len == 0)
+		return;
+	fd = open_session_cache();
+	if (fd < 0)
+		return;
+	slot = find_session(fd, hsd->session_key, &s);
+	strcpy(s.key, hsd->session_key);
+	s.time = time(NULL);
+	s.cipher_id = tls->cipher_id;
+	memcpy(s.session_id, hsd->session_id, sizeof(s.session_id));
+	memcpy(s.master_secret, hsd->master_secret, sizeof(s.master_secret));
+	dbg("saving session for %s in slot %d\n", s.key, slot);
+	xlseek(fd, slot * sizeof(s), SEEK_SET);
+	full_write(fd, &s, sizeof(s));
+	memset(&s, 0, sizeof(s));
+	close(fd);
+}
+#else
+# define lookup_session(tls, sni) ((void)0)
+# define save_session(tls)        ((void)0)
+#endif
+
 static void send_client_hello_and_alloc_hsd(tls_state_t *tls, const char *sni)
 {
 #define NUM_CIPHERS (0 \
@@ -1634,8 +1753,17 @@ static void send_client_hello_and_alloc_hsd(tls_state_t *tls, const char *sni)
 	uint8_t *ptr;
 	int len;
 	int ext_len;
+	int sid_len;
 	int sni_len = sni ? strnlen(sni, 127 - 5) : 0;
 
+	tls->hsd = xzalloc(sizeof(*tls->hsd));
+	/* HANDSHAKE HASH: ^^^ + len if need to save saved_client_hello */
+	lookup_session(tls, sni);
+	sid_len = 0;
+#if ENABLE_FEATURE_TLS_SESSION_CACHE
+	sid_len = tls->hsd->session_id_len;
+#endif
+
 	ext_len = 0;
 	ext_len += sizeof(extensions);
 	if (sni_len)
@@ -1643,7 +1771,7 @@ static void send_client_hello_and_alloc_hsd(tls_state_t *tls, const char *sni)
 
 	/* +2 is for "len of all extensions" 2-byte field */
 	len = sizeof(*record) + 2 + ext_len;
-	record = tls_get_zeroed_outbuf(tls, len);
+	record = tls_get_zeroed_outbuf(tls, len + sid_len);
 
 	fill_handshake_record_hdr(record, HANDSHAKE_CLIENT_HELLO, len);
 	record->proto_maj = TLS_MAJ;	/* the "requested" version of the protocol, */
@@ -1673,8 +1801,17 @@ static void send_client_hello_and_alloc_hsd(tls_state_t *tls, const char *sni)
 	}
 	memcpy(ptr, extensions, sizeof(extensions));
 
-	tls->hsd = xzalloc(sizeof(*tls->hsd));
-	/* HANDSHAKE HASH: ^^^ + len if need to save saved_client_hello */
+#if ENABLE_FEATURE_TLS_SESSION_CACHE
+	if (sid_len) {
+		/* Insert session_id[] after session_id_len */
+		ptr = &record->session_id_len + 1;
+		memmove(ptr + sid_len, ptr, (uint8_t*)record + len - ptr);
+		memcpy(ptr, tls->hsd->session_id, sid_len);
+		record->session_id_len = sid_len;
+		len += sid_len;
+		fill_handshake_record_hdr(record, HANDSHAKE_CLIENT_HELLO, len);
+	}
+#endif
 	memcpy(tls->hsd->client_and_server_rand32, record->rand32, sizeof(record->rand32));
 /* HANDSHAKE HASH:
 	tls->hsd->saved_client_hello_size = len;
@@ -1819,6 +1956,23 @@ static void get_server_hello(tls_state_t *tls)
 	dbg("server chose cipher %04x\n", tls->cipher_id);
 	dbg("key_size:%u MAC_size:%u IV_size:%u\n", tls->key_size, tls->MAC_size, tls->IV_size);
 
+#if ENABLE_FEATURE_TLS_SESSION_CACHE
+	if (hp->session_id_len != 0
+	 && tls->hsd->session_id_len != 0
+	 && memcmp(hp->session_id, tls->hsd->session_id, 32) == 0
+	) {
+		/* Server agreed to resume our session */
+		if (tls->cipher_id != tls->hsd->session_cipher_id)
+			bad_record_die(tls, "'server hello'", len);
+		dbg("resuming session\n");
+		tls->hsd->resumed = 1;
+	} else {
+		/* Full handshake. Remember new session id, if any */
+		tls->hsd->session_id_len = hp->session_id_len;
+		memcpy(tls->hsd->session_id, hp->session_id, hp->session_id_len);
+	}
+#endif
+
 	/* Handshake hash eventually destined to FINISHED record
 	 * is sha256 regardless of cipher
 	 * (at least for all ciphers defined by RFC5246).
@@ -2066,7 +2220,10 @@ static void send_client_key_exchange(tls_state_t *tls)
 		tls->hsd->client_and_server_rand32, sizeof(tls->hsd->client_and_server_rand32)
 	);
 	dump_hex("master secret:%s\n", tls->hsd->master_secret, sizeof(tls->hsd->master_secret));
+}
 
+static void compute_keys(tls_state_t *tls)
+{
 	// RFC 5246
 	// 6.3.  Key Calculation
 	//
@@ -2154,6 +2311,39 @@ static void send_change_cipher_spec(tls_state_t *tls)
 	xwrite(tls->ofd, rec_CHANGE_CIPHER_SPEC, sizeof(rec_CHANGE_CIPHER_SPEC));
 }
 
+static void get_change_cipher_spec_and_finished(tls_state_t *tls)
+{
+	int len;
+
+	/* Get CHANGE_CIPHER_SPEC */
+	len = tls_xread_record(tls, "switch to encrypted traffic");
+	if (len != 1 || memcmp(tls->inbuf, rec_CHANGE_CIPHER_SPEC, 6) != 0)
+		bad_record_die(tls, "switch to encrypted traffic", len);
+	dbg("<< CHANGE_CIPHER_SPEC\n");
+
+	if (ALLOW_RSA_NULL_SHA256
+	 && tls->cipher_id == TLS_RSA_WITH_NULL_SHA256
+	) {
+		tls->min_encrypted_len_on_read = tls->MAC_size;
+	} else
+	if (!(tls->flags & ENCRYPTION_AESGCM)) {
+		unsigned mac_blocks = (unsigned)(TLS_MAC_SIZE(tls) + AES_BLOCK_SIZE-1) / AES_BLOCK_SIZE;
+		/* all incoming packets now should be encrypted and have
+		 * at least IV + (MAC padded to blocksize):
+		 */
+		tls->min_encrypted_len_on_read = AES_BLOCK_SIZE + (mac_blocks * AES_BLOCK_SIZE);
+	} else {
+		tls->min_encrypted_len_on_read = 8 + AES_BLOCK_SIZE;
+	}
+	dbg("min_encrypted_len_on_read: %u\n", tls->min_encrypted_len_on_read);
+
+	/* Get (encrypted) FINISHED from the server */
+	len = tls_xread_record(tls, "'server finished'");
+	if (len < 4 || tls->inbuf[RECHDR_LEN] != HANDSHAKE_FINISHED)
+		bad_record_die(tls, "'server finished'", len);
+	dbg("<< FINISHED\n");
+}
+
 // 7.4.9.  Finished
 // A Finished message is always sent immediately after a change
 // cipher spec message to verify that the key exchange and
@@ -2240,12 +2430,34 @@ void FAST_FUNC tls_handshake(tls_state_t *tls, const char *sni)
 	//                                 [ChangeCipherSpec]
 	//                      <-------             Finished
 	// Application Data     <------>     Application Data
+	//
+	// Resumed session (RFC 5246 7.3):
+	// ClientHello          ------->
+	//                                        ServerHello
+	//                                 [ChangeCipherSpec]
+	//                      <-------             Finished
+	// [ChangeCipherSpec]
+	// Finished             ------->
+	// Application Data     <------>     Application Data
 	int len;
 	int got_cert_req;
 
 	send_client_hello_and_alloc_hsd(tls, sni);
 	get_server_hello(tls);
 
+#if ENABLE_FEATURE_TLS_SESSION_CACHE
+	if (tls->hsd->resumed) {
+		/* master_secret is from the cache, randoms are new */
+		compute_keys(tls);
+		get_change_cipher_spec_and_finished(tls);
+		/* client's FINISHED hash includes server's FINISHED */
+		send_change_cipher_spec(tls);
+		tls->flags |= ENCRYPT_ON_WRITE;
+		send_client_finished(tls);
+		goto done;
+	}
+#endif
+
 	// RFC 5246
 	// The server MUST send a Certificate message whenever the agreed-
 	// upon key exchange method uses certificates for authentication
@@ -2306,6 +2518,7 @@ void FAST_FUNC tls_handshake(tls_state_t *tls, const char *sni)
 		send_empty_client_cert(tls);
 
 	send_client_key_exchange(tls);
+	compute_keys(tls);
 
 	send_change_cipher_spec(tls);
 	/* from now on we should send encrypted */
@@ -2314,39 +2527,15 @@ void FAST_FUNC tls_handshake(tls_state_t *tls, const char *sni)
 
 	send_client_finished(tls);
 
-	/* Get CHANGE_CIPHER_SPEC */
-	len = tls_xread_record(tls, "switch to encrypted traffic");
-	if (len != 1 || memcmp(tls->inbuf, rec_CHANGE_CIPHER_SPEC, 6) != 0)
-		bad_record_die(tls, "switch to encrypted traffic", len);
-	dbg("<< CHANGE_CIPHER_SPEC\n");
-
-	if (ALLOW_RSA_NULL_SHA256
-	 && tls->cipher_id == TLS_RSA_WITH_NULL_SHA256
-	) {
-		tls->min_encrypted_len_on_read = tls->MAC_size;
-	} else
-	if (!(tls->flags & ENCRYPTION_AESGCM)) {
-		unsigned mac_blocks = (unsigned)(TLS_MAC_SIZE(tls) + AES_BLOCK_SIZE-1) / AES_BLOCK_SIZE;
-		/* all incoming packets now should be encrypted and have
-		 * at least IV + (MAC padded to blocksize):
-		 */
-		tls->min_encrypted_len_on_read = AES_BLOCK_SIZE + (mac_blocks * AES_BLOCK_SIZE);
-	} else {
-		tls->min_encrypted_len_on_read = 8 + AES_BLOCK_SIZE;
-	}
-	dbg("min_encrypted_len_on_read: %u\n", tls->min_encrypted_len_on_read);
-
-	/* Get (encrypted) FINISHED from the server */
-	len = tls_xread_record(tls, "'server finished'");
-	if (len < 4 || tls->inbuf[RECHDR_LEN] != HANDSHAKE_FINISHED)
-		bad_record_die(tls, "'server finished'", len);
-	dbg("<< FINISHED\n");
+	get_change_cipher_spec_and_finished(tls);
+	save_session(tls);
+ IF_FEATURE_TLS_SESSION_CACHE(done:)
 	/* application data can be sent/received */
 
 	/* free handshake data */
 	psRsaKey_clear(&tls->hsd->server_rsa_pub_key);
-//	if (PARANOIA)
-//		memset(tls->hsd, 0, tls->hsd->hsd_size);
+	IF_FEATURE_TLS_SESSION_CACHE(free(tls->hsd->session_key);)
+	memset(tls->hsd, 0, sizeof(*tls->hsd));
 	free(tls->hsd);
 	tls->hsd = NULL;
 }
@@ -2447,11 +2636,11 @@ void FAST_FUNC tls_run_copy_loop(tls_state_t *tls, unsigned flags)
 			} else {
 				if (nread == inbuf_size) {
 					/* TLS has per record overhead, if input comes fast,
-					 * read, encrypt and send bigger chunks
+					 * read, encrypt and send maximum-sized records.
+					 * (Stepping up 4k at a time made e.g. uploads
+					 * start with three undersized records).
 					 */
-					inbuf_size += INBUF_STEP;
-					if (inbuf_size > TLS_MAX_OUTBUF)
-						inbuf_size = TLS_MAX_OUTBUF;
+					inbuf_size = TLS_MAX_OUTBUF;
 				}
 				tls_xwrite(tls, nread);
 			}
@@ -40,6 +40,19 @@
 //#if SOME_COND #define PSTM_MIPS, #define PSTM_32BIT
 //#if SOME_COND #define PSTM_ARM,  #define PSTM_32BIT
 
+/* AES-NI and PCLMULQDQ code is written with intrinsics in functions
+ * which have target("...") attributes: no need for -maes etc,
+ * the generic code stays runnable on any x86. Used only if cpuid
+ * says the instructions are there.
+ */
+#if ENABLE_FEATURE_TLS_HWACCEL && defined(__GNUC__) \
+ && (defined(__i386__) || defined(__x86_64__)) \
+ && (__GNUC__ >= 5 || defined(__clang__))
+# define TLS_X86_HWACCEL 1
+#else
+# define TLS_X86_HWACCEL 0
+#endif
+
 
 #define PS_SUCCESS              0
 #define PS_FAILURE              -1
@@ -343,9 +343,226 @@ static void aes_encrypt_1(struct tls_aes *aes, unsigned astate[16])
 	AddRoundKey(astate, RoundKey);
 }
 
+#if TLS_X86_HWACCEL
+# include <wmmintrin.h>
+
+static void cpuid(unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx)
+{
+	asm ("cpuid"
+		: "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+		: "0"(*eax),  "1"(*ebx),  "2"(*ecx),  "3"(*edx)
+	);
+}
+static smallint aesNI;
+
+# define AESNI_FUNC __attribute__((target("aes,sse2")))
+
+// With AES-NI, aes->key[] holds round keys in memory byte order
+// (aes_setkey() byteswaps what KeyExpansion() produced),
+// so that each 16-byte round key can be loaded directly.
+static AESNI_FUNC void aesni_load_keys(__m128i *k, const struct tls_aes *aes)
+{
+	const __m128i *rk = (const __m128i *)aes->key;
+	unsigned i;
+
+	for (i = 0; i <= aes->rounds; i++)
+		k[i] = _mm_loadu_si128(rk + i);
+}
+
+static AESNI_FUNC __m128i aesni_encrypt_1(const __m128i *k, unsigned rounds, __m128i b)
+{
+	unsigned i;
+
+	b = _mm_xor_si128(b, k[0]);
+	for (i = 1; i < rounds; i++)
+		b = _mm_aesenc_si128(b, k[i]);
+	return _mm_aesenclast_si128(b, k[rounds]);
+}
+
+static AESNI_FUNC void aesni_encrypt_one_block(struct tls_aes *aes, const void *data, void *dst)
+{
+	__m128i k[15];
+
+	aesni_load_keys(k, aes);
+	_mm_storeu_si128(dst, aesni_encrypt_1(k, aes->rounds, _mm_loadu_si128(data)));
+}
+
+static AESNI_FUNC void aesni_cbc_encrypt(struct tls_aes *aes, void *iv, const void *data, size_t len, void *dst)
+{
+	__m128i k[15];
+	const __m128i *pt = data;
+	__m128i *ct = dst;
+	__m128i b;
+
+	aesni_load_keys(k, aes);
+	b = _mm_loadu_si128(iv);
+	while (len > 0) {
+		b = aesni_encrypt_1(k, aes->rounds, _mm_xor_si128(b, _mm_loadu_si128(pt)));
+		_mm_storeu_si128(ct, b);
+		ct++;
+		pt++;
+		len -= 16;
+	}
+}
+
+static AESNI_FUNC void aesni_cbc_decrypt(struct tls_aes *aes, void *iv, const void *data, size_t len, void *dst)
+{
+	__m128i dk[15];
+	const __m128i *rk = (const __m128i *)aes->key;
+	unsigned rounds = aes->rounds;
+	const __m128i *ct = data;
+	__m128i *pt = dst;
+	__m128i prev;
+	unsigned i;
+
+	// "Equivalent inverse cipher": round keys in reverse order,
+	// all but the first and the last one passed through InvMixColumns
+	dk[0] = _mm_loadu_si128(rk + rounds);
+	for (i = 1; i < rounds; i++)
+		dk[i] = _mm_aesimc_si128(_mm_loadu_si128(rk + rounds - i));
+	dk[rounds] = _mm_loadu_si128(rk);
+
+	prev = _mm_loadu_si128(iv);
+	// Unlike encryption, CBC decryption of different blocks
+	// is independent: run four of them through the pipeline at once.
+	// All four ciphertext blocks are loaded before any plaintext
+	// is stored: callers decrypt in place, or to data - 16.
+	while (len >= 4*16) {
+		__m128i c0 = _mm_loadu_si128(ct + 0);
+		__m128i c1 = _mm_loadu_si128(ct + 1);
+		__m128i c2 = _mm_loadu_si128(ct + 2);
+		__m128i c3 = _mm_loadu_si128(ct + 3);
+		__m128i b0 = _mm_xor_si128(c0, dk[0]);
+		__m128i b1 = _mm_xor_si128(c1, dk[0]);
+		__m128i b2 = _mm_xor_si128(c2, dk[0]);
+		__m128i b3 = _mm_xor_si128(c3, dk[0]);
+		for (i = 1; i < rounds; i++) {
+			b0 = _mm_aesdec_si128(b0, dk[i]);
+			b1 = _mm_aesdec_si128(b1, dk[i]);
+			b2 = _mm_aesdec_si128(b2, dk[i]);
+			b3 = _mm_aesdec_si128(b3, dk[i]);
+		}
+		b0 = _mm_aesdeclast_si128(b0, dk[rounds]);
+		b1 = _mm_aesdeclast_si128(b1, dk[rounds]);
+		b2 = _mm_aesdeclast_si128(b2, dk[rounds]);
+		b3 = _mm_aesdeclast_si128(b3, dk[rounds]);
+		_mm_storeu_si128(pt + 0, _mm_xor_si128(b0, prev));
+		_mm_storeu_si128(pt + 1, _mm_xor_si128(b1, c0));
+		_mm_storeu_si128(pt + 2, _mm_xor_si128(b2, c1));
+		_mm_storeu_si128(pt + 3, _mm_xor_si128(b3, c2));
+		prev = c3;
+		ct += 4;
+		pt += 4;
+		len -= 4*16;
+	}
+	while (len > 0) {
+		__m128i c0 = _mm_loadu_si128(ct);
+		__m128i b0 = _mm_xor_si128(c0, dk[0]);
+		for (i = 1; i < rounds; i++)
+			b0 = _mm_aesdec_si128(b0, dk[i]);
+		b0 = _mm_aesdeclast_si128(b0, dk[rounds]);
+		_mm_storeu_si128(pt, _mm_xor_si128(b0, prev));
+		prev = c0;
+		ct++;
+		pt++;
+		len -= 16;
+	}
+}
+
+// GCM's counter mode: only the last 32 bits of the counter block
+// are incremented (as big-endian number).
+// Keystream for four blocks is computed at once: aesenc has latency
+// of several cycles, but a new one can start every cycle or two.
+// Source blocks are loaded before results are stored:
+// callers decrypt into dst = data - 8.
+static AESNI_FUNC void aesni_ctr32_xor(struct tls_aes *aes, uint8_t *ctr, const void *data, size_t len, void *dst)
+{
+	__m128i k[15];
+	uint8_t cb[4 * 16];
+	unsigned rounds = aes->rounds;
+	const __m128i *src = data;
+	__m128i *d = dst;
+	uint32_t cnt;
+	unsigned i;
+
+	aesni_load_keys(k, aes);
+	for (i = 0; i < 4; i++)
+		memcpy(cb + i * 16, ctr, 12);
+	cnt = get_unaligned_be32(ctr + 12);
+	while (len >= 4*16) {
+		__m128i b0, b1, b2, b3;
+
+		put_unaligned_be32(cnt + 0, cb + 0*16 + 12);
+		put_unaligned_be32(cnt + 1, cb + 1*16 + 12);
+		put_unaligned_be32(cnt + 2, cb + 2*16 + 12);
+		put_unaligned_be32(cnt + 3, cb + 3*16 + 12);
+		cnt += 4;
+		b0 = _mm_xor_si128(_mm_loadu_si128((void*)(cb + 0*16)), k[0]);
+		b1 = _mm_xor_si128(_mm_loadu_si128((void*)(cb + 1*16)), k[0]);
+		b2 = _mm_xor_si128(_mm_loadu_si128((void*)(cb + 2*16)), k[0]);
+		b3 = _mm_xor_si128(_mm_loadu_si128((void*)(cb + 3*16)), k[0]);
+		for (i = 1; i < rounds; i++) {
+			b0 = _mm_aesenc_si128(b0, k[i]);
+			b1 = _mm_aesenc_si128(b1, k[i]);
+			b2 = _mm_aesenc_si128(b2, k[i]);
+			b3 = _mm_aesenc_si128(b3, k[i]);
+		}
+		b0 = _mm_aesenclast_si128(b0, k[rounds]);
+		b1 = _mm_aesenclast_si128(b1, k[rounds]);
+		b2 = _mm_aesenclast_si128(b2, k[rounds]);
+		b3 = _mm_aesenclast_si128(b3, k[rounds]);
+		b0 = _mm_xor_si128(b0, _mm_loadu_si128(src + 0));
+		b1 = _mm_xor_si128(b1, _mm_loadu_si128(src + 1));
+		b2 = _mm_xor_si128(b2, _mm_loadu_si128(src + 2));
+		b3 = _mm_xor_si128(b3, _mm_loadu_si128(src + 3));
+		_mm_storeu_si128(d + 0, b0);
+		_mm_storeu_si128(d + 1, b1);
+		_mm_storeu_si128(d + 2, b2);
+		_mm_storeu_si128(d + 3, b3);
+		src += 4;
+		d += 4;
+		len -= 4*16;
+	}
+	while (len != 0) {
+		__m128i b0;
+
+		put_unaligned_be32(cnt, cb + 12);
+		cnt++;
+		b0 = aesni_encrypt_1(k, rounds, _mm_loadu_si128((void*)cb));
+		if (len >= 16) {
+			_mm_storeu_si128(d, _mm_xor_si128(b0, _mm_loadu_si128(src)));
+			src++;
+			d++;
+			len -= 16;
+		} else {
+			const uint8_t *s = (const void*)src;
+			uint8_t *p = (void*)d;
+
+			_mm_storeu_si128((void*)cb, b0);
+			for (i = 0; i < len; i++)
+				p[i] = s[i] ^ cb[i];
+			break;
+		}
+	}
+	put_unaligned_be32(cnt, ctr + 12);
+}
+#endif
+
 void FAST_FUNC aes_setkey(struct tls_aes *aes, const void *key, unsigned key_len)
 {
 	aes->rounds = KeyExpansion(aes->key, key, key_len);
+#if TLS_X86_HWACCEL
+	if (!aesNI) {
+		unsigned eax = 1, ebx = ebx, ecx = 0, edx = edx;
+		cpuid(&eax, &ebx, &ecx, &edx);
+		aesNI = ((ecx >> 24) & 2) - 1; /* CPUID.1:ECX bit 25 */
+	}
+	if (aesNI > 0) {
+		unsigned i;
+		for (i = 0; i < (aes->rounds + 1) * 4; i++)
+			aes->key[i] = SWAP_BE32(aes->key[i]);
+	}
+#endif
 }
 
 void FAST_FUNC aes_encrypt_one_block(struct tls_aes *aes, const void *data, void *dst)
@@ -356,6 +573,13 @@ void FAST_FUNC aes_encrypt_one_block(struct tls_aes *aes, const void *data, void
 	const uint8_t *pt = data;
 	uint8_t *ct = dst;
 
+#if TLS_X86_HWACCEL
+	if (aesNI > 0) {
+		aesni_encrypt_one_block(aes, data, dst);
+		return;
+	}
+#endif
+
 	for (i = 0; i < 16; i++)
 		astate[i] = pt[i];
 	aes_encrypt_1(aes, astate);
@@ -370,6 +594,12 @@ void FAST_FUNC aes_cbc_encrypt(struct tls_aes *aes, void *iv, const void *data,
 	const uint8_t *pt = data;
 	uint8_t *ct = dst;
 
+#if TLS_X86_HWACCEL
+	if (aesNI > 0) {
+		aesni_cbc_encrypt(aes, iv, data, len, dst);
+		return;
+	}
+#endif
 	memcpy(iv2, iv, 16);
 	while (len > 0) {
 		{
@@ -391,6 +621,35 @@ void FAST_FUNC aes_cbc_encrypt(struct tls_aes *aes, void *iv, const void *data,
 	}
 }
 
+void FAST_FUNC aes_ctr32_xor(struct tls_aes *aes, void *ctr, const void *data, size_t len, void *dst)
+{
+	uint8_t *cb = ctr;
+	const uint8_t *src = data;
+	uint8_t *d = dst;
+
+#if TLS_X86_HWACCEL
+	if (aesNI > 0) {
+		aesni_ctr32_xor(aes, cb, data, len, dst);
+		return;
+	}
+#endif
+	while (len != 0) {
+		unsigned n = len > 16 ? 16 : len;
+		int i;
+		unsigned astate[16];
+
+		for (i = 0; i < 16; i++)
+			astate[i] = cb[i];
+		aes_encrypt_1(aes, astate);
+		put_unaligned_be32(get_unaligned_be32(cb + 12) + 1, cb + 12);
+		for (i = 0; i < n; i++)
+			d[i] = src[i] ^ astate[i];
+		src += n;
+		d += n;
+		len -= n;
+	}
+}
+
 static void aes_decrypt_1(struct tls_aes *aes, unsigned astate[16])
 {
 	unsigned rounds = aes->rounds;
@@ -438,6 +697,12 @@ void FAST_FUNC aes_cbc_decrypt(struct tls_aes *aes, void *iv, const void *data,
 	const uint8_t *ct = data;
 	uint8_t *pt = dst;
 
+#if TLS_X86_HWACCEL
+	if (aesNI > 0) {
+		aesni_cbc_decrypt(aes, iv, data, len, dst);
+		return;
+	}
+#endif
 	ivbuf = memcpy(iv2, iv, 16);
 	while (len) {
 		ivnext = (ivbuf==iv2) ? iv3 : iv2;
@@ -12,3 +12,6 @@ void aes_encrypt_one_block(struct tls_aes *aes, const void *data, void *dst) FAS
 
 void aes_cbc_encrypt(struct tls_aes *aes, void *iv, const void *data, size_t len, void *dst) FAST_FUNC;
 void aes_cbc_decrypt(struct tls_aes *aes, void *iv, const void *data, size_t len, void *dst) FAST_FUNC;
+
+/* ctr[16] is the counter block, its last 4 bytes are incremented (big-endian) */
+void aes_ctr32_xor(struct tls_aes *aes, void *ctr, const void *data, size_t len, void *dst) FAST_FUNC;
@@ -35,92 +35,84 @@ static ALWAYS_INLINE void FlattenSzInBits(byte* buf, word32 sz)
 }
 #endif
 
-static void RIGHTSHIFTX(byte* x)
+// Multiplication by H in GF(2^128), four bits at a time (Shoup's method):
+// precompute 16 multiples of H, then every byte of X costs two table
+// lookups and two 4-bit shifts, instead of 8 conditional xors and
+// 8 RIGHTSHIFTX of the bit-serial algorithm.
+// Table is built once per aesgcm_GHASH() call, and each TLS record
+// is hashed with one call.
+typedef struct gcm_table {
+	uint64_t HL[16];
+	uint64_t HH[16];
+} gcm_table;
+
+// What the four bits shifted out of Z by "Z >>= 4" are worth
+// after reduction modulo x^128 + x^7 + x^2 + x + 1 (only top 16 bits
+// of Z are affected)
+static const uint16_t last4[16] = {
+	0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+	0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static void gcm_gen_table(gcm_table *t, const byte* h)
 {
-#define l ((unsigned long*)x)
-#if 0
-
-    // Generic byte-at-a-time algorithm
-    int i;
-    byte carryIn = (x[15] & 0x01) ? 0xE1 : 0;
-    for (i = 0; i < AES_BLOCK_SIZE; i++) {
-        byte carryOut = (x[i] << 7); // zero, or 0x80
-        x[i] = (x[i] >> 1) ^ carryIn;
-        carryIn = carryOut;
-    }
+	uint64_t vh, vl;
+	int i, j;
 
-#elif BB_BIG_ENDIAN
-
-    // Big-endian can shift-right in larger than byte chunks
-    // (we use the fact that 'x' is long-aligned)
-    unsigned long carryIn = (x[15] & 0x01)
-        ? ((unsigned long)0xE1 << (LONG_BIT-8))
-        : 0;
-# if ULONG_MAX <= 0xffffffff
-    int i;
-    for (i = 0; i < AES_BLOCK_SIZE/sizeof(long); i++) {
-        unsigned long carryOut = l[i] << (LONG_BIT-1); // zero, or 0x800..00
-        l[i] = (l[i] >> 1) ^ carryIn;
-        carryIn = carryOut;
-    }
-# else
-    // 64-bit code: need to process only 2 words
-    unsigned long carryOut = l[0] << (LONG_BIT-1); // zero, or 0x800..00
-    l[0] = (l[0] >> 1) ^ carryIn;
-    l[1] = (l[1] >> 1) ^ carryOut;
-# endif
-
-#else /* LITTLE_ENDIAN */
-
-    // In order to use word-sized ops, little-endian needs to byteswap.
-    // On x86, code size increase is ~10 bytes compared to byte-by-byte.
-    unsigned long carryIn = (x[15] & 0x01)
-        ? ((unsigned long)0xE1 << (LONG_BIT-8))
-        : 0;
-# if ULONG_MAX <= 0xffffffff
-    int i;
-    for (i = 0; i < AES_BLOCK_SIZE/sizeof(long); i++) {
-        unsigned long ti = SWAP_BE32(l[i]);
-        unsigned long carryOut = ti << (LONG_BIT-1); // zero, or 0x800..00
-        ti = (ti >> 1) ^ carryIn;
-        l[i] = SWAP_BE32(ti);
-        carryIn = carryOut;
-    }
-# else
-    // 64-bit code: need to process only 2 words
-    unsigned long tt = SWAP_BE64(l[0]);
-    unsigned long carryOut = tt << (LONG_BIT-1); // zero, or 0x800..00
-    tt = (tt >> 1) ^ carryIn; l[0] = SWAP_BE64(tt);
-    tt = SWAP_BE64(l[1]);
-    tt = (tt >> 1) ^ carryOut; l[1] = SWAP_BE64(tt);
-# endif
-
-#endif /* LITTLE_ENDIAN */
-#undef l
+	vh = get_unaligned_be64(h);
+	vl = get_unaligned_be64(h + 8);
+	// table index bits are in "reflected" order too:
+	// 8 is H itself, 4 is H*x, 2 is H*x^2, 1 is H*x^3
+	t->HH[8] = vh;
+	t->HL[8] = vl;
+	t->HH[0] = 0;
+	t->HL[0] = 0;
+	for (i = 4; i > 0; i >>= 1) {
+		uint64_t carry = (vl & 1) ? ((uint64_t)0xe1000000 << 32) : 0;
+		vl = (vh << 63) | (vl >> 1);
+		vh = (vh >> 1) ^ carry;
+		t->HH[i] = vh;
+		t->HL[i] = vl;
+	}
+	for (i = 2; i <= 8; i *= 2) {
+		for (j = 1; j < i; j++) {
+			t->HH[i + j] = t->HH[i] ^ t->HH[j];
+			t->HL[i + j] = t->HL[i] ^ t->HL[j];
+		}
+	}
 }
 
-// Caller guarantees X is aligned
-static void GMULT(byte* X, byte* Y)
+static void GMULT(byte* X, const gcm_table *t)
 {
-    byte Z[AES_BLOCK_SIZE] ALIGNED_long;
-    //byte V[AES_BLOCK_SIZE] ALIGNED_long;
-    int i;
-
-    XMEMSET(Z, 0, AES_BLOCK_SIZE);
-    //XMEMCPY(V, X, AES_BLOCK_SIZE);
-    for (i = 0; i < AES_BLOCK_SIZE; i++) {
-        uint32_t y = 0x800000 | Y[i];
-        for (;;) { // for every bit in Y[i], from msb to lsb
-            if (y & 0x80) {
-                xorbuf_aligned_AES_BLOCK_SIZE(Z, X); // was V, not X
-            }
-            RIGHTSHIFTX(X); // was V, not X
-            y = y << 1;
-            if ((int32_t)y < 0) // if bit 0x80000000 set = if 8 iterations done
-                break;
-        }
-    }
-    XMEMCPY(X, Z, AES_BLOCK_SIZE);
+	uint64_t zh, zl;
+	unsigned rem;
+	int i;
+
+	i = AES_BLOCK_SIZE - 1;
+	zh = t->HH[X[i] & 0xf];
+	zl = t->HL[X[i] & 0xf];
+	for (;;) {
+		unsigned hi = X[i] >> 4;
+
+		rem = zl & 0xf;
+		zl = (zh << 60) | (zl >> 4);
+		zh = (zh >> 4) ^ ((uint64_t)last4[rem] << 48);
+		zh ^= t->HH[hi];
+		zl ^= t->HL[hi];
+		if (--i < 0)
+			break;
+		{
+			unsigned lo = X[i] & 0xf;
+
+			rem = zl & 0xf;
+			zl = (zh << 60) | (zl >> 4);
+			zh = (zh >> 4) ^ ((uint64_t)last4[rem] << 48);
+			zh ^= t->HH[lo];
+			zl ^= t->HL[lo];
+		}
+	}
+	put_unaligned_be64(zh, X);
+	put_unaligned_be64(zl, X + 8);
 }
 
 //bbox:
@@ -131,6 +123,105 @@ static void GMULT(byte* X, byte* Y)
 // This allows some simplifications.
 #define aSz 13
 #define sSz AES_BLOCK_SIZE
+
+#if TLS_X86_HWACCEL
+# include <wmmintrin.h>
+# include <tmmintrin.h>
+
+static void cpuid(unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx)
+{
+	asm ("cpuid"
+		: "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+		: "0"(*eax),  "1"(*ebx),  "2"(*ecx),  "3"(*edx)
+	);
+}
+static smallint pclmul;
+
+# define PCLMUL_FUNC __attribute__((target("pclmul,ssse3")))
+
+// Operands are byte-reversed GHASH blocks: then bit order matches
+// what PCLMULQDQ expects, except for a shift by one bit.
+// 256-bit carry-less product is shifted left by 1 and reduced
+// modulo x^128 + x^7 + x^2 + x + 1.
+// Algorithm from Intel's "Carry-Less Multiplication Instruction
+// and its Usage for Computing the GCM Mode" white paper.
+static PCLMUL_FUNC __m128i gfmul(__m128i a, __m128i b)
+{
+	__m128i lo, mid, hi, t1, t2, t3;
+
+	lo  = _mm_clmulepi64_si128(a, b, 0x00);
+	hi  = _mm_clmulepi64_si128(a, b, 0x11);
+	mid = _mm_xor_si128(
+		_mm_clmulepi64_si128(a, b, 0x10),
+		_mm_clmulepi64_si128(a, b, 0x01)
+	);
+	lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+	hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+	// hi:lo <<= 1
+	t1 = _mm_srli_epi32(lo, 31);
+	t2 = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	t3 = _mm_srli_si128(t1, 12);
+	t2 = _mm_slli_si128(t2, 4);
+	t1 = _mm_slli_si128(t1, 4);
+	lo = _mm_or_si128(lo, t1);
+	hi = _mm_or_si128(hi, t2);
+	hi = _mm_or_si128(hi, t3);
+
+	// reduce
+	t1 = _mm_xor_si128(
+		_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+		_mm_slli_epi32(lo, 25)
+	);
+	t2 = _mm_srli_si128(t1, 4);
+	t1 = _mm_slli_si128(t1, 12);
+	lo = _mm_xor_si128(lo, t1);
+	t3 = _mm_xor_si128(
+		_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+		_mm_xor_si128(_mm_srli_epi32(lo, 7), t2)
+	);
+	lo = _mm_xor_si128(lo, t3);
+	return _mm_xor_si128(hi, lo);
+}
+
+static PCLMUL_FUNC void aesgcm_GHASH_pclmul(const byte* h,
+	const byte* a,
+	const byte* c, unsigned cSz,
+	byte* s
+)
+{
+	const __m128i bswap = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+	__m128i H, X;
+	unsigned blocks, partial;
+
+	H = _mm_shuffle_epi8(_mm_loadu_si128((const void*)h), bswap);
+	X = gfmul(_mm_shuffle_epi8(_mm_loadu_si128((const void*)a), bswap), H);
+
+	blocks = cSz / AES_BLOCK_SIZE;
+	partial = cSz % AES_BLOCK_SIZE;
+	while (blocks--) {
+		X = _mm_xor_si128(X, _mm_shuffle_epi8(_mm_loadu_si128((const void*)c), bswap));
+		X = gfmul(X, H);
+		c += AES_BLOCK_SIZE;
+	}
+	if (partial != 0) {
+		byte scratch[AES_BLOCK_SIZE];
+		memset(scratch, 0, AES_BLOCK_SIZE);
+		memcpy(scratch, c, partial);
+		X = _mm_xor_si128(X, _mm_shuffle_epi8(_mm_loadu_si128((void*)scratch), bswap));
+		X = gfmul(X, H);
+	}
+
+	// Lengths of A and C in bits: be64 aSz*8, be64 cSz*8, byte-reversed
+	X = _mm_xor_si128(X, _mm_set_epi64x(aSz * 8, (uint64_t)cSz * 8));
+	X = gfmul(X, H);
+
+	_mm_storeu_si128((void*)s, _mm_shuffle_epi8(X, bswap));
+}
+#endif
+
 void FAST_FUNC aesgcm_GHASH(byte* h,
     const byte* a, //unsigned aSz,
     const byte* c, unsigned cSz,
@@ -140,8 +231,23 @@ void FAST_FUNC aesgcm_GHASH(byte* h,
     byte x[AES_BLOCK_SIZE] ALIGNED_long;
 //    byte scratch[AES_BLOCK_SIZE] ALIGNED_long;
     unsigned blocks, partial;
+    gcm_table t;
     //was: byte* h = aes->H;
 
+#if TLS_X86_HWACCEL
+    if (!pclmul) {
+        unsigned eax = 1, ebx = ebx, ecx = 0, edx = edx;
+        cpuid(&eax, &ebx, &ecx, &edx);
+        /* CPUID.1:ECX bit 1 is PCLMULQDQ, bit 9 is SSSE3 (for PSHUFB) */
+        pclmul = ((ecx & 0x202) == 0x202) ? 1 : -1;
+    }
+    if (pclmul > 0) {
+        aesgcm_GHASH_pclmul(h, a, c, cSz, s);
+        return;
+    }
+#endif
+    gcm_gen_table(&t, h);
+
     //XMEMSET(x, 0, AES_BLOCK_SIZE);
 
     /* Hash in A, the Additional Authentication Data */
@@ -151,14 +257,14 @@ void FAST_FUNC aesgcm_GHASH(byte* h,
 //        while (blocks--) {
             //xorbuf(x, a, AES_BLOCK_SIZE);
             XMEMCPY(x, a, AES_BLOCK_SIZE);// memcpy(x,a) = memset(x,0)+xorbuf(x,a)
-            GMULT(x, h);
+            GMULT(x, &t);
 //            a += AES_BLOCK_SIZE;
 //        }
 //        if (partial != 0) {
 //            XMEMSET(scratch, 0, AES_BLOCK_SIZE);
 //            XMEMCPY(scratch, a, partial);
 //            xorbuf(x, scratch, AES_BLOCK_SIZE);
-//            GMULT(x, h);
+//            GMULT(x, &t);
 //        }
 //    }
 
@@ -171,7 +277,7 @@ void FAST_FUNC aesgcm_GHASH(byte* h,
                 xorbuf_aligned_AES_BLOCK_SIZE(x, c);
             else
                 xorbuf(x, c, AES_BLOCK_SIZE);
-            GMULT(x, h);
+            GMULT(x, &t);
             c += AES_BLOCK_SIZE;
         }
         if (partial != 0) {
@@ -179,7 +285,7 @@ void FAST_FUNC aesgcm_GHASH(byte* h,
             //XMEMCPY(scratch, c, partial);
             //xorbuf(x, scratch, AES_BLOCK_SIZE);
             xorbuf(x, c, partial);//same result as above
-            GMULT(x, h);
+            GMULT(x, &t);
         }
     }
 
@@ -195,7 +301,7 @@ void FAST_FUNC aesgcm_GHASH(byte* h,
     P32(x)[3] ^= SWAP_BE32(cSz * 8);
 #undef P32
 
-    GMULT(x, h);
+    GMULT(x, &t);
 
     /* Copy the result into s. */
     XMEMCPY(s, x, sSz);